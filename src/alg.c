@@ -25,6 +25,7 @@
 #include "util.h"
 #include "draw.h"
 #include "alg.h"
+#include "mask_span.h"
 
 #ifdef __MMX__
     #define HAVE_MMX
@@ -937,14 +938,16 @@ int alg_despeckle(struct context *cnt, int olddiffs)
  */
 void alg_tune_smartmask(struct context *cnt)
 {
-    int i, diff;
+    int i, diff, triggered, changed;
     int motionsize = cnt->imgs.motionsize;
     unsigned char *smartmask = cnt->imgs.smartmask;
     unsigned char *smartmask_final = cnt->imgs.smartmask_final;
     int *smartmask_buffer = cnt->imgs.smartmask_buffer;
     int sensitivity = cnt->lastrate * (11 - cnt->smartmask_speed);
 
+    changed = FALSE;
     for (i = 0; i < motionsize; i++) {
+        triggered = (smartmask[i] > 20);
         /* Decrease smart_mask sensitivity every 5*speed seconds only. */
         if (smartmask[i] > 0) {
             smartmask[i]--;
@@ -960,6 +963,17 @@ void alg_tune_smartmask(struct context *cnt)
             }
             smartmask_buffer[i] %= sensitivity;
         }
+        if ((smartmask[i] > 20) != triggered) {
+            changed = TRUE;
+        }
+    }
+
+    /* The final mask and its spans are kept until a pixel crosses the trigger value */
+    if (!changed) {
+        return;
+    }
+
+    for (i = 0; i < motionsize; i++) {
         /* Transfer raw mask to the final stage when above trigger value. */
         if (smartmask[i] > 20) {
             smartmask_final[i] = 0;
@@ -972,39 +986,39 @@ void alg_tune_smartmask(struct context *cnt)
                   cnt->imgs.common_buffer, 255);
     diff = erode5(smartmask_final, cnt->imgs.width, cnt->imgs.height,
                   cnt->imgs.common_buffer, 255);
+
+    /* Compiled again by overlay_smartmask when next drawn */
+    mask_span_free(cnt->imgs.smartmask_spans);
+    cnt->imgs.smartmask_spans = NULL;
 }
 
 /* Increment for *smartmask_buffer in alg_diff_standard. */
 #define SMARTMASK_SENSITIVITY_INCR 5
 
 /**
- * alg_diff_standard
+ * alg_diff_span
  *
+ *   Diff the count pixels from start.  The mask, if any, starts at the
+ *   first of these pixels.
  */
-int alg_diff_standard(struct context *cnt, unsigned char *new)
+static int alg_diff_span(struct context *cnt, unsigned char *new, int start, int count
+            , unsigned char *mask)
 {
     struct images *imgs = &cnt->imgs;
     int i, diffs = 0;
     int noise = cnt->noise;
     int smartmask_speed = cnt->smartmask_speed;
-    unsigned char *ref = imgs->ref;
-    unsigned char *out = imgs->img_motion.image_norm;
-    unsigned char *mask = imgs->mask;
-    unsigned char *smartmask_final = imgs->smartmask_final;
-    int *smartmask_buffer = imgs->smartmask_buffer;
+    unsigned char *ref = imgs->ref + start;
+    unsigned char *out = imgs->img_motion.image_norm + start;
+    unsigned char *smartmask_final = imgs->smartmask_final + start;
+    int *smartmask_buffer = imgs->smartmask_buffer + start;
     #ifdef HAVE_MMX
         mmx_t mmtemp; /* Used for transferring to/from memory. */
         int unload;   /* Counter for unloading diff counts. */
     #endif
 
-    i = imgs->motionsize;
-    memset(out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
-    /*
-     * Keeping this memset in the MMX case when zeroes are necessarily
-     * written anyway seems to be beneficial in terms of speed. Perhaps a
-     * cache thing?
-     */
-    memset(out, 0, i);
+    new += start;
+    i = count;
 
     #ifdef HAVE_MMX
         /*
@@ -1270,6 +1284,47 @@ int alg_diff_standard(struct context *cnt, unsigned char *new)
     return diffs;
 }
 
+/**
+ * alg_diff_standard
+ *
+ */
+int alg_diff_standard(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    const struct mask_span *span;
+    int i, indx, diffs;
+    unsigned char *out = imgs->img_motion.image_norm;
+
+    i = imgs->motionsize;
+    memset(out + i, 128, i / 2); /* Motion pictures are now b/w i.o. green */
+    /*
+     * Keeping this memset in the MMX case when zeroes are necessarily
+     * written anyway seems to be beneficial in terms of speed. Perhaps a
+     * cache thing?
+     */
+    memset(out, 0, i);
+
+    if (imgs->mask_spans == NULL) {
+        return alg_diff_span(cnt, new, 0, i, imgs->mask);
+    }
+
+    /*
+     * Pixels of the blocked spans can never be in motion and do not count
+     * for the smartmask so they are skipped.  The open spans need no mask.
+     */
+    diffs = 0;
+    for (indx = 0; indx < imgs->mask_spans->count_y; indx++) {
+        span = &imgs->mask_spans->span[indx];
+        if (span->type == MASK_SPAN_OPEN) {
+            diffs += alg_diff_span(cnt, new, span->start, span->len, NULL);
+        } else if (span->type == MASK_SPAN_PARTIAL) {
+            diffs += alg_diff_span(cnt, new, span->start, span->len, imgs->mask + span->start);
+        }
+    }
+
+    return diffs;
+}
+
 /**
  * alg_diff_fast
  *      Very fast diff function, does not apply mask overlaying.
@@ -87,6 +87,10 @@ struct config conf_template = {
     .height =                          DEF_HEIGHT,
     .framerate =                       DEF_MAXFRAMERATE,
     .minimum_frame_time =              0,
+    .pipeline_capture_depth =          0,
+    .pipeline_output_depth =           0,
+    .pipeline_output_policy =          "drop",
+    .frame_hugepages =                 "off",
     .rotate =                          0,
     .flip_axis =                       "none",
     .locate_motion_mode =              "off",
@@ -114,6 +118,8 @@ struct config conf_template = {
     .minimum_motion_frames =           1,
     .event_gap =                       DEF_EVENT_GAP,
     .pre_capture =                     0,
+    .pre_capture_quality =             0,
+    .pre_capture_memory =              0,
     .post_capture =                    0,
 
     /* Script execution configuration parameters */
@@ -126,6 +132,7 @@ struct config conf_template = {
     .on_movie_end =                    NULL,
     .on_camera_lost =                  NULL,
     .on_camera_found =                 NULL,
+    .on_command_max =                  0,
 
     /* Picture output configuration parameters */
     .picture_output =                  "off",
@@ -134,6 +141,8 @@ struct config conf_template = {
     .picture_quality =                 75,
     .picture_exif =                    NULL,
     .picture_filename =                DEF_IMAGEPATH,
+    .picture_writer_threads =          0,
+    .picture_writer_queue =            8,
 
     /* Snapshot configuration parameters */
     .snapshot_interval =               0,
@@ -148,6 +157,8 @@ struct config conf_template = {
     .movie_codec =                     "mkv",
     .movie_duplicate_frames =          FALSE,
     .movie_passthrough =               FALSE,
+    .movie_encoder_queue =             0,
+    .movie_fragment_duration =         0,
     .movie_filename =                  DEF_MOVIEPATH,
     .movie_extpipe_use =               FALSE,
     .movie_extpipe =                   NULL,
@@ -168,6 +179,7 @@ struct config conf_template = {
     .webcontrol_ipv6 =                 FALSE,
     .webcontrol_localhost =            TRUE,
     .webcontrol_parms =                0,
+    .webcontrol_threads =              2,
     .webcontrol_interface =            0,
     .webcontrol_auth_method =          0,
     .webcontrol_authentication =       NULL,
@@ -190,6 +202,13 @@ struct config conf_template = {
     .stream_grey =                     FALSE,
     .stream_motion =                   FALSE,
     .stream_maxrate =                  1,
+    .stream_worker =                   FALSE,
+    .stream_threads =                  4,
+    .stream_adaptive =                 TRUE,
+    .stream_thumbnail =                160,
+    .stream_mosaic_width =             0,
+    .stream_mosaic_columns =           0,
+    .stream_mosaic_rate =              1,
     .stream_limit =                    0,
 
     /* Database and SQL configuration parameters */
@@ -513,6 +532,42 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "pipeline_capture_depth",
+    "# Number of frames captured ahead of motion detection in a separate thread. 0 = capture in the motion loop.",
+    0,
+    CONF_OFFSET(pipeline_capture_depth),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "pipeline_output_depth",
+    "# Number of events queued for saving pictures and movies in a separate thread. 0 = save in the motion loop.",
+    0,
+    CONF_OFFSET(pipeline_output_depth),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "pipeline_output_policy",
+    "# What to do with pictures when the output queue is full (drop or block). Movie frames are never dropped",
+    0,
+    CONF_OFFSET(pipeline_output_policy),
+    copy_string,
+    print_string,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "frame_hugepages",
+    "# Huge pages for the image buffers (off, transparent or explicit)",
+    0,
+    CONF_OFFSET(frame_hugepages),
+    copy_string,
+    print_string,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "rotate",
     "# Number of degrees to rotate image.",
     0,
@@ -741,6 +796,24 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "pre_capture_quality",
+    "# Quality of the jpegs the older pre-captured pictures are kept as.  0 keeps them uncompressed.",
+    0,
+    CONF_OFFSET(pre_capture_quality),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "pre_capture_memory",
+    "# Megabytes of memory for the compressed pre-captured pictures.  0 for a quarter of uncompressed.",
+    0,
+    CONF_OFFSET(pre_capture_memory),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "post_capture",
     "# Number of frames to capture after motion is no longer detected.",
     0,
@@ -834,6 +907,15 @@ config_param config_params[] = {
     WEBUI_LEVEL_RESTRICTED
     },
     {
+    "on_command_max",
+    "# Maximum number of on_* commands running at the same time, 0 for no limit.",
+    1,
+    CONF_OFFSET(on_command_max),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
     "picture_output",
     "############################################################\n"
     "# Picture output configuration parameters\n"
@@ -891,6 +973,24 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "picture_writer_threads",
+    "# Number of threads compressing and writing pictures. 0 = write in the event handlers.",
+    0,
+    CONF_OFFSET(picture_writer_threads),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "picture_writer_queue",
+    "# Number of pictures waiting to be written before detected pictures are dropped.",
+    0,
+    CONF_OFFSET(picture_writer_queue),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "snapshot_interval",
     "############################################################\n"
     "# Snapshot output configuration parameters\n"
@@ -987,6 +1087,24 @@ config_param config_params[] = {
     WEBUI_LEVEL_ADVANCED
     },
     {
+    "movie_encoder_queue",
+    "# Frames queued for the movie encoder thread. 0 encodes in the event handlers.",
+    0,
+    CONF_OFFSET(movie_encoder_queue),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "movie_fragment_duration",
+    "# Milliseconds of movie in each fragment of mp4 and mkv files. 0 writes regular files.",
+    0,
+    CONF_OFFSET(movie_fragment_duration),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "movie_filename",
     "# File name(without extension) for movies relative to target directory",
     0,
@@ -1122,6 +1240,15 @@ config_param config_params[] = {
     WEBUI_LEVEL_NEVER
     },
     {
+    "webcontrol_threads",
+    "# Number of threads serving the webcontrol connections.  0 for a thread per connection.",
+    1,
+    CONF_OFFSET(webcontrol_threads),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
     "webcontrol_interface",
     "# Method that webcontrol should use for interface with user.",
     1,
@@ -1306,6 +1433,70 @@ config_param config_params[] = {
     WEBUI_LEVEL_LIMITED
     },
     {
+    "stream_worker",
+    "# Compress the stream images in a separate thread only when a client needs them.",
+    0,
+    CONF_OFFSET(stream_worker),
+    copy_bool,
+    print_bool,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "stream_threads",
+    "# Number of threads serving the stream connections of the port.  0 for a thread per connection.",
+    0,
+    CONF_OFFSET(stream_threads),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_ADVANCED
+    },
+    {
+    "stream_adaptive",
+    "# Send worse images to the clients of the stream that cannot keep up with it.",
+    0,
+    CONF_OFFSET(stream_adaptive),
+    copy_bool,
+    print_bool,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "stream_thumbnail",
+    "# Width in pixels of the images of the thumbnail stream.",
+    0,
+    CONF_OFFSET(stream_thumbnail),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "stream_mosaic_width",
+    "# Width in pixels of the stream of all the cameras on the stream_port of motion.conf.\n"
+    "# 0 disables the mosaic stream.",
+    1,
+    CONF_OFFSET(stream_mosaic_width),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "stream_mosaic_columns",
+    "# Number of cameras across the mosaic stream.  0 for as many as rows.",
+    1,
+    CONF_OFFSET(stream_mosaic_columns),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
+    "stream_mosaic_rate",
+    "# Maximum number of images per second of the mosaic stream.",
+    1,
+    CONF_OFFSET(stream_mosaic_rate),
+    copy_int,
+    print_int,
+    WEBUI_LEVEL_LIMITED
+    },
+    {
     "stream_limit",
     "# Limit the number of images per connection",
     0,
@@ -3408,6 +3599,10 @@ static void config_parms_intl()
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","height",_("height"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","framerate",_("framerate"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","minimum_frame_time",_("minimum_frame_time"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pipeline_capture_depth",_("pipeline_capture_depth"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pipeline_output_depth",_("pipeline_output_depth"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pipeline_output_policy",_("pipeline_output_policy"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","frame_hugepages",_("frame_hugepages"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","rotate",_("rotate"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","flip_axis",_("flip_axis"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","locate_motion_mode",_("locate_motion_mode"));
@@ -3433,6 +3628,8 @@ static void config_parms_intl()
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","minimum_motion_frames",_("minimum_motion_frames"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","event_gap",_("event_gap"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pre_capture",_("pre_capture"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pre_capture_quality",_("pre_capture_quality"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","pre_capture_memory",_("pre_capture_memory"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","post_capture",_("post_capture"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_event_start",_("on_event_start"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_event_end",_("on_event_end"));
@@ -3443,12 +3640,15 @@ static void config_parms_intl()
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_movie_end",_("on_movie_end"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_camera_lost",_("on_camera_lost"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_camera_found",_("on_camera_found"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","on_command_max",_("on_command_max"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_output",_("picture_output"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_output_motion",_("picture_output_motion"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_type",_("picture_type"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_quality",_("picture_quality"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_exif",_("picture_exif"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_filename",_("picture_filename"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_writer_threads",_("picture_writer_threads"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","picture_writer_queue",_("picture_writer_queue"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","snapshot_interval",_("snapshot_interval"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","snapshot_filename",_("snapshot_filename"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_output",_("movie_output"));
@@ -3459,6 +3659,8 @@ static void config_parms_intl()
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_codec",_("movie_codec"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_duplicate_frames",_("movie_duplicate_frames"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_passthrough",_("movie_passthrough"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_encoder_queue",_("movie_encoder_queue"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_fragment_duration",_("movie_fragment_duration"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_filename",_("movie_filename"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_extpipe_use",_("movie_extpipe_use"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","movie_extpipe",_("movie_extpipe"));
@@ -3473,6 +3675,7 @@ static void config_parms_intl()
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_ipv6",_("webcontrol_ipv6"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_localhost",_("webcontrol_localhost"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_parms",_("webcontrol_parms"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_threads",_("webcontrol_threads"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_interface",_("webcontrol_interface"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_auth_method",_("webcontrol_auth_method"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","webcontrol_authentication",_("webcontrol_authentication"));
@@ -3493,6 +3696,13 @@ static void config_parms_intl()
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_grey",_("stream_grey"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_motion",_("stream_motion"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_maxrate",_("stream_maxrate"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_worker",_("stream_worker"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_threads",_("stream_threads"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_adaptive",_("stream_adaptive"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_thumbnail",_("stream_thumbnail"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_mosaic_width",_("stream_mosaic_width"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_mosaic_columns",_("stream_mosaic_columns"));
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_mosaic_rate",_("stream_mosaic_rate"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","stream_limit",_("stream_limit"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","database_type",_("database_type"));
         MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO,"%s:%s","database_dbname",_("database_dbname"));
@@ -70,6 +70,10 @@ struct config {
     int             height;
     int             framerate;
     int             minimum_frame_time;
+    int             pipeline_capture_depth;
+    int             pipeline_output_depth;
+    const char      *pipeline_output_policy;
+    const char      *frame_hugepages;
     int             rotate;
     const char      *flip_axis;
     const char      *locate_motion_mode;
@@ -97,6 +101,8 @@ struct config {
     int             minimum_motion_frames;
     int             event_gap;
     int             pre_capture;
+    int             pre_capture_quality;
+    int             pre_capture_memory;
     int             post_capture;
 
     /* Script execution configuration parameters */
@@ -109,6 +115,7 @@ struct config {
     char            *on_movie_end;
     char            *on_camera_lost;
     char            *on_camera_found;
+    int             on_command_max;
 
     /* Picture output configuration parameters */
     const char      *picture_output;
@@ -117,6 +124,8 @@ struct config {
     int             picture_quality;
     const char      *picture_exif;
     const char      *picture_filename;
+    int             picture_writer_threads;
+    int             picture_writer_queue;
 
     /* Snapshot configuration parameters */
     int             snapshot_interval;
@@ -131,6 +140,8 @@ struct config {
     const char      *movie_codec;
     int             movie_duplicate_frames;
     int             movie_passthrough;
+    int             movie_encoder_queue;
+    int             movie_fragment_duration;
     const char      *movie_filename;
     int             movie_extpipe_use;
     const char      *movie_extpipe;
@@ -151,6 +162,7 @@ struct config {
     int             webcontrol_ipv6;
     int             webcontrol_localhost;
     int             webcontrol_parms;
+    int             webcontrol_threads;
     int             webcontrol_interface;
     int             webcontrol_auth_method;
     const char      *webcontrol_authentication;
@@ -173,6 +185,13 @@ struct config {
     int             stream_grey;
     int             stream_motion;
     int             stream_maxrate;
+    int             stream_worker;
+    int             stream_threads;
+    int             stream_adaptive;
+    int             stream_thumbnail;
+    int             stream_mosaic_width;
+    int             stream_mosaic_columns;
+    int             stream_mosaic_rate;
     int             stream_limit;
 
     /* Database and SQL configuration parameters */
@@ -19,12 +19,31 @@
  *
  *      Module of routines associated with database processing.
  *
+ *      The queries are run by one writer thread for all the cameras so
+ *      that a slow or unreachable database does not hold up the capture.
+ *      The queries of a camera waiting in the queue are run in one
+ *      transaction.  While the database is unreachable, the writer keeps
+ *      the queries and tries again after a delay that doubles up to
+ *      DBSE_BACKOFF_MAX seconds.  Queries are dropped once the queue is full.
+ *
+ *      The writer opens and closes the connections of the cameras itself
+ *      so that a connection is only used by the thread that opened it.  The
+ *      connection of a camera is opened before its first query and closed
+ *      by a request queued after its last one when the camera stops.
+ *
+ *      The event id returned by sql_query_start is only known once the
+ *      writer has run it.  %{dbeventid} in the other queries is therefore
+ *      put in by the writer.  In the file names and the commands it is 0
+ *      until the writer has run the sql_query_start of the event, so the
+ *      camera never waits for the database.
  */
 
 #include "translate.h"
 #include "motion.h"
 #include "util.h"
 #include "logger.h"
+#include "event.h"
+#include "pipeline.h"
 #include "dbse.h"
 
 /**
@@ -241,6 +260,7 @@ static int dbse_init_sqlite3(struct context *cnt,struct context **cntlist)
                     ,_("Can't open SQLite3 database %s : %s")
                     ,cnt->conf.database_dbname, sqlite3_errmsg(cnt->database_sqlite3));
                 sqlite3_close(cnt->database_sqlite3);
+                cnt->database_sqlite3 = NULL;
                 return -2;
             }
             MOTION_LOG(NTC, TYPE_DB, NO_ERRNO
@@ -300,9 +320,101 @@ static int dbse_init_pgsql(struct context *cnt)
     return 0;
 }
 
+static unsigned long dbse_writer_put(struct context *cnt, const char *sqlquery, int save_id);
+
+/* Whether %{dbeventid} is used by an option other than the sql queries */
+static int dbse_eid_used(struct context *cnt)
+{
+    unsigned int indx;
+    char **val;
+
+    for (indx = 0; config_params[indx].param_name != NULL; indx++) {
+        if ((config_params[indx].copy != copy_string) ||
+            (!strncmp(config_params[indx].param_name, "sql_query", 9))) {
+            continue;
+        }
+        val = (char **)((char *)cnt + config_params[indx].conf_value);
+        if ((*val != NULL) && (strstr(*val, "{dbeventid}") != NULL)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * dbse_connect
+ *
+ */
+static int dbse_connect(struct context *cnt, struct context **cntlist)
+{
+    int retcd = 0;
+
+    if (mystreq(cnt->conf.database_type,"mysql")) {
+        retcd = dbse_init_mysql(cnt);
+    } else if (mystreq(cnt->conf.database_type,"mariadb")) {
+        retcd = dbse_init_mariadb(cnt);
+    } else if (mystreq(cnt->conf.database_type,"postgresql")) {
+        retcd = dbse_init_pgsql(cnt);
+    } else if (mystreq(cnt->conf.database_type,"sqlite3")) {
+        retcd = dbse_init_sqlite3(cnt, cntlist);
+    }
+
+    return retcd;
+}
+
+/**
+ * dbse_close
+ *
+ *   Close the connections of the camera.  The SQLite3 handle of the first
+ *   context is shared by the cameras and is left open when cntlist is given.
+ */
+static void dbse_close(struct context *cnt, struct context **cntlist)
+{
+    #if defined(HAVE_MYSQL)
+        if (cnt->database_mysql != NULL) {
+            mysql_close(cnt->database_mysql);
+            free(cnt->database_mysql);
+            cnt->database_mysql = NULL;
+            cnt->database_event_id = 0;
+        }
+    #endif /* HAVE_MYSQL */
+
+    #if defined(HAVE_MARIADB)
+        if (cnt->database_mariadb != NULL) {
+            mysql_close(cnt->database_mariadb);
+            free(cnt->database_mariadb);
+            cnt->database_mariadb = NULL;
+            cnt->database_event_id = 0;
+        }
+    #endif /* HAVE_MARIADB */
+
+    #ifdef HAVE_PGSQL
+        if (cnt->database_pgsql != NULL) {
+            PQfinish(cnt->database_pgsql);
+            cnt->database_pgsql = NULL;
+            cnt->database_event_id = 0;
+        }
+    #endif /* HAVE_PGSQL */
+
+    #ifdef HAVE_SQLITE3
+        if ((cnt->database_sqlite3 != NULL) &&
+            ((cntlist == NULL) || (cnt->database_sqlite3 != cntlist[0]->database_sqlite3))) {
+            sqlite3_close(cnt->database_sqlite3);
+            cnt->database_sqlite3 = NULL;
+        }
+    #else
+        (void)cntlist;
+    #endif /* HAVE_SQLITE3 */
+
+    (void)cnt;
+}
+
 /**
  * dbse_init
  *
+ *   With the writer the connection is opened by the writer before the
+ *   first query of the camera.
  */
 int dbse_init(struct context *cnt, struct context **cntlist)
 {
@@ -312,14 +424,11 @@ int dbse_init(struct context *cnt, struct context **cntlist)
         MOTION_LOG(NTC, TYPE_DB, NO_ERRNO
             ,_("Database backend %s"), cnt->conf.database_type);
 
-        if (mystreq(cnt->conf.database_type,"mysql")) {
-            retcd = dbse_init_mysql(cnt);
-        } else if (mystreq(cnt->conf.database_type,"mariadb")) {
-            retcd = dbse_init_mariadb(cnt);
-        } else if (mystreq(cnt->conf.database_type,"postgresql")) {
-            retcd = dbse_init_pgsql(cnt);
-        } else if (mystreq(cnt->conf.database_type,"sqlite3")) {
-            retcd = dbse_init_sqlite3(cnt, cntlist);
+        if (cnt->dbse_writer == NULL) {
+            retcd = dbse_connect(cnt, cntlist);
+        } else if (dbse_eid_used(cnt)) {
+            MOTION_LOG(NTC, TYPE_DB, NO_ERRNO
+                ,_("%%{dbeventid} outside of the sql queries is 0 until sql_query_start has run"));
         }
 
         /* Set the sql mask file according to the SQL config options*/
@@ -335,42 +444,25 @@ int dbse_init(struct context *cnt, struct context **cntlist)
 /**
  * dbse_deinit
  *
+ *   With the writer the connection is closed by the writer once the
+ *   queries of the camera before it have run.  The camera does not wait.
  */
 void dbse_deinit(struct context *cnt)
 {
     if (cnt->conf.database_type) {
-        #if defined(HAVE_MYSQL)
-            if ( (mystreq(cnt->conf.database_type, "mysql")) && (cnt->conf.database_dbname)) {
-                mysql_thread_end();
-                mysql_close(cnt->database_mysql);
-                cnt->database_event_id = 0;
-            }
-        #endif /* HAVE_MYSQL */
+        if (cnt->dbse_writer != NULL) {
+            dbse_writer_put(cnt, NULL, FALSE);
+            return;
+        }
 
-        #if defined(HAVE_MARIADB)
-            if ( (mystreq(cnt->conf.database_type, "mariadb")) && (cnt->conf.database_dbname)) {
+        #if defined(HAVE_MYSQL) || defined(HAVE_MARIADB)
+            if (mystreq(cnt->conf.database_type, "mysql") ||
+                mystreq(cnt->conf.database_type, "mariadb")) {
                 mysql_thread_end();
-                mysql_close(cnt->database_mariadb);
-                cnt->database_event_id = 0;
             }
-        #endif /* HAVE_MARIADB */
+        #endif /* HAVE_MYSQL HAVE_MARIADB */
 
-        #ifdef HAVE_PGSQL
-                if ((mystreq(cnt->conf.database_type, "postgresql")) && (cnt->conf.database_dbname)) {
-                    PQfinish(cnt->database_pgsql);
-                    cnt->database_pgsql = NULL;
-                    cnt->database_event_id = 0;
-                }
-        #endif /* HAVE_PGSQL */
-
-        #ifdef HAVE_SQLITE3
-                /* Close the SQLite database */
-                if ((mystreq(cnt->conf.database_type, "sqlite3")) && (cnt->conf.database_dbname)) {
-                    sqlite3_close(cnt->database_sqlite3);
-                    cnt->database_sqlite3 = NULL;
-                }
-        #endif /* HAVE_SQLITE3 */
-        (void)cnt;
+        dbse_close(cnt, NULL);
     }
 }
 
@@ -395,7 +487,7 @@ void dbse_sqlmask_update(struct context *cnt)
  * dbse_exec_mysql
  *
  */
-static void dbse_exec_mysql(char *sqlquery, struct context *cnt, int save_id)
+static int dbse_exec_mysql(const char *sqlquery, struct context *cnt, int save_id)
 {
     #if defined(HAVE_MYSQL)
         if (mystreq(cnt->conf.database_type, "mysql")) {
@@ -406,7 +498,7 @@ static void dbse_exec_mysql(char *sqlquery, struct context *cnt, int save_id)
                 MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO
                     ,_("MySQL query failed %s error code %d")
                     ,mysql_error(cnt->database_mysql), error_code);
-                /* Try to reconnect ONCE if fails continue and discard this sql query */
+                /* Reconnect and run the query again once the database is reachable */
                 if (error_code >= 2000) {
                     // Close connection before start a new connection
                     mysql_close(cnt->database_mysql);
@@ -427,14 +519,10 @@ static void dbse_exec_mysql(char *sqlquery, struct context *cnt, int save_id)
                         MOTION_LOG(INF, TYPE_DB, NO_ERRNO
                             ,_("Re-Connection to MySQL database '%s' Succeed")
                             ,cnt->conf.database_dbname);
-                        if (mysql_query(cnt->database_mysql, sqlquery) != 0) {
-                            int error_my = mysql_errno(cnt->database_mysql);
-                            MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO
-                                ,_("after re-connection MySQL query failed %s error code %d")
-                                ,mysql_error(cnt->database_mysql), error_my);
-                        }
                     }
+                    return DBSE_RETRY;
                 }
+                return DBSE_FAIL;
             }
             if (save_id) {
                 cnt->database_event_id = (unsigned long long) mysql_insert_id(cnt->database_mysql);
@@ -445,13 +533,15 @@ static void dbse_exec_mysql(char *sqlquery, struct context *cnt, int save_id)
         (void)cnt;
         (void)save_id;
     #endif /* HAVE_MYSQL*/
+
+    return DBSE_OK;
 }
 
 /**
  * dbse_exec_mariadb
  *
  */
-static void dbse_exec_mariadb(char *sqlquery, struct context *cnt, int save_id)
+static int dbse_exec_mariadb(const char *sqlquery, struct context *cnt, int save_id)
 {
     #if defined(HAVE_MARIADB)
         if (mystreq(cnt->conf.database_type, "mariadb")) {
@@ -462,7 +552,7 @@ static void dbse_exec_mariadb(char *sqlquery, struct context *cnt, int save_id)
                 MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO
                     ,_("MariaDB query failed %s error code %d")
                     ,mysql_error(cnt->database_mariadb), error_code);
-                /* Try to reconnect ONCE if fails continue and discard this sql query */
+                /* Reconnect and run the query again once the database is reachable */
                 if (error_code >= 2000) {
                     // Close connection before start a new connection
                     mysql_close(cnt->database_mariadb);
@@ -483,14 +573,10 @@ static void dbse_exec_mariadb(char *sqlquery, struct context *cnt, int save_id)
                         MOTION_LOG(INF, TYPE_DB, NO_ERRNO
                             ,_("Re-Connection to MariaDB database '%s' Succeed")
                             ,cnt->conf.database_dbname);
-                        if (mysql_query(cnt->database_mariadb, sqlquery) != 0) {
-                            int error_my = mysql_errno(cnt->database_mariadb);
-                            MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO
-                                ,_("after re-connection MariaDB query failed %s error code %d")
-                                ,mysql_error(cnt->database_mariadb), error_my);
-                        }
                     }
+                    return DBSE_RETRY;
                 }
+                return DBSE_FAIL;
             }
             if (save_id) {
                 cnt->database_event_id = (unsigned long long) mysql_insert_id(cnt->database_mariadb);
@@ -502,19 +588,21 @@ static void dbse_exec_mariadb(char *sqlquery, struct context *cnt, int save_id)
         (void)save_id;
     #endif /* HAVE_MYSQL HAVE_MARIADB*/
 
+    return DBSE_OK;
 }
 
 /**
  * dbse_exec_pgsql
  *
  */
-static void dbse_exec_pgsql(char *sqlquery, struct context *cnt, int save_id)
+static int dbse_exec_pgsql(const char *sqlquery, struct context *cnt, int save_id)
 {
     #ifdef HAVE_PGSQL
         if (mystreq(cnt->conf.database_type, "postgresql") && cnt->database_pgsql) {
             PGresult *res;
             ExecStatusType estat;
             PostgresPollingStatusType pstat;
+            int retcd = DBSE_OK;
 
             if (cnt->eid_db_format == dbeid_recovery) {
                 /* lost DB session recovery pending */
@@ -527,7 +615,7 @@ static void dbse_exec_pgsql(char *sqlquery, struct context *cnt, int save_id)
                 } else if (pstat == PGRES_POLLING_FAILED) {
                     cnt->eid_db_format = dbeid_rec_fail;  /* retry PGresetStart() */
                 } else {  /* session recovery in process but not complete */
-                    return;  /* discard this sqlquery; check again on next one */
+                    return DBSE_RETRY;  /* keep this sqlquery; check again on next attempt */
                 }
             }
 
@@ -554,9 +642,11 @@ static void dbse_exec_pgsql(char *sqlquery, struct context *cnt, int save_id)
                 } else {  /* reset request fails if PGSQL server is (temporarily?) unreachable */
                     cnt->eid_db_format = dbeid_rec_fail;  /* try again next sqlquery */
                 }
+                retcd = DBSE_RETRY;
             } else if (!(estat == PGRES_COMMAND_OK || estat == PGRES_TUPLES_OK)) {
                 MOTION_LOG(ERR, TYPE_DB, SHOW_ERRNO, _("PGSQL query failed: [%s]  %s %s"),
                     sqlquery, PQresStatus(PQresultStatus(res)), PQresultErrorMessage(res));
+                retcd = DBSE_FAIL;
             } else if (save_id) {
                 /* sqlquery processing is complete unless it potentially returns an event ID value;
                  * save_id optionally allows SQL INSERT RETURNING a single positive integer value,
@@ -602,6 +692,7 @@ static void dbse_exec_pgsql(char *sqlquery, struct context *cnt, int save_id)
             if (res) {
                 PQclear(res);
             }
+            return retcd;
         }
     #else
         (void)sqlquery;
@@ -609,13 +700,14 @@ static void dbse_exec_pgsql(char *sqlquery, struct context *cnt, int save_id)
         (void)save_id;
     #endif /* HAVE_PGSQL */
 
+    return DBSE_OK;
 }
 
 /**
  * dbse_exec_sqlite3
  *
  */
-static void dbse_exec_sqlite3(char *sqlquery, struct context *cnt, int save_id)
+static int dbse_exec_sqlite3(const char *sqlquery, struct context *cnt, int save_id)
 {
     #ifdef HAVE_SQLITE3
         if ((mystreq(cnt->conf.database_type, "sqlite3")) && (cnt->conf.database_dbname)) {
@@ -629,6 +721,10 @@ static void dbse_exec_sqlite3(char *sqlquery, struct context *cnt, int save_id)
                 if (save_id) {
                     cnt->database_event_id = 0;
                 }
+                if ((res == SQLITE_BUSY) || (res == SQLITE_LOCKED)) {
+                    return DBSE_RETRY;
+                }
+                return DBSE_FAIL;
             } else if (save_id) {
                 cnt->database_event_id = sqlite3_last_insert_rowid(cnt->database_sqlite3);
             }
@@ -640,87 +736,553 @@ static void dbse_exec_sqlite3(char *sqlquery, struct context *cnt, int save_id)
         (void)save_id;
     #endif /* HAVE_SQLITE3 */
 
+    return DBSE_OK;
 }
 
 /**
- * dbse_firstmotion
+ * dbse_exec
  *
  */
-void dbse_firstmotion(struct context *cnt)
+static int dbse_exec(struct context *cnt, const char *sqlquery, int save_id)
 {
-    char sqlquery[PATH_MAX];
-
-    mystrftime(cnt, sqlquery, sizeof(sqlquery), cnt->conf.sql_query_start,
-                   &cnt->current_image->timestamp_tv, NULL, 0);
-
-    if (strlen(sqlquery) <= 0) {
-        MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "Ignoring empty sql query");
-        return;
-    }
-
     if (mystreq(cnt->conf.database_type,"mysql")) {
-        dbse_exec_mysql(sqlquery, cnt, 1);
+        return dbse_exec_mysql(sqlquery, cnt, save_id);
     } else if (mystreq(cnt->conf.database_type,"mariadb")) {
-        dbse_exec_mariadb(sqlquery, cnt, 1);
+        return dbse_exec_mariadb(sqlquery, cnt, save_id);
     } else if (mystreq(cnt->conf.database_type,"postgresql")) {
-        dbse_exec_pgsql(sqlquery, cnt, 1);
+        return dbse_exec_pgsql(sqlquery, cnt, save_id);
     } else if (mystreq(cnt->conf.database_type,"sqlite3")) {
-        dbse_exec_sqlite3(sqlquery, cnt, 1);
+        return dbse_exec_sqlite3(sqlquery, cnt, save_id);
     }
 
+    return DBSE_OK;
 }
 
 /**
- * dbse_newfile
+ * dbse_writer_eid
  *
+ *   Query with the event id in place of DBSE_EID_MARK or NULL when the query
+ *   does not use it.
  */
-void dbse_newfile(struct context *cnt, char *filename, int sqltype, struct timeval *tv1)
+static char *dbse_writer_eid(struct context *cnt, const char *sqlquery)
 {
-    char sqlquery[PATH_MAX];
+    const char *pos;
+    char *query, eid[32];
+    int marks;
+    size_t len;
+
+    marks = 0;
+    for (pos = sqlquery; *pos != '\0'; pos++) {
+        if (*pos == DBSE_EID_MARK) {
+            marks++;
+        }
+    }
+    if (marks == 0) {
+        return NULL;
+    }
 
-    mystrftime(cnt, sqlquery, sizeof(sqlquery), cnt->conf.sql_query,
-                   tv1, filename, sqltype);
+    #ifdef HAVE_PGSQL
+        if (cnt->eid_db_format == dbeid_no_return) {
+            MOTION_LOG(ERR, TYPE_DB, NO_ERRNO,
+                _("Used %{dbeventid} but sql_query_start returned no valid event ID"));
+            cnt->eid_db_format = dbeid_use_error;
+        }
+    #endif
+
+    snprintf(eid, sizeof(eid), "%llu", cnt->database_event_id);
+
+    query = mymalloc(strlen(sqlquery) + (marks * strlen(eid)) + 1);
+    len = 0;
+    for (pos = sqlquery; *pos != '\0'; pos++) {
+        if (*pos == DBSE_EID_MARK) {
+            memcpy(query + len, eid, strlen(eid));
+            len += strlen(eid);
+        } else {
+            query[len++] = *pos;
+        }
+    }
+    query[len] = '\0';
 
-    if (strlen(sqlquery) <= 0) {
-        MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "Ignoring empty sql query");
+    return query;
+}
+
+/**
+ * dbse_writer_run
+ *
+ *   Run the count queries at the head of the queue, all of camera cnt.  Gives
+ *   the number of them that are finished with, which is none when the
+ *   transaction had to be rolled back.  A request to close the connection
+ *   is always alone in its batch.
+ */
+static int dbse_writer_run(struct dbse_writer *dbw, struct context *cnt, int count, int *done)
+{
+    struct dbse_job *job;
+    char *sqlquery;
+    int indx, retcd, transaction;
+
+    *done = 0;
+
+    if (dbw->jobs[dbw->head].sqlquery == NULL) {
+        if (cnt->dbse_open) {
+            dbse_close(cnt, dbw->cntlist);
+            cnt->dbse_open = FALSE;
+        }
+        *done = 1;
+        return DBSE_OK;
+    }
+
+    if (!cnt->dbse_open) {
+        if (dbse_connect(cnt, dbw->cntlist) != 0) {
+            dbse_close(cnt, dbw->cntlist);
+            return DBSE_RETRY;
+        }
+        cnt->dbse_open = TRUE;
+    }
+
+    /* A failed query aborts the whole transaction on PostgreSQL */
+    transaction = ((count > 1) && (!mystreq(cnt->conf.database_type, "postgresql")));
+    if (transaction) {
+        retcd = dbse_exec(cnt, "BEGIN", 0);
+        if (retcd == DBSE_RETRY) {
+            return retcd;
+        } else if (retcd == DBSE_FAIL) {
+            transaction = FALSE;
+        }
+    }
+
+    for (indx = 0; indx < count; indx++) {
+        job = &dbw->jobs[(dbw->head + indx) % DBSE_QUEUE_MAX];
+        sqlquery = dbse_writer_eid(cnt, job->sqlquery);
+        retcd = dbse_exec(cnt, (sqlquery != NULL) ? sqlquery : job->sqlquery, job->save_id);
+        free(sqlquery);
+        if (retcd == DBSE_RETRY) {
+            if (transaction) {
+                dbse_exec(cnt, "ROLLBACK", 0);
+            } else {
+                *done = indx;
+            }
+            return retcd;
+        }
+    }
+
+    if (transaction) {
+        retcd = dbse_exec(cnt, "COMMIT", 0);
+        if (retcd == DBSE_RETRY) {
+            return retcd;
+        }
+    }
+
+    *done = count;
+
+    return DBSE_OK;
+}
+
+/* Take the done queries off the head of the queue and hand out the event id */
+static void dbse_writer_done(struct dbse_writer *dbw, int done)
+{
+    struct dbse_job *job;
+    int indx;
+
+    for (indx = 0; indx < done; indx++) {
+        job = &dbw->jobs[dbw->head];
+        if ((job->save_id) && (job->seq == job->cnt->dbse_event_seq)) {
+            __atomic_store_n(&job->cnt->dbse_event_id, job->cnt->database_event_id, __ATOMIC_SEQ_CST);
+        }
+        free(job->sqlquery);
+        job->sqlquery = NULL;
+        dbw->head = (dbw->head + 1) % DBSE_QUEUE_MAX;
+        dbw->count--;
+    }
+    if (done > 0) {
+        dbw->executed += done;
+        dbw->batches++;
+    }
+}
+
+/**
+ * dbse_writer_close
+ *
+ *   Close the connections the writer still has open when it stops.
+ */
+static void dbse_writer_close(struct dbse_writer *dbw)
+{
+    int indx;
+
+    for (indx = 0; dbw->cntlist[indx] != NULL; indx++) {
+        if (dbw->cntlist[indx]->dbse_open) {
+            dbse_close(dbw->cntlist[indx], dbw->cntlist);
+            dbw->cntlist[indx]->dbse_open = FALSE;
+        }
+    }
+
+    #ifdef HAVE_SQLITE3
+        /* The shared handle last */
+        if (dbw->cntlist[0]->database_sqlite3 != NULL) {
+            for (indx = 1; dbw->cntlist[indx] != NULL; indx++) {
+                if (dbw->cntlist[indx]->database_sqlite3 == dbw->cntlist[0]->database_sqlite3) {
+                    dbw->cntlist[indx]->database_sqlite3 = NULL;
+                }
+            }
+            dbse_close(dbw->cntlist[0], NULL);
+        }
+    #endif /* HAVE_SQLITE3 */
+}
+
+/**
+ * dbse_writer_loop
+ *
+ *   Thread function of the writer.  Runs the queries of a camera at the head
+ *   of the queue in one batch and waits before the next attempt when the
+ *   database is unreachable.
+ */
+static void *dbse_writer_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct dbse_writer *dbw = cnt->dbse_writer;
+    struct context *cnt_job;
+    struct timespec ts;
+    int count, done, retcd;
+
+    util_threadname_set("db", 0, NULL);
+
+    #if defined(HAVE_MYSQL) || defined(HAVE_MARIADB)
+        mysql_thread_init();
+    #endif
+
+    pthread_mutex_lock(&dbw->mutex);
+        while (TRUE) {
+            while ((dbw->count == 0) && (!dbw->stage.finish)) {
+                pthread_cond_wait(&dbw->cond_work, &dbw->mutex);
+            }
+            if (dbw->count == 0) {
+                break;
+            }
+
+            cnt_job = dbw->jobs[dbw->head].cnt;
+            count = 1;
+            while ((dbw->jobs[dbw->head].sqlquery != NULL) &&
+                   (count < dbw->count) && (count < DBSE_BATCH_MAX) &&
+                   (dbw->jobs[(dbw->head + count) % DBSE_QUEUE_MAX].cnt == cnt_job) &&
+                   (dbw->jobs[(dbw->head + count) % DBSE_QUEUE_MAX].sqlquery != NULL)) {
+                count++;
+            }
+
+            pthread_mutex_unlock(&dbw->mutex);
+
+            retcd = dbse_writer_run(dbw, cnt_job, count, &done);
+
+            pthread_mutex_lock(&dbw->mutex);
+
+            dbse_writer_done(dbw, done);
+
+            if (retcd == DBSE_RETRY) {
+                if (dbw->stage.finish) {
+                    break;
+                }
+                if (dbw->backoff == 0) {
+                    dbw->backoff = 1;
+                    MOTION_LOG(WRN, TYPE_DB, NO_ERRNO
+                        ,_("Database unreachable, %d queries waiting"), dbw->count);
+                } else {
+                    dbw->backoff *= 2;
+                    if (dbw->backoff > DBSE_BACKOFF_MAX) {
+                        dbw->backoff = DBSE_BACKOFF_MAX;
+                    }
+                }
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += dbw->backoff;
+                while (!dbw->stage.finish) {
+                    if (pthread_cond_timedwait(&dbw->cond_work, &dbw->mutex, &ts) == ETIMEDOUT) {
+                        break;
+                    }
+                }
+            } else if (dbw->backoff > 0) {
+                MOTION_LOG(NTC, TYPE_DB, NO_ERRNO
+                    ,_("Database reachable again, %d queries waiting"), dbw->count);
+                dbw->backoff = 0;
+            }
+        }
+    pthread_mutex_unlock(&dbw->mutex);
+
+    dbse_writer_close(dbw);
+
+    #if defined(HAVE_MYSQL) || defined(HAVE_MARIADB)
+        mysql_thread_end();
+    #endif
+
+    dbw->stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/**
+ * dbse_writer_put
+ *
+ *   Queue a query for the writer or with a NULL query the closing of the
+ *   connection of the camera.  Returns its sequence number or 0 when the
+ *   queue is full and the query is dropped.  A close that is dropped leaves
+ *   the connection open for the next start of the camera.
+ */
+static unsigned long dbse_writer_put(struct context *cnt, const char *sqlquery, int save_id)
+{
+    struct dbse_writer *dbw = cnt->dbse_writer;
+    struct dbse_job *job;
+    char *query;
+    unsigned long seq;
+
+    query = (sqlquery != NULL) ? mystrdup(sqlquery) : NULL;
+
+    pthread_mutex_lock(&dbw->mutex);
+        if (dbw->count == DBSE_QUEUE_MAX) {
+            if ((dbw->dropped % DBSE_QUEUE_MAX) == 0) {
+                MOTION_LOG(WRN, TYPE_DB, NO_ERRNO
+                    ,_("Database queue full, %lu queries dropped"), dbw->dropped + 1);
+            }
+            dbw->dropped++;
+            seq = 0;
+        } else {
+            job = &dbw->jobs[(dbw->head + dbw->count) % DBSE_QUEUE_MAX];
+            job->cnt = cnt;
+            job->sqlquery = query;
+            job->save_id = save_id;
+            job->seq = ++dbw->seq_queued;
+            seq = job->seq;
+            if (save_id) {
+                /* The file names and commands of the event wait for this id */
+                cnt->dbse_event_seq = seq;
+                __atomic_store_n(&cnt->dbse_event_id, 0, __ATOMIC_SEQ_CST);
+            }
+            query = NULL;
+            dbw->count++;
+            pthread_cond_signal(&dbw->cond_work);
+        }
+    pthread_mutex_unlock(&dbw->mutex);
+
+    free(query);
+
+    return seq;
+}
+
+/**
+ * dbse_writer_init
+ *
+ *   Start the writer thread when any camera uses a database.
+ */
+void dbse_writer_init(struct context **cntlist)
+{
+    struct dbse_writer *dbw;
+    int indx;
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->dbse_writer = NULL;
+    }
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        if ((cntlist[indx]->conf.database_type) && (cntlist[indx]->conf.database_dbname)) {
+            break;
+        }
+    }
+    if (cntlist[indx] == NULL) {
         return;
     }
 
-    if (mystreq(cnt->conf.database_type,"mysql")) {
-        dbse_exec_mysql(sqlquery, cnt, 0);
-    } else if (mystreq(cnt->conf.database_type,"mariadb")) {
-        dbse_exec_mariadb(sqlquery, cnt, 0);
-    } else if (mystreq(cnt->conf.database_type,"postgresql")) {
-        dbse_exec_pgsql(sqlquery, cnt, 0);
-    } else if (mystreq(cnt->conf.database_type,"sqlite3")) {
-        dbse_exec_sqlite3(sqlquery, cnt, 0);
+    dbw = mymalloc(sizeof(struct dbse_writer));
+    dbw->stage.finished = TRUE;
+    dbw->stage.global = TRUE;
+    pthread_mutex_init(&dbw->mutex, NULL);
+    pthread_cond_init(&dbw->cond_work, NULL);
+
+    dbw->cntlist = cntlist;
+    cntlist[0]->dbse_writer = dbw;
+
+    if (pipeline_stage_start(cntlist[0], &dbw->stage, dbse_writer_loop) != 0) {
+        /* Run the queries in the event handlers as before */
+        dbse_writer_deinit(cntlist);
+        return;
     }
 
+    for (indx = 1; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->dbse_writer = dbw;
+    }
+
+    MOTION_LOG(NTC, TYPE_DB, NO_ERRNO
+        ,_("Database writer started, queue %d"), DBSE_QUEUE_MAX);
 }
 
 /**
- * dbse_fileclose
+ * dbse_writer_deinit
  *
+ *   Stop the writer thread.  Called once the cameras have stopped.
  */
-void dbse_fileclose(struct context *cnt, char *filename, int sqltype, struct timeval *tv1)
+void dbse_writer_deinit(struct context **cntlist)
+{
+    struct dbse_writer *dbw = cntlist[0]->dbse_writer;
+    int indx;
+
+    if (dbw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&dbw->mutex);
+        dbw->stage.finish = TRUE;
+        pthread_cond_broadcast(&dbw->cond_work);
+    pthread_mutex_unlock(&dbw->mutex);
+
+    pipeline_stage_stop(cntlist[0], &dbw->stage, NULL);
+
+    if (dbw->count > 0) {
+        MOTION_LOG(ERR, TYPE_DB, NO_ERRNO
+            ,_("Database writer stopped, %d queries lost"), dbw->count);
+    }
+    while (dbw->count > 0) {
+        free(dbw->jobs[dbw->head].sqlquery);
+        dbw->head = (dbw->head + 1) % DBSE_QUEUE_MAX;
+        dbw->count--;
+    }
+
+    if (dbw->executed > 0) {
+        MOTION_LOG(INF, TYPE_DB, NO_ERRNO
+            ,_("Database writer finished: %lu queries in %lu batches, %lu dropped")
+            ,dbw->executed, dbw->batches, dbw->dropped);
+    }
+
+    pthread_mutex_destroy(&dbw->mutex);
+    pthread_cond_destroy(&dbw->cond_work);
+
+    free(dbw);
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->dbse_writer = NULL;
+    }
+}
+
+/**
+ * dbse_defer_eid
+ *
+ *   Copy the sql format with DBSE_EID_MARK in place of %{dbeventid} so that
+ *   the writer puts in the event id once the sql_query_start before it has
+ *   run.
+ */
+static const char *dbse_defer_eid(const char *sqlformat, char *sqldefer, size_t size)
+{
+    const char *pos, *word;
+    size_t len;
+
+    if (sqlformat == NULL) {
+        return NULL;
+    }
+
+    len = 0;
+    pos = sqlformat;
+    while ((*pos != '\0') && (len < size - 1)) {
+        if (*pos == '%') {
+            word = pos + 1;
+            while ((*word == '-') || (isdigit((unsigned char)*word))) {
+                word++;
+            }
+            if (!strncmp(word, "{dbeventid}", 11)) {
+                sqldefer[len++] = DBSE_EID_MARK;
+                pos = word + 11;
+                continue;
+            }
+            if (pos[1] == '%') {
+                if (len + 2 > size - 1) {
+                    break;
+                }
+                sqldefer[len++] = *pos++;
+            }
+        }
+        sqldefer[len++] = *pos++;
+    }
+    sqldefer[len] = '\0';
+
+    return sqldefer;
+}
+
+/**
+ * dbse_query
+ *
+ *   Expand the sql format and hand the query to the writer.  Without the
+ *   writer it is run here, and once more if the database had to reconnect.
+ */
+static void dbse_query(struct context *cnt, const char *sqlformat, struct timeval *tv1
+            , char *filename, int sqltype, int save_id)
 {
     char sqlquery[PATH_MAX];
+    char sqldefer[PATH_MAX];
+
+    if (cnt->dbse_writer != NULL) {
+        sqlformat = dbse_defer_eid(sqlformat, sqldefer, sizeof(sqldefer));
+    }
+
+    mystrftime(cnt, sqlquery, sizeof(sqlquery), sqlformat, tv1, filename, sqltype);
 
-    mystrftime(cnt, sqlquery, sizeof(sqlquery), cnt->conf.sql_query_stop,
-               tv1, filename, sqltype);
     if (strlen(sqlquery) <= 0) {
         MOTION_LOG(WRN, TYPE_DB, NO_ERRNO, "Ignoring empty sql query");
         return;
     }
 
-    if (mystreq(cnt->conf.database_type,"mysql")) {
-        dbse_exec_mysql(sqlquery, cnt, 0);
-    } else if (mystreq(cnt->conf.database_type,"mariadb")) {
-        dbse_exec_mariadb(sqlquery, cnt, 0);
-    } else if (mystreq(cnt->conf.database_type,"postgresql")) {
-        dbse_exec_pgsql(sqlquery, cnt, 0);
-    } else if (mystreq(cnt->conf.database_type,"sqlite3")) {
-        dbse_exec_sqlite3(sqlquery, cnt, 0);
+    if (cnt->dbse_writer == NULL) {
+        if (dbse_exec(cnt, sqlquery, save_id) == DBSE_RETRY) {
+            dbse_exec(cnt, sqlquery, save_id);
+        }
+        return;
     }
+
+    dbse_writer_put(cnt, sqlquery, save_id);
+}
+
+/**
+ * dbse_firstmotion
+ *
+ */
+void dbse_firstmotion(struct context *cnt)
+{
+    struct pipe_view view;
+
+    pipeline_view(cnt, &view);
+
+    dbse_query(cnt, cnt->conf.sql_query_start, &view.image->timestamp_tv, NULL, 0, TRUE);
+}
+
+/**
+ * dbse_newfile
+ *
+ */
+void dbse_newfile(struct context *cnt, char *filename, int sqltype, struct timeval *tv1)
+{
+    dbse_query(cnt, cnt->conf.sql_query, tv1, filename, sqltype, FALSE);
 }
 
+/**
+ * dbse_fileclose
+ *
+ */
+void dbse_fileclose(struct context *cnt, char *filename, int sqltype, struct timeval *tv1)
+{
+    dbse_query(cnt, cnt->conf.sql_query_stop, tv1, filename, sqltype, FALSE);
+}
+
+
+/**
+ * dbse_event_id
+ *
+ *   Event id for %{dbeventid} in the file names and the commands.  With the
+ *   writer it is 0 until the sql_query_start of the event has run.
+ */
+unsigned long long dbse_event_id(struct context *cnt)
+{
+    if (cnt->dbse_writer != NULL) {
+        return __atomic_load_n(&cnt->dbse_event_id, __ATOMIC_SEQ_CST);
+    }
+
+    #ifdef HAVE_PGSQL
+        if (cnt->eid_db_format == dbeid_no_return) {
+            MOTION_LOG(ERR, TYPE_DB, NO_ERRNO,
+                _("Used %{dbeventid} but sql_query_start returned no valid event ID"));
+            cnt->eid_db_format = dbeid_use_error;
+        }
+    #endif
+
+    return cnt->database_event_id;
+}
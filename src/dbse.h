@@ -18,12 +18,50 @@
  *      dbse.h
  *
  *      Headers associated with functions in the dbse.c module.
+ *      The file pipeline.h must be included before this one.
  *
  */
 
 #ifndef _INCLUDE_DBSE_H
 #define _INCLUDE_DBSE_H
 
+#define DBSE_QUEUE_MAX      256     /* Queries waiting for the writer thread */
+#define DBSE_BATCH_MAX      32      /* Queries of a camera run in one transaction */
+#define DBSE_BACKOFF_MAX    60      /* Seconds between attempts while the database is unreachable */
+#define DBSE_EID_MARK       '\001'  /* Stands for %{dbeventid} in a query until it is run */
+
+enum DBSE_RESULT {
+    DBSE_OK,
+    DBSE_FAIL,                      /* Query failed and is dropped */
+    DBSE_RETRY                      /* Database unreachable, run the query again later */
+};
+
+/* A query waiting for the writer thread */
+struct dbse_job {
+    struct context     *cnt;
+    char               *sqlquery;       /* NULL to close the connection of the camera */
+    int                 save_id;        /* Query is sql_query_start and sets database_event_id */
+    unsigned long       seq;
+};
+
+/* Thread running the queries of all the cameras.  Only on the first context */
+struct dbse_writer {
+    struct pipe_stage   stage;
+    struct context    **cntlist;        /* Cameras whose connections the writer opens */
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond_work;      /* Writer waits for queries */
+    struct dbse_job     jobs[DBSE_QUEUE_MAX];
+    int                 head;
+    int                 count;
+    int                 backoff;        /* Seconds until the next attempt.  0 while reachable */
+    unsigned long       seq_queued;
+    unsigned long       executed;
+    unsigned long       batches;
+    unsigned long       dropped;
+};
+
+void dbse_writer_init(struct context **cntlist);
+void dbse_writer_deinit(struct context **cntlist);
 void dbse_global_init(struct context **cntlist);
 void dbse_global_deinit(struct context **cntlist);
 
@@ -34,6 +72,7 @@ void dbse_sqlmask_update(struct context *cnt);
 void dbse_firstmotion(struct context *cnt);
 void dbse_newfile(struct context *cnt, char *filename, int sqltype, struct timeval *tv1);
 void dbse_fileclose(struct context *cnt, char *filename, int sqltype, struct timeval *tv1);
+unsigned long long dbse_event_id(struct context *cnt);
 
 
 #endif
@@ -1082,15 +1082,57 @@ struct draw_char draw_table[]= {
 };
 
 #define NEWLINE "\\n"
+
+/* Runs of black or white pixels of one row of a character at scale 1 */
+struct draw_run {
+    unsigned char row;
+    unsigned char x;
+    unsigned char len;
+    unsigned char value;
+};
+
+/* Glyph atlas built from draw_table by initialize_chars */
+struct draw_glyph {
+    struct draw_run runs[8 * 7];
+    int             count;
+};
+
+static struct draw_glyph draw_glyphs[ASCII_MAX];
+
+/* Keep the span in the cache or write it right away */
+static void draw_span_put(struct draw_cache *cache, unsigned char *image
+            , int offset, int len, unsigned char value)
+{
+    struct draw_span *span;
+
+    if (cache == NULL) {
+        memset(image + offset, value, len);
+        return;
+    }
+
+    if (cache->span_count == cache->span_size) {
+        cache->span_size = (cache->span_size == 0) ? 256 : cache->span_size * 2;
+        cache->spans = myrealloc(cache->spans
+            , cache->span_size * sizeof(struct draw_span), "draw_span_put");
+    }
+    span = &cache->spans[cache->span_count++];
+    span->offset = offset;
+    span->len = len;
+    span->value = value;
+}
+
 /**
  * draw_textn
+ *
+ *   Put one line of text on the image, or the spans it is made of in the
+ *   cache when one is given.
  */
-static int draw_textn(unsigned char *image, int startx,  int starty,  int width, const char *text, int len, int factor)
+static int draw_textn(struct draw_cache *cache, unsigned char *image, int startx,  int starty
+            ,  int width, const char *text, int len, int factor)
 {
-
-    int x, y;
-    int pos, line_offset, next_char_offs;
-    unsigned char *image_ptr, *char_ptr;
+    int pos, indx, row, offset;
+    struct draw_glyph *glyph;
+    struct draw_run *run;
 
     if (startx > width / 2) {
         startx -= len * (6 * factor);
@@ -1104,49 +1146,33 @@ static int draw_textn(unsigned char *image, int startx,  int starty,  int width,
         return 0;
     }
 
-    line_offset = width - (7 * factor);
-    next_char_offs = (width * 8 * factor) - (6 * factor);
-
-    image_ptr = image + startx + (starty * width);
+    offset = startx + (starty * width);
 
     for (pos = 0; pos < len; pos++) {
         int pos_check = (int)text[pos];
 
-        if ((pos_check <0) || (pos_check >127)) {
+        if ((pos_check <0) || (pos_check >= ASCII_MAX)) {
             pos_check = 45; /* Use a - for non ascii characters*/
         }
 
-        char_ptr = char_arr_ptr[pos_check];
-
-        for (y = 0; y < 8 * factor; y++) {
-            for (x = 0; x < 7 * factor; x++) {
-                char_ptr = char_arr_ptr[pos_check] + y/factor*7 + x/factor;
-
-                switch(*char_ptr) {
-                case 1:
-                    *image_ptr = 0;
-                     break;
-                case 2:
-                    *image_ptr = 255;
-                    break;
-                default:
-                    break;
-                }
+        glyph = &draw_glyphs[pos_check];
 
-                image_ptr++;
+        for (indx = 0; indx < glyph->count; indx++) {
+            run = &glyph->runs[indx];
+            for (row = run->row * factor; row < (run->row + 1) * factor; row++) {
+                draw_span_put(cache, image, offset + (row * width) + (run->x * factor)
+                    , run->len * factor, run->value);
             }
-            image_ptr += line_offset;
         }
-        image_ptr -= next_char_offs;
+        offset += 6 * factor;
     }
 
     return 0;
 }
 
-/**
- * draw_text
- */
-int draw_text(unsigned char *image, int width, int height, int startx, int starty, const char *text, int factor)
+/* Put the text on the image, or its spans in the cache when one is given */
+static void draw_layout(struct draw_cache *cache, unsigned char *image, int width, int height
+            , int startx, int starty, const char *text, int factor)
 {
     int num_nl = 0;
     const char *end, *begin;
@@ -1193,17 +1219,81 @@ int draw_text(unsigned char *image, int width, int height, int startx, int start
     while ((end = strstr(end, NEWLINE))) {
         int len = end-begin;
 
-        draw_textn(image, startx, starty, width, begin, len, factor);
+        draw_textn(cache, image, startx, starty, width, begin, len, factor);
         end += sizeof(NEWLINE)-1;
         begin = end;
         starty += line_space;
     }
 
-    draw_textn(image, startx, starty, width, begin, strlen(begin), factor);
+    draw_textn(cache, image, startx, starty, width, begin, strlen(begin), factor);
+}
+
+/**
+ * draw_text
+ */
+int draw_text(unsigned char *image, int width, int height, int startx, int starty, const char *text, int factor)
+{
+    draw_layout(NULL, image, width, height, startx, starty, text, factor);
+
+    return 0;
+}
+
+/**
+ * draw_text_cached
+ *
+ *   Same as draw_text for a text put at the same place on every frame.  The
+ *   spans of the text are kept in the cache and only made again when the
+ *   text, its place or the scale changed since the last frame.
+ */
+int draw_text_cached(struct draw_cache *cache, unsigned char *image, int width, int height
+            , int startx, int starty, const char *text, int factor)
+{
+    struct draw_span *span, *span_end;
+
+    if ((cache->text == NULL) || mystrne(cache->text, text) ||
+        (cache->width != width) || (cache->height != height) ||
+        (cache->startx != startx) || (cache->starty != starty) ||
+        (cache->factor != factor)) {
+        free(cache->text);
+        cache->text = mystrdup(text);
+        cache->width = width;
+        cache->height = height;
+        cache->startx = startx;
+        cache->starty = starty;
+        cache->factor = factor;
+        cache->span_count = 0;
+        draw_layout(cache, image, width, height, startx, starty, text, factor);
+    }
+
+    span_end = cache->spans + cache->span_count;
+    for (span = cache->spans; span < span_end; span++) {
+        memset(image + span->offset, span->value, span->len);
+    }
 
     return 0;
 }
 
+void draw_cache_init(struct context *cnt)
+{
+    cnt->draw_cache = mymalloc(DRAW_CACHE_COUNT * sizeof(struct draw_cache));
+}
+
+void draw_cache_deinit(struct context *cnt)
+{
+    int indx;
+
+    if (cnt->draw_cache == NULL) {
+        return;
+    }
+
+    for (indx = 0; indx < DRAW_CACHE_COUNT; indx++) {
+        free(cnt->draw_cache[indx].text);
+        free(cnt->draw_cache[indx].spans);
+    }
+    free(cnt->draw_cache);
+    cnt->draw_cache = NULL;
+}
+
 /**
  * initialize_chars
  */
@@ -1211,6 +1301,9 @@ int initialize_chars(void)
 {
     unsigned int i;
     size_t draw_table_size;
+    int row, x, len;
+    unsigned char *pix;
+    struct draw_glyph *glyph;
 
     draw_table_size = sizeof(draw_table) / sizeof(struct draw_char);
 
@@ -1224,6 +1317,29 @@ int initialize_chars(void)
         char_arr_ptr[(int)draw_table[i].ascii] = &draw_table[i].pix[0][0];
     }
 
+    /* Build the runs of each character, 1 is black and 2 is white */
+    for (i = 0; i < ASCII_MAX; i++) {
+        glyph = &draw_glyphs[i];
+        glyph->count = 0;
+        for (row = 0; row < 8; row++) {
+            pix = char_arr_ptr[i] + row * 7;
+            x = 0;
+            while (x < 7) {
+                len = 1;
+                while ((x + len < 7) && (pix[x + len] == pix[x])) {
+                    len++;
+                }
+                if ((pix[x] == 1) || (pix[x] == 2)) {
+                    glyph->runs[glyph->count].row = row;
+                    glyph->runs[glyph->count].x = x;
+                    glyph->runs[glyph->count].len = len;
+                    glyph->runs[glyph->count].value = (pix[x] == 1) ? 0 : 255;
+                    glyph->count++;
+                }
+                x += len;
+            }
+        }
+    }
+
     return 0;
 }
-
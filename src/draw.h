@@ -17,9 +17,43 @@
 #ifndef _INCLUDE_DRAW_H
 #define _INCLUDE_DRAW_H
 
+/* Texts put on every frame, each with its own cache */
+enum DRAW_CACHE_TEXT {
+    DRAW_CACHE_CHANGES,
+    DRAW_CACHE_SETUP_DIFFS,
+    DRAW_CACHE_SETUP_THREAD,
+    DRAW_CACHE_LEFT,
+    DRAW_CACHE_RIGHT,
+    DRAW_CACHE_COUNT
+};
+
+/* Pixels of a text set to black or white */
+struct draw_span {
+    int             offset;     /* Offset of the first pixel in the image */
+    int             len;
+    unsigned char   value;
+};
+
+/* Spans of the text last drawn at one place of the frames */
+struct draw_cache {
+    char               *text;
+    int                 width;
+    int                 height;
+    int                 startx;
+    int                 starty;
+    int                 factor;
+    struct draw_span   *spans;
+    int                 span_count;
+    int                 span_size;
+};
+
 int initialize_chars(void);
 
 int draw_text(unsigned char *image, int width, int height, int startx, int starty, const char *text, int factor);
+int draw_text_cached(struct draw_cache *cache, unsigned char *image, int width, int height
+            , int startx, int starty, const char *text, int factor);
+void draw_cache_init(struct context *cnt);
+void draw_cache_deinit(struct context *cnt);
 
 
 #endif
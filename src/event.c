@@ -31,9 +31,20 @@
 #include "netcam_rtsp.h"
 #include "ffmpeg.h"
 #include "event.h"
+#include "pipeline.h"
+#include "picture_writer.h"
+#include "movie_encoder.h"
+#include "jpeg_cache.h"
+#include "stream_worker.h"
+#include "stream_jpeg.h"
+#include "mosaic.h"
+#include "spawner.h"
+#include "webu.h"
+#include "webu_stream.h"
 #include "video_loopback.h"
 #include "video_common.h"
 #include "dbse.h"
+#include "draw.h"
 
 /*
  * TODO Items:
@@ -68,47 +79,26 @@ const char *eventList[] = {
     "EVENT_CAMERA_FOUND",
     "EVENT_FFMPEG_PUT",
     "EVENT_LAST",
-    "EVENT_MAX_MOVIE"
+    "EVENT_MAX_MOVIE",
+    "EVENT_MOVIE_RESUME"
 };
 
 /**
  * exec_command
  *      Execute 'command' with 'arg' as its argument.
  *      if !arg command is started with no arguments
- *      Before we call execl we need to close all the file handles
- *      that the fork inherited from the parent in order not to pass
- *      the open handles on to the shell
+ *      The command is started by the spawner thread so the camera thread
+ *      does not wait on a fork of the whole Motion process.
  */
 static void exec_command(struct context *cnt, char *command, char *filename, int filetype)
 {
     char stamp[PATH_MAX];
-    mystrftime(cnt, stamp, sizeof(stamp), command, &cnt->current_image->timestamp_tv, filename, filetype);
+    struct pipe_view view;
 
-    if (!fork()) {
-        int i;
+    pipeline_view(cnt, &view);
+    mystrftime(cnt, stamp, sizeof(stamp), command, &view.image->timestamp_tv, filename, filetype);
 
-        /* Detach from parent */
-        setsid();
-
-        /*
-         * Close any file descriptor except console because we will
-         * like to see error messages
-         */
-        for (i = getdtablesize() - 1; i > 2; i--) {
-            close(i);
-        }
-
-        execl("/bin/sh", "sh", "-c", stamp, " &", NULL);
-
-        /* if above function succeeds the program never reach here */
-        MOTION_LOG(ALR, TYPE_EVENTS, SHOW_ERRNO
-            ,_("Unable to start external command '%s'"), stamp);
-
-        exit(1);
-    }
-
-    MOTION_LOG(DBG, TYPE_EVENTS, NO_ERRNO
-        ,_("Executing external command '%s'"), stamp);
+    spawner_put(cnt, stamp);
 }
 
 /*
@@ -280,104 +270,105 @@ static void on_event_end_command(struct context *cnt, motion_event eventtype
     }
 }
 
+/* Compress the camera image scaled for a stream with clients */
+static void event_stream_scaled(struct context *cnt, struct stream_data *stream
+            , struct image_data *img_data)
+{
+    struct stream_jpeg *jpeg;
+    long jpeg_size;
+
+    if ((stream->cnct_count > 0) && (img_data->image_norm != NULL)) {
+        jpeg = stream_jpeg_claim(cnt, stream);
+        jpeg_size = stream_jpeg_put_scaled(cnt, stream, jpeg, img_data->image_norm, img_data);
+        stream_jpeg_publish(stream, jpeg, jpeg_size);
+    }
+}
+
 static void event_stream_put(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
-    int subsize;
+    struct stream_jpeg *jpeg;
+    long jpeg_size;
 
     (void)eventtype;
     (void)filename;
     (void)eventdata;
     (void)tv1;
 
+    mosaic_put(cnt, img_data);
+
+    if (stream_worker_put(cnt, img_data) == STREAM_WORKER_QUEUED) {
+        return;
+    }
 
+    /* The lock keeps a single thread compressing the stream images.  The
+     * clients take the published images without it.  See stream_jpeg.c
+     */
     pthread_mutex_lock(&cnt->mutex_stream);
         /* Normal stream processing */
-        if (cnt->stream_norm.cnct_count > 0) {
-            if (cnt->stream_norm.jpeg_data == NULL) {
-                cnt->stream_norm.jpeg_data = mymalloc(cnt->imgs.size_norm);
-            }
-            if (img_data->image_norm != NULL) {
-                cnt->stream_norm.jpeg_size = put_picture_memory(cnt
-                    ,cnt->stream_norm.jpeg_data
-                    ,cnt->imgs.size_norm
-                    ,img_data->image_norm
-                    ,cnt->conf.stream_quality
-                    ,cnt->imgs.width
-                    ,cnt->imgs.height);
-            }
+        if ((cnt->stream_norm.cnct_count > 0) && (img_data->image_norm != NULL)) {
+            jpeg = stream_jpeg_claim(cnt, &cnt->stream_norm);
+            jpeg_size = put_picture_memory(cnt
+                ,jpeg->jpeg_data
+                ,cnt->imgs.size_norm
+                ,img_data->image_norm
+                ,cnt->conf.stream_quality
+                ,cnt->imgs.width
+                ,cnt->imgs.height
+                ,img_data, JPEG_PLANE_NORM);
+            stream_jpeg_publish(&cnt->stream_norm, jpeg, jpeg_size);
         }
 
-        /* Substream processing */
-        if (cnt->stream_sub.cnct_count > 0) {
-            if (cnt->stream_sub.jpeg_data == NULL) {
-                cnt->stream_sub.jpeg_data = mymalloc(cnt->imgs.size_norm);
-            }
-            if (img_data->image_norm != NULL) {
-                /* Resulting substream image must be multiple of 8 */
-                if (((cnt->imgs.width  % 16) == 0)  &&
-                    ((cnt->imgs.height % 16) == 0)) {
-                    subsize = ((cnt->imgs.width / 2) * (cnt->imgs.height / 2) * 3 / 2);
-                    if (cnt->imgs.substream_image == NULL) {
-                        cnt->imgs.substream_image = mymalloc(subsize);
-                    }
-                    pic_scale_img(cnt->imgs.width
-                        ,cnt->imgs.height
-                        ,img_data->image_norm
-                        ,cnt->imgs.substream_image);
-                    cnt->stream_sub.jpeg_size = put_picture_memory(cnt
-                        ,cnt->stream_sub.jpeg_data
-                        ,subsize
-                        ,cnt->imgs.substream_image
-                        ,cnt->conf.stream_quality
-                        ,(cnt->imgs.width / 2)
-                        ,(cnt->imgs.height / 2));
-                } else {
-                    /* Substream was not multiple of 8 so send full image*/
-                    cnt->stream_sub.jpeg_size = put_picture_memory(cnt
-                        ,cnt->stream_sub.jpeg_data
-                        ,cnt->imgs.size_norm
-                        ,img_data->image_norm
-                        ,cnt->conf.stream_quality
-                        ,cnt->imgs.width
-                        ,cnt->imgs.height);
-                }
-            }
+        /* Normal stream at a lower quality for the clients falling behind */
+        if ((cnt->stream_low.cnct_count > 0) && (img_data->image_norm != NULL)) {
+            jpeg = stream_jpeg_claim(cnt, &cnt->stream_low);
+            jpeg_size = put_picture_memory(cnt
+                ,jpeg->jpeg_data
+                ,cnt->imgs.size_norm
+                ,img_data->image_norm
+                ,stream_jpeg_low_quality(cnt)
+                ,cnt->imgs.width
+                ,cnt->imgs.height
+                ,img_data, JPEG_PLANE_NORM);
+            stream_jpeg_publish(&cnt->stream_low, jpeg, jpeg_size);
         }
 
+        /* Scaled streams processing */
+        event_stream_scaled(cnt, &cnt->stream_sub, img_data);
+        event_stream_scaled(cnt, &cnt->stream_quarter, img_data);
+        event_stream_scaled(cnt, &cnt->stream_thumb, img_data);
+
         /* Motion stream processing */
-        if (cnt->stream_motion.cnct_count > 0) {
-            if (cnt->stream_motion.jpeg_data == NULL) {
-                cnt->stream_motion.jpeg_data = mymalloc(cnt->imgs.size_norm);
-            }
-            if (cnt->imgs.img_motion.image_norm != NULL) {
-                cnt->stream_motion.jpeg_size = put_picture_memory(cnt
-                    ,cnt->stream_motion.jpeg_data
-                    ,cnt->imgs.size_norm
-                    ,cnt->imgs.img_motion.image_norm
-                    ,cnt->conf.stream_quality
-                    ,cnt->imgs.width
-                    ,cnt->imgs.height);
-            }
+        if ((cnt->stream_motion.cnct_count > 0) && (cnt->imgs.img_motion.image_norm != NULL)) {
+            jpeg = stream_jpeg_claim(cnt, &cnt->stream_motion);
+            jpeg_size = put_picture_memory(cnt
+                ,jpeg->jpeg_data
+                ,cnt->imgs.size_norm
+                ,cnt->imgs.img_motion.image_norm
+                ,cnt->conf.stream_quality
+                ,cnt->imgs.width
+                ,cnt->imgs.height
+                ,NULL, JPEG_PLANE_NONE);
+            stream_jpeg_publish(&cnt->stream_motion, jpeg, jpeg_size);
         }
 
         /* Source stream processing */
-        if (cnt->stream_source.cnct_count > 0) {
-            if (cnt->stream_source.jpeg_data == NULL) {
-                cnt->stream_source.jpeg_data = mymalloc(cnt->imgs.size_norm);
-            }
-            if (cnt->imgs.image_virgin.image_norm != NULL) {
-                cnt->stream_source.jpeg_size = put_picture_memory(cnt
-                    ,cnt->stream_source.jpeg_data
-                    ,cnt->imgs.size_norm
-                    ,cnt->imgs.image_virgin.image_norm
-                    ,cnt->conf.stream_quality
-                    ,cnt->imgs.width
-                    ,cnt->imgs.height);
-            }
+        if ((cnt->stream_source.cnct_count > 0) && (cnt->imgs.image_virgin.image_norm != NULL)) {
+            jpeg = stream_jpeg_claim(cnt, &cnt->stream_source);
+            jpeg_size = put_picture_memory(cnt
+                ,jpeg->jpeg_data
+                ,cnt->imgs.size_norm
+                ,cnt->imgs.image_virgin.image_norm
+                ,cnt->conf.stream_quality
+                ,cnt->imgs.width
+                ,cnt->imgs.height
+                ,NULL, JPEG_PLANE_NONE);
+            stream_jpeg_publish(&cnt->stream_source, jpeg, jpeg_size);
         }
     pthread_mutex_unlock(&cnt->mutex_stream);
 
+    webu_stream_wake(cnt, FALSE);
+
 }
 
 
@@ -411,6 +402,24 @@ const char *imageext(struct context *cnt)
     return "jpg";
 }
 
+/**
+ * event_put_picture
+ *      Write a picture and raise EVENT_FILECREATE for it.  With picture writer
+ *      threads the picture is queued and the event is raised once it is written.
+ *      Pictures with may_drop set are not saved when the writers are behind.
+ */
+static void event_put_picture(struct context *cnt, char *fullfilename, unsigned char *image
+            , int ftype, long filetype, struct timeval *tv1, int may_drop)
+{
+    if (picture_writer_put(cnt, fullfilename, image, ftype, filetype
+            , tv1, may_drop, NULL, NULL) != PICTURE_WRITER_NONE) {
+        return;
+    }
+
+    put_picture(cnt, fullfilename, image, ftype);
+    event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)filetype, tv1);
+}
+
 static void event_image_detect(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
@@ -444,11 +453,12 @@ static void event_image_detect(struct context *cnt, motion_event eventtype
 
         passthrough = util_check_passthrough(cnt);
         if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-            put_picture(cnt, fullfilename,img_data->image_high, FTYPE_IMAGE);
+            event_put_picture(cnt, fullfilename, img_data->image_high
+                , FTYPE_IMAGE, FTYPE_IMAGE, tv1, TRUE);
         } else {
-            put_picture(cnt, fullfilename,img_data->image_norm, FTYPE_IMAGE);
+            event_put_picture(cnt, fullfilename, img_data->image_norm
+                , FTYPE_IMAGE, FTYPE_IMAGE, tv1, TRUE);
         }
-        event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)FTYPE_IMAGE, tv1);
     }
 }
 
@@ -456,6 +466,7 @@ static void event_imagem_detect(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
     struct config *conf = &cnt->conf;
+    struct pipe_view view;
     char fullfilenamem[PATH_MAX];
     char fname[PATH_MAX];
     char filenamem[PATH_MAX];
@@ -489,8 +500,12 @@ static void event_imagem_detect(struct context *cnt, motion_event eventtype
             , cnt->conf.target_dir
             , (int)(PATH_MAX-2-strlen(cnt->conf.target_dir)-strlen(imageext(cnt)))
             , filenamem, imageext(cnt));
-        put_picture(cnt, fullfilenamem, cnt->imgs.img_motion.image_norm, FTYPE_IMAGE_MOTION);
-        event(cnt, EVENT_FILECREATE, NULL, fullfilenamem, (void *)FTYPE_IMAGE, tv1);
+        pipeline_view(cnt, &view);
+        if (view.image_motion == NULL) {
+            return;
+        }
+        event_put_picture(cnt, fullfilenamem, view.image_motion->image_norm
+            , FTYPE_IMAGE_MOTION, FTYPE_IMAGE, tv1, TRUE);
     }
 }
 
@@ -500,6 +515,7 @@ static void event_image_snapshot(struct context *cnt, motion_event eventtype
     char fullfilename[PATH_MAX];
     char fname[PATH_MAX];
     char filepath[PATH_MAX];
+    unsigned char *image;
     int offset = 0;
     int len = strlen(cnt->conf.snapshot_filename);
     int passthrough;
@@ -535,22 +551,30 @@ static void event_image_snapshot(struct context *cnt, motion_event eventtype
             , (int)(PATH_MAX-1-strlen(cnt->conf.target_dir))
             , fname);
 
+        snprintf(linkpath, PATH_MAX, "%.*s/lastsnap.%s"
+            , (int)(PATH_MAX-strlen("/lastsnap.")-strlen(imageext(cnt)))
+            , cnt->conf.target_dir, imageext(cnt));
+
         passthrough = util_check_passthrough(cnt);
         if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-            put_picture(cnt, fullfilename, img_data->image_high, FTYPE_IMAGE_SNAPSHOT);
+            image = img_data->image_high;
         } else {
-            put_picture(cnt, fullfilename, img_data->image_norm, FTYPE_IMAGE_SNAPSHOT);
+            image = img_data->image_norm;
+        }
+
+        /* The writer threads update the link once the picture is written */
+        if (picture_writer_put(cnt, fullfilename, image, FTYPE_IMAGE_SNAPSHOT, FTYPE_IMAGE_SNAPSHOT
+                , tv1, FALSE, fname, linkpath) != PICTURE_WRITER_NONE) {
+            return;
         }
+
+        put_picture(cnt, fullfilename, image, FTYPE_IMAGE_SNAPSHOT);
         event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)FTYPE_IMAGE_SNAPSHOT, tv1);
 
         /*
          *  Update symbolic link *after* image has been written so that
          *  the link always points to a valid file.
          */
-        snprintf(linkpath, PATH_MAX, "%.*s/lastsnap.%s"
-            , (int)(PATH_MAX-strlen("/lastsnap.")-strlen(imageext(cnt)))
-            , cnt->conf.target_dir, imageext(cnt));
-
         remove(linkpath);
 
         if (symlink(fname, linkpath)) {
@@ -572,15 +596,13 @@ static void event_image_snapshot(struct context *cnt, motion_event eventtype
 
         passthrough = util_check_passthrough(cnt);
         if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-            put_picture(cnt, fullfilename, img_data->image_high, FTYPE_IMAGE_SNAPSHOT);
+            event_put_picture(cnt, fullfilename, img_data->image_high
+                , FTYPE_IMAGE_SNAPSHOT, FTYPE_IMAGE_SNAPSHOT, tv1, FALSE);
         } else {
-            put_picture(cnt, fullfilename, img_data->image_norm, FTYPE_IMAGE_SNAPSHOT);
+            event_put_picture(cnt, fullfilename, img_data->image_norm
+                , FTYPE_IMAGE_SNAPSHOT, FTYPE_IMAGE_SNAPSHOT, tv1, FALSE);
         }
-
-        event(cnt, EVENT_FILECREATE, NULL, fullfilename, (void *)FTYPE_IMAGE_SNAPSHOT, tv1);
     }
-
-    cnt->snapshot = 0;
 }
 
 /**
@@ -596,18 +618,14 @@ static void event_image_preview(struct context *cnt, motion_event eventtype
     const char *imagepath;
     char previewname[PATH_MAX];
     char fname[PATH_MAX];
-    struct image_data *saved_current_image;
     int passthrough, retcd;
 
     (void)eventtype;
-    (void)img_data;
     (void)filename;
     (void)eventdata;
 
-    if (cnt->imgs.preview_image.diffs) {
-        saved_current_image = cnt->current_image;
-        cnt->current_image = &cnt->imgs.preview_image;
-
+    /* img_data is the preview image, the motion loop sets it as the current image */
+    if (img_data->diffs) {
         /* Use filename of movie i.o. jpeg_filename when set to 'preview'. */
         use_imagepath = strcmp(cnt->conf.picture_filename, "preview");
 
@@ -646,11 +664,12 @@ static void event_image_preview(struct context *cnt, motion_event eventtype
 
             passthrough = util_check_passthrough(cnt);
             if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_high , FTYPE_IMAGE);
+                event_put_picture(cnt, previewname, img_data->image_high
+                    , FTYPE_IMAGE, FTYPE_IMAGE, tv1, FALSE);
             } else {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_norm , FTYPE_IMAGE);
+                event_put_picture(cnt, previewname, img_data->image_norm
+                    , FTYPE_IMAGE, FTYPE_IMAGE, tv1, FALSE);
             }
-            event(cnt, EVENT_FILECREATE, NULL, previewname, (void *)FTYPE_IMAGE, tv1);
         } else {
             /*
              * Save best preview-shot also when no movies are recorded or imagepath
@@ -667,7 +686,7 @@ static void event_image_preview(struct context *cnt, motion_event eventtype
                 imagepath = (char *)DEF_IMAGEPATH;
             }
 
-            mystrftime(cnt, fname, sizeof(fname), imagepath, &cnt->imgs.preview_image.timestamp_tv, NULL, 0);
+            mystrftime(cnt, fname, sizeof(fname), imagepath, &img_data->timestamp_tv, NULL, 0);
             snprintf(previewname, PATH_MAX, "%.*s/%.*s.%s"
                 , (int)(PATH_MAX-2-strlen(fname)-strlen(imageext(cnt)))
                 , cnt->conf.target_dir
@@ -676,15 +695,13 @@ static void event_image_preview(struct context *cnt, motion_event eventtype
 
             passthrough = util_check_passthrough(cnt);
             if ((cnt->imgs.size_high > 0) && (!passthrough)) {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_high , FTYPE_IMAGE);
+                event_put_picture(cnt, previewname, img_data->image_high
+                    , FTYPE_IMAGE, FTYPE_IMAGE, tv1, FALSE);
             } else {
-                put_picture(cnt, previewname, cnt->imgs.preview_image.image_norm, FTYPE_IMAGE);
+                event_put_picture(cnt, previewname, img_data->image_norm
+                    , FTYPE_IMAGE, FTYPE_IMAGE, tv1, FALSE);
             }
-            event(cnt, EVENT_FILECREATE, NULL, previewname, (void *)FTYPE_IMAGE, tv1);
         }
-
-        /* Restore global context values. */
-        cnt->current_image = saved_current_image;
     }
 }
 
@@ -754,6 +771,7 @@ static void event_extpipe_end(struct context *cnt, motion_event eventtype
 static void event_create_extpipe(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
+    struct pipe_view view;
     int retcd;
 
     (void)eventtype;
@@ -818,7 +836,8 @@ static void event_create_extpipe(struct context *cnt, motion_event eventtype
         }
         MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, _("pipe: %s"), cnt->extpipecmdline);
 
-        MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, _("cnt->moviefps: %d"), cnt->movie_fps);
+        pipeline_view(cnt, &view);
+        MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO, _("cnt->moviefps: %d"), view.movie_fps);
 
         event(cnt, EVENT_FILECREATE, NULL, cnt->extpipefilename, (void *)FTYPE_MPEG, tv1);
         cnt->extpipe = popen(cnt->extpipecmdline, "we");
@@ -868,45 +887,80 @@ static void event_extpipe_put(struct context *cnt, motion_event eventtype
 }
 
 
-static void event_new_video(struct context *cnt, motion_event eventtype
-            , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
+/* Encode a frame on the movie encoder thread or right away when there is none */
+static void event_ffmpeg_encode(struct context *cnt, struct ffmpeg *ffmpeg
+            , struct image_data *img_data, struct timeval *tv1, int fillers)
 {
-    (void)eventtype;
-    (void)img_data;
-    (void)filename;
-    (void)eventdata;
-    (void)tv1;
-
-    cnt->movie_last_shot = -1;
-    cnt->movie_fps = cnt->lastrate;
-    cnt->movietime = tv1->tv_sec;
+    if (movie_encoder_put(cnt, ffmpeg, img_data, tv1, fillers) != MOVIE_ENCODER_NONE) {
+        return;
+    }
 
-    MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO, _("Source FPS %d"), cnt->movie_fps);
+    if (ffmpeg_put_image(ffmpeg, img_data, tv1, fillers) == -1) {
+        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
+    }
+}
 
-    if (cnt->movie_fps < 2) {
-        cnt->movie_fps = 2;
+/**
+ * event_ffmpeg_close
+ *
+ *   Close and free the movie after its queued frames are encoded.
+ *   EVENT_FILECLOSE is raised once the file is complete.
+ */
+static void event_ffmpeg_close(struct context *cnt, struct ffmpeg *ffmpeg
+            , char *filename, long filetype, struct timeval *tv1)
+{
+    if (movie_encoder_close(cnt, ffmpeg, filename, filetype, tv1) != MOVIE_ENCODER_NONE) {
+        return;
     }
 
+    ffmpeg_close(ffmpeg);
+    free(ffmpeg);
+    event(cnt, EVENT_FILECLOSE, NULL, filename, (void *)filetype, tv1);
 }
 
+/**
+ * event_ffmpeg_open
+ *
+ *   Open the movie set up in *ffmpeg.  A movie of the movie encoder thread
+ *   has its file created by the thread after the movies queued before it
+ *   are closed and gets EVENT_FILECREATE then.  A movie prepared ahead by
+ *   the thread replaces *ffmpeg.  filetype 0 raises no event.
+ *
+ * Returns -1 when the movie could not be opened.  *ffmpeg is then freed.
+ */
+static int event_ffmpeg_open(struct context *cnt, struct ffmpeg **ffmpeg, char *filename
+            , long filetype, struct timeval *tv1, int rollover)
+{
+    int retcd;
 
-static void event_ffmpeg_newfile(struct context *cnt, motion_event eventtype
-            , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
+    retcd = movie_encoder_open(cnt, ffmpeg, filetype, tv1, rollover);
+    if (retcd == MOVIE_ENCODER_QUEUED) {
+        return 0;
+    }
+    if ((retcd == MOVIE_ENCODER_FAILED) ||
+        ((retcd == MOVIE_ENCODER_NONE) && (ffmpeg_open(*ffmpeg) < 0))) {
+        free(*ffmpeg);
+        *ffmpeg = NULL;
+        return -1;
+    }
+
+    if (filetype != 0) {
+        event(cnt, EVENT_FILECREATE, NULL, filename, (void *)filetype, tv1);
+    }
+
+    return 0;
+}
+
+/* Put the names of the next movies in newfilename and motionfilename and give their codec */
+static const char *event_ffmpeg_names(struct context *cnt, struct timeval *tv1)
 {
     char stamp[PATH_MAX];
     const char *moviepath;
     const char *codec;
     long codenbr;
-    int retcd;
-
-    (void)eventtype;
-    (void)img_data;
-    (void)filename;
-    (void)eventdata;
+    struct pipe_view view;
 
-    if (!cnt->conf.movie_output && !cnt->conf.movie_output_motion) {
-        return;
-    }
+    pipeline_view(cnt, &view);
 
     /*
      *  conf.mpegpath would normally be defined but if someone deleted it by control interface
@@ -941,7 +995,7 @@ static void event_ffmpeg_newfile(struct context *cnt, motion_event eventtype
     }
     if (mystreq(codec, "test")) {
         MOTION_LOG(NTC, TYPE_ENCODER, NO_ERRNO, _("Running test of the various output formats."));
-        codenbr = cnt->event_nr % 10;
+        codenbr = view.event_nr % 10;
         switch (codenbr) {
         case 1:
             codec = "mpeg4";
@@ -996,87 +1050,71 @@ static void event_ffmpeg_newfile(struct context *cnt, motion_event eventtype
             , (int)(PATH_MAX-5-strlen(cnt->conf.target_dir))
             , stamp);
     }
+
+    return codec;
+}
+
+/* Open the movies named by event_ffmpeg_names */
+static void event_ffmpeg_openmovies(struct context *cnt, struct timeval *tv1, const char *codec
+            , int rollover)
+{
+    int retcd;
+    struct pipe_view view;
+
+    pipeline_view(cnt, &view);
+
     if (cnt->conf.movie_output) {
         cnt->ffmpeg_output = mymalloc(sizeof(struct ffmpeg));
-        if (cnt->imgs.size_high > 0) {
-            cnt->ffmpeg_output->width  = cnt->imgs.width_high;
-            cnt->ffmpeg_output->height = cnt->imgs.height_high;
-            cnt->ffmpeg_output->high_resolution = TRUE;
-            cnt->ffmpeg_output->rtsp_data = cnt->rtsp_high;
-        } else {
-            cnt->ffmpeg_output->width  = cnt->imgs.width;
-            cnt->ffmpeg_output->height = cnt->imgs.height;
-            cnt->ffmpeg_output->high_resolution = FALSE;
-            cnt->ffmpeg_output->rtsp_data = cnt->rtsp;
-        }
-        cnt->ffmpeg_output->tlapse = TIMELAPSE_NONE;
-        cnt->ffmpeg_output->fps = cnt->movie_fps;
-        cnt->ffmpeg_output->bps = cnt->conf.movie_bps;
-        cnt->ffmpeg_output->filename = cnt->newfilename;
-        cnt->ffmpeg_output->quality = cnt->conf.movie_quality;
-        cnt->ffmpeg_output->start_time.tv_sec = tv1->tv_sec;
-        cnt->ffmpeg_output->start_time.tv_usec = tv1->tv_usec;
-        cnt->ffmpeg_output->last_pts = -1;
-        cnt->ffmpeg_output->base_pts = 0;
-        cnt->ffmpeg_output->gop_cnt = 0;
-        cnt->ffmpeg_output->codec_name = codec;
-        if (mystreq(cnt->conf.movie_codec, "test")) {
-            cnt->ffmpeg_output->test_mode = 1;
-        } else {
-            cnt->ffmpeg_output->test_mode = 0;
-        }
-        cnt->ffmpeg_output->motion_images = 0;
-        cnt->ffmpeg_output->passthrough =util_check_passthrough(cnt);
+        ffmpeg_movie_init(cnt->ffmpeg_output, cnt, FALSE, view.movie_fps, codec
+            , cnt->newfilename, tv1);
 
-
-        retcd = ffmpeg_open(cnt->ffmpeg_output);
+        retcd = event_ffmpeg_open(cnt, &cnt->ffmpeg_output, cnt->newfilename, FTYPE_MPEG, tv1, rollover);
         if (retcd < 0) {
             MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO
                 ,_("Error opening context for movie output."));
-            free(cnt->ffmpeg_output);
-            cnt->ffmpeg_output=NULL;
             return;
         }
-        event(cnt, EVENT_FILECREATE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, tv1);
     }
 
     if (cnt->conf.movie_output_motion) {
         cnt->ffmpeg_output_motion = mymalloc(sizeof(struct ffmpeg));
-        cnt->ffmpeg_output_motion->width  = cnt->imgs.width;
-        cnt->ffmpeg_output_motion->height = cnt->imgs.height;
-        cnt->ffmpeg_output_motion->rtsp_data = NULL;
-        cnt->ffmpeg_output_motion->tlapse = TIMELAPSE_NONE;
-        cnt->ffmpeg_output_motion->fps = cnt->movie_fps;
-        cnt->ffmpeg_output_motion->bps = cnt->conf.movie_bps;
-        cnt->ffmpeg_output_motion->filename = cnt->motionfilename;
-        cnt->ffmpeg_output_motion->quality = cnt->conf.movie_quality;
-        cnt->ffmpeg_output_motion->start_time.tv_sec = tv1->tv_sec;
-        cnt->ffmpeg_output_motion->start_time.tv_usec = tv1->tv_usec;
-        cnt->ffmpeg_output_motion->last_pts = -1;
-        cnt->ffmpeg_output_motion->base_pts = 0;
-        cnt->ffmpeg_output_motion->gop_cnt = 0;
-        cnt->ffmpeg_output_motion->codec_name = codec;
-        if (mystreq(cnt->conf.movie_codec, "test")) {
-            cnt->ffmpeg_output_motion->test_mode = TRUE;
-        } else {
-            cnt->ffmpeg_output_motion->test_mode = FALSE;
-        }
-        cnt->ffmpeg_output_motion->motion_images = TRUE;
-        cnt->ffmpeg_output_motion->passthrough = FALSE;
-        cnt->ffmpeg_output_motion->high_resolution = FALSE;
-        cnt->ffmpeg_output_motion->rtsp_data = NULL;
+        ffmpeg_movie_init(cnt->ffmpeg_output_motion, cnt, TRUE, view.movie_fps, codec
+            , cnt->motionfilename, tv1);
 
-        retcd = ffmpeg_open(cnt->ffmpeg_output_motion);
+        retcd = event_ffmpeg_open(cnt, &cnt->ffmpeg_output_motion, cnt->motionfilename, 0, tv1, rollover);
         if (retcd < 0) {
             MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO
                 ,_("ffopen_open error creating (motion) file [%s]"), cnt->motionfilename);
-            free(cnt->ffmpeg_output_motion);
-            cnt->ffmpeg_output_motion = NULL;
             return;
         }
     }
 }
 
+/* Open the movies of a new event */
+static void event_ffmpeg_openfiles(struct context *cnt, struct timeval *tv1)
+{
+    const char *codec;
+
+    if (!cnt->conf.movie_output && !cnt->conf.movie_output_motion) {
+        return;
+    }
+
+    codec = event_ffmpeg_names(cnt, tv1);
+
+    event_ffmpeg_openmovies(cnt, tv1, codec, FALSE);
+}
+
+static void event_ffmpeg_newfile(struct context *cnt, motion_event eventtype
+            , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
+{
+    (void)eventtype;
+    (void)img_data;
+    (void)filename;
+    (void)eventdata;
+
+    event_ffmpeg_openfiles(cnt, tv1);
+}
+
 static void event_ffmpeg_timelapse(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
@@ -1134,6 +1172,8 @@ static void event_ffmpeg_timelapse(struct context *cnt, motion_event eventtype
         cnt->ffmpeg_timelapse->gop_cnt = 0;
         cnt->ffmpeg_timelapse->motion_images = FALSE;
         cnt->ffmpeg_timelapse->passthrough = FALSE;
+        cnt->ffmpeg_timelapse->frag_duration = 0;
+        cnt->ffmpeg_timelapse->file_writer = cnt->file_writer;
         cnt->ffmpeg_timelapse->rtsp_data = NULL;
 
         if ((mystreq(cnt->conf.timelapse_codec,"mpg")) ||
@@ -1168,27 +1208,98 @@ static void event_ffmpeg_timelapse(struct context *cnt, motion_event eventtype
         event(cnt, EVENT_FILECREATE, NULL, cnt->timelapsefilename, (void *)FTYPE_MPEG_TIMELAPSE, tv1);
     }
 
-    if (ffmpeg_put_image(cnt->ffmpeg_timelapse, img_data, tv1) == -1) {
-        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
-    }
+    event_ffmpeg_encode(cnt, cnt->ffmpeg_timelapse, img_data, tv1, 0);
 
 }
 
 static void event_ffmpeg_put(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
+    struct pipe_view view;
+
     (void)eventtype;
     (void)filename;
     (void)eventdata;
 
+    pipeline_view(cnt, &view);
+
     if (cnt->ffmpeg_output) {
-        if (ffmpeg_put_image(cnt->ffmpeg_output, img_data, tv1) == -1) {
-            MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
+        event_ffmpeg_encode(cnt, cnt->ffmpeg_output, img_data, tv1, view.fillers);
+    }
+    if ((cnt->ffmpeg_output_motion) && (view.image_motion != NULL)) {
+        event_ffmpeg_encode(cnt, cnt->ffmpeg_output_motion, view.image_motion, tv1, view.fillers);
+    }
+}
+
+/**
+ * event_ffmpeg_fillerframes
+ *
+ *   Check if we must add any "filler" frames into movie to keep up fps
+ *   Only if we are recording videos ( ffmpeg or extenal pipe )
+ *   While the overall elapsed time might be correct, if there are
+ *   many duplicated frames, say 10 fps, 5 duplicated, the video will
+ *   look like it is frozen every second for half a second.
+ *   Runs after the other handlers of the detected image.  The count was
+ *   worked out by event_movie_shot when the image was raised and the movies
+ *   got their filler frames from event_ffmpeg_put, so the detected image
+ *   is only sent again to the external pipe.
+ */
+static void event_ffmpeg_fillerframes(struct context *cnt, motion_event eventtype
+            , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
+{
+    struct pipe_view view;
+    int indx;
+
+    (void)eventtype;
+    (void)filename;
+    (void)eventdata;
+
+    pipeline_view(cnt, &view);
+
+    if ((view.fillers == 0) ||
+        ((!cnt->ffmpeg_output) && (!(cnt->conf.movie_extpipe_use && cnt->extpipe)))) {
+        return;
+    }
+
+    if (cnt->log_level >= DBG) {
+        char tmp[25];
+        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO
+        ,_("Added %d fillerframes into movie"), view.fillers);
+        sprintf(tmp, "Fillerframes %d", view.fillers);
+        /* Without an output stage this is the ring frame and may be shared */
+        if (!pipeline_output_thread(cnt)) {
+            image_writable(cnt, img_data);
         }
+        draw_text(img_data->image_norm,
+                  cnt->imgs.width, cnt->imgs.height, 10, 40, tmp, cnt->text_scale);
+        img_data->frame_id = 0;
     }
-    if (cnt->ffmpeg_output_motion) {
-        if (ffmpeg_put_image(cnt->ffmpeg_output_motion, &cnt->imgs.img_motion, tv1) == -1) {
-            MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, _("Error encoding image"));
+
+    /* Add the filler frames into the external pipe */
+    if (cnt->conf.movie_extpipe_use && cnt->extpipe) {
+        for (indx = 0; indx < view.fillers; indx++) {
+            event(cnt, EVENT_FFMPEG_PUT, img_data, NULL, NULL, tv1);
+        }
+    }
+}
+
+/**
+ * event_ffmpeg_resume
+ *
+ *   Motion was detected again while the movie was still open.  Reset the
+ *   start time so that the movie does not get a pause.
+ */
+static void event_ffmpeg_resume(struct context *cnt, motion_event eventtype
+            , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
+{
+    (void)eventtype;
+    (void)img_data;
+    (void)filename;
+    (void)eventdata;
+
+    if (cnt->ffmpeg_output) {
+        if (movie_encoder_reset(cnt, cnt->ffmpeg_output, tv1) == MOVIE_ENCODER_NONE) {
+            ffmpeg_reset_movie_start_time(cnt->ffmpeg_output, tv1);
         }
     }
 }
@@ -1202,21 +1313,118 @@ static void event_ffmpeg_closefile(struct context *cnt, motion_event eventtype
     (void)eventdata;
 
     if (cnt->ffmpeg_output) {
-        ffmpeg_close(cnt->ffmpeg_output);
-        free(cnt->ffmpeg_output);
+        event_ffmpeg_close(cnt, cnt->ffmpeg_output, cnt->newfilename, FTYPE_MPEG, tv1);
         cnt->ffmpeg_output = NULL;
-        event(cnt, EVENT_FILECLOSE, NULL, cnt->newfilename, (void *)FTYPE_MPEG, tv1);
     }
 
     if (cnt->ffmpeg_output_motion) {
-        ffmpeg_close(cnt->ffmpeg_output_motion);
-        free(cnt->ffmpeg_output_motion);
+        event_ffmpeg_close(cnt, cnt->ffmpeg_output_motion, cnt->motionfilename, FTYPE_MPEG_MOTION, tv1);
         cnt->ffmpeg_output_motion = NULL;
-        event(cnt, EVENT_FILECLOSE, NULL, cnt->motionfilename, (void *)FTYPE_MPEG_MOTION, tv1);
     }
 
 }
 
+/* Whether the movie file prev is the one named name, whose extension is not appended yet */
+static int event_ffmpeg_samefile(const char *prev, const char *name)
+{
+    size_t len;
+
+    len = strlen(name);
+
+    return ((strncmp(prev, name, len) == 0) &&
+            ((prev[len] == '\0') || (prev[len] == '.')));
+}
+
+/* Close the movies that reached movie_max_time */
+static void event_ffmpeg_closeprev(struct context *cnt, struct ffmpeg *prev_output, char *prev_newfilename
+            , struct ffmpeg *prev_motion, char *prev_motionfilename, struct timeval *tv1)
+{
+    if (prev_output) {
+        event_ffmpeg_close(cnt, prev_output, prev_newfilename, FTYPE_MPEG, tv1);
+    }
+
+    if (prev_motion) {
+        event_ffmpeg_close(cnt, prev_motion, prev_motionfilename, FTYPE_MPEG_MOTION, tv1);
+    }
+}
+
+/**
+ * event_ffmpeg_rollover
+ *
+ *   The movies reached movie_max_time.  With the movie encoder thread the
+ *   next movies are opened before the previous ones are closed so that the
+ *   thread can write their first frames without waiting for the files to be
+ *   created.  Movies written here, or named like the previous ones, are
+ *   closed first.  The time between the last frame of the previous movie
+ *   and the first of the next is added to the movie encoder statistics.
+ */
+static void event_ffmpeg_rollover(struct context *cnt, motion_event eventtype
+            , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
+{
+    struct ffmpeg *prev_output, *prev_motion;
+    char prev_newfilename[PATH_MAX];
+    char prev_motionfilename[PATH_MAX];
+    const char *codec;
+    struct timeval tv_start, tv_end;
+    int close_first, measure;
+
+    (void)eventtype;
+    (void)img_data;
+    (void)filename;
+    (void)eventdata;
+
+    if (!cnt->conf.movie_output && !cnt->conf.movie_output_motion) {
+        return;
+    }
+
+    prev_output = cnt->ffmpeg_output;
+    prev_motion = cnt->ffmpeg_output_motion;
+    snprintf(prev_newfilename, sizeof(prev_newfilename), "%s", cnt->newfilename);
+    snprintf(prev_motionfilename, sizeof(prev_motionfilename), "%s", cnt->motionfilename);
+    cnt->ffmpeg_output = NULL;
+    cnt->ffmpeg_output_motion = NULL;
+
+    codec = event_ffmpeg_names(cnt, tv1);
+
+    /* The next movie is only opened ahead by the encoder thread and not over
+     * the file of the previous one (e.g. named with %v) since creating it
+     * would truncate the file still being written.
+     */
+    close_first = FALSE;
+    if ((prev_output != NULL) &&
+        ((!movie_encoder_active(cnt, prev_output)) ||
+         (event_ffmpeg_samefile(prev_newfilename, cnt->newfilename)))) {
+        close_first = TRUE;
+    }
+    if ((prev_motion != NULL) &&
+        ((!movie_encoder_active(cnt, prev_motion)) ||
+         (event_ffmpeg_samefile(prev_motionfilename, cnt->motionfilename)))) {
+        close_first = TRUE;
+    }
+
+    /* The gap of the movies written here is the time to close and open them */
+    measure = ((prev_output != NULL) && (!movie_encoder_active(cnt, prev_output)));
+    gettimeofday(&tv_start, NULL);
+
+    if (close_first) {
+        event_ffmpeg_closeprev(cnt, prev_output, prev_newfilename
+            , prev_motion, prev_motionfilename, tv1);
+    }
+
+    event_ffmpeg_openmovies(cnt, tv1, codec, TRUE);
+
+    if (!close_first) {
+        event_ffmpeg_closeprev(cnt, prev_output, prev_newfilename
+            , prev_motion, prev_motionfilename, tv1);
+    }
+
+    if (measure) {
+        gettimeofday(&tv_end, NULL);
+        movie_encoder_gap(cnt, ((tv_end.tv_sec - tv_start.tv_sec) * 1000L) +
+            ((tv_end.tv_usec - tv_start.tv_usec) / 1000L));
+    }
+}
+
 static void event_ffmpeg_timelapseend(struct context *cnt, motion_event eventtype
             , struct image_data *img_data, char *filename, void *eventdata, struct timeval *tv1)
 {
@@ -1226,15 +1434,85 @@ static void event_ffmpeg_timelapseend(struct context *cnt, motion_event eventtyp
     (void)eventdata;
 
     if (cnt->ffmpeg_timelapse) {
-        ffmpeg_close(cnt->ffmpeg_timelapse);
-        free(cnt->ffmpeg_timelapse);
+        event_ffmpeg_close(cnt, cnt->ffmpeg_timelapse, cnt->timelapsefilename, FTYPE_MPEG_TIMELAPSE, tv1);
         cnt->ffmpeg_timelapse = NULL;
-        event(cnt, EVENT_FILECLOSE, NULL, cnt->timelapsefilename, (void *)FTYPE_MPEG_TIMELAPSE, tv1);
     }
 }
 
 
 
+/**
+ * event_movie_fps
+ *
+ *   Frame rate of a movie started now, the rate measured over the last
+ *   second.
+ */
+int event_movie_fps(struct context *cnt)
+{
+    if (cnt->lastrate < 2) {
+        return 2;
+    }
+    return cnt->lastrate;
+}
+
+/**
+ * event_movie_shot
+ *
+ *   Keep the frame rate of the movies and the count of the filler frames
+ *   of each detected image.  Runs on the motion loop before the event is
+ *   handed to the output stage, which gets the values with the event, so
+ *   this state never leaves the motion loop.
+ *
+ *   movie_last_shot is -1 when the movie is created since we do not know
+ *   how many frames there are in the first second.
+ */
+static void event_movie_shot(struct context *cnt, motion_event eventtype
+            , struct image_data *img_data)
+{
+    switch (eventtype) {
+    case EVENT_FIRSTMOTION:
+    case EVENT_MAX_MOVIE:
+        cnt->movie_last_shot = -1;
+        cnt->movie_fillers = 0;
+        MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO, _("Source FPS %d"), cnt->lastrate);
+
+        cnt->movie_fps = event_movie_fps(cnt);
+        break;
+    case EVENT_TIMELAPSE:
+        cnt->timelapse_active = TRUE;
+        break;
+    case EVENT_TIMELAPSEEND:
+        cnt->timelapse_active = FALSE;
+        break;
+    case EVENT_IMAGE_DETECTED:
+        cnt->movie_fillers = 0;
+        if (!cnt->conf.movie_duplicate_frames) {
+            /* don't duplicate frames */
+        } else if ((img_data->shot == 0) &&
+            (cnt->conf.movie_output || cnt->conf.movie_output_motion || cnt->conf.movie_extpipe_use)) {
+            /* Check how many frames it was last sec */
+            if ((cnt->movie_last_shot >= 0) && ((cnt->movie_last_shot + 1) < cnt->movie_fps)) {
+                cnt->movie_fillers = cnt->movie_fps - (cnt->movie_last_shot + 1);
+            }
+            cnt->movie_last_shot = 0;
+        } else if (img_data->shot != (cnt->movie_last_shot + 1)) {
+            /* We are out of sync! Propably we got motion - no motion - motion */
+            cnt->movie_last_shot = -1;
+        }
+
+        /*
+         * Save last shot added to movie
+         * only when we not are within first sec
+         */
+        if (cnt->movie_last_shot >= 0) {
+            cnt->movie_last_shot = img_data->shot;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 /*
  * Starting point for all events
  */
@@ -1313,10 +1591,6 @@ struct event_handlers event_handlers[] = {
     },
     {
     EVENT_FIRSTMOTION,
-    event_new_video
-    },
-    {
-    EVENT_FIRSTMOTION,
     event_ffmpeg_newfile
     },
     {
@@ -1324,10 +1598,6 @@ struct event_handlers event_handlers[] = {
     event_ffmpeg_put
     },
     {
-    EVENT_FFMPEG_PUT,
-    event_ffmpeg_put
-    },
-    {
     EVENT_ENDMOTION,
     event_ffmpeg_closefile
     },
@@ -1373,23 +1643,23 @@ struct event_handlers event_handlers[] = {
     },
     {
     EVENT_MAX_MOVIE,
-    event_ffmpeg_closefile
+    event_extpipe_end
     },
     {
     EVENT_MAX_MOVIE,
-    event_extpipe_end
+    event_ffmpeg_rollover
     },
     {
     EVENT_MAX_MOVIE,
-    event_new_video
+    event_create_extpipe
     },
     {
-    EVENT_MAX_MOVIE,
-    event_ffmpeg_newfile
+    EVENT_MOVIE_RESUME,
+    event_ffmpeg_resume
     },
     {
-    EVENT_MAX_MOVIE,
-    event_create_extpipe
+    EVENT_IMAGE_DETECTED,
+    event_ffmpeg_fillerframes
     },
     {0, NULL}
 };
@@ -1409,6 +1679,25 @@ struct event_handlers event_handlers[] = {
  */
 void event(struct context *cnt, motion_event eventtype, struct image_data *img_data,
            char *filename, void *eventdata, struct timeval *tv1)
+{
+    event_movie_shot(cnt, eventtype, img_data);
+
+    /* Hand the event to the output stage when there is one */
+    if (pipeline_event(cnt, eventtype, img_data, tv1)) {
+        return;
+    }
+
+    event_dispatch(cnt, eventtype, img_data, filename, eventdata, tv1);
+}
+
+/**
+ * event_dispatch
+ *
+ *   Run the handlers of an event.  Used by the output stage for the events
+ *   queued by event() after their state was kept.
+ */
+void event_dispatch(struct context *cnt, motion_event eventtype, struct image_data *img_data,
+           char *filename, void *eventdata, struct timeval *tv1)
 {
     int i=-1;
 
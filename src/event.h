@@ -48,6 +48,7 @@ typedef enum {
     EVENT_FFMPEG_PUT,
     EVENT_LAST,
     EVENT_MAX_MOVIE,
+    EVENT_MOVIE_RESUME,
 } motion_event;
 
 typedef void(* event_handler)(struct context *cnt, motion_event type, struct image_data *img_data,
@@ -55,7 +56,10 @@ typedef void(* event_handler)(struct context *cnt, motion_event type, struct ima
 
 void event(struct context *cnt, motion_event type, struct image_data *img_data,
            char *filename, void *eventdata, struct timeval *tv1);
+void event_dispatch(struct context *cnt, motion_event type, struct image_data *img_data,
+           char *filename, void *eventdata, struct timeval *tv1);
 
 const char *imageext(struct context *cnt);
+int event_movie_fps(struct context *cnt);
 
 #endif /* _INCLUDE_EVENT_H_ */
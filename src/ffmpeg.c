@@ -41,9 +41,20 @@
 #include "netcam.h"
 #include "netcam_rtsp.h"
 #include "ffmpeg.h"
+#include "event.h"
+#include "pipeline.h"
+#include "file_writer.h"
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
 
 #ifdef HAVE_FFMPEG
 
+#define FFMPEG_AVIO_SIZE    (64 * 1024)     /* Bytes the muxer gathers before they go to the file writer */
+
 static void movie_free_pkt(struct ffmpeg *ffmpeg)
 {
     my_packet_free(ffmpeg->pkt);
@@ -95,16 +106,90 @@ static int ffmpeg_timelapse_exists(const char *fname)
 
 static int ffmpeg_timelapse_append(struct ffmpeg *ffmpeg, AVPacket *pkt)
 {
-    FILE *file;
+    /* The file stays open until the timelapse movie is closed */
+    if (ffmpeg->tlapse_out == NULL) {
+        ffmpeg->tlapse_out = file_writer_open(ffmpeg->file_writer, ffmpeg->filename, FILE_OUT_APPEND);
+        if (ffmpeg->tlapse_out == NULL) {
+            return -1;
+        }
+    }
 
-    file = fopen(ffmpeg->filename, "a");
-    if (!file) {
+    if (file_writer_write(ffmpeg->tlapse_out, pkt->data, pkt->size) != 0) {
         return -1;
     }
 
-    fwrite(pkt->data, 1, pkt->size,file);
+    return 0;
+}
+
+#if (MYFFVER >= 61000)
+static int ffmpeg_avio_write(void *opaque, const uint8_t *buf, int buf_size)
+#else
+static int ffmpeg_avio_write(void *opaque, uint8_t *buf, int buf_size)
+#endif
+{
+    if (file_writer_write(opaque, buf, buf_size) != 0) {
+        return AVERROR(errno);
+    }
+    return buf_size;
+}
 
-    fclose(file);
+static int64_t ffmpeg_avio_seek(void *opaque, int64_t offset, int whence)
+{
+    struct file_out *out = opaque;
+
+    if (whence & AVSEEK_SIZE) {
+        return out->size;
+    }
+    return file_writer_seek(out, offset, whence & ~AVSEEK_FORCE);
+}
+
+/* Open the movie file for the muxer to write through the file writer */
+static int ffmpeg_avio_open(struct ffmpeg *ffmpeg)
+{
+    struct file_out *out;
+    unsigned char *buffer;
+
+    out = file_writer_open(ffmpeg->file_writer, ffmpeg->filename, FILE_OUT_PREALLOC);
+    if (out == NULL) {
+        return -1;
+    }
+
+    buffer = av_malloc(FFMPEG_AVIO_SIZE);
+    ffmpeg->oc->pb = avio_alloc_context(buffer, FFMPEG_AVIO_SIZE, 1, out
+        , NULL, ffmpeg_avio_write, ffmpeg_avio_seek);
+    if (ffmpeg->oc->pb == NULL) {
+        av_free(buffer);
+        file_writer_close(out);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ffmpeg_avio_close(struct ffmpeg *ffmpeg)
+{
+    struct file_out *out;
+
+    if (ffmpeg->oc->pb == NULL) {
+        return 0;
+    }
+
+    avio_flush(ffmpeg->oc->pb);
+    out = ffmpeg->oc->pb->opaque;
+
+    av_freep(&ffmpeg->oc->pb->buffer);
+    #if (MYFFVER >= 57081)
+        avio_context_free(&ffmpeg->oc->pb);
+    #else
+        av_freep(&ffmpeg->oc->pb);
+    #endif
+
+    if (file_writer_close(out) != 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO
+            ,_("Error writing file %s"), ffmpeg->filename);
+        return -1;
+    }
 
     return 0;
 }
@@ -167,6 +252,7 @@ static void ffmpeg_free_context(struct ffmpeg *ffmpeg)
         }
 
         if (ffmpeg->oc != NULL) {
+            ffmpeg_avio_close(ffmpeg);
             avformat_free_context(ffmpeg->oc);
             ffmpeg->oc = NULL;
         }
@@ -437,7 +523,7 @@ static int ffmpeg_encode_video(struct ffmpeg *ffmpeg)
     #endif
 }
 
-static int ffmpeg_set_pts(struct ffmpeg *ffmpeg, const struct timeval *tv1)
+static int ffmpeg_set_pts(struct ffmpeg *ffmpeg, const struct timeval *tv1, int64_t pts_back)
 {
 
     int64_t pts_interval;
@@ -456,7 +542,7 @@ static int ffmpeg_set_pts(struct ffmpeg *ffmpeg, const struct timeval *tv1)
             // This is the very first frame, ensure PTS is zero
             ffmpeg->picture->pts = 0;
         } else
-            ffmpeg->picture->pts = av_rescale_q(pts_interval,(AVRational){1, 1000000L},ffmpeg->video_st->time_base) + ffmpeg->base_pts;
+            ffmpeg->picture->pts = av_rescale_q(pts_interval,(AVRational){1, 1000000L},ffmpeg->video_st->time_base) + ffmpeg->base_pts - pts_back;
 
         if (ffmpeg->test_mode == TRUE) {
             MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
@@ -913,11 +999,41 @@ static int ffmpeg_set_picture(struct ffmpeg *ffmpeg)
 
 }
 
+static void ffmpeg_set_fragments(struct ffmpeg *ffmpeg, AVDictionary **opts)
+{
+    /* Write the movie in fragments of frag_duration so that it can be read
+     * while it is being written and it is written in small steady pieces
+     * rather than with a large index when it is closed.  The mp4 and mov
+     * files get an empty header followed by moof/mdat fragments and the
+     * mkv files get clusters of the same length.
+     */
+    char optval[20];
+    const char *fmt_name;
+
+    if ((ffmpeg->frag_duration <= 0) || (ffmpeg->tlapse != TIMELAPSE_NONE)) {
+        return;
+    }
+
+    fmt_name = ffmpeg->oc->oformat->name;
+    if (mystreq(fmt_name, "mp4") || mystreq(fmt_name, "mov")) {
+        av_dict_set(opts, "movflags", "empty_moov+default_base_moof", 0);
+        snprintf(optval, sizeof(optval), "%lld", (long long)ffmpeg->frag_duration * 1000);
+        av_dict_set(opts, "frag_duration", optval, 0);
+    } else if (mystreq(fmt_name, "matroska")) {
+        snprintf(optval, sizeof(optval), "%d", ffmpeg->frag_duration);
+        av_dict_set(opts, "cluster_time_limit", optval, 0);
+    } else {
+        MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
+            ,_("The %s container is not written in fragments"), fmt_name);
+    }
+}
+
 static int ffmpeg_set_outputfile(struct ffmpeg *ffmpeg)
 {
 
     int retcd;
     char errstr[128];
+    AVDictionary *opts;
 
     #if ( MYFFVER < 58000)
         snprintf(ffmpeg->oc->filename, sizeof(ffmpeg->oc->filename), "%s", ffmpeg->filename);
@@ -926,13 +1042,13 @@ static int ffmpeg_set_outputfile(struct ffmpeg *ffmpeg)
     /* Open the output file, if needed. */
     if ((ffmpeg_timelapse_exists(ffmpeg->filename) == 0) || (ffmpeg->tlapse != TIMELAPSE_APPEND)) {
         if (!(ffmpeg->oc->oformat->flags & AVFMT_NOFILE)) {
-            if (avio_open(&ffmpeg->oc->pb, ffmpeg->filename, MY_FLAG_WRITE) < 0) {
+            if (ffmpeg_avio_open(ffmpeg) < 0) {
                 if (errno == ENOENT) {
                     if (mycreate_path(ffmpeg->filename) == -1) {
                         ffmpeg_free_context(ffmpeg);
                         return -1;
                     }
-                    if (avio_open(&ffmpeg->oc->pb, ffmpeg->filename, MY_FLAG_WRITE) < 0) {
+                    if (ffmpeg_avio_open(ffmpeg) < 0) {
                         MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO
                             ,_("error opening file %s"), ffmpeg->filename);
                         ffmpeg_free_context(ffmpeg);
@@ -957,7 +1073,10 @@ static int ffmpeg_set_outputfile(struct ffmpeg *ffmpeg)
          * we write the data via standard file I/O so we close the
          * items here
          */
-        retcd = avformat_write_header(ffmpeg->oc, NULL);
+        opts = NULL;
+        ffmpeg_set_fragments(ffmpeg, &opts);
+        retcd = avformat_write_header(ffmpeg->oc, &opts);
+        av_dict_free(&opts);
         if (retcd < 0) {
             av_strerror(retcd, errstr, sizeof(errstr));
             MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO
@@ -967,7 +1086,7 @@ static int ffmpeg_set_outputfile(struct ffmpeg *ffmpeg)
         }
         if (ffmpeg->tlapse == TIMELAPSE_APPEND) {
             av_write_trailer(ffmpeg->oc);
-            avio_close(ffmpeg->oc->pb);
+            ffmpeg_avio_close(ffmpeg);
         }
 
     }
@@ -1039,13 +1158,13 @@ static int ffmpeg_flush_codec(struct ffmpeg *ffmpeg)
 
 }
 
-static int ffmpeg_put_frame(struct ffmpeg *ffmpeg, const struct timeval *tv1)
+static int ffmpeg_put_frame(struct ffmpeg *ffmpeg, const struct timeval *tv1, int64_t pts_back)
 {
     int retcd;
 
     ffmpeg->pkt = my_packet_alloc(ffmpeg->pkt);
 
-    retcd = ffmpeg_set_pts(ffmpeg, tv1);
+    retcd = ffmpeg_set_pts(ffmpeg, tv1, pts_back);
     if (retcd < 0) {
         //If there is an error, it has already been reported.
         movie_free_pkt(ffmpeg);
@@ -1314,10 +1433,47 @@ void ffmpeg_avcodec_log(void *ignoreme, int errno_flag, const char *fmt, va_list
     }
 }
 
+/* Interleave len bytes of cb and cr into dst */
+static void ffmpeg_interleave_uv(unsigned char *dst, const unsigned char *cb
+            , const unsigned char *cr, int len)
+{
+    int x;
+
+    x = 0;
+
+    #if defined(__SSE2__)
+        {
+            __m128i vcb, vcr;
+
+            for (; x + 16 <= len; x += 16) {
+                vcb = _mm_loadu_si128((const __m128i *)(cb + x));
+                vcr = _mm_loadu_si128((const __m128i *)(cr + x));
+                _mm_storeu_si128((__m128i *)(dst + x * 2), _mm_unpacklo_epi8(vcb, vcr));
+                _mm_storeu_si128((__m128i *)(dst + x * 2 + 16), _mm_unpackhi_epi8(vcb, vcr));
+            }
+        }
+    #elif defined(__ARM_NEON)
+        {
+            uint8x16x2_t uv;
+
+            for (; x + 16 <= len; x += 16) {
+                uv.val[0] = vld1q_u8(cb + x);
+                uv.val[1] = vld1q_u8(cr + x);
+                vst2q_u8(dst + x * 2, uv);
+            }
+        }
+    #endif
+
+    for (; x < len; x++) {
+        dst[x * 2] = cb[x];
+        dst[x * 2 + 1] = cr[x];
+    }
+}
+
 static void ffmpeg_put_pix_nv21(struct ffmpeg *ffmpeg, struct image_data *img_data)
 {
     unsigned char *image,*imagecr, *imagecb;
-    int cr_len, x, y;
+    int cr_len, y;
 
     if (ffmpeg->high_resolution) {
         image = img_data->image_high;
@@ -1331,12 +1487,10 @@ static void ffmpeg_put_pix_nv21(struct ffmpeg *ffmpeg, struct image_data *img_da
 
     memcpy(ffmpeg->picture->data[0], image, ffmpeg->ctx_codec->width * ffmpeg->ctx_codec->height);
     for (y = 0; y < ffmpeg->ctx_codec->height; y++) {
-        for (x = 0; x < ffmpeg->ctx_codec->width/4; x++) {
-            ffmpeg->picture->data[1][y*ffmpeg->ctx_codec->width/2 + x*2] = *imagecb;
-            ffmpeg->picture->data[1][y*ffmpeg->ctx_codec->width/2 + x*2 + 1] = *imagecr;
-            imagecb++;
-            imagecr++;
-        }
+        ffmpeg_interleave_uv(ffmpeg->picture->data[1] + (y * ffmpeg->ctx_codec->width / 2)
+            , imagecb, imagecr, ffmpeg->ctx_codec->width / 4);
+        imagecb += ffmpeg->ctx_codec->width / 4;
+        imagecr += ffmpeg->ctx_codec->width / 4;
     }
 
 }
@@ -1358,6 +1512,38 @@ static void ffmpeg_put_pix_yuv420(struct ffmpeg *ffmpeg, struct image_data *img_
 
 }
 
+/* Set up the container, the encoder and the frame of a movie that is not pass-through */
+static int ffmpeg_open_encoder(struct ffmpeg *ffmpeg)
+{
+    int retcd;
+
+    retcd = ffmpeg_get_oformat(ffmpeg);
+    if (retcd < 0 ) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not get codec!"));
+        ffmpeg_free_context(ffmpeg);
+        return -1;
+    }
+
+    retcd = ffmpeg_set_codec(ffmpeg);
+    if (retcd < 0 ) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Failed to allocate codec!"));
+        return -1;
+    }
+
+    retcd = ffmpeg_set_stream(ffmpeg);
+    if (retcd < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not set the stream"));
+        return -1;
+    }
+
+    retcd = ffmpeg_set_picture(ffmpeg);
+    if (retcd < 0) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not set the stream"));
+        return -1;
+    }
+
+    return 0;
+}
 
 #endif /* HAVE_FFMPEG */
 
@@ -1438,28 +1624,8 @@ int ffmpeg_open(struct ffmpeg *ffmpeg)
             ffmpeg_passthru_reset(ffmpeg);
 
         } else {
-            retcd = ffmpeg_get_oformat(ffmpeg);
-            if (retcd < 0 ) {
-                MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not get codec!"));
-                ffmpeg_free_context(ffmpeg);
-                return -1;
-            }
-
-            retcd = ffmpeg_set_codec(ffmpeg);
-            if (retcd < 0 ) {
-                MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Failed to allocate codec!"));
-                return -1;
-            }
-
-            retcd = ffmpeg_set_stream(ffmpeg);
-            if (retcd < 0) {
-                MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not set the stream"));
-                return -1;
-            }
-
-            retcd = ffmpeg_set_picture(ffmpeg);
+            retcd = ffmpeg_open_encoder(ffmpeg);
             if (retcd < 0) {
-                MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not set the stream"));
                 return -1;
             }
         }
@@ -1479,11 +1645,176 @@ int ffmpeg_open(struct ffmpeg *ffmpeg)
 
 }
 
+/**
+ * ffmpeg_movie_init
+ *
+ *   Set up a movie of the camera before it is opened or prepared.
+ *   motion_images is TRUE for movie_output_motion.  filename is the buffer
+ *   of PATH_MAX of the movie.  tv1 is the time of its first image, NULL when
+ *   it is prepared ahead and started later with ffmpeg_movie_start.
+ */
+void ffmpeg_movie_init(struct ffmpeg *ffmpeg, struct context *cnt, int motion_images
+        , int fps, const char *codec, char *filename, const struct timeval *tv1)
+{
+    if (motion_images) {
+        ffmpeg->width  = cnt->imgs.width;
+        ffmpeg->height = cnt->imgs.height;
+        ffmpeg->high_resolution = FALSE;
+        ffmpeg->rtsp_data = NULL;
+        ffmpeg->passthrough = FALSE;
+    } else {
+        if (cnt->imgs.size_high > 0) {
+            ffmpeg->width  = cnt->imgs.width_high;
+            ffmpeg->height = cnt->imgs.height_high;
+            ffmpeg->high_resolution = TRUE;
+            ffmpeg->rtsp_data = cnt->rtsp_high;
+        } else {
+            ffmpeg->width  = cnt->imgs.width;
+            ffmpeg->height = cnt->imgs.height;
+            ffmpeg->high_resolution = FALSE;
+            ffmpeg->rtsp_data = cnt->rtsp;
+        }
+        ffmpeg->passthrough = util_check_passthrough(cnt);
+    }
+    ffmpeg->motion_images = motion_images;
+    ffmpeg->tlapse = TIMELAPSE_NONE;
+    ffmpeg->fps = fps;
+    ffmpeg->bps = cnt->conf.movie_bps;
+    ffmpeg->quality = cnt->conf.movie_quality;
+    ffmpeg->codec_name = codec;
+    ffmpeg->filename = filename;
+    ffmpeg->test_mode = mystreq(cnt->conf.movie_codec, "test");
+    ffmpeg->frag_duration = cnt->conf.movie_fragment_duration;
+    ffmpeg->file_writer = cnt->file_writer;
+    ffmpeg->gop_cnt = 0;
+
+    ffmpeg_movie_start(ffmpeg, tv1);
+}
+
+/**
+ * ffmpeg_movie_start
+ *
+ *   Start the timestamps of a movie at tv1, the time of its first image.
+ *   Used as well for a movie prepared ahead when it is taken for an event.
+ */
+void ffmpeg_movie_start(struct ffmpeg *ffmpeg, const struct timeval *tv1)
+{
+    if (tv1 != NULL) {
+        ffmpeg->start_time.tv_sec = tv1->tv_sec;
+        ffmpeg->start_time.tv_usec = tv1->tv_usec;
+    } else {
+        ffmpeg->start_time.tv_sec = 0;
+        ffmpeg->start_time.tv_usec = 0;
+    }
+    ffmpeg->last_pts = -1;
+    ffmpeg->base_pts = 0;
+}
+
+/**
+ * ffmpeg_prepare
+ *
+ *   Open the encoder of a movie ahead of the event that needs it.  The file
+ *   is named later with ffmpeg_set_filename and created with
+ *   ffmpeg_open_file.  ffmpeg->filename must point to an empty buffer of
+ *   PATH_MAX and is left with the extension of the container.  Pass-through
+ *   movies cannot be prepared since they copy the stream of the camera as
+ *   it is when the movie starts.
+ */
+int ffmpeg_prepare(struct ffmpeg *ffmpeg)
+{
+    #ifdef HAVE_FFMPEG
+        if (ffmpeg->passthrough) {
+            return -1;
+        }
+
+        ffmpeg->oc = avformat_alloc_context();
+        if (!ffmpeg->oc) {
+            MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Could not allocate output context"));
+            return -1;
+        }
+
+        return ffmpeg_open_encoder(ffmpeg);
+
+    #else /* No FFMPEG */
+        (void)ffmpeg;
+        return -1;
+    #endif /* HAVE_FFMPEG */
+}
+
+/**
+ * ffmpeg_set_filename
+ *
+ *   Name a movie opened by ffmpeg_prepare.  The extension of the container
+ *   is appended to filename, which must be a buffer of PATH_MAX that lasts
+ *   as long as the movie.
+ */
+int ffmpeg_set_filename(struct ffmpeg *ffmpeg, char *filename)
+{
+    size_t len;
+    int retcd;
+
+    len = strlen(filename);
+    retcd = snprintf(filename + len, PATH_MAX - len, "%s", ffmpeg->filename);
+    if ((retcd < 0) || ((size_t)retcd >= (PATH_MAX - len))) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Error setting file name"));
+        filename[len] = '\0';
+        return -1;
+    }
+    ffmpeg->filename = filename;
+
+    return 0;
+}
+
+/* Create the file of a movie opened by ffmpeg_prepare and write its header */
+int ffmpeg_open_file(struct ffmpeg *ffmpeg)
+{
+    #ifdef HAVE_FFMPEG
+        if (ffmpeg->oc == NULL) {
+            return -1;
+        }
+
+        if (ffmpeg_set_outputfile(ffmpeg) < 0) {
+            MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO
+                ,_("Could not create movie %s"), ffmpeg->filename);
+            return -1;
+        }
+
+        return 0;
+
+    #else /* No FFMPEG */
+        (void)ffmpeg;
+        return -1;
+    #endif /* HAVE_FFMPEG */
+}
+
+/* Whether the movie may be written.  The context is freed when its file could not be created */
+int ffmpeg_is_open(struct ffmpeg *ffmpeg)
+{
+    #ifdef HAVE_FFMPEG
+        return (ffmpeg->oc != NULL);
+    #else
+        (void)ffmpeg;
+        return FALSE;
+    #endif // HAVE_FFMPEG
+}
+
+/* Free a movie that was prepared but never got a file */
+void ffmpeg_discard(struct ffmpeg *ffmpeg)
+{
+    #ifdef HAVE_FFMPEG
+        ffmpeg_free_context(ffmpeg);
+        ffmpeg_free_nal(ffmpeg);
+    #else
+        (void)ffmpeg;
+    #endif // HAVE_FFMPEG
+}
+
 void ffmpeg_close(struct ffmpeg *ffmpeg)
 {
     #ifdef HAVE_FFMPEG
 
-        if (ffmpeg != NULL) {
+        /* The context is already freed when the file could not be created */
+        if ((ffmpeg != NULL) && (ffmpeg->oc != NULL)) {
 
             if (ffmpeg_flush_codec(ffmpeg) < 0) {
                 MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Error flushing codec"));
@@ -1494,10 +1825,17 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
                 }
                 if (!(ffmpeg->oc->oformat->flags & AVFMT_NOFILE)) {
                     if (ffmpeg->tlapse != TIMELAPSE_APPEND) {
-                        avio_close(ffmpeg->oc->pb);
+                        ffmpeg_avio_close(ffmpeg);
                     }
                 }
             }
+            if (ffmpeg->tlapse_out != NULL) {
+                if (file_writer_close(ffmpeg->tlapse_out) != 0) {
+                    MOTION_LOG(ERR, TYPE_ENCODER, SHOW_ERRNO
+                        ,_("Error writing file %s"), ffmpeg->filename);
+                }
+                ffmpeg->tlapse_out = NULL;
+            }
             ffmpeg_free_context(ffmpeg);
             ffmpeg_free_nal(ffmpeg);
         }
@@ -1507,11 +1845,21 @@ void ffmpeg_close(struct ffmpeg *ffmpeg)
     #endif // HAVE_FFMPEG
 }
 
-int ffmpeg_put_image(struct ffmpeg *ffmpeg, struct image_data *img_data, const struct timeval *tv1)
+/**
+ * ffmpeg_put_image
+ *
+ *   Encode the image at the time tv1.  The image is also encoded fillers
+ *   more times at one frame interval apart just before tv1 so that the
+ *   movie keeps its frame rate.  The pixels are only loaded once and the
+ *   filler frames that would not come after the last frame are skipped.
+ */
+int ffmpeg_put_image(struct ffmpeg *ffmpeg, struct image_data *img_data
+        , const struct timeval *tv1, int fillers)
 {
     #ifdef HAVE_FFMPEG
         int retcd = 0;
         int cnt = 0;
+        int64_t one_frame_interval;
 
         if (ffmpeg->passthrough) {
             retcd = ffmpeg_passthru_put(ffmpeg, img_data);
@@ -1526,35 +1874,48 @@ int ffmpeg_put_image(struct ffmpeg *ffmpeg, struct image_data *img_data, const s
                 ffmpeg_put_pix_yuv420(ffmpeg, img_data);
             }
 
-            ffmpeg->gop_cnt ++;
-            if (ffmpeg->gop_cnt == ffmpeg->ctx_codec->gop_size ) {
-                ffmpeg->picture->pict_type = AV_PICTURE_TYPE_I;
-                ffmpeg->picture->key_frame = 1;
-                ffmpeg->gop_cnt = 0;
-            } else {
-                ffmpeg->picture->pict_type = AV_PICTURE_TYPE_P;
-                ffmpeg->picture->key_frame = 0;
+            if ((ffmpeg->tlapse != TIMELAPSE_NONE) || (fillers < 0)) {
+                fillers = 0;
+            }
+            one_frame_interval = av_rescale_q(1,(AVRational){1, ffmpeg->fps},ffmpeg->video_st->time_base);
+            if (one_frame_interval <= 0) {
+                one_frame_interval = 1;
             }
 
-            /* A return code of -2 is thrown by the put_frame
-            * when a image is buffered.  For timelapse, we absolutely
-            * never want a frame buffered so we keep sending back the
-            * the same pic until it flushes or fails in a different way
-            */
-            retcd = ffmpeg_put_frame(ffmpeg, tv1);
-            while ((retcd == -2) && (ffmpeg->tlapse != TIMELAPSE_NONE)) {
-                retcd = ffmpeg_put_frame(ffmpeg, tv1);
-                cnt++;
-                if (cnt > 50) {
-                    MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO
-                        ,_("Excessive attempts to clear buffered packet"));
-                    retcd = -1;
+            for (; fillers >= 0; fillers--) {
+                ffmpeg->gop_cnt ++;
+                if (ffmpeg->gop_cnt == ffmpeg->ctx_codec->gop_size ) {
+                    ffmpeg->picture->pict_type = AV_PICTURE_TYPE_I;
+                    ffmpeg->picture->key_frame = 1;
+                    ffmpeg->gop_cnt = 0;
+                } else {
+                    ffmpeg->picture->pict_type = AV_PICTURE_TYPE_P;
+                    ffmpeg->picture->key_frame = 0;
+                }
+
+                /* A return code of -2 is thrown by the put_frame
+                * when a image is buffered.  For timelapse, we absolutely
+                * never want a frame buffered so we keep sending back the
+                * the same pic until it flushes or fails in a different way
+                */
+                retcd = ffmpeg_put_frame(ffmpeg, tv1, one_frame_interval * fillers);
+                while ((retcd == -2) && (ffmpeg->tlapse != TIMELAPSE_NONE)) {
+                    retcd = ffmpeg_put_frame(ffmpeg, tv1, one_frame_interval * fillers);
+                    cnt++;
+                    if (cnt > 50) {
+                        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO
+                            ,_("Excessive attempts to clear buffered packet"));
+                        retcd = -1;
+                    }
+                }
+                //non timelapse buffered is ok
+                if (retcd == -2) {
+                    retcd = 0;
+                    MOTION_LOG(DBG, TYPE_ENCODER, NO_ERRNO, _("Buffered packet"));
+                }
+                if (retcd < 0) {
+                    break;
                 }
-            }
-            //non timelapse buffered is ok
-            if (retcd == -2) {
-                retcd = 0;
-                MOTION_LOG(DBG, TYPE_ENCODER, NO_ERRNO, _("Buffered packet"));
             }
         }
 
@@ -1564,6 +1925,7 @@ int ffmpeg_put_image(struct ffmpeg *ffmpeg, struct image_data *img_data, const s
         (void)ffmpeg;
         (void)img_data;
         (void)tv1;
+        (void)fillers;
         return 0;
     #endif // HAVE_FFMPEG
 }
@@ -23,7 +23,10 @@
 #include <stdint.h>
 #include "config.h"
 struct image_data; /* forward declare for functions */
+struct context;
 struct rtsp_context;
+struct file_writer;
+struct file_out;
 
 enum TIMELAPSE_TYPE {
     TIMELAPSE_NONE,         /* No timelapse, regular processing */
@@ -66,9 +69,12 @@ enum USER_CODEC {
         int            high_resolution;
         int            motion_images;
         int            passthrough;
+        int            frag_duration;  /* Milliseconds in each fragment, 0 for a regular file */
         enum USER_CODEC     preferred_codec;
         char *nal_info;
         int  nal_info_len;
+        struct file_writer *file_writer;    /* Engine writing the file, NULL to write it right away */
+        struct file_out    *tlapse_out;     /* Timelapse file appended to, kept open */
     };
 #else
     struct ffmpeg {
@@ -89,6 +95,9 @@ enum USER_CODEC {
         int            high_resolution;
         int            motion_images;
         int            passthrough;
+        int            frag_duration;  /* Milliseconds in each fragment, 0 for a regular file */
+        struct file_writer *file_writer;
+        struct file_out    *tlapse_out;
     };
 #endif // HAVE_FFMPEG
 
@@ -97,7 +106,16 @@ void ffmpeg_global_deinit(void);
 void ffmpeg_avcodec_log(void *, int, const char *, va_list);
 
 int ffmpeg_open(struct ffmpeg *ffmpeg);
-int ffmpeg_put_image(struct ffmpeg *ffmpeg, struct image_data *img_data, const struct timeval *tv1);
+void ffmpeg_movie_init(struct ffmpeg *ffmpeg, struct context *cnt, int motion_images
+        , int fps, const char *codec, char *filename, const struct timeval *tv1);
+void ffmpeg_movie_start(struct ffmpeg *ffmpeg, const struct timeval *tv1);
+int ffmpeg_prepare(struct ffmpeg *ffmpeg);
+int ffmpeg_set_filename(struct ffmpeg *ffmpeg, char *filename);
+int ffmpeg_open_file(struct ffmpeg *ffmpeg);
+int ffmpeg_is_open(struct ffmpeg *ffmpeg);
+void ffmpeg_discard(struct ffmpeg *ffmpeg);
+int ffmpeg_put_image(struct ffmpeg *ffmpeg, struct image_data *img_data
+        , const struct timeval *tv1, int fillers);
 void ffmpeg_close(struct ffmpeg *ffmpeg);
 void ffmpeg_reset_movie_start_time(struct ffmpeg *ffmpeg, const struct timeval *tv1);
 
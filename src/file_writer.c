@@ -0,0 +1,1028 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      file_writer.c
+ *
+ *      Write-behind engine for the pictures, movies and timelapse files of
+ *      all the cameras.
+ *
+ *      The bytes of a file are gathered in aligned buffers of
+ *      FILE_WRITER_BUFFER bytes.  A full buffer is queued to the engine
+ *      thread and the caller goes on with the next one, so it only waits
+ *      once FILE_WRITER_INFLIGHT buffers of the file are still queued.
+ *      Closing a file waits for its writes so the file is complete when
+ *      its event is raised.
+ *
+ *      Where the kernel has io_uring, the engine keeps up to
+ *      FILE_WRITER_RING writes in flight at once so a slow target_dir does
+ *      not hold up the files of the other cameras.  Otherwise the engine
+ *      writes them one after the other with pwrite.
+ *
+ *      Files kept open for long, such as movies and timelapse files, are
+ *      synced every FILE_WRITER_SYNC_SECS seconds rather than leaving the
+ *      kernel to write them out all at once.  Movies reserve their space
+ *      ahead of the writes with fallocate.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "event.h"
+#include "pipeline.h"
+#include "file_writer.h"
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+    #include <sys/eventfd.h>
+    #include <linux/io_uring.h>
+    #define FILE_WRITER_URING
+#endif
+
+enum FILE_REQ_TYPE {
+    FILE_REQ_WRITE,
+    FILE_REQ_SYNC,
+    FILE_REQ_WAKE                       /* Read of the eventfd waking the io_uring */
+};
+
+/* A write or sync waiting for the engine or in flight */
+struct file_req {
+    enum FILE_REQ_TYPE  type;
+    struct file_out    *out;
+    int                 fd;
+    unsigned char      *buf;
+    size_t              len;
+    size_t              done;           /* Bytes written so far by short writes */
+    off_t               offset;
+    struct iovec        iov;
+    struct timeval      tv_start;
+    struct file_req    *next;
+};
+
+#ifdef FILE_WRITER_URING
+
+/* The rings shared with the kernel */
+struct file_ring {
+    int                     fd;
+    unsigned               *sq_head;
+    unsigned               *sq_tail;
+    unsigned               *sq_mask;
+    unsigned               *sq_array;
+    unsigned                sq_entries;
+    unsigned               *cq_head;
+    unsigned               *cq_tail;
+    unsigned               *cq_mask;
+    struct io_uring_sqe    *sqes;
+    struct io_uring_cqe    *cqes;
+    void                   *sq_ptr;
+    size_t                  sq_size;
+    void                   *cq_ptr;
+    size_t                  cq_size;
+    size_t                  sqes_size;
+    unsigned                to_submit;  /* Entries filled since the last io_uring_enter */
+    struct file_req         wake;
+    uint64_t                wake_value;
+};
+
+static void file_ring_free(struct file_ring *ring)
+{
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != MAP_FAILED) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/* Set up the io_uring.  Returns NULL when the kernel does not allow it */
+static struct file_ring *file_ring_init(void)
+{
+    struct io_uring_params params;
+    struct file_ring *ring;
+    unsigned char *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+
+    ring = mymalloc(sizeof(struct file_ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, FILE_WRITER_RING, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    ring->cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE
+        , MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE
+        , MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE
+        , MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if ((ring->sq_ptr == MAP_FAILED) || (ring->cq_ptr == MAP_FAILED) ||
+        (ring->sqes == MAP_FAILED)) {
+        file_ring_free(ring);
+        return NULL;
+    }
+
+    sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+/* Put the request in the submission queue.  Returns -1 when it is full */
+static int file_ring_prep(struct file_ring *ring, struct file_req *req)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, indx;
+
+    tail = *ring->sq_tail;
+    if ((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= ring->sq_entries) {
+        return -1;
+    }
+    indx = tail & *ring->sq_mask;
+
+    sqe = &ring->sqes[indx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = req->fd;
+    sqe->user_data = (unsigned long)req;
+
+    if (req->type == FILE_REQ_SYNC) {
+        /* The ring may run requests out of order, so the sync has to
+         * wait for the writes already submitted for the file */
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+    } else {
+        req->iov.iov_base = req->buf + req->done;
+        req->iov.iov_len = req->len - req->done;
+        sqe->opcode = (req->type == FILE_REQ_WAKE) ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = (unsigned long)&req->iov;
+        sqe->len = 1;
+        sqe->off = (req->type == FILE_REQ_WAKE) ? 0 : (req->offset + req->done);
+    }
+
+    ring->sq_array[indx] = indx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return 0;
+}
+
+/* Submit the new entries and wait for at least one to complete */
+static int file_ring_enter(struct file_ring *ring)
+{
+    int retcd;
+
+    retcd = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1
+        , IORING_ENTER_GETEVENTS, NULL, 0);
+    if (retcd < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    ring->to_submit -= retcd;
+
+    return 0;
+}
+
+#endif /* FILE_WRITER_URING */
+
+/* Take a buffer from the pool */
+static unsigned char *file_writer_buffer(struct file_writer *fw)
+{
+    void *buf;
+
+    buf = NULL;
+    if (fw != NULL) {
+        pthread_mutex_lock(&fw->mutex);
+            if (fw->pool_count > 0) {
+                fw->pool_count--;
+                buf = fw->pool[fw->pool_count];
+            }
+        pthread_mutex_unlock(&fw->mutex);
+    }
+
+    if ((buf == NULL) && (posix_memalign(&buf, FILE_WRITER_ALIGN, FILE_WRITER_BUFFER) != 0)) {
+        MOTION_LOG(EMG, TYPE_ALL, NO_ERRNO, _("Could not allocate %llu bytes of memory!")
+            ,(unsigned long long)FILE_WRITER_BUFFER);
+        motion_remove_pid();
+        exit(1);
+    }
+
+    return buf;
+}
+
+/* Give a buffer back to the pool.  Called with the mutex held */
+static void file_writer_recycle(struct file_writer *fw, unsigned char *buf)
+{
+    if (fw->pool_count < FILE_WRITER_POOL) {
+        fw->pool[fw->pool_count] = buf;
+        fw->pool_count++;
+    } else {
+        free(buf);
+    }
+}
+
+/* Index of the statistics of the device, -1 once all of them are taken */
+static int file_writer_dev(struct file_writer *fw, dev_t dev)
+{
+    int indx;
+
+    pthread_mutex_lock(&fw->mutex);
+        for (indx = 0; indx < fw->dev_count; indx++) {
+            if (fw->devs[indx].dev == dev) {
+                break;
+            }
+        }
+        if (indx == fw->dev_count) {
+            if (fw->dev_count < FILE_WRITER_DEVICES) {
+                fw->devs[indx].dev = dev;
+                fw->dev_count++;
+            } else {
+                indx = -1;
+            }
+        }
+    pthread_mutex_unlock(&fw->mutex);
+
+    return indx;
+}
+
+/* Write or sync in the calling thread.  Returns the bytes written or -errno */
+static long file_writer_do(struct file_req *req)
+{
+    ssize_t retcd;
+    size_t done;
+
+    if (req->type == FILE_REQ_SYNC) {
+        if (fdatasync(req->fd) != 0) {
+            return -errno;
+        }
+        return 0;
+    }
+
+    done = req->done;
+    while (done < req->len) {
+        retcd = pwrite(req->fd, req->buf + done, req->len - done, req->offset + (off_t)done);
+        if (retcd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        } else if (retcd == 0) {
+            return -EIO;
+        }
+        done += retcd;
+    }
+
+    return (long)(done - req->done);
+}
+
+/**
+ * file_writer_done
+ *
+ *   Account for a request the engine has done with res bytes written or
+ *   -errno.  A short write is queued again for the rest of its bytes.
+ */
+static void file_writer_done(struct file_writer *fw, struct file_req *req, long res)
+{
+    struct file_out *out = req->out;
+    struct file_dev *dev;
+    struct timeval tv_now;
+    long latency;
+
+    if ((req->type == FILE_REQ_WRITE) && (res == 0)) {
+        res = -EIO;
+    }
+
+    if ((res == -EAGAIN) || (res == -EINTR) ||
+        ((req->type == FILE_REQ_WRITE) && (res > 0) && (req->done + res < req->len))) {
+        if (res > 0) {
+            req->done += res;
+        }
+        pthread_mutex_lock(&fw->mutex);
+            req->next = fw->queue_head;
+            fw->queue_head = req;
+            if (fw->queue_tail == NULL) {
+                fw->queue_tail = req;
+            }
+            fw->inflight--;
+        pthread_mutex_unlock(&fw->mutex);
+        return;
+    }
+
+    /* The file stays open until its last request is done */
+    if (res < 0) {
+        errno = (int)-res;
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+            ,_("Error writing file %s"), out->path);
+    }
+
+    gettimeofday(&tv_now, NULL);
+    latency = ((tv_now.tv_sec - req->tv_start.tv_sec) * 1000000L) +
+        (tv_now.tv_usec - req->tv_start.tv_usec);
+
+    pthread_mutex_lock(&fw->mutex);
+        if (out->dev >= 0) {
+            dev = &fw->devs[out->dev];
+            if (res < 0) {
+                dev->errors++;
+            } else if (req->type == FILE_REQ_SYNC) {
+                dev->syncs++;
+            } else {
+                dev->writes++;
+                dev->bytes += req->len;
+                dev->busy += latency;
+                dev->latency_last = latency;
+                if (latency > dev->latency_max) {
+                    dev->latency_max = latency;
+                }
+            }
+        }
+        if ((res < 0) && (out->error == 0)) {
+            out->error = (int)-res;
+        }
+        if (req->buf != NULL) {
+            file_writer_recycle(fw, req->buf);
+        }
+        out->pending--;
+        fw->inflight--;
+        pthread_cond_broadcast(&fw->cond_done);
+    pthread_mutex_unlock(&fw->mutex);
+
+    free(req);
+}
+
+/* Writes one request after the other.  Without io_uring */
+static void file_writer_loop_plain(struct file_writer *fw)
+{
+    struct file_req *req;
+    long res;
+
+    pthread_mutex_lock(&fw->mutex);
+        while (TRUE) {
+            while ((fw->queue_head == NULL) && (!fw->stage.finish)) {
+                pthread_cond_wait(&fw->cond_work, &fw->mutex);
+            }
+            if (fw->queue_head == NULL) {
+                break;
+            }
+
+            req = fw->queue_head;
+            fw->queue_head = req->next;
+            if (fw->queue_head == NULL) {
+                fw->queue_tail = NULL;
+            }
+            fw->inflight++;
+
+            pthread_mutex_unlock(&fw->mutex);
+
+            res = file_writer_do(req);
+            file_writer_done(fw, req, res);
+
+            pthread_mutex_lock(&fw->mutex);
+        }
+    pthread_mutex_unlock(&fw->mutex);
+}
+
+#ifdef FILE_WRITER_URING
+
+/* Hand the completed requests back and keep the wake read armed */
+static void file_writer_reap(struct file_writer *fw)
+{
+    struct file_ring *ring = fw->ring;
+    struct io_uring_cqe *cqe;
+    struct file_req *req;
+    unsigned head;
+    long res;
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        req = (struct file_req *)(unsigned long)cqe->user_data;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (req == &ring->wake) {
+            file_ring_prep(ring, &ring->wake);
+        } else {
+            file_writer_done(fw, req, res);
+        }
+    }
+}
+
+/**
+ * file_writer_loop_ring
+ *
+ *   Keeps the queued requests in flight on the io_uring.  A read of the
+ *   eventfd is always in flight so that a new request or the end of the
+ *   engine wakes it while it waits for the kernel.
+ */
+static void file_writer_loop_ring(struct file_writer *fw)
+{
+    struct file_ring *ring = fw->ring;
+    struct file_req *req;
+    int stop, failed;
+
+    ring->wake.type = FILE_REQ_WAKE;
+    ring->wake.fd = fw->wake_fd;
+    ring->wake.buf = (unsigned char *)&ring->wake_value;
+    ring->wake.len = sizeof(ring->wake_value);
+    file_ring_prep(ring, &ring->wake);
+
+    failed = FALSE;
+    while (TRUE) {
+        pthread_mutex_lock(&fw->mutex);
+            /* One entry stays for the wake read */
+            while ((fw->queue_head != NULL) && (fw->inflight < (int)ring->sq_entries - 1)) {
+                req = fw->queue_head;
+                if (file_ring_prep(ring, req) != 0) {
+                    break;
+                }
+                fw->queue_head = req->next;
+                if (fw->queue_head == NULL) {
+                    fw->queue_tail = NULL;
+                }
+                fw->inflight++;
+            }
+            stop = ((fw->stage.finish) && (fw->queue_head == NULL) && (fw->inflight == 0));
+        pthread_mutex_unlock(&fw->mutex);
+
+        if (stop) {
+            break;
+        }
+
+        if (file_ring_enter(ring) != 0) {
+            if (!failed) {
+                MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, _("io_uring_enter failed"));
+                failed = TRUE;
+            }
+            SLEEP(0, 10000000L);
+        }
+
+        file_writer_reap(fw);
+    }
+}
+
+#endif /* FILE_WRITER_URING */
+
+/**
+ * file_writer_loop
+ *
+ *   Thread function of the engine.
+ */
+static void *file_writer_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct file_writer *fw = cnt->file_writer;
+
+    util_threadname_set("fw", 0, NULL);
+
+    #ifdef FILE_WRITER_URING
+        if (fw->ring != NULL) {
+            file_writer_loop_ring(fw);
+        } else {
+            file_writer_loop_plain(fw);
+        }
+    #else
+        file_writer_loop_plain(fw);
+    #endif
+
+    fw->stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/* Queue a request to the engine.  Waits while too many of the file are queued */
+static void file_writer_queue(struct file_writer *fw, struct file_req *req)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&fw->mutex);
+        while (req->out->pending >= FILE_WRITER_INFLIGHT) {
+            pthread_cond_wait(&fw->cond_done, &fw->mutex);
+        }
+        gettimeofday(&req->tv_start, NULL);
+        req->out->pending++;
+        req->next = NULL;
+        if (fw->queue_tail == NULL) {
+            fw->queue_head = req;
+        } else {
+            fw->queue_tail->next = req;
+        }
+        fw->queue_tail = req;
+        pthread_cond_signal(&fw->cond_work);
+    pthread_mutex_unlock(&fw->mutex);
+
+    if (fw->ring != NULL) {
+        if (write(fw->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* Only when the counter is full, and then the engine is awake anyway */
+        }
+    }
+}
+
+/* Reserve the space of the file ahead of its writes so it is laid out in one piece */
+static void file_writer_reserve(struct file_out *out, off_t end)
+{
+    if ((!(out->flags & FILE_OUT_PREALLOC)) || (end <= out->prealloc)) {
+        return;
+    }
+
+    #ifdef FALLOC_FL_KEEP_SIZE
+        if (fallocate(out->fd, FALLOC_FL_KEEP_SIZE, out->prealloc
+                , (end - out->prealloc) + FILE_WRITER_PREALLOC) == 0) {
+            out->prealloc = end + FILE_WRITER_PREALLOC;
+            return;
+        }
+    #endif
+
+    /* Not supported by the file system */
+    out->flags &= ~FILE_OUT_PREALLOC;
+}
+
+/**
+ * file_writer_submit
+ *
+ *   Hand the gathered bytes to the engine.  Without the engine, they are
+ *   written right away and the buffer is kept for the next bytes.
+ */
+static void file_writer_submit(struct file_out *out)
+{
+    struct file_req *req;
+    long res;
+
+    if (out->buf_len == 0) {
+        return;
+    }
+
+    file_writer_reserve(out, out->buf_offset + (off_t)out->buf_len);
+
+    req = mymalloc(sizeof(struct file_req));
+    req->type = FILE_REQ_WRITE;
+    req->out = out;
+    req->fd = out->fd;
+    req->buf = out->buf;
+    req->len = out->buf_len;
+    req->offset = out->buf_offset;
+
+    out->buf_len = 0;
+    out->dirty = TRUE;
+
+    if (out->fw == NULL) {
+        res = file_writer_do(req);
+        if (res < 0) {
+            errno = (int)-res;
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+                ,_("Error writing file %s"), out->path);
+            if (out->error == 0) {
+                out->error = errno;
+            }
+        }
+        free(req);
+        return;
+    }
+
+    out->buf = NULL;
+    file_writer_queue(out->fw, req);
+}
+
+/* Sync a file kept open for long every FILE_WRITER_SYNC_SECS seconds */
+static void file_writer_sync(struct file_out *out)
+{
+    struct file_req *req;
+    struct timeval tv_now;
+
+    if ((out->fw == NULL) || (!out->dirty)) {
+        return;
+    }
+
+    gettimeofday(&tv_now, NULL);
+    if ((tv_now.tv_sec - out->tv_sync.tv_sec) < FILE_WRITER_SYNC_SECS) {
+        return;
+    }
+    out->tv_sync = tv_now;
+    out->dirty = FALSE;
+
+    req = mymalloc(sizeof(struct file_req));
+    req->type = FILE_REQ_SYNC;
+    req->out = out;
+    req->fd = out->fd;
+
+    file_writer_queue(out->fw, req);
+}
+
+/* Wait until the requests of the file are done */
+static void file_writer_wait(struct file_out *out)
+{
+    struct file_writer *fw = out->fw;
+
+    if (fw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fw->mutex);
+        while (out->pending > 0) {
+            pthread_cond_wait(&fw->cond_done, &fw->mutex);
+        }
+    pthread_mutex_unlock(&fw->mutex);
+}
+
+/* Returns -1 with errno set once a write of the file failed */
+static int file_writer_error(struct file_out *out)
+{
+    int error;
+
+    if (out->fw != NULL) {
+        pthread_mutex_lock(&out->fw->mutex);
+            error = out->error;
+        pthread_mutex_unlock(&out->fw->mutex);
+    } else {
+        error = out->error;
+    }
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * file_writer_open
+ *
+ *   Open the file for writing through the engine fw.  With a NULL fw the
+ *   bytes are written by the calling thread.  Like myfopen, the path is
+ *   created when it does not exist.  Returns NULL with errno set.
+ */
+struct file_out *file_writer_open(struct file_writer *fw, const char *path, int flags)
+{
+    struct file_out *out;
+    struct stat st;
+    int fd, oflags;
+
+    oflags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (!(flags & FILE_OUT_APPEND)) {
+        oflags |= O_TRUNC;
+    }
+
+    fd = open(path, oflags, 0666);
+    if ((fd == -1) && (errno == ENOENT)) {
+        if (mycreate_path(path) == -1) {
+            return NULL;
+        }
+        fd = open(path, oflags, 0666);
+    }
+    if (fd == -1) {
+        return NULL;
+    }
+
+    out = mymalloc(sizeof(struct file_out));
+    out->fw = fw;
+    out->path = mystrdup(path);
+    out->fd = fd;
+    out->flags = flags;
+    out->dev = -1;
+
+    if (flags & FILE_OUT_APPEND) {
+        out->pos = lseek(fd, 0, SEEK_END);
+        if (out->pos < 0) {
+            out->pos = 0;
+        }
+        out->size = out->pos;
+    }
+    gettimeofday(&out->tv_sync, NULL);
+
+    if ((fw != NULL) && (fstat(fd, &st) == 0)) {
+        out->dev = file_writer_dev(fw, st.st_dev);
+    }
+
+    return out;
+}
+
+/**
+ * file_writer_write
+ *
+ *   Add len bytes at the position of the file.  Returns -1 with errno set
+ *   when a write of the file has failed, which may have been one of the
+ *   earlier bytes.
+ */
+int file_writer_write(struct file_out *out, const void *data, size_t len)
+{
+    const unsigned char *src = data;
+    size_t count;
+
+    while (len > 0) {
+        if (out->buf == NULL) {
+            out->buf = file_writer_buffer(out->fw);
+        }
+        if (out->buf_len == 0) {
+            out->buf_offset = out->pos;
+        }
+
+        count = FILE_WRITER_BUFFER - out->buf_len;
+        if (count > len) {
+            count = len;
+        }
+        memcpy(out->buf + out->buf_len, src, count);
+        out->buf_len += count;
+        out->pos += count;
+        src += count;
+        len -= count;
+
+        if (out->pos > out->size) {
+            out->size = out->pos;
+        }
+        if (out->buf_len == FILE_WRITER_BUFFER) {
+            file_writer_submit(out);
+        }
+    }
+
+    file_writer_sync(out);
+
+    return file_writer_error(out);
+}
+
+/**
+ * file_writer_seek
+ *
+ *   Move the position of the file.  Going back over bytes already written
+ *   waits for their writes so that the new bytes land after them.
+ */
+off_t file_writer_seek(struct file_out *out, off_t offset, int whence)
+{
+    off_t pos;
+
+    if (whence == SEEK_SET) {
+        pos = offset;
+    } else if (whence == SEEK_CUR) {
+        pos = out->pos + offset;
+    } else if (whence == SEEK_END) {
+        pos = out->size + offset;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pos != out->pos) {
+        file_writer_submit(out);
+        if (pos < out->size) {
+            file_writer_wait(out);
+        }
+        out->pos = pos;
+    }
+
+    return pos;
+}
+
+/**
+ * file_writer_close
+ *
+ *   Write out the rest of the file, wait for its writes and close it.
+ *   Returns -1 with errno set when a write or the close failed.
+ */
+int file_writer_close(struct file_out *out)
+{
+    int retcd, error;
+
+    file_writer_submit(out);
+    file_writer_wait(out);
+
+    if (out->buf != NULL) {
+        if (out->fw != NULL) {
+            pthread_mutex_lock(&out->fw->mutex);
+                file_writer_recycle(out->fw, out->buf);
+            pthread_mutex_unlock(&out->fw->mutex);
+        } else {
+            free(out->buf);
+        }
+    }
+
+    /* Give back the space reserved past the end */
+    if (out->prealloc > out->size) {
+        if (ftruncate(out->fd, out->size) != 0) {
+            MOTION_LOG(WRN, TYPE_ALL, SHOW_ERRNO
+                ,_("Could not release the space reserved for %s"), out->path);
+        }
+    }
+
+    retcd = file_writer_error(out);
+    error = errno;
+    if ((close(out->fd) != 0) && (retcd == 0)) {
+        retcd = -1;
+        error = errno;
+    }
+
+    free(out->path);
+    free(out);
+
+    errno = error;
+    return retcd;
+}
+
+static ssize_t file_writer_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    if (file_writer_write(cookie, buf, size) != 0) {
+        return -1;
+    }
+    return (ssize_t)size;
+}
+
+static int file_writer_cookie_close(void *cookie)
+{
+    return file_writer_close(cookie);
+}
+
+/**
+ * file_writer_fopen
+ *
+ *   Open a stream writing the file through the engine, for the code that
+ *   writes with fwrite.  The mode is "w" or "a".  Without the engine, the
+ *   file is opened with myfopen.
+ */
+FILE *file_writer_fopen(struct file_writer *fw, const char *path, const char *mode)
+{
+    cookie_io_functions_t funcs;
+    struct file_out *out;
+    FILE *fp;
+
+    if (fw == NULL) {
+        return myfopen(path, mode);
+    }
+
+    out = file_writer_open(fw, path, (mode[0] == 'a') ? FILE_OUT_APPEND : 0);
+    if (out == NULL) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+            ,_("Error opening file %s with mode %s"), path, mode);
+        return NULL;
+    }
+
+    memset(&funcs, 0, sizeof(funcs));
+    funcs.write = file_writer_cookie_write;
+    funcs.close = file_writer_cookie_close;
+
+    fp = fopencookie(out, mode, funcs);
+    if (fp == NULL) {
+        file_writer_close(out);
+        return NULL;
+    }
+
+    /* The bytes are gathered by the engine */
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    return fp;
+}
+
+/**
+ * file_writer_init
+ *
+ *   Start the engine.  The files of all the contexts go through the one of
+ *   the first context.
+ */
+void file_writer_init(struct context **cntlist)
+{
+    struct file_writer *fw;
+    int indx;
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->file_writer = NULL;
+    }
+
+    fw = mymalloc(sizeof(struct file_writer));
+    fw->stage.finished = TRUE;
+    fw->stage.global = TRUE;
+    fw->ring = NULL;
+    fw->wake_fd = -1;
+    pthread_mutex_init(&fw->mutex, NULL);
+    pthread_cond_init(&fw->cond_work, NULL);
+    pthread_cond_init(&fw->cond_done, NULL);
+
+    #ifdef FILE_WRITER_URING
+        fw->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (fw->wake_fd != -1) {
+            fw->ring = file_ring_init();
+            if (fw->ring == NULL) {
+                close(fw->wake_fd);
+                fw->wake_fd = -1;
+            }
+        }
+    #endif
+
+    cntlist[0]->file_writer = fw;
+
+    if (pipeline_stage_start(cntlist[0], &fw->stage, file_writer_loop) != 0) {
+        /* Write the files in the calling threads */
+        file_writer_deinit(cntlist);
+        return;
+    }
+
+    for (indx = 1; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->file_writer = fw;
+    }
+
+    if (fw->ring != NULL) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("File writer started with io_uring"));
+    } else {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("File writer started"));
+    }
+}
+
+/**
+ * file_writer_deinit
+ *
+ *   Stop the engine once its requests are done.  Called once the cameras
+ *   have stopped and closed their files.
+ */
+void file_writer_deinit(struct context **cntlist)
+{
+    struct file_writer *fw = cntlist[0]->file_writer;
+    struct file_dev *dev;
+    uint64_t one = 1;
+    int indx;
+
+    if (fw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fw->mutex);
+        fw->stage.finish = TRUE;
+        pthread_cond_broadcast(&fw->cond_work);
+    pthread_mutex_unlock(&fw->mutex);
+
+    if (fw->ring != NULL) {
+        if (write(fw->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* The engine is awake anyway */
+        }
+    }
+
+    pipeline_stage_stop(cntlist[0], &fw->stage, NULL);
+
+    for (indx = 0; indx < fw->dev_count; indx++) {
+        dev = &fw->devs[indx];
+        if ((dev->writes > 0) || (dev->errors > 0)) {
+            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+                ,_("File writer device %u:%u: %lu writes of %llu bytes, %lu syncs, %lu errors, longest write %ld us")
+                ,major(dev->dev), minor(dev->dev), dev->writes, dev->bytes, dev->syncs
+                , dev->errors, dev->latency_max);
+        }
+    }
+
+    for (indx = 0; indx < fw->pool_count; indx++) {
+        free(fw->pool[indx]);
+    }
+
+    #ifdef FILE_WRITER_URING
+        if (fw->ring != NULL) {
+            file_ring_free(fw->ring);
+        }
+        if (fw->wake_fd != -1) {
+            close(fw->wake_fd);
+        }
+    #endif
+
+    pthread_mutex_destroy(&fw->mutex);
+    pthread_cond_destroy(&fw->cond_work);
+    pthread_cond_destroy(&fw->cond_done);
+
+    free(fw);
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->file_writer = NULL;
+    }
+}
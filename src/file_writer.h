@@ -0,0 +1,99 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      file_writer.h
+ *
+ *      Headers associated with functions in the file_writer.c module.
+ *      The file pipeline.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_FILE_WRITER_H
+#define _INCLUDE_FILE_WRITER_H
+
+#define FILE_WRITER_BUFFER      (256 * 1024)        /* Bytes gathered before a write is queued */
+#define FILE_WRITER_ALIGN       4096                /* Alignment of the buffers */
+#define FILE_WRITER_INFLIGHT    4                   /* Writes queued for one file before its writer waits */
+#define FILE_WRITER_POOL        16                  /* Buffers kept for the next files */
+#define FILE_WRITER_RING        64                  /* Entries of the io_uring */
+#define FILE_WRITER_DEVICES     8                   /* Devices with their own statistics */
+#define FILE_WRITER_SYNC_SECS   5                   /* Least time between two syncs of a file */
+#define FILE_WRITER_PREALLOC    (16 * 1024 * 1024)  /* Space reserved ahead of a movie */
+
+#define FILE_OUT_APPEND         0x01    /* Keep the content and write from its end */
+#define FILE_OUT_PREALLOC       0x02    /* Reserve the space ahead of the writes */
+
+/* Statistics of the writes to the files of one device */
+struct file_dev {
+    dev_t               dev;
+    unsigned long       writes;
+    unsigned long       syncs;
+    unsigned long       errors;
+    unsigned long long  bytes;
+    long long           busy;           /* Microseconds spent in the writes */
+    long                latency_last;   /* Microseconds from queued to written */
+    long                latency_max;
+};
+
+/* A file written through the engine.  Only used by the thread that opened it */
+struct file_out {
+    struct file_writer *fw;             /* NULL to write in the calling thread */
+    char               *path;
+    int                 fd;
+    int                 flags;
+    int                 dev;            /* Index in the devices of the engine or -1 */
+    off_t               pos;            /* Where the next bytes go */
+    off_t               size;           /* End of the bytes written so far */
+    off_t               prealloc;       /* End of the space reserved */
+    unsigned char      *buf;            /* Gathers the bytes from buf_offset */
+    size_t              buf_len;
+    off_t               buf_offset;
+    int                 pending;        /* Requests queued and not yet done */
+    int                 error;          /* errno of the first failed write */
+    int                 dirty;          /* Written since the last sync */
+    struct timeval      tv_sync;
+};
+
+struct file_req;
+struct file_ring;
+
+/* Engine writing the files of all the cameras.  Only on the first context */
+struct file_writer {
+    struct pipe_stage   stage;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond_work;      /* Engine waits for requests without io_uring */
+    pthread_cond_t      cond_done;      /* A request was done */
+    struct file_req    *queue_head;     /* Requests not yet given to the kernel */
+    struct file_req    *queue_tail;
+    int                 inflight;
+    unsigned char      *pool[FILE_WRITER_POOL];
+    int                 pool_count;
+    struct file_dev     devs[FILE_WRITER_DEVICES];
+    int                 dev_count;
+    struct file_ring   *ring;           /* NULL when writing with pwrite */
+    int                 wake_fd;
+};
+
+void file_writer_init(struct context **cntlist);
+void file_writer_deinit(struct context **cntlist);
+struct file_out *file_writer_open(struct file_writer *fw, const char *path, int flags);
+int file_writer_write(struct file_out *out, const void *data, size_t len);
+off_t file_writer_seek(struct file_out *out, off_t offset, int whence);
+int file_writer_close(struct file_out *out);
+FILE *file_writer_fopen(struct file_writer *fw, const char *path, const char *mode);
+
+#endif /* _INCLUDE_FILE_WRITER_H */
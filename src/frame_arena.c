@@ -0,0 +1,328 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      frame_arena.c
+ *
+ *      Image sized buffers of a camera.
+ *
+ *      The image ring, the capture buffers and the other buffers the size of
+ *      an image are handed out from large regions mapped for the camera
+ *      instead of the heap.  The regions may be backed by huge pages
+ *      (frame_hugepages) so that walking a large image needs fewer TLB
+ *      entries.  A freed buffer goes to the pool of its size and is handed
+ *      out again for the next buffer of that size, so resizing the image
+ *      ring only takes or returns the buffers it needs.  The regions are
+ *      only unmapped when the camera stops.
+ *
+ *      Every buffer starts after a header of FRAME_ARENA_ALIGN bytes giving
+ *      its pool.  Buffers that are not in a region, such as when a region
+ *      could not be mapped, came from the heap and are freed there.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "frame_arena.h"
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+    #define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Header in front of every buffer of the regions */
+struct frame_arena_block {
+    struct frame_arena_pool    *pool;
+    void                       *next;       /* Next free buffer of the pool */
+};
+
+static size_t frame_arena_round(size_t size, size_t unit)
+{
+    return ((size + unit - 1) / unit) * unit;
+}
+
+/**
+ * frame_arena_map
+ *
+ *   Map a new region of at least size bytes.  Explicit huge pages fall back
+ *   to normal pages when none are reserved.
+ */
+static struct frame_arena_chunk *frame_arena_map(struct frame_arena *arena, size_t size)
+{
+    struct frame_arena_chunk *chunk;
+    void *base;
+    int hugepages;
+
+    size = frame_arena_round(size, FRAME_ARENA_HUGEPAGE);
+    if (size < FRAME_ARENA_CHUNK) {
+        size = FRAME_ARENA_CHUNK;
+    }
+
+    base = MAP_FAILED;
+    hugepages = FALSE;
+    #ifdef MAP_HUGETLB
+        if (arena->hugepages == FRAME_HUGEPAGES_EXPLICIT) {
+            base = mmap(NULL, size, PROT_READ | PROT_WRITE
+                , MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (base == MAP_FAILED) {
+                MOTION_LOG(WRN, TYPE_ALL, SHOW_ERRNO
+                    ,_("Unable to map %lu kilobytes of huge pages, using normal pages")
+                    ,(unsigned long)(size / 1024));
+            } else {
+                hugepages = TRUE;
+            }
+        }
+    #endif
+
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
+                ,_("Unable to map %lu kilobytes for the images")
+                ,(unsigned long)(size / 1024));
+            return NULL;
+        }
+        #ifdef MADV_HUGEPAGE
+            if (arena->hugepages != FRAME_HUGEPAGES_OFF) {
+                if (madvise(base, size, MADV_HUGEPAGE) == -1) {
+                    MOTION_LOG(DBG, TYPE_ALL, SHOW_ERRNO, _("No transparent huge pages"));
+                }
+            }
+        #endif
+    }
+
+    chunk = mymalloc(sizeof(struct frame_arena_chunk));
+    chunk->base = base;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->hugepages = hugepages;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->mapped += size;
+
+    return chunk;
+}
+
+static struct frame_arena_pool *frame_arena_pool(struct frame_arena *arena, size_t size)
+{
+    struct frame_arena_pool *pool;
+    int indx;
+
+    for (indx = 0; indx < arena->pool_count; indx++) {
+        if (arena->pools[indx].size == size) {
+            return &arena->pools[indx];
+        }
+    }
+
+    if (arena->pool_count == FRAME_ARENA_POOLS) {
+        return NULL;
+    }
+
+    pool = &arena->pools[arena->pool_count++];
+    pool->size = size;
+    pool->free_list = NULL;
+    pool->count = 0;
+    pool->free_count = 0;
+
+    return pool;
+}
+
+/* The region holding ptr, NULL when it came from the heap */
+static struct frame_arena_chunk *frame_arena_chunk(struct frame_arena *arena, void *ptr)
+{
+    struct frame_arena_chunk *chunk;
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+        if (((unsigned char *)ptr >= chunk->base) &&
+            ((unsigned char *)ptr < chunk->base + chunk->size)) {
+            return chunk;
+        }
+    }
+
+    return NULL;
+}
+
+void frame_arena_init(struct context *cnt)
+{
+    struct frame_arena *arena;
+
+    arena = mymalloc(sizeof(struct frame_arena));
+    pthread_mutex_init(&arena->mutex, NULL);
+
+    if (mystreq(cnt->conf.frame_hugepages, "transparent")) {
+        arena->hugepages = FRAME_HUGEPAGES_TRANSPARENT;
+    } else if (mystreq(cnt->conf.frame_hugepages, "explicit")) {
+        #ifdef MAP_HUGETLB
+            arena->hugepages = FRAME_HUGEPAGES_EXPLICIT;
+        #else
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+                ,_("Explicit huge pages are not available, using transparent huge pages"));
+            arena->hugepages = FRAME_HUGEPAGES_TRANSPARENT;
+        #endif
+    } else {
+        arena->hugepages = FRAME_HUGEPAGES_OFF;
+    }
+
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->frame_arena = arena;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+}
+
+void frame_arena_deinit(struct context *cnt)
+{
+    struct frame_arena *arena = cnt->frame_arena;
+    struct frame_arena_chunk *chunk;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    /* frame_arena_usage is called from the web status */
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->frame_arena = NULL;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    if (arena->in_use > 0) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+            ,_("%lu kilobytes of images still in use"), (unsigned long)(arena->in_use / 1024));
+    }
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+        ,_("Image memory: %lu kilobytes mapped, %lu buffers reused")
+        ,(unsigned long)(arena->mapped / 1024), arena->reused);
+
+    while (arena->chunks != NULL) {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        munmap(chunk->base, chunk->size);
+        free(chunk);
+    }
+
+    pthread_mutex_destroy(&arena->mutex);
+    free(arena);
+}
+
+/**
+ * frame_arena_alloc
+ *
+ *   Hand out a buffer of size bytes filled with zeros, like mymalloc.
+ */
+void *frame_arena_alloc(struct context *cnt, size_t size)
+{
+    struct frame_arena *arena = cnt->frame_arena;
+    struct frame_arena_pool *pool;
+    struct frame_arena_chunk *chunk;
+    struct frame_arena_block *block;
+    size_t block_size;
+    int reused;
+
+    if (arena == NULL) {
+        return mymalloc(size);
+    }
+
+    block_size = FRAME_ARENA_ALIGN + frame_arena_round(size, FRAME_ARENA_ALIGN);
+
+    block = NULL;
+    reused = FALSE;
+    pthread_mutex_lock(&arena->mutex);
+        pool = frame_arena_pool(arena, block_size);
+        if ((pool != NULL) && (pool->free_list != NULL)) {
+            block = pool->free_list;
+            pool->free_list = block->next;
+            pool->free_count--;
+            arena->pooled -= block_size;
+            arena->reused++;
+            reused = TRUE;
+        } else if (pool != NULL) {
+            chunk = arena->chunks;
+            if ((chunk == NULL) || (chunk->size - chunk->used < block_size)) {
+                chunk = frame_arena_map(arena, block_size);
+            }
+            if (chunk != NULL) {
+                /* New pages of the region are already zero */
+                block = (struct frame_arena_block *)(chunk->base + chunk->used);
+                chunk->used += block_size;
+                pool->count++;
+            }
+        }
+        if (block != NULL) {
+            block->pool = pool;
+            block->next = NULL;
+            arena->in_use += block_size;
+        }
+    pthread_mutex_unlock(&arena->mutex);
+
+    if (block == NULL) {
+        return mymalloc(size);
+    }
+
+    if (reused) {
+        /* Reused buffers still hold their last image */
+        memset((unsigned char *)block + FRAME_ARENA_ALIGN, 0, size);
+    }
+
+    return (unsigned char *)block + FRAME_ARENA_ALIGN;
+}
+
+/* Give back a buffer of frame_arena_alloc.  NULL is ignored like free */
+void frame_arena_free(struct context *cnt, void *ptr)
+{
+    struct frame_arena *arena = cnt->frame_arena;
+    struct frame_arena_block *block;
+    int in_arena;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    in_arena = FALSE;
+    if (arena != NULL) {
+        pthread_mutex_lock(&arena->mutex);
+            if (frame_arena_chunk(arena, ptr) != NULL) {
+                block = (struct frame_arena_block *)((unsigned char *)ptr - FRAME_ARENA_ALIGN);
+                block->next = block->pool->free_list;
+                block->pool->free_list = block;
+                block->pool->free_count++;
+                arena->in_use -= block->pool->size;
+                arena->pooled += block->pool->size;
+                in_arena = TRUE;
+            }
+        pthread_mutex_unlock(&arena->mutex);
+    }
+
+    if (!in_arena) {
+        free(ptr);
+    }
+}
+
+/* Bytes mapped, handed out and waiting in the pools for the status page */
+void frame_arena_usage(struct context *cnt, size_t *mapped, size_t *in_use, size_t *pooled)
+{
+    struct frame_arena *arena = cnt->frame_arena;
+
+    *mapped = 0;
+    *in_use = 0;
+    *pooled = 0;
+    if (arena == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&arena->mutex);
+        *mapped = arena->mapped;
+        *in_use = arena->in_use;
+        *pooled = arena->pooled;
+    pthread_mutex_unlock(&arena->mutex);
+}
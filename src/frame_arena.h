@@ -0,0 +1,75 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      frame_arena.h
+ *
+ *      Headers associated with functions in the frame_arena.c module.
+ *
+ */
+
+#ifndef _INCLUDE_FRAME_ARENA_H
+#define _INCLUDE_FRAME_ARENA_H
+
+struct context;
+
+#define FRAME_ARENA_ALIGN       64                  /* Alignment of the buffers and size of their header */
+#define FRAME_ARENA_CHUNK       (32 * 1024 * 1024)  /* Smallest region mapped at a time */
+#define FRAME_ARENA_HUGEPAGE    (2 * 1024 * 1024)   /* Regions are a multiple of this size */
+#define FRAME_ARENA_POOLS       16                  /* Different buffer sizes */
+
+enum FRAME_HUGEPAGES {
+    FRAME_HUGEPAGES_OFF,
+    FRAME_HUGEPAGES_TRANSPARENT,    /* Ask the kernel to back the regions with huge pages */
+    FRAME_HUGEPAGES_EXPLICIT        /* Map the regions from the reserved huge pages */
+};
+
+/* Region mapped for the buffers.  Never unmapped before the arena is freed */
+struct frame_arena_chunk {
+    struct frame_arena_chunk   *next;
+    unsigned char              *base;
+    size_t                      size;
+    size_t                      used;       /* Bytes handed out from the start of the region */
+    int                         hugepages;  /* Mapped from the reserved huge pages */
+};
+
+/* Buffers of one size.  Freed buffers wait here for the next allocation of that size */
+struct frame_arena_pool {
+    size_t                      size;       /* Bytes of a buffer including its header */
+    void                       *free_list;
+    int                         count;      /* Buffers of this size in the regions */
+    int                         free_count;
+};
+
+struct frame_arena {
+    pthread_mutex_t             mutex;
+    enum FRAME_HUGEPAGES        hugepages;
+    struct frame_arena_chunk   *chunks;
+    struct frame_arena_pool     pools[FRAME_ARENA_POOLS];
+    int                         pool_count;
+    size_t                      mapped;     /* Bytes of all the regions */
+    size_t                      in_use;     /* Bytes of the buffers handed out */
+    size_t                      pooled;     /* Bytes of the freed buffers waiting to be reused */
+    unsigned long               reused;     /* Allocations served from a pool */
+};
+
+void frame_arena_init(struct context *cnt);
+void frame_arena_deinit(struct context *cnt);
+void *frame_arena_alloc(struct context *cnt, size_t size);
+void frame_arena_free(struct context *cnt, void *ptr);
+void frame_arena_usage(struct context *cnt, size_t *mapped, size_t *in_use, size_t *pooled);
+
+#endif /* _INCLUDE_FRAME_ARENA_H */
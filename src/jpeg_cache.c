@@ -0,0 +1,183 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      jpeg_cache.c
+ *
+ *      Recently compressed images of a camera so that a frame is compressed
+ *      only once when it goes to the stream, the pictures and the snapshots
+ *      with the same size and quality.
+ *
+ *      A compressed image is found by the id of the frame, which pixels of
+ *      the frame were compressed, the size, the quality and whether it is
+ *      grey.  Every captured frame gets a new id (see mlp_prepare).  Frames
+ *      whose pixels are changed after they were captured, such as the
+ *      preview with the locate box drawn on it, get an id of 0 and are
+ *      never cached.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "jpeg_cache.h"
+
+/**
+ * jpeg_cache_plane
+ *
+ *   Which pixels of the frame img the image points at.
+ *
+ * Returns JPEG_PLANE_NONE when image is not part of img or img has no id.
+ */
+enum JPEG_PLANE jpeg_cache_plane(const struct image_data *img, const unsigned char *image)
+{
+    if ((img == NULL) || (image == NULL) || (img->frame_id == 0)) {
+        return JPEG_PLANE_NONE;
+    }
+    if (image == img->image_norm) {
+        return JPEG_PLANE_NORM;
+    }
+    if (image == img->image_high) {
+        return JPEG_PLANE_HIGH;
+    }
+    return JPEG_PLANE_NONE;
+}
+
+static int jpeg_cache_match(const struct jpeg_key *key1, const struct jpeg_key *key2)
+{
+    return ((key1->frame_id == key2->frame_id) &&
+            (key1->plane == key2->plane) &&
+            (key1->width == key2->width) &&
+            (key1->height == key2->height) &&
+            (key1->quality == key2->quality) &&
+            (key1->grey == key2->grey));
+}
+
+/**
+ * jpeg_cache_get
+ *
+ *   Copy the compressed image made from key into dest.
+ *
+ * Returns the size of the image or 0 when it is not in the cache.
+ */
+int jpeg_cache_get(struct context *cnt, const struct jpeg_key *key, unsigned char *dest, int dest_size)
+{
+    struct jpeg_cache *jc = cnt->jpeg_cache;
+    struct jpeg_entry *entry;
+    int indx, jpeg_size;
+
+    if ((jc == NULL) || (key->plane == JPEG_PLANE_NONE)) {
+        return 0;
+    }
+
+    jpeg_size = 0;
+
+    pthread_mutex_lock(&jc->mutex);
+        for (indx = 0; indx < JPEG_CACHE_SIZE; indx++) {
+            entry = &jc->entries[indx];
+            if ((entry->jpeg_size > 0) && (jpeg_cache_match(&entry->key, key))) {
+                if (entry->jpeg_size <= dest_size) {
+                    memcpy(dest, entry->jpeg, entry->jpeg_size);
+                    jpeg_size = entry->jpeg_size;
+                    entry->used = ++jc->tick;
+                }
+                break;
+            }
+        }
+        if (jpeg_size > 0) {
+            jc->hits++;
+        } else {
+            jc->misses++;
+        }
+    pthread_mutex_unlock(&jc->mutex);
+
+    return jpeg_size;
+}
+
+/**
+ * jpeg_cache_put
+ *
+ *   Keep the compressed image made from key, replacing the image that was
+ *   used the longest time ago.
+ */
+void jpeg_cache_put(struct context *cnt, const struct jpeg_key *key, const unsigned char *jpeg, int jpeg_size)
+{
+    struct jpeg_cache *jc = cnt->jpeg_cache;
+    struct jpeg_entry *entry;
+    int indx;
+
+    if ((jc == NULL) || (key->plane == JPEG_PLANE_NONE) || (jpeg_size <= 0)) {
+        return;
+    }
+
+    pthread_mutex_lock(&jc->mutex);
+        entry = &jc->entries[0];
+        for (indx = 0; indx < JPEG_CACHE_SIZE; indx++) {
+            if ((jc->entries[indx].jpeg_size > 0) &&
+                (jpeg_cache_match(&jc->entries[indx].key, key))) {
+                /* Compressed at the same time by another thread */
+                entry = &jc->entries[indx];
+                break;
+            }
+            if (jc->entries[indx].used < entry->used) {
+                entry = &jc->entries[indx];
+            }
+        }
+
+        if (entry->jpeg_alloc < jpeg_size) {
+            free(entry->jpeg);
+            entry->jpeg = mymalloc(jpeg_size);
+            entry->jpeg_alloc = jpeg_size;
+        }
+        memcpy(entry->jpeg, jpeg, jpeg_size);
+        entry->jpeg_size = jpeg_size;
+        memcpy(&entry->key, key, sizeof(struct jpeg_key));
+        entry->used = ++jc->tick;
+    pthread_mutex_unlock(&jc->mutex);
+}
+
+void jpeg_cache_init(struct context *cnt)
+{
+    struct jpeg_cache *jc;
+
+    jc = mymalloc(sizeof(struct jpeg_cache));
+    pthread_mutex_init(&jc->mutex, NULL);
+
+    cnt->jpeg_cache = jc;
+}
+
+void jpeg_cache_deinit(struct context *cnt)
+{
+    struct jpeg_cache *jc = cnt->jpeg_cache;
+    int indx;
+
+    if (jc == NULL) {
+        return;
+    }
+
+    if (jc->hits > 0) {
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+            ,_("Compressed images reused %lu times, %lu compressed"), jc->hits, jc->misses);
+    }
+
+    for (indx = 0; indx < JPEG_CACHE_SIZE; indx++) {
+        free(jc->entries[indx].jpeg);
+    }
+    pthread_mutex_destroy(&jc->mutex);
+
+    free(jc);
+    cnt->jpeg_cache = NULL;
+}
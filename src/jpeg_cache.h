@@ -0,0 +1,72 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      jpeg_cache.h
+ *
+ *      Headers associated with functions in the jpeg_cache.c module.
+ *
+ */
+
+#ifndef _INCLUDE_JPEG_CACHE_H
+#define _INCLUDE_JPEG_CACHE_H
+
+struct context;
+struct image_data;
+
+#define JPEG_CACHE_SIZE     8       /* Compressed images kept per camera */
+
+/* Which pixels of a frame were compressed */
+enum JPEG_PLANE {
+    JPEG_PLANE_NONE,                /* Not pixels of a captured frame, never cached */
+    JPEG_PLANE_NORM,                /* image_norm of the frame */
+    JPEG_PLANE_HIGH,                /* image_high of the frame */
+    JPEG_PLANE_SUB                  /* image_norm of the frame scaled down, see the key size */
+};
+
+/* What a compressed image was made from */
+struct jpeg_key {
+    unsigned long       frame_id;
+    enum JPEG_PLANE     plane;
+    int                 width;
+    int                 height;
+    int                 quality;
+    int                 grey;
+};
+
+struct jpeg_entry {
+    struct jpeg_key     key;
+    unsigned char      *jpeg;
+    int                 jpeg_size;
+    int                 jpeg_alloc;     /* Size of the jpeg buffer */
+    unsigned long       used;           /* Tick of the last use, the oldest entry is replaced */
+};
+
+struct jpeg_cache {
+    struct jpeg_entry   entries[JPEG_CACHE_SIZE];
+    pthread_mutex_t     mutex;
+    unsigned long       tick;
+    unsigned long       hits;
+    unsigned long       misses;
+};
+
+void jpeg_cache_init(struct context *cnt);
+void jpeg_cache_deinit(struct context *cnt);
+enum JPEG_PLANE jpeg_cache_plane(const struct image_data *img, const unsigned char *image);
+int jpeg_cache_get(struct context *cnt, const struct jpeg_key *key, unsigned char *dest, int dest_size);
+void jpeg_cache_put(struct context *cnt, const struct jpeg_key *key, const unsigned char *jpeg, int jpeg_size);
+
+#endif /* _INCLUDE_JPEG_CACHE_H */
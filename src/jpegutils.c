@@ -699,3 +699,44 @@ int jpgutl_put_grey(unsigned char *dest_image, int image_size, unsigned char *in
     return dest_image_size;
 }
 
+
+/**
+ * jpgutl_strip_exif
+ *  Purpose:  Remove the EXIF APP1 segment from a jpeg made by jpgutl_put_yuv420p
+ *            or jpgutl_put_grey.  The segment is among the APPn segments that
+ *            follow the start of image marker.
+ *
+ *  Parameters:
+ *  jpeg_data        The jpeg data, changed in place
+ *  jpeg_size        The length of the jpeg data
+ *
+ *  Return Values
+ *    The length of the jpeg data without the segment
+ */
+int jpgutl_strip_exif(unsigned char *jpeg_data, int jpeg_size)
+{
+    int pos, seg_len;
+
+    if ((jpeg_size < 4) || (jpeg_data[0] != 0xFF) || (jpeg_data[1] != 0xD8)) {
+        return jpeg_size;
+    }
+
+    pos = 2;
+    while ((pos + 4) <= jpeg_size) {
+        if ((jpeg_data[pos] != 0xFF) || (jpeg_data[pos + 1] < 0xE0) || (jpeg_data[pos + 1] > 0xEF)) {
+            break;
+        }
+        seg_len = (jpeg_data[pos + 2] << 8) + jpeg_data[pos + 3] + 2;
+        if ((pos + seg_len) > jpeg_size) {
+            break;
+        }
+        if ((jpeg_data[pos + 1] == 0xE1) && (seg_len >= 10) &&
+            (memcmp(jpeg_data + pos + 4, "Exif\0\0", 6) == 0)) {
+            memmove(jpeg_data + pos, jpeg_data + pos + seg_len, jpeg_size - pos - seg_len);
+            return jpeg_size - seg_len;
+        }
+        pos += seg_len;
+    }
+
+    return jpeg_size;
+}
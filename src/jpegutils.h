@@ -33,5 +33,6 @@ int jpgutl_put_yuv420p(unsigned char *dest_image, int image_size, unsigned char
             , int height, int quality, struct context *cnt, struct timeval *tv1, struct coord *box);
 int jpgutl_put_grey(unsigned char *dest_image, int image_size, unsigned char *input_image, int width
             , int height, int quality, struct context *cnt, struct timeval *tv1, struct coord *box);
+int jpgutl_strip_exif(unsigned char *jpeg_data, int jpeg_size);
 
 #endif
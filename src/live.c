@@ -0,0 +1,621 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      live.c
+ *
+ *      Live stream of a pass-through camera as fragmented MP4.  The packets
+ *      the camera sends are put in MP4 fragments as they arrive without being
+ *      decoded or compressed again, so the clients get the full resolution
+ *      of the camera at its own bit rate.
+ *
+ *      The network camera thread keeps the packets for the pass-through
+ *      movies in its packet array and hands each one to live_put.  While the
+ *      live stream has clients, the packet is written by the mp4 muxer into
+ *      memory as one fragment (moof and mdat) and published in a ring of
+ *      fragments.  A client is sent the header of the muxer (ftyp and moov)
+ *      and then the fragments from the latest key frame on.  A client that
+ *      falls behind by the whole ring starts again at the next key frame.
+ *
+ *      The muxer is only opened while the stream has clients.  It is opened
+ *      again when the camera reconnects, and the clients of the previous
+ *      muxer are then disconnected since its header no longer applies.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "netcam.h"
+#include "netcam_rtsp.h"
+#include "webu.h"
+#include "webu_stream.h"
+#include "live.h"
+
+#ifdef HAVE_FFMPEG
+
+#if (MYFFVER >= 61000)
+static int live_out_write(void *opaque, const uint8_t *buf, int buf_size)
+#else
+static int live_out_write(void *opaque, uint8_t *buf, int buf_size)
+#endif
+{
+    /* Keep the bytes written by the muxer until they make a fragment */
+    struct live *live = opaque;
+
+    if ((live->out_size + buf_size) > live->out_alloc) {
+        live->out_alloc = (live->out_size + buf_size) * 2;
+        live->out = myrealloc(live->out, live->out_alloc, "live_out_write");
+    }
+    memcpy(live->out + live->out_size, buf, buf_size);
+    live->out_size += buf_size;
+
+    return buf_size;
+}
+
+/* Close the muxer and drop the fragments.  Called with the mutex held */
+static void live_close(struct live *live)
+{
+    int indx;
+
+    if (live->oc != NULL) {
+        if (live->init != NULL) {
+            av_write_trailer(live->oc);
+        }
+        if (live->oc->pb != NULL) {
+            av_freep(&live->oc->pb->buffer);
+            #if (MYFFVER >= 57081)
+                avio_context_free(&live->oc->pb);
+            #else
+                av_freep(&live->oc->pb);
+            #endif
+        }
+        avformat_free_context(live->oc);
+        live->oc = NULL;
+    }
+
+    if (live->pkt != NULL) {
+        my_packet_free(live->pkt);
+        live->pkt = NULL;
+    }
+
+    free(live->init);
+    live->init = NULL;
+    live->init_size = 0;
+
+    for (indx = 0; indx < LIVE_FRAGS; indx++) {
+        free(live->frags[indx].data);
+        live->frags[indx].data = NULL;
+        live->frags[indx].size = 0;
+        live->frags[indx].alloc = 0;
+        live->frags[indx].seq = 0;
+    }
+    live->key_seq = 0;
+    live->out_size = 0;
+}
+
+/**
+ * live_open
+ *
+ *   Start the fragmented MP4 muxer with the codec of the camera and keep
+ *   the header it writes for the clients.  Called with the mutex held.
+ */
+static int live_open(struct live *live, struct rtsp_context *rtsp_data)
+{
+    #if (MYFFVER >= 57041)
+        AVStream *stream_out;
+        AVDictionary *opts;
+        unsigned char *buffer;
+        char errstr[128];
+        int retcd;
+
+        live->oc = NULL;
+        retcd = avformat_alloc_output_context2(&live->oc, NULL, "mp4", NULL);
+        if ((retcd < 0) || (live->oc == NULL)) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, _("Could not get the mp4 muxer"));
+            live->oc = NULL;
+            return -1;
+        }
+
+        stream_out = avformat_new_stream(live->oc, NULL);
+        if (stream_out == NULL) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, _("Could not alloc stream"));
+            live_close(live);
+            return -1;
+        }
+
+        pthread_mutex_lock(&rtsp_data->mutex_transfer);
+            retcd = -1;
+            if (rtsp_data->transfer_format != NULL) {
+                retcd = avcodec_parameters_copy(stream_out->codecpar
+                    , rtsp_data->transfer_format->streams[0]->codecpar);
+            }
+        pthread_mutex_unlock(&rtsp_data->mutex_transfer);
+        if (retcd < 0) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, _("Unable to copy codec parameters"));
+            live_close(live);
+            return -1;
+        }
+        stream_out->codecpar->codec_tag = 0;
+        stream_out->time_base = (AVRational){1, 1000000};
+
+        buffer = av_malloc(LIVE_OUT_SIZE);
+        live->oc->pb = avio_alloc_context(buffer, LIVE_OUT_SIZE, 1, live
+            , NULL, live_out_write, NULL);
+        if (live->oc->pb == NULL) {
+            av_free(buffer);
+            live_close(live);
+            return -1;
+        }
+
+        /* Header without samples and one fragment for each packet */
+        opts = NULL;
+        av_dict_set(&opts, "movflags", "empty_moov+default_base_moof+frag_custom", 0);
+        live->out_size = 0;
+        retcd = avformat_write_header(live->oc, &opts);
+        av_dict_free(&opts);
+        if (retcd < 0) {
+            av_strerror(retcd, errstr, sizeof(errstr));
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO
+                ,_("Could not write the live stream header: %s"), errstr);
+            live_close(live);
+            return -1;
+        }
+        avio_flush(live->oc->pb);
+
+        live->init = mymalloc(live->out_size);
+        memcpy(live->init, live->out, live->out_size);
+        live->init_size = live->out_size;
+        live->out_size = 0;
+
+        live->pkt = my_packet_alloc(NULL);
+        live->dts_last = AV_NOPTS_VALUE;
+        live->duration = 0;
+        live->key_seq = 0;
+        live->generation++;
+
+        return 0;
+    #else
+        (void)live;
+        (void)rtsp_data;
+        return -1;
+    #endif
+}
+
+/* Publish the bytes written by the muxer as the next fragment */
+static void live_publish(struct live *live, int iskey)
+{
+    struct live_frag *frag;
+
+    live->seq++;
+    frag = &live->frags[live->seq % LIVE_FRAGS];
+    if ((frag->seq != 0) && (frag->seq == live->key_seq)) {
+        /* No key frame left for the clients to start at */
+        live->key_seq = 0;
+    }
+
+    if (frag->alloc < live->out_size) {
+        free(frag->data);
+        frag->alloc = live->out_size;
+        frag->data = mymalloc(frag->alloc);
+    }
+    memcpy(frag->data, live->out, live->out_size);
+    frag->size = live->out_size;
+    frag->seq = live->seq;
+    frag->iskey = iskey;
+    if (iskey) {
+        live->key_seq = live->seq;
+    }
+
+    live->out_size = 0;
+    live->fragments++;
+
+    pthread_cond_broadcast(&live->cond_frag);
+}
+
+/**
+ * live_mux
+ *
+ *   Write the packet just received from the camera as one fragment.  Like
+ *   the pass-through movies, the time stamps are the times the packets were
+ *   received.  Called with the mutex held.
+ *
+ * Returns whether a fragment was published.
+ */
+static int live_mux(struct live *live, struct rtsp_context *rtsp_data)
+{
+    AVStream *stream = live->oc->streams[0];
+    struct timeval *tv = &rtsp_data->img_recv->image_time;
+    int64_t dts;
+    int retcd, iskey, fps;
+    char errstr[128];
+
+    if (live->dts_last == AV_NOPTS_VALUE) {
+        live->start_tv = *tv;
+    }
+    dts = ((int64_t)(tv->tv_sec - live->start_tv.tv_sec) * 1000000) +
+        (tv->tv_usec - live->start_tv.tv_usec);
+    dts = av_rescale_q(dts, (AVRational){1, 1000000}, stream->time_base);
+
+    /* The length of a packet is only known with the next one, so the
+     * previous length is used for the last packet of the fragment
+     */
+    if (live->dts_last == AV_NOPTS_VALUE) {
+        fps = (rtsp_data->src_fps > 0) ? rtsp_data->src_fps : rtsp_data->conf->framerate;
+        if (fps < 1) {
+            fps = 1;
+        }
+        live->duration = av_rescale_q(1, (AVRational){1, fps}, stream->time_base);
+    } else {
+        if (dts <= live->dts_last) {
+            dts = live->dts_last + 1;
+        }
+        live->duration = dts - live->dts_last;
+    }
+
+    live->pkt = my_packet_alloc(live->pkt);
+    retcd = my_copy_packet(live->pkt, rtsp_data->packet_recv);
+    if (retcd < 0) {
+        av_strerror(retcd, errstr, sizeof(errstr));
+        MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO, _("av_copy_packet: %s"),errstr);
+        return FALSE;
+    }
+
+    iskey = ((live->pkt->flags & AV_PKT_FLAG_KEY) != 0);
+
+    live->pkt->stream_index = 0;
+    live->pkt->pts = dts;
+    live->pkt->dts = dts;
+    live->pkt->duration = live->duration;
+    live->pkt->pos = -1;
+
+    retcd = av_write_frame(live->oc, live->pkt);
+    if (retcd >= 0) {
+        /* Flush the fragment */
+        retcd = av_write_frame(live->oc, NULL);
+    }
+    if (retcd < 0) {
+        av_strerror(retcd, errstr, sizeof(errstr));
+        MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO
+            ,_("Error while writing live stream packet: %s"),errstr);
+        live->out_size = 0;
+        return FALSE;
+    }
+    avio_flush(live->oc->pb);
+
+    live->dts_last = dts;
+
+    if (live->out_size == 0) {
+        return FALSE;
+    }
+
+    live_publish(live, iskey);
+
+    return TRUE;
+}
+
+/**
+ * live_put
+ *
+ *   Called by the network camera thread for every video packet kept for
+ *   pass-through.
+ */
+void live_put(struct rtsp_context *rtsp_data)
+{
+    struct context *cnt = rtsp_data->cnt;
+    struct live *live;
+
+    live = __atomic_load_n(&cnt->live, __ATOMIC_SEQ_CST);
+    if (live == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&live->mutex);
+        /* The count is only a hint.  A new client waits for the next key frame anyway */
+        if ((!live->enabled) || (cnt->stream_live.cnct_count == 0)) {
+            if (live->oc != NULL) {
+                live_close(live);
+            }
+            pthread_mutex_unlock(&live->mutex);
+            return;
+        }
+
+        if (live->oc == NULL) {
+            /* The stream starts at a key frame */
+            if (!(rtsp_data->packet_recv->flags & AV_PKT_FLAG_KEY)) {
+                pthread_mutex_unlock(&live->mutex);
+                return;
+            }
+            if (live_open(live, rtsp_data) != 0) {
+                MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, _("Live stream disabled"));
+                live->enabled = FALSE;
+                pthread_mutex_unlock(&live->mutex);
+                return;
+            }
+        }
+
+        if (live_mux(live, rtsp_data)) {
+            /* Resume the clients waiting for the fragment.  Done under the mutex
+             * so that live_deinit cannot finish before the camera stream does.
+             */
+            __atomic_store_n(&cnt->stream_live.seq, live->seq, __ATOMIC_SEQ_CST);
+            webu_stream_wake(cnt, FALSE);
+        }
+    pthread_mutex_unlock(&live->mutex);
+}
+
+/**
+ * live_reset
+ *
+ *   Called by the network camera thread when it connected again.  The
+ *   codec may have changed so the muxer is opened again for the next key
+ *   frame.
+ */
+void live_reset(struct rtsp_context *rtsp_data)
+{
+    struct live *live;
+
+    live = __atomic_load_n(&rtsp_data->cnt->live, __ATOMIC_SEQ_CST);
+    if (live == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&live->mutex);
+        live_close(live);
+    pthread_mutex_unlock(&live->mutex);
+}
+
+/**
+ * live_read
+ *
+ *   Copy the next bytes of the live stream for a client.
+ *
+ * Returns the number of bytes copied, 0 when the client must wait for the
+ * next fragment and -1 when the stream of the client ended.
+ */
+int live_read(struct webui_ctx *webui, char *buf, size_t max)
+{
+    struct live *live;
+    struct live_frag *frag;
+    size_t sent, part;
+
+    live = __atomic_load_n(&webui->cnt->live, __ATOMIC_SEQ_CST);
+    if (live == NULL) {
+        return -1;
+    }
+
+    sent = 0;
+    pthread_mutex_lock(&live->mutex);
+        if (live->oc == NULL) {
+            webui->stream_seq = live->seq;
+            pthread_mutex_unlock(&live->mutex);
+            return 0;
+        }
+
+        if (webui->live_generation == 0) {
+            webui->live_generation = live->generation;
+            webui->live_init_sent = FALSE;
+            webui->live_seq = 0;
+            webui->live_pos = 0;
+        } else if (webui->live_generation != live->generation) {
+            /* The muxer was opened again with a new header */
+            pthread_mutex_unlock(&live->mutex);
+            return -1;
+        }
+
+        if (!webui->live_init_sent) {
+            part = live->init_size - webui->live_pos;
+            if (part > max) {
+                part = max;
+            }
+            memcpy(buf, live->init + webui->live_pos, part);
+            sent += part;
+            webui->live_pos += part;
+            if (webui->live_pos == live->init_size) {
+                webui->live_init_sent = TRUE;
+                webui->live_pos = 0;
+            }
+        }
+
+        while ((webui->live_init_sent) && (sent < max)) {
+            if (webui->live_seq == 0) {
+                if (live->key_seq == 0) {
+                    break;
+                }
+                webui->live_seq = live->key_seq;
+                webui->live_pos = 0;
+            }
+            if (webui->live_seq > live->seq) {
+                break;
+            }
+
+            frag = &live->frags[webui->live_seq % LIVE_FRAGS];
+            if (frag->seq != webui->live_seq) {
+                if (webui->live_pos != 0) {
+                    /* Replaced while it was being sent */
+                    pthread_mutex_unlock(&live->mutex);
+                    return -1;
+                }
+                /* Fell behind by the whole ring.  Start again at a key frame */
+                webui->stream_skipped += live->seq - webui->live_seq;
+                webui->live_seq = 0;
+                continue;
+            }
+
+            part = frag->size - webui->live_pos;
+            if (part > (max - sent)) {
+                part = max - sent;
+            }
+            memcpy(buf + sent, frag->data + webui->live_pos, part);
+            sent += part;
+            webui->live_pos += part;
+            if (webui->live_pos == frag->size) {
+                webui->live_seq++;
+                webui->live_pos = 0;
+                webui->stream_images++;
+            }
+        }
+
+        if (sent == 0) {
+            /* Everything published was sent */
+            webui->stream_seq = live->seq;
+        }
+    pthread_mutex_unlock(&live->mutex);
+
+    return (int)sent;
+}
+
+/* Wait a little for the next fragment.  For clients served by a thread of their own */
+void live_wait(struct webui_ctx *webui)
+{
+    struct live *live;
+    struct timespec ts;
+
+    live = __atomic_load_n(&webui->cnt->live, __ATOMIC_SEQ_CST);
+    if (live == NULL) {
+        SLEEP(0, 100000000L);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&live->mutex);
+        if (live->seq == webui->stream_seq) {
+            pthread_cond_timedwait(&live->cond_frag, &live->mutex, &ts);
+        }
+    pthread_mutex_unlock(&live->mutex);
+}
+
+/**
+ * live_init
+ *
+ *   Let the pass-through packets of the camera be streamed.  The live
+ *   stream is kept with the context so a client may outlast a restart of
+ *   the camera.
+ */
+void live_init(struct context *cnt)
+{
+    #if (MYFFVER >= 57041)
+        struct live *live;
+
+        if (!cnt->movie_passthrough) {
+            return;
+        }
+
+        live = cnt->live;
+        if (live == NULL) {
+            live = mymalloc(sizeof(struct live));
+            pthread_mutex_init(&live->mutex, NULL);
+            pthread_cond_init(&live->cond_frag, NULL);
+            live->dts_last = AV_NOPTS_VALUE;
+            __atomic_store_n(&cnt->live, live, __ATOMIC_SEQ_CST);
+        }
+
+        pthread_mutex_lock(&live->mutex);
+            live->enabled = TRUE;
+            live->fragments = 0;
+        pthread_mutex_unlock(&live->mutex);
+    #else
+        if (cnt->movie_passthrough) {
+            MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO
+                ,_("Live stream disabled.  ffmpeg too old"));
+        }
+    #endif
+}
+
+void live_deinit(struct context *cnt)
+{
+    struct live *live = cnt->live;
+
+    if (live == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&live->mutex);
+        live->enabled = FALSE;
+        live_close(live);
+        pthread_cond_broadcast(&live->cond_frag);
+        if (live->fragments > 0) {
+            MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO
+                ,_("Live stream finished: %lu fragments"), live->fragments);
+        }
+    pthread_mutex_unlock(&live->mutex);
+}
+
+/* Free the live stream once the web server stopped */
+void live_free(struct context *cnt)
+{
+    struct live *live = cnt->live;
+
+    if (live == NULL) {
+        return;
+    }
+
+    live_close(live);
+    free(live->out);
+    pthread_mutex_destroy(&live->mutex);
+    pthread_cond_destroy(&live->cond_frag);
+    free(live);
+    cnt->live = NULL;
+}
+
+#else /* No FFmpeg, so no pass-through */
+
+void live_init(struct context *cnt)
+{
+    (void)cnt;
+}
+
+void live_deinit(struct context *cnt)
+{
+    (void)cnt;
+}
+
+void live_free(struct context *cnt)
+{
+    (void)cnt;
+}
+
+void live_reset(struct rtsp_context *rtsp_data)
+{
+    (void)rtsp_data;
+}
+
+void live_put(struct rtsp_context *rtsp_data)
+{
+    (void)rtsp_data;
+}
+
+int live_read(struct webui_ctx *webui, char *buf, size_t max)
+{
+    (void)webui;
+    (void)buf;
+    (void)max;
+    return -1;
+}
+
+void live_wait(struct webui_ctx *webui)
+{
+    (void)webui;
+    SLEEP(0, 100000000L);
+}
+
+#endif /* HAVE_FFMPEG */
@@ -0,0 +1,81 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      live.h
+ *
+ *      Headers associated with functions in the live.c module.
+ *
+ */
+
+#ifndef _INCLUDE_LIVE_H
+#define _INCLUDE_LIVE_H
+
+#define LIVE_FRAGS      256     /* Fragments kept for the clients, more than a group of pictures */
+#define LIVE_OUT_SIZE   65536   /* Size of the buffer of the muxer output */
+
+struct rtsp_context;
+struct webui_ctx;
+
+/* A fragment of the live stream: one camera packet in a moof and mdat */
+struct live_frag {
+    unsigned long           seq;            /* Sequence number, 0 while unused */
+    int                     iskey;          /* Starts with a key frame so a client may start here */
+    unsigned char          *data;
+    size_t                  size;
+    size_t                  alloc;
+};
+
+#ifdef HAVE_FFMPEG
+
+    struct live {
+        pthread_mutex_t         mutex;          /* Guards everything below */
+        pthread_cond_t          cond_frag;      /* Signalled for every fragment published */
+        int                     enabled;        /* The camera runs with pass-through */
+        int                     generation;     /* Incremented every time the muxer is opened */
+        AVFormatContext        *oc;             /* Fragmented MP4 muxer, NULL while nobody watches */
+        AVPacket               *pkt;
+        unsigned char          *init;           /* ftyp and moov written when the muxer was opened */
+        size_t                  init_size;
+        struct live_frag        frags[LIVE_FRAGS];
+        unsigned long           seq;            /* Last fragment published */
+        unsigned long           key_seq;        /* Latest fragment a client may start at, 0 for none */
+        unsigned char          *out;            /* Bytes written by the muxer since the last fragment */
+        size_t                  out_size;
+        size_t                  out_alloc;
+        struct timeval          start_tv;       /* Time of the first packet muxed */
+        int64_t                 dts_last;       /* In the time base of the muxer */
+        int64_t                 duration;       /* Of the last packet in the time base of the muxer */
+        unsigned long           fragments;      /* Fragments published since the camera started */
+    };
+
+#else
+
+    struct live {
+        int                     dummy;
+    };
+
+#endif
+
+void live_init(struct context *cnt);
+void live_deinit(struct context *cnt);
+void live_free(struct context *cnt);
+void live_reset(struct rtsp_context *rtsp_data);
+void live_put(struct rtsp_context *rtsp_data);
+int live_read(struct webui_ctx *webui, char *buf, size_t max);
+void live_wait(struct webui_ctx *webui);
+
+#endif /* _INCLUDE_LIVE_H */
@@ -0,0 +1,261 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      mask_span.c
+ *
+ *      Compile mask images into runs of open, blocked and partial pixels.
+ *
+ *      Masks are mostly large areas that are either fully open (255) or
+ *      fully blocked (0).  Once the mask is compiled, the privacy mask
+ *      only has to write the blocked runs and the motion detection can
+ *      skip them and leave out the multiply on the open runs.  Only the
+ *      pixels of partial runs still need the mask value of every pixel.
+ *
+ *      The rows of an image follow each other in memory so a run is not
+ *      cut at the end of a row.  Open or blocked runs shorter than
+ *      MASK_SPAN_MIN are kept within a partial run so that a dithered
+ *      mask does not end up with more spans than pixels.
+ *
+ *      The fixed mask and the smartmask are also drawn on the motion images.
+ *      The pixels they colour are compiled into blocked spans of the luma and
+ *      of the chroma, so drawing them is a memset of each span.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "mask_span.h"
+
+static enum MASK_SPAN_TYPE mask_span_type(unsigned char value)
+{
+    if (value == 0xff) {
+        return MASK_SPAN_OPEN;
+    } else if (value == 0x00) {
+        return MASK_SPAN_BLOCKED;
+    }
+    return MASK_SPAN_PARTIAL;
+}
+
+/**
+ * mask_span_scan
+ *
+ *   Find the spans of len pixels of the mask from start.  When span is
+ *   NULL, they are only counted.
+ */
+static int mask_span_scan(const unsigned char *mask, int start, int len, struct mask_span *span)
+{
+    enum MASK_SPAN_TYPE type, prev;
+    int indx, run, count;
+
+    count = 0;
+    prev = MASK_SPAN_PARTIAL;
+    indx = start;
+    while (indx < start + len) {
+        type = mask_span_type(mask[indx]);
+        run = 1;
+        while ((indx + run < start + len) && (mask_span_type(mask[indx + run]) == type)) {
+            run++;
+        }
+        if ((type != MASK_SPAN_PARTIAL) && (run < MASK_SPAN_MIN)) {
+            type = MASK_SPAN_PARTIAL;
+        }
+
+        if ((count > 0) && (type == prev)) {
+            if (span != NULL) {
+                span[count - 1].len += run;
+            }
+        } else {
+            if (span != NULL) {
+                span[count].start = indx;
+                span[count].len = run;
+                span[count].type = type;
+            }
+            count++;
+            prev = type;
+        }
+        indx += run;
+    }
+
+    return count;
+}
+
+/**
+ * mask_span_compile
+ *
+ *   Compile the mask image of width x height pixels.  With chroma, the U and
+ *   V planes following the luma of a YUV420P mask are compiled as well.
+ */
+struct mask_spans *mask_span_compile(const unsigned char *mask, int width, int height, int chroma)
+{
+    struct mask_spans *spans;
+    int size_y, count_uv;
+
+    size_y = width * height;
+
+    spans = mymalloc(sizeof(struct mask_spans));
+    spans->count_y = mask_span_scan(mask, 0, size_y, NULL);
+    count_uv = 0;
+    if (chroma) {
+        count_uv = mask_span_scan(mask, size_y, size_y / 2, NULL);
+    }
+    spans->count = spans->count_y + count_uv;
+    spans->span = mymalloc(spans->count * sizeof(struct mask_span));
+
+    mask_span_scan(mask, 0, size_y, spans->span);
+    if (chroma) {
+        mask_span_scan(mask, size_y, size_y / 2, spans->span + spans->count_y);
+    }
+
+    MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO
+        ,_("Mask of %dx%d compiled into %d spans"), width, height, spans->count);
+
+    return spans;
+}
+
+void mask_span_free(struct mask_spans *spans)
+{
+    if (spans == NULL) {
+        return;
+    }
+
+    free(spans->span);
+    free(spans);
+}
+
+/**
+ * mask_span_privacy
+ *
+ *   Apply the privacy mask to a YUV420P image.  Blocked pixels are set to
+ *   black, that is 0 for the luma and 0x80 for the chroma.  The privacy mask
+ *   only holds 0 or 255 so partial spans are masked without a branch.
+ */
+void mask_span_privacy(const struct mask_spans *spans, unsigned char *image, const unsigned char *mask)
+{
+    const struct mask_span *span;
+    unsigned char fill;
+    int indx, pos;
+
+    for (indx = 0; indx < spans->count; indx++) {
+        span = &spans->span[indx];
+        fill = (indx < spans->count_y) ? 0x00 : 0x80;
+
+        if (span->type == MASK_SPAN_BLOCKED) {
+            memset(image + span->start, fill, span->len);
+        } else if (span->type == MASK_SPAN_PARTIAL) {
+            for (pos = span->start; pos < span->start + span->len; pos++) {
+                image[pos] = (image[pos] & mask[pos]) | (fill & ~mask[pos]);
+            }
+        }
+    }
+}
+
+/* Find the runs of 0 of len values of map from start.  Counted when span is NULL */
+static int mask_span_zero(const unsigned char *map, int start, int len, int base
+            , struct mask_span *span)
+{
+    int indx, run, count;
+
+    count = 0;
+    indx = start;
+    while (indx < start + len) {
+        if (map[indx] != 0) {
+            indx++;
+            continue;
+        }
+        run = 1;
+        while ((indx + run < start + len) && (map[indx + run] == 0)) {
+            run++;
+        }
+        if (span != NULL) {
+            span[count].start = base + indx;
+            span[count].len = run;
+            span[count].type = MASK_SPAN_BLOCKED;
+        }
+        count++;
+        indx += run;
+    }
+
+    return count;
+}
+
+/**
+ * mask_span_overlay
+ *
+ *   Compile where the mask is drawn on the motion images: the luma of the
+ *   pixels it blocks and the chroma of the blocks of 2x2 pixels holding at
+ *   least one of them.  The chroma spans start in the U plane.
+ */
+struct mask_spans *mask_span_overlay(const unsigned char *mask, int width, int height)
+{
+    struct mask_spans *spans;
+    unsigned char *chroma;
+    int size_y, size_uv, x, y, line, count_uv;
+
+    size_y = width * height;
+    size_uv = size_y / 4;
+
+    chroma = mymalloc(size_uv);
+    for (y = 0; y < height; y += 2) {
+        line = y * width;
+        for (x = 0; x < width; x += 2) {
+            if (mask[line + x] == 0 || mask[line + x + 1] == 0 ||
+                mask[line + width + x] == 0 ||
+                mask[line + width + x + 1] == 0) {
+                chroma[(y / 2) * (width / 2) + (x / 2)] = 0;
+            } else {
+                chroma[(y / 2) * (width / 2) + (x / 2)] = 255;
+            }
+        }
+    }
+
+    spans = mymalloc(sizeof(struct mask_spans));
+    spans->count_y = mask_span_zero(mask, 0, size_y, 0, NULL);
+    count_uv = mask_span_zero(chroma, 0, size_uv, size_y, NULL);
+    spans->count = spans->count_y + count_uv;
+    spans->span = mymalloc((spans->count + 1) * sizeof(struct mask_span));
+
+    mask_span_zero(mask, 0, size_y, 0, spans->span);
+    mask_span_zero(chroma, 0, size_uv, size_y, spans->span + spans->count_y);
+
+    free(chroma);
+
+    return spans;
+}
+
+/**
+ * mask_span_overlay_put
+ *
+ *   Draw a mask compiled by mask_span_overlay on a YUV420P image of size_y
+ *   luma pixels with the colour y, u, v.
+ */
+void mask_span_overlay_put(const struct mask_spans *spans, unsigned char *image, int size_y
+            , unsigned char y, unsigned char u, unsigned char v)
+{
+    const struct mask_span *span;
+    int indx;
+
+    for (indx = 0; indx < spans->count_y; indx++) {
+        span = &spans->span[indx];
+        memset(image + span->start, y, span->len);
+    }
+    for (; indx < spans->count; indx++) {
+        span = &spans->span[indx];
+        memset(image + span->start, u, span->len);
+        memset(image + span->start + (size_y / 4), v, span->len);
+    }
+}
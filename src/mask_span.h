@@ -0,0 +1,55 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      mask_span.h
+ *
+ *      Headers associated with functions in the mask_span.c module.
+ *
+ */
+
+#ifndef _INCLUDE_MASK_SPAN_H
+#define _INCLUDE_MASK_SPAN_H
+
+#define MASK_SPAN_MIN   16      /* Shorter open or blocked runs are kept in a partial span */
+
+enum MASK_SPAN_TYPE {
+    MASK_SPAN_OPEN,             /* Mask is 255 for all the pixels */
+    MASK_SPAN_BLOCKED,          /* Mask is 0 for all the pixels */
+    MASK_SPAN_PARTIAL           /* Mask must be applied pixel by pixel */
+};
+
+struct mask_span {
+    int                 start;  /* Offset of the first pixel in the image */
+    int                 len;
+    enum MASK_SPAN_TYPE type;
+};
+
+/* Runs of a mask image.  The luma spans come first and then those of the chroma */
+struct mask_spans {
+    int                 count;
+    int                 count_y;
+    struct mask_span   *span;
+};
+
+struct mask_spans *mask_span_compile(const unsigned char *mask, int width, int height, int chroma);
+void mask_span_free(struct mask_spans *spans);
+void mask_span_privacy(const struct mask_spans *spans, unsigned char *image, const unsigned char *mask);
+struct mask_spans *mask_span_overlay(const unsigned char *mask, int width, int height);
+void mask_span_overlay_put(const struct mask_spans *spans, unsigned char *image, int size_y
+            , unsigned char y, unsigned char u, unsigned char v);
+
+#endif /* _INCLUDE_MASK_SPAN_H */
@@ -0,0 +1,425 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      mosaic.c
+ *
+ *      Stream of all the cameras in one image, served on the stream_port
+ *      of motion.conf at the url /mosaic.  A browser showing all the
+ *      cameras then keeps a single connection instead of one per camera.
+ *
+ *      Each camera scales its image to the size of its cell in its own
+ *      thread, and only when the mosaic thread wants a new one, so the
+ *      cameras do no work while nobody watches the mosaic and at most one
+ *      image per mosaic period when someone does.  The mosaic thread copies
+ *      the new tiles into the canvas and compresses it once for all the
+ *      clients.  The cells of the cameras without a new image are left as
+ *      they are and when no camera has a new image, the previous jpeg is
+ *      kept rather than compressed again.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "picture.h"
+#include "jpeg_cache.h"
+#include "event.h"
+#include "pipeline.h"
+#include "scale.h"
+#include "stream_jpeg.h"
+#include "mosaic.h"
+#include "webu.h"
+#include "webu_stream.h"
+
+/* Set a rectangle of a plane of the canvas to one value */
+static void mosaic_fill(unsigned char *plane, int stride, int x, int y
+            , int width, int height, unsigned char value)
+{
+    int indx;
+
+    for (indx = 0; indx < height; indx++) {
+        memset(plane + ((y + indx) * stride) + x, value, width);
+    }
+}
+
+/* Copy a plane of a tile into a rectangle of a plane of the canvas */
+static void mosaic_copy(unsigned char *plane, int stride, int x, int y
+            , const unsigned char *src, int width, int height)
+{
+    int indx;
+
+    for (indx = 0; indx < height; indx++) {
+        memcpy(plane + ((y + indx) * stride) + x, src + (indx * width), width);
+    }
+}
+
+/**
+ * mosaic_cell
+ *
+ *   Draw the image of a tile centered in its cell of the canvas.  The rest
+ *   of the cell is black.  Called with the mutex of the tile held.
+ */
+static void mosaic_cell(struct mosaic *mos, int indx, struct mosaic_tile *tile)
+{
+    unsigned char *canvas_u, *canvas_v;
+    const unsigned char *tile_u, *tile_v;
+    int width, height, cell_x, cell_y, x, y;
+
+    width = mos->cell_width * mos->columns;
+    height = mos->cell_height * mos->rows;
+    canvas_u = mos->canvas + (width * height);
+    canvas_v = canvas_u + ((width / 2) * (height / 2));
+
+    cell_x = (indx % mos->columns) * mos->cell_width;
+    cell_y = (indx / mos->columns) * mos->cell_height;
+
+    mosaic_fill(mos->canvas, width, cell_x, cell_y, mos->cell_width, mos->cell_height, 0);
+    mosaic_fill(canvas_u, width / 2, cell_x / 2, cell_y / 2
+        , mos->cell_width / 2, mos->cell_height / 2, 128);
+    mosaic_fill(canvas_v, width / 2, cell_x / 2, cell_y / 2
+        , mos->cell_width / 2, mos->cell_height / 2, 128);
+
+    /* Even offsets so the chroma of the tile lines up */
+    x = cell_x + (((mos->cell_width - tile->width) / 2) & ~1);
+    y = cell_y + (((mos->cell_height - tile->height) / 2) & ~1);
+
+    tile_u = tile->image + (tile->width * tile->height);
+    tile_v = tile_u + ((tile->width / 2) * (tile->height / 2));
+
+    mosaic_copy(mos->canvas, width, x, y, tile->image, tile->width, tile->height);
+    mosaic_copy(canvas_u, width / 2, x / 2, y / 2, tile_u, tile->width / 2, tile->height / 2);
+    mosaic_copy(canvas_v, width / 2, x / 2, y / 2, tile_v, tile->width / 2, tile->height / 2);
+}
+
+/**
+ * mosaic_draw
+ *
+ *   Draw the new images of the cameras into the canvas and ask the cameras
+ *   for the next ones.
+ *
+ * Returns whether the canvas changed.
+ */
+static int mosaic_draw(struct mosaic *mos)
+{
+    struct mosaic_tile *tile;
+    int indx, changed;
+
+    changed = FALSE;
+    for (indx = 0; indx < mos->tile_count; indx++) {
+        tile = &mos->tiles[indx];
+        pthread_mutex_lock(&tile->mutex);
+            if (tile->seq != tile->drawn) {
+                mosaic_cell(mos, indx, tile);
+                tile->drawn = tile->seq;
+                changed = TRUE;
+            }
+            tile->wanted = TRUE;
+        pthread_mutex_unlock(&tile->mutex);
+    }
+
+    return changed;
+}
+
+/* Compress the canvas and give it to the clients of the mosaic stream */
+static void mosaic_publish(struct context *cnt, struct mosaic *mos)
+{
+    struct stream_data *stream = &cnt->stream_mosaic;
+    struct stream_jpeg *jpeg;
+    long jpeg_size;
+
+    jpeg = stream_jpeg_claim(cnt, stream);
+    jpeg_size = put_picture_memory(cnt
+        ,jpeg->jpeg_data
+        ,(stream->width * stream->height * 3) / 2
+        ,mos->canvas
+        ,cnt->conf.stream_quality
+        ,stream->width
+        ,stream->height
+        ,NULL, JPEG_PLANE_NONE);
+    stream_jpeg_publish(stream, jpeg, jpeg_size);
+
+    webu_stream_wake(cnt, FALSE);
+}
+
+/**
+ * mosaic_loop
+ *
+ *   Thread function of the mosaic.  Once per period of stream_mosaic_rate
+ *   while the mosaic stream has clients, draws the new images of the
+ *   cameras and compresses the canvas if any of them changed.
+ */
+static void *mosaic_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct mosaic *mos = cnt->mosaic;
+    struct timeval tv_start, tv_now;
+    long long period, elapsed, nap;
+
+    util_threadname_set("mo", 0, NULL);
+
+    period = 1000000LL / cnt->conf.stream_mosaic_rate;
+
+    while (!mos->stage.finish) {
+        gettimeofday(&tv_start, NULL);
+
+        if (cnt->stream_mosaic.cnct_count > 0) {
+            if ((mosaic_draw(mos)) || (!stream_jpeg_ready(&cnt->stream_mosaic))) {
+                mosaic_publish(cnt, mos);
+                mos->encoded++;
+            } else {
+                mos->reused++;
+            }
+        }
+
+        /* Rest of the period in short naps to notice the end quickly */
+        while (!mos->stage.finish) {
+            gettimeofday(&tv_now, NULL);
+            elapsed = ((tv_now.tv_sec - tv_start.tv_sec) * 1000000LL) +
+                (tv_now.tv_usec - tv_start.tv_usec);
+            if ((elapsed >= period) || (elapsed < 0)) {
+                break;
+            }
+            nap = period - elapsed;
+            if (nap > 100000) {
+                nap = 100000;
+            }
+            SLEEP(0, nap * 1000L);
+        }
+    }
+
+    mos->stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/**
+ * mosaic_put
+ *
+ *   Scale the image of the camera into its tile when the mosaic wants one.
+ *   The tile keeps the aspect of the camera within the cell.
+ */
+void mosaic_put(struct context *cnt, struct image_data *img_data)
+{
+    struct mosaic_tile *tile = cnt->mosaic_tile;
+    struct mosaic *mos;
+    int width, height;
+
+    if ((tile == NULL) || (!tile->wanted) || (img_data->image_norm == NULL)) {
+        return;
+    }
+
+    mos = tile->mosaic;
+
+    width = mos->cell_width;
+    height = (int)(((long)cnt->imgs.height * width) / cnt->imgs.width);
+    if (height > mos->cell_height) {
+        height = mos->cell_height;
+        width = (int)(((long)cnt->imgs.width * height) / cnt->imgs.height);
+    }
+    width = width & ~1;
+    height = height & ~1;
+    if (width < 2) {
+        width = 2;
+    }
+    if (height < 2) {
+        height = 2;
+    }
+
+    pthread_mutex_lock(&tile->mutex);
+        if (!scale_fits(tile->scale, cnt->imgs.width, cnt->imgs.height, width, height)) {
+            scale_deinit(tile->scale);
+            tile->scale = scale_init(cnt->imgs.width, cnt->imgs.height, width, height);
+            tile->width = width;
+            tile->height = height;
+        }
+        scale_yuv420p(tile->scale, img_data->image_norm, tile->image);
+        tile->seq++;
+        tile->wanted = FALSE;
+    pthread_mutex_unlock(&tile->mutex);
+}
+
+/**
+ * mosaic_init
+ *
+ *   Start the mosaic of the cameras when stream_mosaic_width is set for the
+ *   stream_port of motion.conf.  Called before the stream daemons start.
+ */
+void mosaic_init(struct context **cntlst)
+{
+    struct context *cnt = cntlst[0];
+    struct mosaic *mos;
+    struct mosaic_tile *tile;
+    int indx, count, columns, rows, cell_width, cell_height, width, height;
+
+    cnt->mosaic = NULL;
+
+    if ((cntlst[1] == NULL) || (cnt->conf.stream_port == 0) ||
+        (cnt->conf.stream_mosaic_width <= 0)) {
+        return;
+    }
+
+    if ((cntlst[1]->conf.width <= 0) || (cntlst[1]->conf.height <= 0)) {
+        MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO
+            ,_("Mosaic stream needs the size of the first camera"));
+        return;
+    }
+
+    count = 0;
+    while (cntlst[count + 1] != NULL) {
+        count++;
+    }
+
+    columns = cnt->conf.stream_mosaic_columns;
+    if (columns <= 0) {
+        columns = 1;
+        while ((columns * columns) < count) {
+            columns++;
+        }
+    }
+    if (columns > count) {
+        columns = count;
+    }
+    rows = (count + columns - 1) / columns;
+
+    if (cnt->conf.stream_mosaic_width > 4096) {
+        cnt->conf.stream_mosaic_width = 4096;
+    }
+
+    /* Multiples of 8 like the camera images for the jpeg encoder */
+    cell_width = cnt->conf.stream_mosaic_width / columns;
+    cell_width = cell_width - (cell_width % 8);
+    if (cell_width < 16) {
+        cell_width = 16;
+    }
+    cell_height = (int)(((long)cntlst[1]->conf.height * cell_width) / cntlst[1]->conf.width);
+    cell_height = cell_height - (cell_height % 8);
+    if (cell_height < 16) {
+        cell_height = 16;
+    }
+
+    width = cell_width * columns;
+    height = cell_height * rows;
+
+    if (cnt->conf.stream_mosaic_rate < 1) {
+        cnt->conf.stream_mosaic_rate = 1;
+    } else if (cnt->conf.stream_mosaic_rate > 100) {
+        cnt->conf.stream_mosaic_rate = 100;
+    }
+
+    mos = mymalloc(sizeof(struct mosaic));
+    mos->columns = columns;
+    mos->rows = rows;
+    mos->cell_width = cell_width;
+    mos->cell_height = cell_height;
+    mos->canvas = mymalloc((width * height * 3) / 2);
+    memset(mos->canvas, 0, width * height);
+    memset(mos->canvas + (width * height), 128, (width * height) / 2);
+    mos->tile_count = count;
+    mos->tiles = mymalloc(count * sizeof(struct mosaic_tile));
+    mos->encoded = 0;
+    mos->reused = 0;
+    mos->stage.finished = TRUE;
+    mos->stage.global = TRUE;
+
+    for (indx = 0; indx < count; indx++) {
+        tile = &mos->tiles[indx];
+        pthread_mutex_init(&tile->mutex, NULL);
+        tile->mosaic = mos;
+        tile->width = 0;
+        tile->height = 0;
+        tile->image = mymalloc((cell_width * cell_height * 3) / 2);
+        tile->scale = NULL;
+        tile->seq = 0;
+        tile->drawn = 0;
+        tile->wanted = FALSE;
+        cntlst[indx + 1]->mosaic_tile = tile;
+    }
+
+    /* The context of motion.conf runs no camera so its stream is set up here */
+    cnt->stream_closed = FALSE;
+    cnt->stream_mosaic.jpeg = NULL;
+    cnt->stream_mosaic.buffers = NULL;
+    cnt->stream_mosaic.cnct_count = 0;
+    cnt->stream_mosaic.due = 0;
+    cnt->stream_mosaic.seq = 0;
+    cnt->stream_mosaic.width = width;
+    cnt->stream_mosaic.height = height;
+    cnt->stream_mosaic.scale = NULL;
+    cnt->stream_mosaic.image = NULL;
+
+    cnt->mosaic = mos;
+
+    if (pipeline_stage_start(cnt, &mos->stage, mosaic_loop) != 0) {
+        mosaic_deinit(cntlst);
+        return;
+    }
+
+    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO
+        ,_("Mosaic stream of %d cameras in %d columns at %dx%d")
+        ,count, columns, width, height);
+}
+
+/**
+ * mosaic_deinit
+ *
+ *   Stop the mosaic.  Called once the stream daemons and the cameras have
+ *   stopped.
+ */
+void mosaic_deinit(struct context **cntlst)
+{
+    struct context *cnt = cntlst[0];
+    struct mosaic *mos = cnt->mosaic;
+    struct mosaic_tile *tile;
+    int indx;
+
+    if (mos == NULL) {
+        return;
+    }
+
+    pipeline_stage_stop(cnt, &mos->stage, NULL);
+
+    for (indx = 0; indx < mos->tile_count; indx++) {
+        if (cntlst[indx + 1] == NULL) {
+            break;
+        }
+        cntlst[indx + 1]->mosaic_tile = NULL;
+    }
+
+    pthread_mutex_lock(&cnt->mutex_stream);
+        cnt->stream_closed = TRUE;
+    pthread_mutex_unlock(&cnt->mutex_stream);
+    webu_stream_wake(cnt, TRUE);
+
+    stream_jpeg_free(&cnt->stream_mosaic);
+
+    if ((mos->encoded + mos->reused) > 0) {
+        MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO
+            ,_("Mosaic finished: %lu images compressed, %lu reused")
+            ,mos->encoded, mos->reused);
+    }
+
+    for (indx = 0; indx < mos->tile_count; indx++) {
+        tile = &mos->tiles[indx];
+        pthread_mutex_destroy(&tile->mutex);
+        scale_deinit(tile->scale);
+        free(tile->image);
+    }
+    free(mos->tiles);
+    free(mos->canvas);
+    free(mos);
+    cnt->mosaic = NULL;
+}
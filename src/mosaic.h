@@ -0,0 +1,58 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      mosaic.h
+ *
+ *      Headers associated with functions in the mosaic.c module.
+ *      The file pipeline.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_MOSAIC_H
+#define _INCLUDE_MOSAIC_H
+
+/* Latest image of a camera scaled to fit its cell of the mosaic */
+struct mosaic_tile {
+    struct mosaic          *mosaic;         /* Mosaic the tile belongs to */
+    pthread_mutex_t         mutex;          /* Guards the image, its size and the scaler */
+    int                     width;          /* Size of the scaled image, at most the cell size */
+    int                     height;
+    unsigned char          *image;          /* YUV420P image of the cell size */
+    struct scale_ctx       *scale;          /* Scaler of the camera images, NULL until first scaled */
+    unsigned long           seq;            /* Incremented for every image put */
+    unsigned long           drawn;          /* Sequence of the image on the canvas.  Mosaic thread only */
+    volatile int            wanted;         /* The mosaic thread takes the next image of the camera */
+};
+
+struct mosaic {
+    struct pipe_stage       stage;
+    int                     columns;
+    int                     rows;
+    int                     cell_width;     /* Size of the cell of each camera */
+    int                     cell_height;
+    unsigned char          *canvas;         /* YUV420P image of all the cells */
+    int                     tile_count;
+    struct mosaic_tile     *tiles;          /* One per camera in the order of the camera list */
+    unsigned long           encoded;        /* Mosaic images compressed */
+    unsigned long           reused;         /* Times no camera had a new image */
+};
+
+void mosaic_init(struct context **cntlst);
+void mosaic_deinit(struct context **cntlst);
+void mosaic_put(struct context *cnt, struct image_data *img_data);
+
+#endif /* _INCLUDE_MOSAIC_H */
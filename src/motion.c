@@ -37,8 +37,21 @@
 #include "picture.h"
 #include "rotate.h"
 #include "webu.h"
+#include "webu_stream.h"
 #include "draw.h"
+#include "pipeline.h"
 #include "dbse.h"
+#include "picture_writer.h"
+#include "movie_encoder.h"
+#include "jpeg_cache.h"
+#include "stream_worker.h"
+#include "stream_jpeg.h"
+#include "live.h"
+#include "precap.h"
+#include "frame_arena.h"
+#include "mask_span.h"
+#include "spawner.h"
+#include "file_writer.h"
 
 
 /**
@@ -88,6 +101,57 @@ FILE *ptr_logfile = NULL;
 unsigned int restart = 0;
 
 
+/**
+ * image_writable
+ *
+ * Make the images of img writable.  image_virgin, image_vprvcy and
+ * preview_image share the images of the frame they were taken from until
+ * then and get their own copy here.  Called before every write to an image
+ * of the ring and before its slot is reused.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *      img      Pointer to the image_data structure about to change
+ *
+ * Returns:     nothing
+ */
+void image_writable(struct context *cnt, struct image_data *img)
+{
+    struct images *imgs = &cnt->imgs;
+    int virgin, vprvcy;
+
+    if (img->image_norm == NULL) {
+        return;
+    }
+
+    virgin = (imgs->image_virgin.image_norm == img->image_norm);
+    vprvcy = (imgs->image_vprvcy.image_norm == img->image_norm);
+
+    if (vprvcy) {
+        memcpy(imgs->vprvcy_norm, img->image_norm, imgs->size_norm);
+        imgs->image_vprvcy.image_norm = imgs->vprvcy_norm;
+    }
+
+    /* Without a privacy mask both views share the same pixels */
+    if (virgin && vprvcy) {
+        imgs->image_virgin.image_norm = imgs->vprvcy_norm;
+    } else if (virgin) {
+        memcpy(imgs->virgin_norm, img->image_norm, imgs->size_norm);
+        imgs->image_virgin.image_norm = imgs->virgin_norm;
+    }
+
+    if ((imgs->preview_image.image_norm == img->image_norm) &&
+        (imgs->preview_image.image_norm != imgs->preview_norm)) {
+        memcpy(imgs->preview_norm, img->image_norm, imgs->size_norm);
+        if (imgs->size_high > 0) {
+            memcpy(imgs->preview_high, img->image_high, imgs->size_high);
+        }
+        imgs->preview_image.image_norm = imgs->preview_norm;
+        imgs->preview_image.image_high = imgs->preview_high;
+    }
+}
+
 /**
  * image_ring_resize
  *
@@ -103,6 +167,8 @@ unsigned int restart = 0;
  */
 static void image_ring_resize(struct context *cnt, int new_size)
 {
+    int indx;
+
     /*
      * Only resize if :
      * Not in an event and
@@ -123,6 +189,10 @@ static void image_ring_resize(struct context *cnt, int new_size)
             MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
                 ,_("Resizing pre_capture buffer to %d items"), new_size);
 
+            for (indx = 0; indx < cnt->imgs.image_ring_size; indx++) {
+                image_writable(cnt, &cnt->imgs.image_ring[indx]);
+            }
+
             /* Create memory for new ring buffer */
             struct image_data *tmp;
             tmp = mymalloc(new_size * sizeof(struct image_data));
@@ -139,13 +209,19 @@ static void image_ring_resize(struct context *cnt, int new_size)
             {
                 int i;
                 for(i = smallest; i < new_size; i++) {
-                    tmp[i].image_norm = mymalloc(cnt->imgs.size_norm);
+                    tmp[i].image_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
                     memset(tmp[i].image_norm, 0x80, cnt->imgs.size_norm);  /* initialize to grey */
                     if (cnt->imgs.size_high > 0) {
-                        tmp[i].image_high = mymalloc(cnt->imgs.size_high);
+                        tmp[i].image_high = frame_arena_alloc(cnt, cnt->imgs.size_high);
                         memset(tmp[i].image_high, 0x80, cnt->imgs.size_high);
                     }
                 }
+
+                /* Give the images of the removed buffers back for reuse */
+                for(i = new_size; i < cnt->imgs.image_ring_size; i++) {
+                    frame_arena_free(cnt, cnt->imgs.image_ring[i].image_norm);
+                    frame_arena_free(cnt, cnt->imgs.image_ring[i].image_high);
+                }
             }
 
             /* Free the old ring */
@@ -185,9 +261,9 @@ static void image_ring_destroy(struct context *cnt)
 
     /* Free all image buffers */
     for (i = 0; i < cnt->imgs.image_ring_size; i++) {
-        free(cnt->imgs.image_ring[i].image_norm);
+        frame_arena_free(cnt, cnt->imgs.image_ring[i].image_norm);
         if (cnt->imgs.size_high >0 ) {
-            free(cnt->imgs.image_ring[i].image_high);
+            frame_arena_free(cnt, cnt->imgs.image_ring[i].image_high);
         }
     }
 
@@ -213,23 +289,22 @@ static void image_ring_destroy(struct context *cnt)
  */
 static void image_save_as_preview(struct context *cnt, struct image_data *img)
 {
-    void *image_norm, *image_high;
-
-    /* Save our pointers to our memory locations for images*/
-    image_norm = cnt->imgs.preview_image.image_norm;
-    image_high = cnt->imgs.preview_image.image_high;
-
     /* Copy over the meta data from the img into preview */
     memcpy(&cnt->imgs.preview_image, img, sizeof(struct image_data));
 
-    /* Restore the pointers to the memory locations for images*/
-    cnt->imgs.preview_image.image_norm = image_norm;
-    cnt->imgs.preview_image.image_high = image_high;
+    /* Share the images of a frame of the ring until they are written, see image_writable */
+    if ((img >= cnt->imgs.image_ring) && (img < cnt->imgs.image_ring + cnt->imgs.image_ring_size)) {
+        cnt->imgs.preview_image.image_norm = img->image_norm;
+        cnt->imgs.preview_image.image_high = img->image_high;
+    } else {
+        cnt->imgs.preview_image.image_norm = cnt->imgs.preview_norm;
+        cnt->imgs.preview_image.image_high = cnt->imgs.preview_high;
 
-    /* Copy the actual images for norm and high */
-    memcpy(cnt->imgs.preview_image.image_norm, img->image_norm, cnt->imgs.size_norm);
-    if (cnt->imgs.size_high > 0) {
-        memcpy(cnt->imgs.preview_image.image_high, img->image_high, cnt->imgs.size_high);
+        /* Copy the actual images for norm and high */
+        memcpy(cnt->imgs.preview_image.image_norm, img->image_norm, cnt->imgs.size_norm);
+        if (cnt->imgs.size_high > 0) {
+            memcpy(cnt->imgs.preview_image.image_high, img->image_high, cnt->imgs.size_high);
+        }
     }
 
     /*
@@ -242,6 +317,9 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
 
     /* draw locate box here when mode = LOCATE_PREVIEW */
     if (cnt->locate_motion_mode == LOCATE_PREVIEW) {
+        /* The preview no longer has the pixels of the frame */
+        cnt->imgs.preview_image.frame_id = 0;
+        image_writable(cnt, img);
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
             alg_draw_location(&img->location, &cnt->imgs, cnt->imgs.width, cnt->imgs.preview_image.image_norm,
@@ -259,6 +337,34 @@ static void image_save_as_preview(struct context *cnt, struct image_data *img)
     }
 }
 
+/**
+ * image_event_preview
+ *
+ * Raise the event that saves the preview image.  The preview image is given to
+ * the handlers and is the current image while they run so that the conversion
+ * specifiers refer to it.
+ *
+ * Parameters:
+ *
+ *      cnt      Pointer to the motion context structure
+ *
+ * Returns:     nothing
+ */
+static void image_event_preview(struct context *cnt)
+{
+    struct image_data *saved_current_image;
+    struct timeval tv1;
+
+    tv1 = cnt->current_image->timestamp_tv;
+
+    saved_current_image = cnt->current_image;
+    cnt->current_image = &cnt->imgs.preview_image;
+
+    event(cnt, EVENT_IMAGE_PREVIEW, &cnt->imgs.preview_image, NULL, NULL, &tv1);
+
+    cnt->current_image = saved_current_image;
+}
+
 /**
  * context_init
  *
@@ -329,6 +435,11 @@ static void context_destroy(struct context *cnt)
         }
     }
 
+    live_free(cnt);
+
+    pthread_mutex_destroy(&cnt->mutex_stream);
+    pthread_mutex_destroy(&cnt->mutex_stages);
+
     free(cnt);
 }
 
@@ -516,10 +627,12 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
     struct config *conf = &cnt->conf;
     struct images *imgs = &cnt->imgs;
     struct coord *location = &img->location;
+    struct timeval *tv_first;
     int indx;
 
     /* Draw location */
     if (cnt->locate_motion_mode == LOCATE_ON) {
+        image_writable(cnt, img);
 
         if (cnt->locate_motion_style == LOCATE_BOX) {
             alg_draw_location(location, imgs, imgs->width, img->image_norm, LOCATE_BOX,
@@ -567,17 +680,26 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
 
             /* EVENT_FIRSTMOTION triggers on_event_start_command and event_ffmpeg_newfile */
 
-            indx = cnt->imgs.image_ring_out-1;
-            do {
-                indx++;
-                if (indx == cnt->imgs.image_ring_size) {
-                    indx = 0;
-                }
-                if ((cnt->imgs.image_ring[indx].flags & (IMAGE_SAVE | IMAGE_SAVED)) == IMAGE_SAVE) {
-                    event(cnt, EVENT_FIRSTMOTION, img, NULL, NULL, &cnt->imgs.image_ring[indx].timestamp_tv);
-                    indx = cnt->imgs.image_ring_in;
-                }
-            } while (indx != cnt->imgs.image_ring_in);
+            tv_first = precap_first_tv(cnt);
+            if (tv_first != NULL) {
+                /* Start with the compressed pre-captured images */
+                cnt->movietime = tv_first->tv_sec;
+                event(cnt, EVENT_FIRSTMOTION, img, NULL, NULL, tv_first);
+            } else {
+                indx = cnt->imgs.image_ring_out-1;
+                do {
+                    indx++;
+                    if (indx == cnt->imgs.image_ring_size) {
+                        indx = 0;
+                    }
+                    if ((cnt->imgs.image_ring[indx].flags & (IMAGE_SAVE | IMAGE_SAVED)) == IMAGE_SAVE) {
+                        /* Start time of the movie for movie_max_time */
+                        cnt->movietime = cnt->imgs.image_ring[indx].timestamp_tv.tv_sec;
+                        event(cnt, EVENT_FIRSTMOTION, img, NULL, NULL, &cnt->imgs.image_ring[indx].timestamp_tv);
+                        indx = cnt->imgs.image_ring_in;
+                    }
+                } while (indx != cnt->imgs.image_ring_in);
+            }
 
             MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Motion detected - starting event %d"),
                        cnt->event_nr);
@@ -588,7 +710,7 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
             }
             /* Save first motion frame */
             if (cnt->new_img & NEWIMG_FIRST) {
-                event(cnt, EVENT_IMAGE_PREVIEW, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
+                image_event_preview(cnt);
             }
 
         }
@@ -625,6 +747,74 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
 
 }
 
+/**
+ * process_image
+ *
+ *   Save / send to the movie one image of the pre-capture
+ *
+ * Parameters:
+ *
+ *   cnt        - current thread's context struct
+ *   img        - image flagged to be saved
+ */
+static void process_image(struct context *cnt, struct image_data *img)
+{
+    /* Set inte global context that we are working with this image */
+    cnt->current_image = img;
+
+    if (img->shot < cnt->conf.framerate) {
+        if (cnt->log_level >= DBG) {
+            char tmp[32];
+            const char *t;
+
+            if (img->flags & IMAGE_TRIGGER) {
+                t = "Trigger";
+            } else if (img->flags & IMAGE_MOTION) {
+                t = "Motion";
+            } else if (img->flags & IMAGE_PRECAP) {
+                t = "Precap";
+            } else if (img->flags & IMAGE_POSTCAP) {
+                t = "Postcap";
+            } else {
+                t = "Other";
+            }
+
+            mystrftime(cnt, tmp, sizeof(tmp), "%H%M%S-%q",
+                       &img->timestamp_tv, NULL, 0);
+            image_writable(cnt, img);
+            draw_text(img->image_norm,
+                      cnt->imgs.width, cnt->imgs.height, 10, 20, tmp, cnt->text_scale);
+            draw_text(img->image_norm,
+                      cnt->imgs.width, cnt->imgs.height, 10, 30, t, cnt->text_scale);
+            img->frame_id = 0;
+        }
+
+        /* Output the picture to jpegs and ffmpeg */
+        event(cnt, EVENT_IMAGE_DETECTED, img, NULL, NULL, &img->timestamp_tv);
+
+        /* Filler frames for the movie are added by the handlers of this event */
+    }
+
+    /* Mark the image as saved */
+    img->flags |= IMAGE_SAVED;
+
+    /* Store it as a preview image, only if it has motion */
+    if (img->flags & IMAGE_MOTION) {
+        /* Check for most significant preview-shot when picture_output=best */
+        if (cnt->new_img & NEWIMG_BEST) {
+            if (img->diffs > cnt->imgs.preview_image.diffs) {
+                image_save_as_preview(cnt, img);
+            }
+        }
+        /* Check for most significant preview-shot when picture_output=center */
+        if (cnt->new_img & NEWIMG_CENTER) {
+            if (img->cent_dist < cnt->imgs.preview_image.cent_dist) {
+                image_save_as_preview(cnt, img);
+            }
+        }
+    }
+}
+
 /**
  * process_image_ring
  *
@@ -642,6 +832,15 @@ static void process_image_ring(struct context *cnt)
      * so set it temporary to our image
      */
     struct image_data *saved_current_image = cnt->current_image;
+    struct image_data *img;
+
+    /* The compressed pre-captured images go ahead of the image ring */
+    assert(cnt->imgs.image_ring_out < cnt->imgs.image_ring_size);
+    if ((cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & (IMAGE_SAVE | IMAGE_SAVED)) == IMAGE_SAVE) {
+        while ((img = precap_get(cnt)) != NULL) {
+            process_image(cnt, img);
+        }
+    }
 
     /* If image is flaged to be saved and not saved yet, process it */
     do {
@@ -651,110 +850,7 @@ static void process_image_ring(struct context *cnt)
             break;
         }
 
-        /* Set inte global context that we are working with this image */
-        cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_out];
-
-        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.framerate) {
-            if (cnt->log_level >= DBG) {
-                char tmp[32];
-                const char *t;
-
-                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_TRIGGER) {
-                    t = "Trigger";
-                } else if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_MOTION) {
-                    t = "Motion";
-                } else if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_PRECAP) {
-                    t = "Precap";
-                } else if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_POSTCAP) {
-                    t = "Postcap";
-                } else {
-                    t = "Other";
-                }
-
-                mystrftime(cnt, tmp, sizeof(tmp), "%H%M%S-%q",
-                           &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv, NULL, 0);
-                draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image_norm,
-                          cnt->imgs.width, cnt->imgs.height, 10, 20, tmp, cnt->text_scale);
-                draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image_norm,
-                          cnt->imgs.width, cnt->imgs.height, 10, 30, t, cnt->text_scale);
-            }
-
-            /* Output the picture to jpegs and ffmpeg */
-            event(cnt, EVENT_IMAGE_DETECTED,
-              &cnt->imgs.image_ring[cnt->imgs.image_ring_out], NULL, NULL,
-              &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv);
-
-
-            /*
-             * Check if we must add any "filler" frames into movie to keep up fps
-             * Only if we are recording videos ( ffmpeg or extenal pipe )
-             * While the overall elapsed time might be correct, if there are
-             * many duplicated frames, say 10 fps, 5 duplicated, the video will
-             * look like it is frozen every second for half a second.
-             */
-            if (!cnt->conf.movie_duplicate_frames) {
-                /* don't duplicate frames */
-            } else if ((cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot == 0) &&
-                (cnt->ffmpeg_output || (cnt->conf.movie_extpipe_use && cnt->extpipe))) {
-                /*
-                 * movie_last_shoot is -1 when file is created,
-                 * we don't know how many frames there is in first sec
-                 */
-                if (cnt->movie_last_shot >= 0) {
-                    if (cnt_list[0]->log_level >= DBG) {
-                        int frames = cnt->movie_fps - (cnt->movie_last_shot + 1);
-                        if (frames > 0) {
-                            char tmp[25];
-                            MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO
-                            ,_("Added %d fillerframes into movie"), frames);
-                            sprintf(tmp, "Fillerframes %d", frames);
-                            draw_text(cnt->imgs.image_ring[cnt->imgs.image_ring_out].image_norm,
-                                      cnt->imgs.width, cnt->imgs.height, 10, 40, tmp, cnt->text_scale);
-                        }
-                    }
-                    /* Check how many frames it was last sec */
-                    while ((cnt->movie_last_shot + 1) < cnt->movie_fps) {
-                        /* Add a filler frame into encoder */
-                        event(cnt, EVENT_FFMPEG_PUT,
-                          &cnt->imgs.image_ring[cnt->imgs.image_ring_out], NULL, NULL,
-                          &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tv);
-
-                        cnt->movie_last_shot++;
-                    }
-                }
-                cnt->movie_last_shot = 0;
-            } else if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot != (cnt->movie_last_shot + 1)) {
-                /* We are out of sync! Propably we got motion - no motion - motion */
-                cnt->movie_last_shot = -1;
-            }
-
-            /*
-             * Save last shot added to movie
-             * only when we not are within first sec
-             */
-            if (cnt->movie_last_shot >= 0) {
-                cnt->movie_last_shot = cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot;
-            }
-        }
-
-        /* Mark the image as saved */
-        cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags |= IMAGE_SAVED;
-
-        /* Store it as a preview image, only if it has motion */
-        if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].flags & IMAGE_MOTION) {
-            /* Check for most significant preview-shot when picture_output=best */
-            if (cnt->new_img & NEWIMG_BEST) {
-                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].diffs > cnt->imgs.preview_image.diffs) {
-                    image_save_as_preview(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
-                }
-            }
-            /* Check for most significant preview-shot when picture_output=center */
-            if (cnt->new_img & NEWIMG_CENTER) {
-                if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].cent_dist < cnt->imgs.preview_image.cent_dist) {
-                    image_save_as_preview(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
-                }
-            }
-        }
+        process_image(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_out]);
 
         /* Increment to image after last sended */
         if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size) {
@@ -822,16 +918,16 @@ static void init_mask_privacy(struct context *cnt)
     int y_index, uv_index;
     int indx_img, indx_max;         /* Counter and max for norm/high */
     int indx_width, indx_height;
-    unsigned char *img_temp, *img_temp_uv;
+    unsigned char *img_temp;
 
 
     FILE *picture;
 
     /* Load the privacy file if any */
     cnt->imgs.mask_privacy = NULL;
-    cnt->imgs.mask_privacy_uv = NULL;
+    cnt->imgs.mask_privacy_spans = NULL;
     cnt->imgs.mask_privacy_high = NULL;
-    cnt->imgs.mask_privacy_high_uv = NULL;
+    cnt->imgs.mask_privacy_high_spans = NULL;
 
     if (cnt->conf.mask_privacy) {
         if ((picture = myfopen(cnt->conf.mask_privacy, "r"))) {
@@ -843,14 +939,11 @@ static void init_mask_privacy(struct context *cnt)
              */
             cnt->imgs.mask_privacy = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
 
-            /* We only need the "or" mask for the U & V chrominance area.  */
-            cnt->imgs.mask_privacy_uv = mymalloc((cnt->imgs.height * cnt->imgs.width) / 2);
             if (cnt->imgs.size_high > 0) {
                 MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
                     ,_("Opening high resolution privacy mask file"));
                 rewind(picture);
                 cnt->imgs.mask_privacy_high = get_pgm(picture, cnt->imgs.width_high, cnt->imgs.height_high);
-                cnt->imgs.mask_privacy_high_uv = mymalloc((cnt->imgs.height_high * cnt->imgs.width_high) / 2);
             }
 
             myfclose(picture);
@@ -882,7 +975,6 @@ static void init_mask_privacy(struct context *cnt)
                     indx_width = cnt->imgs.width;
                     indx_height = cnt->imgs.height;
                     img_temp = cnt->imgs.mask_privacy;
-                    img_temp_uv = cnt->imgs.mask_privacy_uv;
                 } else {
                     start_cr = (cnt->imgs.height_high * cnt->imgs.width_high);
                     offset_cb = ((cnt->imgs.height_high * cnt->imgs.width_high)/4);
@@ -890,7 +982,6 @@ static void init_mask_privacy(struct context *cnt)
                     indx_width = cnt->imgs.width_high;
                     indx_height = cnt->imgs.height_high;
                     img_temp = cnt->imgs.mask_privacy_high;
-                    img_temp_uv = cnt->imgs.mask_privacy_high_uv;
                 }
 
                 for (indxrow = 0; indxrow < indx_height; indxrow++) {
@@ -901,8 +992,6 @@ static void init_mask_privacy(struct context *cnt)
                                 uv_index = (indxcol/2) + ((indxrow * indx_width)/4);
                                 img_temp[start_cr + uv_index] = 0xff;
                                 img_temp[start_cb + uv_index] = 0xff;
-                                img_temp_uv[uv_index] = 0x00;
-                                img_temp_uv[offset_cb + uv_index] = 0x00;
                             }
                         } else {
                             img_temp[y_index] = 0x00;
@@ -910,12 +999,18 @@ static void init_mask_privacy(struct context *cnt)
                                 uv_index = (indxcol/2) + ((indxrow * indx_width)/4);
                                 img_temp[start_cr + uv_index] = 0x00;
                                 img_temp[start_cb + uv_index] = 0x00;
-                                img_temp_uv[uv_index] = 0x80;
-                                img_temp_uv[offset_cb + uv_index] = 0x80;
                             }
                         }
                     }
                 }
+
+                if (indx_img == 1) {
+                    cnt->imgs.mask_privacy_spans = mask_span_compile(img_temp
+                        , indx_width, indx_height, TRUE);
+                } else {
+                    cnt->imgs.mask_privacy_high_spans = mask_span_compile(img_temp
+                        , indx_width, indx_height, TRUE);
+                }
                 indx_img++;
             }
         }
@@ -959,29 +1054,35 @@ static void init_text_scale(struct context *cnt)
 
 }
 
-static void mot_stream_init(struct context *cnt)
+static void mot_stream_init_data(struct context *cnt, struct stream_data *stream, int width)
 {
+    stream->jpeg = NULL;
+    stream->buffers = NULL;
+    stream->cnct_count = 0;
+    stream->due = 0;
+    stream->scale = NULL;
+    stream->image = NULL;
+    stream_jpeg_size(cnt, stream, width);
+}
 
-    /* The image buffers are allocated in event_stream_put if needed*/
-    pthread_mutex_init(&cnt->mutex_stream, NULL);
-
-    cnt->imgs.substream_image = NULL;
-
-    cnt->stream_norm.jpeg_size = 0;
-    cnt->stream_norm.jpeg_data = NULL;
-    cnt->stream_norm.cnct_count = 0;
-
-    cnt->stream_sub.jpeg_size = 0;
-    cnt->stream_sub.jpeg_data = NULL;
-    cnt->stream_sub.cnct_count = 0;
-
-    cnt->stream_motion.jpeg_size = 0;
-    cnt->stream_motion.jpeg_data = NULL;
-    cnt->stream_motion.cnct_count = 0;
+static void mot_stream_init(struct context *cnt)
+{
 
-    cnt->stream_source.jpeg_size = 0;
-    cnt->stream_source.jpeg_data = NULL;
-    cnt->stream_source.cnct_count = 0;
+    /* The image buffers are allocated in stream_jpeg_claim if needed*/
+    mot_stream_init_data(cnt, &cnt->stream_norm, cnt->imgs.width);
+    mot_stream_init_data(cnt, &cnt->stream_low, cnt->imgs.width);
+    mot_stream_init_data(cnt, &cnt->stream_sub, cnt->imgs.width / 2);
+    mot_stream_init_data(cnt, &cnt->stream_quarter, cnt->imgs.width / 4);
+    mot_stream_init_data(cnt, &cnt->stream_thumb, cnt->conf.stream_thumbnail);
+    mot_stream_init_data(cnt, &cnt->stream_motion, cnt->imgs.width);
+    mot_stream_init_data(cnt, &cnt->stream_source, cnt->imgs.width);
+    mot_stream_init_data(cnt, &cnt->stream_live, cnt->imgs.width);
+
+    /* The connections that waited for the camera to start wait for its images */
+    pthread_mutex_lock(&cnt->mutex_stream);
+        cnt->stream_closed = FALSE;
+    pthread_mutex_unlock(&cnt->mutex_stream);
+    webu_stream_wake(cnt, TRUE);
 
 }
 
@@ -989,35 +1090,22 @@ static void mot_stream_deinit(struct context *cnt)
 {
 
     /* Need to check whether buffers were allocated since init
-     * function defers the allocations to event_stream_put
+     * function defers the allocations to stream_jpeg_claim
     */
 
-    pthread_mutex_destroy(&cnt->mutex_stream);
-
-    if (cnt->imgs.substream_image != NULL) {
-        free(cnt->imgs.substream_image);
-        cnt->imgs.substream_image = NULL;
-    }
-
-    if (cnt->stream_norm.jpeg_data != NULL) {
-        free(cnt->stream_norm.jpeg_data);
-        cnt->stream_norm.jpeg_data = NULL;
-    }
-
-    if (cnt->stream_sub.jpeg_data != NULL) {
-        free(cnt->stream_sub.jpeg_data);
-        cnt->stream_sub.jpeg_data = NULL;
-    }
-
-    if (cnt->stream_motion.jpeg_data != NULL) {
-        free(cnt->stream_motion.jpeg_data);
-        cnt->stream_motion.jpeg_data = NULL;
-    }
-
-    if (cnt->stream_source.jpeg_data != NULL) {
-        free(cnt->stream_source.jpeg_data);
-        cnt->stream_source.jpeg_data = NULL;
-    }
+    /* The connections stay suspended until the camera starts again */
+    pthread_mutex_lock(&cnt->mutex_stream);
+        cnt->stream_closed = TRUE;
+    pthread_mutex_unlock(&cnt->mutex_stream);
+
+    stream_jpeg_free(&cnt->stream_norm);
+    stream_jpeg_free(&cnt->stream_low);
+    stream_jpeg_free(&cnt->stream_sub);
+    stream_jpeg_free(&cnt->stream_quarter);
+    stream_jpeg_free(&cnt->stream_thumb);
+    stream_jpeg_free(&cnt->stream_motion);
+    stream_jpeg_free(&cnt->stream_source);
+    stream_jpeg_free(&cnt->stream_live);
 }
 
 /**
@@ -1045,6 +1133,15 @@ static int motion_init(struct context *cnt)
     /* Store thread number in TLS. */
     pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
 
+    cnt->pipeline = NULL;
+    cnt->picture_writer = NULL;
+    cnt->movie_encoder = NULL;
+    cnt->jpeg_cache = NULL;
+
+    frame_arena_init(cnt);
+
+    draw_cache_init(cnt);
+
     cnt->currenttime_tm = mymalloc(sizeof(struct tm));
     cnt->eventtime_tm = mymalloc(sizeof(struct tm));
     /* Init frame time */
@@ -1153,12 +1250,6 @@ static int motion_init(struct context *cnt)
             ,cnt->imgs.width, cnt->imgs.height);
             return -3;
     }
-    /* Substream size notification*/
-    if ((cnt->imgs.width % 16) || (cnt->imgs.height % 16)) {
-        MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO
-            ,_("Substream not available.  Image sizes not modulo 16."));
-    }
-
 
     /* We set size_high here so that it can be used in the retry function to determine whether
      * we need to break and reallocate buffers
@@ -1167,23 +1258,27 @@ static int motion_init(struct context *cnt)
 
     image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
 
-    cnt->imgs.ref = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.img_motion.image_norm = mymalloc(cnt->imgs.size_norm);
+    cnt->imgs.ref = frame_arena_alloc(cnt, cnt->imgs.size_norm);
+    cnt->imgs.img_motion.image_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
 
     /* contains the moving objects of ref. frame */
-    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
-    cnt->imgs.image_virgin.image_norm = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.image_vprvcy.image_norm = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.smartmask = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
-    cnt->imgs.labels = mymalloc(cnt->imgs.motionsize * sizeof(*cnt->imgs.labels));
+    cnt->imgs.ref_dyn = frame_arena_alloc(cnt, cnt->imgs.motionsize * sizeof(*cnt->imgs.ref_dyn));
+    cnt->imgs.virgin_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
+    cnt->imgs.vprvcy_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
+    cnt->imgs.image_virgin.image_norm = cnt->imgs.virgin_norm;
+    cnt->imgs.image_vprvcy.image_norm = cnt->imgs.vprvcy_norm;
+    cnt->imgs.smartmask = frame_arena_alloc(cnt, cnt->imgs.motionsize);
+    cnt->imgs.smartmask_final = frame_arena_alloc(cnt, cnt->imgs.motionsize);
+    cnt->imgs.smartmask_buffer = frame_arena_alloc(cnt, cnt->imgs.motionsize * sizeof(*cnt->imgs.smartmask_buffer));
+    cnt->imgs.labels = frame_arena_alloc(cnt, cnt->imgs.motionsize * sizeof(*cnt->imgs.labels));
     cnt->imgs.labelsize = mymalloc((cnt->imgs.motionsize/2+1) * sizeof(*cnt->imgs.labelsize));
-    cnt->imgs.preview_image.image_norm = mymalloc(cnt->imgs.size_norm);
-    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
+    cnt->imgs.preview_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
+    cnt->imgs.preview_image.image_norm = cnt->imgs.preview_norm;
+    cnt->imgs.common_buffer = frame_arena_alloc(cnt, 3 * cnt->imgs.width * cnt->imgs.height);
     if (cnt->imgs.size_high > 0) {
-        cnt->imgs.image_virgin.image_high = mymalloc(cnt->imgs.size_high);
-        cnt->imgs.preview_image.image_high = mymalloc(cnt->imgs.size_high);
+        cnt->imgs.image_virgin.image_high = frame_arena_alloc(cnt, cnt->imgs.size_high);
+        cnt->imgs.preview_high = frame_arena_alloc(cnt, cnt->imgs.size_high);
+        cnt->imgs.preview_image.image_high = cnt->imgs.preview_high;
     }
 
     mot_stream_init(cnt);
@@ -1306,9 +1401,15 @@ static int motion_init(struct context *cnt)
             MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
                 ,_("Maskfile \"%s\" loaded.")
                 ,cnt->conf.mask_file);
+            cnt->imgs.mask_spans = mask_span_compile(cnt->imgs.mask
+                , cnt->imgs.width, cnt->imgs.height, FALSE);
+            cnt->imgs.mask_overlay_spans = mask_span_overlay(cnt->imgs.mask
+                , cnt->imgs.width, cnt->imgs.height);
         }
     } else {
         cnt->imgs.mask = NULL;
+        cnt->imgs.mask_spans = NULL;
+        cnt->imgs.mask_overlay_spans = NULL;
     }
 
     init_mask_privacy(cnt);
@@ -1408,6 +1509,14 @@ static int motion_init(struct context *cnt)
     cnt->passflag = 0;  //only purpose to flag first frame
     cnt->rolling_frame = 0;
 
+    /* Compressed images, picture writers, movie encoder, stream worker, output stage and capture buffers.  See motion_loop */
+    jpeg_cache_init(cnt);
+    picture_writer_init(cnt);
+    movie_encoder_init(cnt);
+    stream_worker_init(cnt);
+    live_init(cnt);
+    pipeline_init(cnt);
+
     if (cnt->conf.emulate_motion) {
         MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Emulating motion"));
     }
@@ -1430,6 +1539,10 @@ static int motion_init(struct context *cnt)
 static void motion_cleanup(struct context *cnt)
 {
 
+    /* Finish the queued output first; the events below are handled right away */
+    pipeline_deinit(cnt);
+    picture_writer_deinit(cnt);
+
     event(cnt, EVENT_TIMELAPSEEND, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
     if (cnt->event_nr == cnt->prev_event) {
       /* run only if event active; else, may overwrite last event's data */
@@ -1437,41 +1550,50 @@ static void motion_cleanup(struct context *cnt)
       cnt->event_nr++;
     }
 
+    /* Closes the movies ended above */
+    movie_encoder_deinit(cnt);
+
+    stream_worker_deinit(cnt);
+    live_deinit(cnt);
     mot_stream_deinit(cnt);
 
+    jpeg_cache_deinit(cnt);
+
     if (cnt->video_dev >= 0) {
         MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Calling vid_close() from motion_cleanup"));
         vid_close(cnt);
     }
 
-    free(cnt->imgs.img_motion.image_norm);
+    frame_arena_free(cnt, cnt->imgs.img_motion.image_norm);
     cnt->imgs.img_motion.image_norm = NULL;
 
-    free(cnt->imgs.ref);
+    frame_arena_free(cnt, cnt->imgs.ref);
     cnt->imgs.ref = NULL;
 
-    free(cnt->imgs.ref_dyn);
+    frame_arena_free(cnt, cnt->imgs.ref_dyn);
     cnt->imgs.ref_dyn = NULL;
 
-    free(cnt->imgs.image_virgin.image_norm);
+    frame_arena_free(cnt, cnt->imgs.virgin_norm);
+    cnt->imgs.virgin_norm = NULL;
     cnt->imgs.image_virgin.image_norm = NULL;
 
-    free(cnt->imgs.image_vprvcy.image_norm);
+    frame_arena_free(cnt, cnt->imgs.vprvcy_norm);
+    cnt->imgs.vprvcy_norm = NULL;
     cnt->imgs.image_vprvcy.image_norm = NULL;
 
-    free(cnt->imgs.labels);
+    frame_arena_free(cnt, cnt->imgs.labels);
     cnt->imgs.labels = NULL;
 
     free(cnt->imgs.labelsize);
     cnt->imgs.labelsize = NULL;
 
-    free(cnt->imgs.smartmask);
+    frame_arena_free(cnt, cnt->imgs.smartmask);
     cnt->imgs.smartmask = NULL;
 
-    free(cnt->imgs.smartmask_final);
+    frame_arena_free(cnt, cnt->imgs.smartmask_final);
     cnt->imgs.smartmask_final = NULL;
 
-    free(cnt->imgs.smartmask_buffer);
+    frame_arena_free(cnt, cnt->imgs.smartmask_buffer);
     cnt->imgs.smartmask_buffer = NULL;
 
     if (cnt->imgs.mask) {
@@ -1479,41 +1601,49 @@ static void motion_cleanup(struct context *cnt)
     }
     cnt->imgs.mask = NULL;
 
+    mask_span_free(cnt->imgs.mask_spans);
+    cnt->imgs.mask_spans = NULL;
+
+    mask_span_free(cnt->imgs.mask_overlay_spans);
+    cnt->imgs.mask_overlay_spans = NULL;
+
+    mask_span_free(cnt->imgs.smartmask_spans);
+    cnt->imgs.smartmask_spans = NULL;
+
     if (cnt->imgs.mask_privacy) {
         free(cnt->imgs.mask_privacy);
     }
     cnt->imgs.mask_privacy = NULL;
 
-    if (cnt->imgs.mask_privacy_uv) {
-        free(cnt->imgs.mask_privacy_uv);
-    }
-    cnt->imgs.mask_privacy_uv = NULL;
+    mask_span_free(cnt->imgs.mask_privacy_spans);
+    cnt->imgs.mask_privacy_spans = NULL;
 
     if (cnt->imgs.mask_privacy_high) {
         free(cnt->imgs.mask_privacy_high);
     }
     cnt->imgs.mask_privacy_high = NULL;
 
-    if (cnt->imgs.mask_privacy_high_uv) {
-        free(cnt->imgs.mask_privacy_high_uv);
-    }
-    cnt->imgs.mask_privacy_high_uv = NULL;
+    mask_span_free(cnt->imgs.mask_privacy_high_spans);
+    cnt->imgs.mask_privacy_high_spans = NULL;
 
-    free(cnt->imgs.common_buffer);
+    frame_arena_free(cnt, cnt->imgs.common_buffer);
     cnt->imgs.common_buffer = NULL;
 
-    free(cnt->imgs.preview_image.image_norm);
+    frame_arena_free(cnt, cnt->imgs.preview_norm);
+    cnt->imgs.preview_norm = NULL;
     cnt->imgs.preview_image.image_norm = NULL;
 
     if (cnt->imgs.size_high > 0) {
-        free(cnt->imgs.image_virgin.image_high);
+        frame_arena_free(cnt, cnt->imgs.image_virgin.image_high);
         cnt->imgs.image_virgin.image_high = NULL;
 
-        free(cnt->imgs.preview_image.image_high);
+        frame_arena_free(cnt, cnt->imgs.preview_high);
+        cnt->imgs.preview_high = NULL;
         cnt->imgs.preview_image.image_high = NULL;
     }
 
     image_ring_destroy(cnt); /* Cleanup the precapture ring buffer */
+    precap_free(cnt);
 
     rotate_deinit(cnt); /* cleanup image rotation data */
 
@@ -1542,6 +1672,11 @@ static void motion_cleanup(struct context *cnt)
 
     dbse_deinit(cnt);
 
+    draw_cache_deinit(cnt);
+
+    /* Last since the buffers above were handed out from it */
+    frame_arena_deinit(cnt);
+
 }
 
 static void mlp_mask_privacy(struct context *cnt)
@@ -1551,79 +1686,18 @@ static void mlp_mask_privacy(struct context *cnt)
         return;
     }
 
+    image_writable(cnt, cnt->current_image);
+
     /*
-    * This function uses long operations to process 4 (32 bit) or 8 (64 bit)
-    * bytes at a time, providing a significant boost in performance.
-    * Then a trailer loop takes care of any remaining bytes.
+    * The privacy mask was compiled into spans when it was loaded so only
+    * the blocked areas are written, see mask_span.c
     */
-    unsigned char *image;
-    const unsigned char *mask;
-    const unsigned char *maskuv;
-
-    int index_y;
-    int index_crcb;
-    int increment;
-    int indx_img;                /* Counter for how many images we need to apply the mask to */
-    int indx_max;                /* 1 if we are only doing norm, 2 if we are doing both norm and high */
-
-    indx_img = 1;
-    indx_max = 1;
-    if (cnt->imgs.size_high > 0) {
-        indx_max = 2;
-    }
-    increment = sizeof(unsigned long);
-
-    while (indx_img <= indx_max) {
-        if (indx_img == 1) {
-            /* Normal Resolution */
-            index_y = cnt->imgs.height * cnt->imgs.width;
-            image = cnt->current_image->image_norm;
-            mask = cnt->imgs.mask_privacy;
-            index_crcb = cnt->imgs.size_norm - index_y;
-            maskuv = cnt->imgs.mask_privacy_uv;
-        } else {
-            /* High Resolution */
-            index_y = cnt->imgs.height_high * cnt->imgs.width_high;
-            image = cnt->current_image->image_high;
-            mask = cnt->imgs.mask_privacy_high;
-            index_crcb = cnt->imgs.size_high - index_y;
-            maskuv = cnt->imgs.mask_privacy_high_uv;
-        }
-
-        while (index_y >= increment) {
-            *((unsigned long *)image) &= *((unsigned long *)mask);
-            image += increment;
-            mask += increment;
-            index_y -= increment;
-        }
-        while (--index_y >= 0) {
-            *(image++) &= *(mask++);
-        }
-
-        /* Mask chrominance. */
-        while (index_crcb >= increment) {
-            index_crcb -= increment;
-            /*
-            * Replace the masked bytes with 0x080. This is done using two masks:
-            * the normal privacy mask is used to clear the masked bits, the
-            * "or" privacy mask is used to write 0x80. The benefit of that method
-            * is that we process 4 or 8 bytes in just two operations.
-            */
-            *((unsigned long *)image) &= *((unsigned long *)mask);
-            mask += increment;
-            *((unsigned long *)image) |= *((unsigned long *)maskuv);
-            maskuv += increment;
-            image += increment;
-        }
-
-        while (--index_crcb >= 0) {
-            if (*(mask++) == 0x00) {
-                *image = 0x80; // Mask last remaining bytes.
-            }
-            image += 1;
-        }
+    mask_span_privacy(cnt->imgs.mask_privacy_spans
+        , cnt->current_image->image_norm, cnt->imgs.mask_privacy);
 
-        indx_img++;
+    if (cnt->imgs.size_high > 0) {
+        mask_span_privacy(cnt->imgs.mask_privacy_high_spans
+            , cnt->current_image->image_high, cnt->imgs.mask_privacy_high);
     }
 }
 
@@ -1705,6 +1779,10 @@ static void mlp_prepare(struct context *cnt)
      * via the http remote control we need to re-size the ring buffer
      */
     frame_buffer_size = cnt->conf.pre_capture + cnt->conf.minimum_motion_frames;
+    if (precap_active(cnt)) {
+        /* The older pre-captured images are kept compressed, see precap.c */
+        frame_buffer_size = cnt->conf.minimum_motion_frames + 1;
+    }
 
     if (cnt->imgs.image_ring_size != frame_buffer_size) {
         image_ring_resize(cnt, frame_buffer_size);
@@ -1729,6 +1807,8 @@ static void mlp_prepare(struct context *cnt)
         cnt->shots = -1;
         cnt->lastframetime = cnt->currenttime;
 
+        movie_encoder_rate(cnt);
+
         if (cnt->conf.minimum_frame_time) {
             cnt->minimum_frame_time_downcounter--;
             if (cnt->minimum_frame_time_downcounter == 0) {
@@ -1765,6 +1845,10 @@ static void mlp_resetimages(struct context *cnt)
         cnt->imgs.image_ring_in = 0;
     }
 
+    /* Keep the image about to be overwritten when pre_capture_quality is set */
+    precap_put(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_in]);
+    image_writable(cnt, &cnt->imgs.image_ring[cnt->imgs.image_ring_in]);
+
     /* Check if we have filled the ring buffer, throw away last image */
     if (cnt->imgs.image_ring_in == cnt->imgs.image_ring_out) {
         if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size) {
@@ -1805,67 +1889,93 @@ static void mlp_resetimages(struct context *cnt)
     /* Store shot number with pre_captured image */
     cnt->current_image->shot = cnt->shots;
 
+    /* New pixels, their compressed images are not those of the previous frame */
+    cnt->current_image->frame_id = ++cnt->frame_id;
+    if (cnt->current_image->frame_id == 0) {
+        cnt->current_image->frame_id = ++cnt->frame_id;
+    }
+
 }
 
-static int mlp_retry(struct context *cnt)
+/**
+ * mlp_reopen
+ *
+ *   Try to open the camera again.  Called from the motion loop while the
+ *   capture stage thread is stopped.
+ *
+ * Returns 1 when the motion thread must be restarted.
+ */
+static int mlp_reopen(struct context *cnt)
 {
-
-    /*
-     * If a camera is not available we keep on retrying every 10 seconds
-     * until it shows up.
-     */
     int size_high;
 
-    if (cnt->video_dev < 0 && cnt->currenttime % 10 == 0 && cnt->shots == 0) {
-        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
-            ,_("Retrying until successful connection with camera"));
-        cnt->video_dev = vid_start(cnt);
-
-        if (cnt->video_dev < 0) {
-            return 1;
-        }
+    MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO
+        ,_("Retrying until successful connection with camera"));
+    cnt->video_dev = vid_start(cnt);
 
-        if ((cnt->imgs.width % 8) || (cnt->imgs.height % 8)) {
-            MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO
-                ,_("Image width (%d) or height(%d) requested is not modulo 8.")
-                ,cnt->imgs.width, cnt->imgs.height);
-            return 1;
-        }
+    if (cnt->video_dev < 0) {
+        return 1;
+    }
 
-        if ((cnt->imgs.width  < 64) || (cnt->imgs.height < 64)) {
-            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
-                ,_("Motion only supports width and height greater than or equal to 64 %dx%d")
-                ,cnt->imgs.width, cnt->imgs.height);
-                return 1;
-        }
+    if ((cnt->imgs.width % 8) || (cnt->imgs.height % 8)) {
+        MOTION_LOG(CRT, TYPE_NETCAM, NO_ERRNO
+            ,_("Image width (%d) or height(%d) requested is not modulo 8.")
+            ,cnt->imgs.width, cnt->imgs.height);
+        return 1;
+    }
 
-        /*
-         * If the netcam has different dimensions than in the config file
-         * we need to restart Motion to re-allocate all the buffers
-         */
-        if (cnt->imgs.width != cnt->conf.width || cnt->imgs.height != cnt->conf.height) {
-            MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Camera has finally become available\n"
-                       "Camera image has different width and height"
-                       "from what is in the config file. You should fix that\n"
-                       "Restarting Motion thread to reinitialize all "
-                       "image buffers to new picture dimensions"));
-            cnt->conf.width = cnt->imgs.width;
-            cnt->conf.height = cnt->imgs.height;
-            /*
-             * Break out of main loop terminating thread
-             * watchdog will start us again
-             */
+    if ((cnt->imgs.width  < 64) || (cnt->imgs.height < 64)) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
+            ,_("Motion only supports width and height greater than or equal to 64 %dx%d")
+            ,cnt->imgs.width, cnt->imgs.height);
             return 1;
-        }
+    }
+
+    /*
+     * If the netcam has different dimensions than in the config file
+     * we need to restart Motion to re-allocate all the buffers
+     */
+    if (cnt->imgs.width != cnt->conf.width || cnt->imgs.height != cnt->conf.height) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("Camera has finally become available\n"
+                   "Camera image has different width and height"
+                   "from what is in the config file. You should fix that\n"
+                   "Restarting Motion thread to reinitialize all "
+                   "image buffers to new picture dimensions"));
+        cnt->conf.width = cnt->imgs.width;
+        cnt->conf.height = cnt->imgs.height;
         /*
-         * For high res, we check the size of buffer to determine whether to break out
-         * the init_motion function allocated the buffer for high using the cnt->imgs.size_high
-         * and the vid_start ONLY re-populates the height/width so we can check the size here.
+         * Break out of main loop terminating thread
+         * watchdog will start us again
          */
-        size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
-        if (cnt->imgs.size_high != size_high) {
+        return 1;
+    }
+    /*
+     * For high res, we check the size of buffer to determine whether to break out
+     * the init_motion function allocated the buffer for high using the cnt->imgs.size_high
+     * and the vid_start ONLY re-populates the height/width so we can check the size here.
+     */
+    size_high = (cnt->imgs.width_high * cnt->imgs.height_high * 3) / 2;
+    if (cnt->imgs.size_high != size_high) {
+        return 1;
+    }
+    return 0;
+}
+
+static void *mlp_capture_loop(void *arg);
+
+static int mlp_retry(struct context *cnt)
+{
+
+    /*
+     * If a camera is not available we keep on retrying every 10 seconds
+     * until it shows up.  The capture stage thread is stopped meanwhile
+     * and started again once the camera is back.
+     */
+    if (cnt->video_dev < 0 && cnt->currenttime % 10 == 0 && cnt->shots == 0) {
+        if (mlp_reopen(cnt) == 1) {
             return 1;
         }
+        pipeline_capture_start(cnt, mlp_capture_loop);
     }
     return 0;
 }
@@ -1887,7 +1997,13 @@ static int mlp_capture(struct context *cnt)
      * <0 = fatal error - leave the thread by breaking out of the main loop
      * >0 = non fatal error - copy last image or show grey image with message
      */
-    if (cnt->video_dev >= 0) {
+    if (pipeline_capture_active(cnt)) {
+        /* The frame was read by the capture stage thread.  It ends itself after these */
+        vid_return_code = pipeline_capture_take(cnt, cnt->current_image);
+        if ((vid_return_code < 0) || (vid_return_code == NETCAM_RESTART_ERROR)) {
+            pipeline_capture_stop(cnt);
+        }
+    } else if (cnt->video_dev >= 0) {
         vid_return_code = vid_next(cnt, cnt->current_image);
     } else {
         vid_return_code = 1; /* Non fatal error */
@@ -1908,14 +2024,15 @@ static int mlp_capture(struct context *cnt)
         cnt->missing_frame_counter = 0;
 
         /*
-         * Save the newly captured still virgin image to a buffer
-         * which we will not alter with text and location graphics
+         * The virgin image is not altered with text and location graphics.
+         * It shares the captured image until that is written, see
+         * image_writable.
          */
-        memcpy(cnt->imgs.image_virgin.image_norm, cnt->current_image->image_norm, cnt->imgs.size_norm);
+        cnt->imgs.image_virgin.image_norm = cnt->current_image->image_norm;
 
         mlp_mask_privacy(cnt);
 
-        memcpy(cnt->imgs.image_vprvcy.image_norm, cnt->current_image->image_norm, cnt->imgs.size_norm);
+        cnt->imgs.image_vprvcy.image_norm = cnt->current_image->image_norm;
 
         /*
          * If the camera is a netcam we let the camera decide the pace.
@@ -1938,6 +2055,7 @@ static int mlp_capture(struct context *cnt)
          * a gray image with message is applied
          * flag lost_connection
          */
+        image_writable(cnt, cnt->current_image);
         memcpy(cnt->current_image->image_norm, cnt->imgs.image_virgin.image_norm, cnt->imgs.size_norm);
         cnt->lost_connection = 1;
     /* NO FATAL ERROR -
@@ -1988,6 +2106,8 @@ static int mlp_capture(struct context *cnt)
          */
         ++cnt->missing_frame_counter;
 
+        image_writable(cnt, cnt->current_image);
+
         if (cnt->video_dev >= 0 &&
             cnt->missing_frame_counter < (MISSING_FRAMES_TIMEOUT * cnt->conf.framerate)) {
             memcpy(cnt->current_image->image_norm, cnt->imgs.image_vprvcy.image_norm, cnt->imgs.size_norm);
@@ -2024,6 +2144,7 @@ static int mlp_capture(struct context *cnt)
                 MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO
                     ,_("Video signal still lost - "
                     "Trying to close video device"));
+                pipeline_capture_stop(cnt);
                 vid_close(cnt);
             }
         }
@@ -2096,6 +2217,10 @@ static void mlp_detection(struct context *cnt)
              * because with Round Robin this is controlled by roundrobin_skip.
              */
             if (cnt->conf.roundrobin_switchfilter && cnt->current_image->diffs > cnt->threshold) {
+                /* Draws the values on the image with text_changes */
+                if (cnt->conf.text_changes) {
+                    image_writable(cnt, cnt->current_image);
+                }
                 cnt->current_image->diffs = alg_switchfilter(cnt, cnt->current_image->diffs,
                                                              cnt->current_image->image_norm);
 
@@ -2269,8 +2394,10 @@ static void mlp_overlay(struct context *cnt)
             sprintf(tmp, "-");
         }
 
-        draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
-                  cnt->imgs.width - 10, 10, tmp, cnt->text_scale);
+        image_writable(cnt, cnt->current_image);
+        draw_text_cached(&cnt->draw_cache[DRAW_CACHE_CHANGES]
+            , cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height
+            , cnt->imgs.width - 10, 10, tmp, cnt->text_scale);
     }
 
     /*
@@ -2280,30 +2407,36 @@ static void mlp_overlay(struct context *cnt)
     if (cnt->conf.setup_mode || (cnt->stream_motion.cnct_count > 0)) {
         sprintf(tmp, "D:%5d L:%3d N:%3d", cnt->current_image->diffs,
                 cnt->current_image->total_labels, cnt->noise);
-        draw_text(cnt->imgs.img_motion.image_norm, cnt->imgs.width, cnt->imgs.height,
-                  cnt->imgs.width - 10, cnt->imgs.height - (30 * cnt->text_scale),
-                  tmp, cnt->text_scale);
+        draw_text_cached(&cnt->draw_cache[DRAW_CACHE_SETUP_DIFFS]
+            , cnt->imgs.img_motion.image_norm, cnt->imgs.width, cnt->imgs.height
+            , cnt->imgs.width - 10, cnt->imgs.height - (30 * cnt->text_scale)
+            , tmp, cnt->text_scale);
         sprintf(tmp, "THREAD %d SETUP", cnt->threadnr);
-        draw_text(cnt->imgs.img_motion.image_norm, cnt->imgs.width, cnt->imgs.height,
-                  cnt->imgs.width - 10, cnt->imgs.height - (10 * cnt->text_scale),
-                  tmp, cnt->text_scale);
+        draw_text_cached(&cnt->draw_cache[DRAW_CACHE_SETUP_THREAD]
+            , cnt->imgs.img_motion.image_norm, cnt->imgs.width, cnt->imgs.height
+            , cnt->imgs.width - 10, cnt->imgs.height - (10 * cnt->text_scale)
+            , tmp, cnt->text_scale);
     }
 
     /* Add text in lower left corner of the pictures */
     if (cnt->conf.text_left) {
         mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left,
                    &cnt->current_image->timestamp_tv, NULL, 0);
-        draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
-                  10, cnt->imgs.height - (10 * cnt->text_scale), tmp, cnt->text_scale);
+        image_writable(cnt, cnt->current_image);
+        draw_text_cached(&cnt->draw_cache[DRAW_CACHE_LEFT]
+            , cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height
+            , 10, cnt->imgs.height - (10 * cnt->text_scale), tmp, cnt->text_scale);
     }
 
     /* Add text in lower right corner of the pictures */
     if (cnt->conf.text_right) {
         mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right,
                    &cnt->current_image->timestamp_tv, NULL, 0);
-        draw_text(cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height,
-                  cnt->imgs.width - 10, cnt->imgs.height - (10 * cnt->text_scale),
-                  tmp, cnt->text_scale);
+        image_writable(cnt, cnt->current_image);
+        draw_text_cached(&cnt->draw_cache[DRAW_CACHE_RIGHT]
+            , cnt->current_image->image_norm, cnt->imgs.width, cnt->imgs.height
+            , cnt->imgs.width - 10, cnt->imgs.height - (10 * cnt->text_scale)
+            , tmp, cnt->text_scale);
     }
 
 }
@@ -2336,8 +2469,8 @@ static void mlp_actions(struct context *cnt)
          *  no motion then we reset the start movie time so that we do not
          *  get a pause in the movie.
         */
-        if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) ) {
-            ffmpeg_reset_movie_start_time(cnt->ffmpeg_output, &cnt->current_image->timestamp_tv);
+        if (cnt->detecting_motion == 0) {
+            event(cnt, EVENT_MOVIE_RESUME, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
         }
         cnt->detecting_motion = 1;
         if (cnt->conf.post_capture > 0) {
@@ -2382,8 +2515,8 @@ static void mlp_actions(struct context *cnt)
              *  no motion then we reset the start movie time so that we do not
              *  get a pause in the movie.
             */
-            if ( (cnt->detecting_motion == 0) && (cnt->ffmpeg_output != NULL) ) {
-                ffmpeg_reset_movie_start_time(cnt->ffmpeg_output, &cnt->current_image->timestamp_tv);
+            if (cnt->detecting_motion == 0) {
+                event(cnt, EVENT_MOVIE_RESUME, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
             }
 
             cnt->detecting_motion = 1;
@@ -2436,6 +2569,7 @@ static void mlp_actions(struct context *cnt)
     if ((cnt->conf.movie_max_time > 0) &&
         (cnt->event_nr == cnt->prev_event) &&
         (cnt->current_image->timestamp_tv.tv_sec - cnt->movietime >= cnt->conf.movie_max_time)) {
+        cnt->movietime = cnt->current_image->timestamp_tv.tv_sec;
         event(cnt, EVENT_MAX_MOVIE, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
     }
 
@@ -2455,7 +2589,7 @@ static void mlp_actions(struct context *cnt)
             if (cnt->imgs.preview_image.diffs) {
                 /* Do not save if it was saved at start */
                 if (!(cnt->new_img & NEWIMG_FIRST)) {
-                    event(cnt, EVENT_IMAGE_PREVIEW, NULL, NULL, NULL, &cnt->current_image->timestamp_tv);
+                    image_event_preview(cnt);
                 }
                 cnt->imgs.preview_image.diffs = 0;
             }
@@ -2603,7 +2737,7 @@ static void mlp_timelapse(struct context *cnt)
                 event(cnt, EVENT_TIMELAPSE, cnt->current_image, NULL, NULL,
                     &cnt->current_image->timestamp_tv);
         }
-    } else if (cnt->ffmpeg_timelapse) {
+    } else if (cnt->timelapse_active) {
     /*
      * If timelapse movie is in progress but conf.timelapse_interval is zero then close timelapse file
      * This is an important feature that allows manual roll-over of timelapse file using the http
@@ -2701,6 +2835,8 @@ static void mlp_parmsupdate(struct context *cnt)
         if (cnt->conf.smart_mask_speed == 0) {
             memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
             memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
+            mask_span_free(cnt->imgs.smartmask_spans);
+            cnt->imgs.smartmask_spans = NULL;
         }
 
         cnt->smartmask_lastrate = cnt->lastrate;
@@ -2736,6 +2872,11 @@ static void mlp_frametiming(struct context *cnt)
     long int delay_time_nsec;
 
     /***** MOTION LOOP - FRAMERATE TIMING AND SLEEPING SECTION *****/
+    /* The capture stage thread sets the pace when there is one */
+    if (pipeline_capture_active(cnt)) {
+        return;
+    }
+
     /*
      * Work out expected frame rate based on config setting which may
      * have changed from http-control
@@ -2794,6 +2935,98 @@ static void mlp_frametiming(struct context *cnt)
 
 }
 
+/**
+ * mlp_capture_loop
+ *
+ *   Thread function for the capture stage.  Reads frames from the camera into
+ *   the pipeline buffers at the configured framerate while the motion loop
+ *   works on the previous ones.  When all buffers are waiting for the motion
+ *   loop, the capture waits as well.  The camera is only read here; after a
+ *   fatal error or a restart request the thread ends and the motion loop
+ *   closes or reopens the camera itself.
+ */
+static void *mlp_capture_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct pipeline *pl = cnt->pipeline;
+    struct image_data *img;
+    struct timeval tv1;
+    unsigned long long int timenow, deadline;
+    long int frame_time, delay_time_nsec;
+    int indx, retcd;
+
+    util_threadname_set("cp", cnt->threadnr, cnt->conf.camera_name);
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, _("Capture stage started"));
+
+    deadline = 0;
+
+    while (!pl->capture_stage.finish) {
+        indx = pipeline_capture_slot(cnt);
+        if (indx == -1) {
+            break;
+        }
+        img = &pl->capture[indx].img;
+
+        gettimeofday(&tv1, NULL);
+        if (cnt->video_dev >= 0) {
+            retcd = vid_next(cnt, img);
+        } else {
+            retcd = 1; /* Non fatal error */
+        }
+        img->timestamp_tv = tv1;
+
+        pipeline_capture_put(cnt, indx, retcd);
+
+        /* The motion loop closes the camera or restarts the thread */
+        if ((retcd < 0) || (retcd == NETCAM_RESTART_ERROR)) {
+            break;
+        }
+
+        if (cnt->conf.framerate) {
+            frame_time = 1000000L / cnt->conf.framerate;
+        } else {
+            frame_time = 0;
+        }
+
+        /*
+         * Sleep until the next frame is due.  Netcams decide the pace
+         * themselves so for them the time is counted from the last frame.
+         * When we are behind we start counting again from now rather than
+         * trying to catch up.
+         */
+        gettimeofday(&tv1, NULL);
+        timenow = tv1.tv_usec + 1000000L * tv1.tv_sec;
+        if ((deadline == 0) || (deadline + frame_time < timenow) ||
+            ((cnt->conf.netcam_url) && (retcd == 0))) {
+            deadline = timenow;
+        }
+        deadline += frame_time;
+
+        if (deadline > timenow) {
+            delay_time_nsec = (deadline - timenow) * 1000;
+            if (delay_time_nsec > 999999999) {
+                delay_time_nsec = 999999999;
+            }
+            SLEEP(0, delay_time_nsec);
+        }
+    }
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+        ,_("Capture stage finished: %lu frames, %lu waits for the motion loop")
+        ,pl->capture_frames, pl->capture_stalls);
+
+    pthread_mutex_lock(&global_lock);
+        threads_running--;
+    pthread_mutex_unlock(&global_lock);
+
+    pl->capture_stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
 /**
  * motion_loop
  *
@@ -2805,7 +3038,12 @@ static void *motion_loop(void *arg)
     struct context *cnt = arg;
 
     if (motion_init(cnt) == 0) {
+        pipeline_capture_start(cnt, mlp_capture_loop);
         while (!cnt->finish || cnt->event_stop) {
+            /* Wait for the capture stage when there is one */
+            if (pipeline_capture_wait(cnt) != 0) {
+                continue;
+            }
             mlp_prepare(cnt);
             if (cnt->get_image) {
                 mlp_resetimages(cnt);
@@ -2824,6 +3062,8 @@ static void *motion_loop(void *arg)
             mlp_snapshot(cnt);
             mlp_timelapse(cnt);
             mlp_loopback(cnt);
+            picture_writer_drain(cnt);
+            movie_encoder_drain(cnt);
             mlp_parmsupdate(cnt);
             mlp_frametiming(cnt);
         }
@@ -2954,6 +3194,8 @@ static void become_daemon(void)
 
 static void cntlist_create(int argc, char *argv[])
 {
+    int i;
+
     /*
      * cnt_list is an array of pointers to the context structures cnt for each thread.
      * First we reserve room for a pointer to thread 0's context structure
@@ -2983,6 +3225,13 @@ static void cntlist_create(int argc, char *argv[])
     cnt_list[0]->conf.argv = argv;
     cnt_list[0]->conf.argc = argc;
     cnt_list = conf_load(cnt_list);
+
+    /* The stream connections of a camera wait out the restarts of its thread */
+    for (i = 0; cnt_list[i] != NULL; i++) {
+        pthread_mutex_init(&cnt_list[i]->mutex_stream, NULL);
+        pthread_mutex_init(&cnt_list[i]->mutex_stages, NULL);
+        cnt_list[i]->stream_closed = TRUE;
+    }
 }
 
 static void motion_shutdown(void)
@@ -2993,6 +3242,12 @@ static void motion_shutdown(void)
 
     webu_stop(cnt_list);
 
+    dbse_writer_deinit(cnt_list);
+
+    spawner_deinit(cnt_list);
+
+    file_writer_deinit(cnt_list);
+
     while (cnt_list[++i]) {
         context_destroy(cnt_list[i]);
     }
@@ -3000,6 +3255,8 @@ static void motion_shutdown(void)
     free(cnt_list);
     cnt_list = NULL;
 
+    util_cache_free();
+
     vid_mutex_destroy();
 }
 
@@ -3209,6 +3466,12 @@ static void motion_startup(int daemonize, int argc, char *argv[])
 
     initialize_chars();
 
+    dbse_writer_init(cnt_list);
+
+    spawner_init(cnt_list);
+
+    file_writer_init(cnt_list);
+
     webu_start(cnt_list);
 
     vid_mutex_init();
@@ -29,6 +29,25 @@ struct images;
 struct image_data;
 struct rtsp_context;
 struct ffmpeg;
+struct pipeline;
+struct picture_writer;
+struct movie_encoder;
+struct jpeg_cache;
+struct stream_worker;
+struct stream_jpeg;
+struct webui_ctx;
+struct scale_ctx;
+struct mosaic;
+struct mosaic_tile;
+struct live;
+struct precap;
+struct frame_arena;
+struct mask_spans;
+struct dbse_writer;
+struct spawner;
+struct file_writer;
+struct draw_cache;
+struct file_out;
 
 #include "config.h"
 
@@ -263,6 +282,7 @@ struct image_data {
     int64_t        idnbr_high;
     struct timeval timestamp_tv;
     int shot;                   /* Sub second timestamp count */
+    unsigned long frame_id;     /* Number of the captured frame, 0 once its pixels were changed */
 
     /*
     * Movement center to img center distance
@@ -279,9 +299,15 @@ struct image_data {
 };
 
 struct stream_data {
-    unsigned char   *jpeg_data; /* Image compressed as JPG */
-    long            jpeg_size;  /* The number of bytes for jpg */
-    int             cnct_count; /* Counter of the number of connections */
+    struct stream_jpeg *jpeg;       /* Published image compressed as JPG.  See stream_jpeg.c */
+    struct stream_jpeg *buffers;    /* All the image buffers of the stream */
+    int             cnct_count;     /* Counter of the number of connections */
+    long long       due;            /* Earliest time in microseconds a client fetches the next image, 0 for none */
+    unsigned long   seq;            /* Sequence number of the published image */
+    int             width;          /* Size of the images, smaller than the camera for scaled streams */
+    int             height;
+    struct scale_ctx *scale;        /* Scaler of the camera images, NULL until first scaled */
+    unsigned char  *image;          /* Camera image scaled to the size of the stream */
 };
 
 /*
@@ -322,17 +348,23 @@ struct images {
     struct image_data image_virgin;   /* Last picture frame with no text or locate overlay */
     struct image_data image_vprvcy;   /* Virgin image with the privacy mask applied */
     struct image_data preview_image;  /* Picture buffer for best image when enables */
+    unsigned char *virgin_norm;       /* Own images of the three above.  They otherwise share */
+    unsigned char *vprvcy_norm;       /* the images of a frame of the ring, see image_writable */
+    unsigned char *preview_norm;
+    unsigned char *preview_high;
     unsigned char *mask;              /* Buffer for the mask file */
+    struct mask_spans *mask_spans;    /* Runs of the mask file, see mask_span.c */
+    struct mask_spans *mask_overlay_spans;   /* Pixels of the mask file drawn on the motion images */
     unsigned char *smartmask;
     unsigned char *smartmask_final;
+    struct mask_spans *smartmask_spans;      /* Pixels of smartmask_final drawn, NULL once it changed */
     unsigned char *common_buffer;
-    unsigned char *substream_image;
 
     unsigned char *mask_privacy;      /* Buffer for the privacy mask values */
-    unsigned char *mask_privacy_uv;   /* Buffer for the privacy U&V values */
+    struct mask_spans *mask_privacy_spans;   /* Runs of the privacy mask */
 
     unsigned char *mask_privacy_high;      /* Buffer for the privacy mask values */
-    unsigned char *mask_privacy_high_uv;   /* Buffer for the privacy U&V values */
+    struct mask_spans *mask_privacy_high_spans;
 
     int *smartmask_buffer;
     int *labels;
@@ -408,6 +440,17 @@ struct context {
     struct rtsp_context *rtsp_high;         /* this structure contains the context for high resolution RTSP connection */
 
     struct params_context *vdev;            /* Structure for v4l2 and bktr device information */
+    struct pipeline *pipeline;              /* Capture and output stage threads and queues */
+    struct picture_writer *picture_writer;  /* Threads compressing and writing pictures */
+    struct movie_encoder *movie_encoder;    /* Thread encoding the movies */
+    struct jpeg_cache *jpeg_cache;          /* Compressed images shared by the outputs */
+    struct stream_worker *stream_worker;    /* Thread compressing the stream images */
+    struct mosaic *mosaic;                  /* Stream of all the cameras.  Only on the first context */
+    struct mosaic_tile *mosaic_tile;        /* Image of this camera in the mosaic */
+    struct live *live;                      /* Pass-through packets streamed as fragmented MP4 */
+    struct precap *precap;                  /* Compressed pre-captured images */
+    struct frame_arena *frame_arena;        /* Image sized buffers of the camera */
+    struct draw_cache *draw_cache;          /* Texts put on every frame, see draw.c */
 
     struct image_data *current_image;       /* Pointer to a structure where the image, diffs etc is stored */
     unsigned int new_img;
@@ -446,12 +489,19 @@ struct context {
     int event_nr;
     int prev_event;
     unsigned long long database_event_id;
+    struct dbse_writer *dbse_writer;         /* Runs the queries of all the cameras, see dbse.c */
+    int dbse_open;                           /* The writer opened the connection of the camera */
+    unsigned long long dbse_event_id;        /* %{dbeventid} of the file names and commands, see dbse.c */
+    unsigned long dbse_event_seq;            /* The sql_query_start giving dbse_event_id */
+    struct spawner *spawner;                 /* Starts the on_* commands of all the cameras, see spawner.c */
+    struct file_writer *file_writer;         /* Writes the files of all the cameras, see file_writer.c */
     unsigned int lightswitch_framecounter;
     char text_event_string[PATH_MAX];        /* The text for conv. spec. %C - */
     int text_scale;
 
     int postcap;                             /* downcounter, frames left to to send post event */
     int shots;
+    unsigned long frame_id;                 /* Id given to the last captured frame */
     unsigned int detecting_motion;
     struct tm *currenttime_tm;
     struct tm *eventtime_tm;
@@ -509,6 +559,8 @@ struct context {
     char extpipefilename[PATH_MAX];
     char extpipecmdline[PATH_MAX];
     int movie_last_shot;
+    int movie_fillers;              /* Filler frames due before the detected image */
+    int timelapse_active;           /* Timelapse frames were raised since the last timelapse end */
 
     struct ffmpeg   *ffmpeg_output;
     struct ffmpeg   *ffmpeg_output_motion;
@@ -548,16 +600,26 @@ struct context {
 
     struct MHD_Daemon   *webcontrol_daemon;
     struct MHD_Daemon   *webstream_daemon;
+    int                 webstream_poll;     /* The stream daemon suspends connections waiting for images */
+    struct webui_ctx    *stream_waiters;    /* Suspended stream connections.  Guarded by mutex_stream */
+    struct webui_ctx    *stream_clients;    /* All the stream connections.  Guarded by mutex_stream */
+    volatile int        stream_closed;      /* No more connections may wait for images */
     char                webcontrol_digest_rand[8];
     char                webstream_digest_rand[8];
     int                 camera_id;
 
     pthread_mutex_t     mutex_stream;
+    pthread_mutex_t     mutex_stages;       /* Held while the stages above are set up or freed, see webu_status */
 
     struct stream_data  stream_norm;    /* Copy of the image to use for web stream*/
     struct stream_data  stream_sub;     /* Copy of the image to use for web stream*/
+    struct stream_data  stream_low;     /* Normal stream at a lower quality for slow clients */
+    struct stream_data  stream_quarter; /* Quarter size image to use for web stream */
+    struct stream_data  stream_thumb;   /* Thumbnail image to use for web stream */
     struct stream_data  stream_motion;  /* Copy of the image to use for web stream*/
     struct stream_data  stream_source;  /* Copy of the image to use for web stream*/
+    struct stream_data  stream_mosaic;  /* Images of all the cameras.  Only on the first context */
+    struct stream_data  stream_live;    /* Fragments of the live stream.  Only seq and cnct_count are used */
 
 
 };
@@ -569,5 +631,6 @@ extern FILE *ptr_logfile;
 /* TLS keys below */
 extern pthread_key_t tls_key_threadnr; /* key for thread number */
 void motion_remove_pid(void);
+void image_writable(struct context *cnt, struct image_data *img);
 
 #endif /* _INCLUDE_MOTION_H */
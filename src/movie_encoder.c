@@ -0,0 +1,1113 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      movie_encoder.c
+ *
+ *      Thread encoding the movies of a camera (movie_output,
+ *      movie_output_motion and the timelapse) so that the thread running
+ *      the event handlers only copies the frame.
+ *
+ *      The movies are still opened by the event handlers.  Frames, start time
+ *      resets and the close of a movie are queued as jobs and done by the
+ *      encoder thread in the order they were queued.  A frame is copied once
+ *      and the copy is shared by every job encoding it.  When all
+ *      movie_encoder_queue jobs are in use, frames are dropped and the movie
+ *      holds the previous frame until the next one.
+ *
+ *      Pass-through movies only copy packets and are written by the event
+ *      handlers as before.
+ *
+ *      While it has nothing to encode, the thread opens the encoders of the
+ *      next movie_output and movie_output_motion ahead of time (standby).  A
+ *      movie started with the same settings takes the standby and the
+ *      thread creates its file and writes its header before the first frame
+ *      while the event handlers carry on.  A movie with other settings has
+ *      its encoder opened by the event handlers and its file created by the
+ *      thread, and its settings are prepared for the next one.  Since the
+ *      files are always created by the thread, they are created after the
+ *      movies queued for closing before them.  The time from the event to
+ *      the first frame encoded and the time without frames encoded at a
+ *      rollover are kept with the statistics of the thread.
+ *
+ *      EVENT_FILECREATE of the movies created by the thread and
+ *      EVENT_FILECLOSE are raised by the thread running the event handlers
+ *      (see pipeline_output_owner) when it calls movie_encoder_drain.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "ffmpeg.h"
+#include "event.h"
+#include "pipeline.h"
+#include "movie_encoder.h"
+
+/* Whether the jobs of the movie are done by the encoder thread */
+static int movie_encoder_use(struct movie_encoder *me, struct ffmpeg *ffmpeg)
+{
+    return ((me != NULL) && (!me->finish) && (!ffmpeg->passthrough));
+}
+
+/* Find a free job.  Called with the mutex held */
+static int movie_encoder_free(struct movie_encoder *me)
+{
+    int indx;
+
+    for (indx = 0; indx < me->depth; indx++) {
+        if (me->jobs[indx].state == MOVIE_JOB_FREE) {
+            return indx;
+        }
+    }
+    return -1;
+}
+
+/**
+ * movie_encoder_claim
+ *
+ *   Claim a free job.  When the queue is full, frames are dropped and the
+ *   other jobs wait for the encoder.
+ *
+ * Returns the job index or -1 when the frame was dropped.
+ */
+static int movie_encoder_claim(struct context *cnt, int may_drop)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct timespec ts;
+    int indx;
+
+    pthread_mutex_lock(&me->mutex);
+        indx = movie_encoder_free(me);
+        while (indx == -1) {
+            if (may_drop) {
+                me->dropped++;
+                pthread_mutex_unlock(&me->mutex);
+                if ((me->dropped % 100) == 1) {
+                    MOTION_LOG(WRN, TYPE_ENCODER, NO_ERRNO
+                        ,_("Movie encoder is behind, %lu frames dropped so far")
+                        ,me->dropped);
+                }
+                return -1;
+            }
+
+            /* Closed movies only give back their job once their event is raised */
+            pthread_mutex_unlock(&me->mutex);
+            movie_encoder_drain(cnt);
+            pthread_mutex_lock(&me->mutex);
+
+            indx = movie_encoder_free(me);
+            if ((indx == -1) && (me->done_count == 0)) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec++;
+                pthread_cond_timedwait(&me->cond_done, &me->mutex, &ts);
+            }
+        }
+        me->jobs[indx].state = MOVIE_JOB_QUEUED;
+        me->jobs[indx].frame = -1;
+        me->jobs[indx].fillers = 0;
+        me->jobs[indx].failed = FALSE;
+        me->pending++;
+        if (me->pending > me->pending_max) {
+            me->pending_max = me->pending;
+        }
+    pthread_mutex_unlock(&me->mutex);
+
+    return indx;
+}
+
+/* Hand a claimed job to the encoder thread */
+static void movie_encoder_queue(struct movie_encoder *me, int indx, struct ffmpeg *ffmpeg
+        , enum MOVIE_JOB_TYPE type, struct timeval *tv1)
+{
+    struct movie_job *job = &me->jobs[indx];
+
+    job->type = type;
+    job->ffmpeg = ffmpeg;
+    job->tv = *tv1;
+    gettimeofday(&job->queued_tv, NULL);
+
+    pthread_mutex_lock(&me->mutex);
+        if ((type == MOVIE_JOB_OPEN) || (type == MOVIE_JOB_CLOSE)) {
+            me->closing++;
+        }
+        me->queued[(me->queued_head + me->queued_count) % me->depth] = indx;
+        me->queued_count++;
+        pthread_cond_signal(&me->cond_work);
+    pthread_mutex_unlock(&me->mutex);
+}
+
+/**
+ * movie_encoder_frame
+ *
+ *   Get the copy of the plane of img_data that the movie reads.  A frame
+ *   already queued for another movie is shared instead of copied again.
+ *
+ * Returns the frame index.
+ */
+static int movie_encoder_frame(struct context *cnt, struct ffmpeg *ffmpeg, struct image_data *img_data)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct movie_frame *frame;
+    const unsigned char *source;
+    int indx, size;
+
+    if (ffmpeg->high_resolution) {
+        source = img_data->image_high;
+        size = cnt->imgs.size_high;
+    } else {
+        source = img_data->image_norm;
+        size = cnt->imgs.size_norm;
+    }
+
+    pthread_mutex_lock(&me->mutex);
+        for (indx = 0; indx < me->depth; indx++) {
+            frame = &me->frames[indx];
+            if ((frame->refcnt > 0) && (frame->source == source) &&
+                (frame->img.shot == img_data->shot) &&
+                (frame->img.timestamp_tv.tv_sec == img_data->timestamp_tv.tv_sec) &&
+                (frame->img.timestamp_tv.tv_usec == img_data->timestamp_tv.tv_usec)) {
+                frame->refcnt++;
+                me->shared++;
+                pthread_mutex_unlock(&me->mutex);
+                return indx;
+            }
+        }
+        /* There are never more frames in use than jobs so one is free */
+        for (indx = 0; indx < me->depth; indx++) {
+            if (me->frames[indx].refcnt == 0) {
+                break;
+            }
+        }
+        frame = &me->frames[indx];
+        frame->refcnt = 1;
+    pthread_mutex_unlock(&me->mutex);
+
+    if (frame->image == NULL) {
+        frame->image = mymalloc(me->size_image);
+    }
+    memcpy(frame->image, source, size);
+
+    memcpy(&frame->img, img_data, sizeof(struct image_data));
+    if (ffmpeg->high_resolution) {
+        frame->img.image_norm = NULL;
+        frame->img.image_high = frame->image;
+    } else {
+        frame->img.image_norm = frame->image;
+        frame->img.image_high = NULL;
+    }
+    frame->source = source;
+
+    return indx;
+}
+
+/* Milliseconds from tv_from to tv_to */
+static long movie_encoder_msec(const struct timeval *tv_from, const struct timeval *tv_to)
+{
+    return ((tv_to->tv_sec - tv_from->tv_sec) * 1000L) +
+        ((tv_to->tv_usec - tv_from->tv_usec) / 1000L);
+}
+
+/* Keep the time without frames encoded at a rollover.  Called with the mutex held */
+static void movie_encoder_gap_add(struct movie_encoder *me, long msec)
+{
+    me->rollover_count++;
+    me->rollover_last = msec;
+    me->rollover_total += msec;
+    if (msec > me->rollover_max) {
+        me->rollover_max = msec;
+    }
+}
+
+/**
+ * movie_encoder_first
+ *
+ *   Keep the start or rollover time of the movie when its first frame was
+ *   encoded at tv_done.  Called with the mutex held.
+ *
+ * Returns the milliseconds or -1 when it was not the first frame.
+ */
+static long movie_encoder_first(struct movie_encoder *me, struct ffmpeg *ffmpeg
+        , const struct timeval *tv_done, int *rollover)
+{
+    struct movie_start *start;
+    long msec;
+    int indx;
+
+    for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+        start = &me->starts[indx];
+        if (start->ffmpeg != ffmpeg) {
+            continue;
+        }
+        start->ffmpeg = NULL;
+        *rollover = start->rollover;
+
+        if (start->rollover) {
+            /* The previous movies were written up to the last frame encoded */
+            if (me->put_tv.tv_sec == 0) {
+                return -1;
+            }
+            msec = movie_encoder_msec(&me->put_tv, tv_done);
+            movie_encoder_gap_add(me, msec);
+        } else {
+            msec = movie_encoder_msec(&start->event_tv, tv_done);
+            me->start_count++;
+            me->start_last = msec;
+            me->start_total += msec;
+            if (msec > me->start_max) {
+                me->start_max = msec;
+            }
+        }
+        return msec;
+    }
+
+    return -1;
+}
+
+/* Forget the movie being closed before any frame was encoded.  Called with the mutex held */
+static void movie_encoder_untrack(struct movie_encoder *me, struct ffmpeg *ffmpeg)
+{
+    int indx;
+
+    for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+        if (me->starts[indx].ffmpeg == ffmpeg) {
+            me->starts[indx].ffmpeg = NULL;
+        }
+    }
+}
+
+/* Do one job.  Runs on the encoder thread */
+static void movie_encoder_work(struct context *cnt, struct movie_job *job)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct timeval tv_done;
+    long latency, first;
+    int rollover;
+
+    if (job->type == MOVIE_JOB_OPEN) {
+        if (ffmpeg_open_file(job->ffmpeg) < 0) {
+            job->failed = TRUE;
+        }
+
+    } else if (job->type == MOVIE_JOB_PUT) {
+        /* Frames of a movie whose file could not be created are dropped */
+        if (!ffmpeg_is_open(job->ffmpeg)) {
+            job->ffmpeg = NULL;
+            return;
+        }
+
+        if (ffmpeg_put_image(job->ffmpeg, &me->frames[job->frame].img, &job->tv, job->fillers) == -1) {
+            MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO, _("Error encoding image"));
+        }
+
+        gettimeofday(&tv_done, NULL);
+        latency = movie_encoder_msec(&job->queued_tv, &tv_done);
+
+        rollover = FALSE;
+        pthread_mutex_lock(&me->mutex);
+            me->encoded++;
+            me->fillers += job->fillers;
+            me->latency_last = latency;
+            me->latency_total += latency;
+            if (latency > me->latency_max) {
+                me->latency_max = latency;
+            }
+            first = movie_encoder_first(me, job->ffmpeg, &tv_done, &rollover);
+            me->put_tv = tv_done;
+        pthread_mutex_unlock(&me->mutex);
+
+        if ((first >= 0) && rollover) {
+            MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
+                ,_("Movie rolled over with %ld ms between frames encoded"), first);
+        } else if (first >= 0) {
+            MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
+                ,_("First frame of the movie encoded %ld ms after the event"), first);
+        }
+
+    } else if (job->type == MOVIE_JOB_RESET) {
+        if (ffmpeg_is_open(job->ffmpeg)) {
+            ffmpeg_reset_movie_start_time(job->ffmpeg, &job->tv);
+        }
+
+    } else {
+        if (!ffmpeg_is_open(job->ffmpeg)) {
+            job->failed = TRUE;
+        }
+        pthread_mutex_lock(&me->mutex);
+            movie_encoder_untrack(me, job->ffmpeg);
+        pthread_mutex_unlock(&me->mutex);
+
+        ffmpeg_close(job->ffmpeg);
+        free(job->ffmpeg);
+    }
+    job->ffmpeg = NULL;
+}
+
+/* Take the settings of the movie for the standby.  Called with the mutex held */
+static void movie_encoder_settings(struct movie_standby *sb, const struct ffmpeg *ffmpeg)
+{
+    if (strlen(ffmpeg->codec_name) >= sizeof(sb->codec)) {
+        sb->width = 0;
+    } else {
+        sb->width = ffmpeg->width;
+    }
+    sb->height = ffmpeg->height;
+    sb->fps = ffmpeg->fps;
+    sb->bps = ffmpeg->bps;
+    sb->quality = ffmpeg->quality;
+    sb->high_resolution = ffmpeg->high_resolution;
+    snprintf(sb->codec, sizeof(sb->codec), "%s", ffmpeg->codec_name);
+    sb->failed = FALSE;
+    sb->gen++;
+}
+
+/* Whether the standby was prepared with the settings of the movie.  Called with the mutex held */
+static int movie_encoder_match(const struct movie_standby *sb, const struct ffmpeg *ffmpeg)
+{
+    return ((sb->width > 0) &&
+            (sb->width == ffmpeg->width) && (sb->height == ffmpeg->height) &&
+            (sb->fps == ffmpeg->fps) && (sb->bps == ffmpeg->bps) &&
+            (sb->quality == ffmpeg->quality) &&
+            (sb->high_resolution == ffmpeg->high_resolution) &&
+            mystreq(sb->codec, ffmpeg->codec_name));
+}
+
+/* Standby the encoder thread should prepare or -1.  Called with the mutex held */
+static int movie_encoder_want(struct movie_encoder *me)
+{
+    struct movie_standby *sb;
+    int indx;
+
+    if (me->finish) {
+        return -1;
+    }
+    for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+        sb = &me->standby[indx];
+        if ((sb->width > 0) && (sb->ffmpeg == NULL) && (!sb->busy) && (!sb->failed)) {
+            return indx;
+        }
+    }
+    return -1;
+}
+
+/**
+ * movie_encoder_prepare
+ *
+ *   Open the encoder of the standby.  The movie is set up like the ones of
+ *   the events with the frame rate and codec of the standby.  Runs on the
+ *   encoder thread and is called with the mutex held, which is released
+ *   while the encoder opens.
+ */
+static void movie_encoder_prepare(struct context *cnt, int indx)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct movie_standby *sb = &me->standby[indx];
+    struct ffmpeg *ffmpeg;
+    unsigned int gen;
+
+    sb->busy = TRUE;
+    gen = sb->gen;
+    memcpy(sb->codec_prep, sb->codec, sizeof(sb->codec_prep));
+    sb->ext[0] = '\0';
+
+    ffmpeg = mymalloc(sizeof(struct ffmpeg));
+    ffmpeg_movie_init(ffmpeg, cnt, (indx == MOVIE_STANDBY_MOTION), sb->fps
+        , sb->codec_prep, sb->ext, NULL);
+
+    pthread_mutex_unlock(&me->mutex);
+
+    if (ffmpeg_prepare(ffmpeg) < 0) {
+        MOTION_LOG(WRN, TYPE_ENCODER, NO_ERRNO
+            ,_("Could not open the encoder of the next movie ahead of time"));
+        ffmpeg_discard(ffmpeg);
+        free(ffmpeg);
+        ffmpeg = NULL;
+    }
+
+    pthread_mutex_lock(&me->mutex);
+
+    sb->busy = FALSE;
+    if (ffmpeg == NULL) {
+        /* Not tried again until the settings change */
+        if (gen == sb->gen) {
+            sb->failed = TRUE;
+        }
+    } else if ((gen != sb->gen) || (me->finish)) {
+        /* The settings changed while the encoder was opened */
+        pthread_mutex_unlock(&me->mutex);
+        ffmpeg_discard(ffmpeg);
+        free(ffmpeg);
+        pthread_mutex_lock(&me->mutex);
+    } else {
+        sb->ffmpeg = ffmpeg;
+    }
+}
+
+/**
+ * movie_encoder_loop
+ *
+ *   Thread function of the encoder.  Does the jobs in the order they were
+ *   queued and hands the opened and closed movies back.  Prepares the
+ *   standby movies when there is nothing else to do.
+ */
+static void *movie_encoder_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct movie_job *job;
+    int indx;
+
+    util_threadname_set("me", cnt->threadnr, cnt->conf.camera_name);
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    pthread_mutex_lock(&me->mutex);
+        while (TRUE) {
+            while ((me->queued_count == 0) && (!me->finish) && (movie_encoder_want(me) == -1)) {
+                pthread_cond_wait(&me->cond_work, &me->mutex);
+            }
+            if (me->queued_count == 0) {
+                if (me->finish) {
+                    break;
+                }
+                /* Nothing to encode, open the encoder of the next movie */
+                movie_encoder_prepare(cnt, movie_encoder_want(me));
+                continue;
+            }
+
+            indx = me->queued[me->queued_head];
+            me->queued_head = (me->queued_head + 1) % me->depth;
+            me->queued_count--;
+
+            job = &me->jobs[indx];
+            job->state = MOVIE_JOB_BUSY;
+
+            pthread_mutex_unlock(&me->mutex);
+
+            movie_encoder_work(cnt, job);
+
+            pthread_mutex_lock(&me->mutex);
+
+            if (job->frame != -1) {
+                me->frames[job->frame].refcnt--;
+                job->frame = -1;
+            }
+            if ((job->type == MOVIE_JOB_OPEN) || (job->type == MOVIE_JOB_CLOSE)) {
+                job->state = MOVIE_JOB_DONE;
+                me->done[(me->done_head + me->done_count) % me->depth] = indx;
+                me->done_count++;
+            } else {
+                job->state = MOVIE_JOB_FREE;
+                me->pending--;
+            }
+            pthread_cond_broadcast(&me->cond_done);
+        }
+    pthread_mutex_unlock(&me->mutex);
+
+    pthread_mutex_lock(&global_lock);
+        threads_running--;
+    pthread_mutex_unlock(&global_lock);
+
+    me->stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/* Keep what the event of an open or close job is raised with by movie_encoder_drain */
+static void movie_encoder_event(struct context *cnt, struct movie_job *job
+        , const char *filename, long filetype)
+{
+    struct pipe_view view;
+
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    job->filetype = filetype;
+
+    /* Keep the values for the conversion specifiers of the commands */
+    pipeline_view(cnt, &view);
+    memcpy(&job->img, view.image, sizeof(struct image_data));
+    job->img.image_norm = NULL;
+    job->img.image_high = NULL;
+    snprintf(job->text_event, sizeof(job->text_event), "%s", view.text_event);
+
+    job->view = view;
+    job->view.image = &job->img;
+    job->view.image_motion = NULL;
+    job->view.text_event = job->text_event;
+}
+
+/* Keep the movie until its first frame is encoded for the start and rollover times */
+static void movie_encoder_track(struct movie_encoder *me, struct ffmpeg *ffmpeg
+        , struct timeval *tv1, int rollover)
+{
+    int indx;
+
+    pthread_mutex_lock(&me->mutex);
+        for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+            if (me->starts[indx].ffmpeg == NULL) {
+                me->starts[indx].ffmpeg = ffmpeg;
+                me->starts[indx].event_tv = *tv1;
+                me->starts[indx].rollover = rollover;
+                break;
+            }
+        }
+    pthread_mutex_unlock(&me->mutex);
+}
+
+/**
+ * movie_encoder_open
+ *
+ *   Open the movie set up in *ffmpeg (movie_output or movie_output_motion).
+ *   When the standby was prepared with the same settings, *ffmpeg is
+ *   replaced by the standby.  Otherwise the encoder of the movie is opened
+ *   right away and the standby is prepared with its settings for the next
+ *   movie.  Either way the file is created by the encoder thread after the
+ *   jobs queued before, which raises EVENT_FILECREATE with filetype once it
+ *   exists (0 for no event).  The extension of the container is appended to
+ *   the file name of the movie.  rollover is TRUE when the movie follows one
+ *   that reached movie_max_time.
+ *
+ * Returns MOVIE_ENCODER_QUEUED, MOVIE_ENCODER_FAILED or MOVIE_ENCODER_NONE
+ * when the caller must open the movie itself.
+ */
+int movie_encoder_open(struct context *cnt, struct ffmpeg **ffmpeg, long filetype
+        , struct timeval *tv1, int rollover)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct movie_standby *sb;
+    struct ffmpeg *want, *standby, *discard;
+    char ext[PATH_MAX], *filename;
+    int indx;
+
+    want = *ffmpeg;
+    if ((!movie_encoder_use(me, want)) || (want->tlapse != TIMELAPSE_NONE)) {
+        return MOVIE_ENCODER_NONE;
+    }
+
+    if (want->motion_images) {
+        sb = &me->standby[MOVIE_STANDBY_MOTION];
+    } else {
+        sb = &me->standby[MOVIE_STANDBY_OUTPUT];
+    }
+
+    standby = NULL;
+    discard = NULL;
+    pthread_mutex_lock(&me->mutex);
+        if (movie_encoder_match(sb, want)) {
+            if ((sb->ffmpeg != NULL) && (ffmpeg_set_filename(sb->ffmpeg, want->filename) == 0)) {
+                standby = sb->ffmpeg;
+                standby->codec_name = want->codec_name;
+                sb->ffmpeg = NULL;
+                /* Prepare the next one */
+                pthread_cond_signal(&me->cond_work);
+            }
+        } else {
+            /* Prepare the movies with these settings from now on */
+            discard = sb->ffmpeg;
+            sb->ffmpeg = NULL;
+            movie_encoder_settings(sb, want);
+            pthread_cond_signal(&me->cond_work);
+        }
+        if (standby != NULL) {
+            me->standby_used++;
+        } else {
+            me->standby_missed++;
+        }
+    pthread_mutex_unlock(&me->mutex);
+
+    if (discard != NULL) {
+        ffmpeg_discard(discard);
+        free(discard);
+    }
+
+    if (standby == NULL) {
+        /* Open the encoder here and leave the file to the encoder thread */
+        filename = want->filename;
+        ext[0] = '\0';
+        want->filename = ext;
+        if ((ffmpeg_prepare(want) < 0) || (ffmpeg_set_filename(want, filename) < 0)) {
+            ffmpeg_discard(want);
+            return MOVIE_ENCODER_FAILED;
+        }
+    } else {
+        /* The prepared encoder starts with the first image of this movie */
+        ffmpeg_movie_start(standby, tv1);
+        free(want);
+        *ffmpeg = standby;
+    }
+
+    indx = movie_encoder_claim(cnt, FALSE);
+    movie_encoder_event(cnt, &me->jobs[indx], (*ffmpeg)->filename, filetype);
+    movie_encoder_queue(me, indx, *ffmpeg, MOVIE_JOB_OPEN, tv1);
+
+    movie_encoder_track(me, *ffmpeg, tv1, rollover);
+
+    return MOVIE_ENCODER_QUEUED;
+}
+
+/**
+ * movie_encoder_active
+ *
+ *   Whether the movie is encoded by the encoder thread.
+ */
+int movie_encoder_active(struct context *cnt, struct ffmpeg *ffmpeg)
+{
+    return ((ffmpeg != NULL) && movie_encoder_use(cnt->movie_encoder, ffmpeg) &&
+            (ffmpeg->tlapse == TIMELAPSE_NONE));
+}
+
+/**
+ * movie_encoder_gap
+ *
+ *   Keep the time without frames at a rollover of a movie written by the
+ *   event handlers, which closed the previous movie and opened the next.
+ */
+void movie_encoder_gap(struct context *cnt, long msec)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+
+    if (me != NULL) {
+        pthread_mutex_lock(&me->mutex);
+            movie_encoder_gap_add(me, msec);
+        pthread_mutex_unlock(&me->mutex);
+    }
+
+    MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
+        ,_("Movie rolled over with %ld ms between frames encoded"), msec);
+}
+
+/**
+ * movie_encoder_put
+ *
+ *   Queue a frame of the movie for the encoder thread along with the number
+ *   of filler frames to add before it.  The frame is copied so the caller may
+ *   reuse it right away.
+ *
+ * Returns MOVIE_ENCODER_QUEUED, MOVIE_ENCODER_DROPPED or MOVIE_ENCODER_NONE
+ * when the caller must encode the frame itself.
+ */
+int movie_encoder_put(struct context *cnt, struct ffmpeg *ffmpeg, struct image_data *img_data
+        , struct timeval *tv1, int fillers)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    int indx;
+
+    if (!movie_encoder_use(me, ffmpeg)) {
+        return MOVIE_ENCODER_NONE;
+    }
+
+    indx = movie_encoder_claim(cnt, TRUE);
+    if (indx == -1) {
+        return MOVIE_ENCODER_DROPPED;
+    }
+
+    me->jobs[indx].frame = movie_encoder_frame(cnt, ffmpeg, img_data);
+    me->jobs[indx].fillers = fillers;
+
+    movie_encoder_queue(me, indx, ffmpeg, MOVIE_JOB_PUT, tv1);
+
+    return MOVIE_ENCODER_QUEUED;
+}
+
+/**
+ * movie_encoder_reset
+ *
+ *   Queue a reset of the start time of the movie after its queued frames.
+ *
+ * Returns MOVIE_ENCODER_QUEUED or MOVIE_ENCODER_NONE when the caller must
+ * reset the start time itself.
+ */
+int movie_encoder_reset(struct context *cnt, struct ffmpeg *ffmpeg, struct timeval *tv1)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    int indx;
+
+    if (!movie_encoder_use(me, ffmpeg)) {
+        return MOVIE_ENCODER_NONE;
+    }
+
+    indx = movie_encoder_claim(cnt, FALSE);
+    movie_encoder_queue(me, indx, ffmpeg, MOVIE_JOB_RESET, tv1);
+
+    return MOVIE_ENCODER_QUEUED;
+}
+
+/**
+ * movie_encoder_close
+ *
+ *   Queue the close of the movie after its queued frames.  The encoder thread
+ *   frees ffmpeg once the movie is closed and EVENT_FILECLOSE is raised with
+ *   filename and filetype by movie_encoder_drain.
+ *
+ * Returns MOVIE_ENCODER_QUEUED or MOVIE_ENCODER_NONE when the caller must
+ * close the movie itself.
+ */
+int movie_encoder_close(struct context *cnt, struct ffmpeg *ffmpeg, const char *filename
+        , long filetype, struct timeval *tv1)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    int indx;
+
+    if (!movie_encoder_use(me, ffmpeg)) {
+        return MOVIE_ENCODER_NONE;
+    }
+
+    indx = movie_encoder_claim(cnt, FALSE);
+    movie_encoder_event(cnt, &me->jobs[indx], filename, filetype);
+    movie_encoder_queue(me, indx, ffmpeg, MOVIE_JOB_CLOSE, tv1);
+
+    return MOVIE_ENCODER_QUEUED;
+}
+
+/**
+ * movie_encoder_drain
+ *
+ *   Raise EVENT_FILECREATE and EVENT_FILECLOSE for the movies opened and
+ *   closed since the last call and give their jobs back.  Does nothing
+ *   unless called by the thread running the event handlers.
+ */
+void movie_encoder_drain(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct movie_job *job;
+    const struct pipe_view *prev;
+    int indx;
+
+    if ((me == NULL) || (!pipeline_output_owner(cnt))) {
+        return;
+    }
+
+    pthread_mutex_lock(&me->mutex);
+        while (me->done_count > 0) {
+            indx = me->done[me->done_head];
+            me->done_head = (me->done_head + 1) % me->depth;
+            me->done_count--;
+
+            job = &me->jobs[indx];
+
+            pthread_mutex_unlock(&me->mutex);
+
+            /* No events for a movie whose file could not be created */
+            if ((!job->failed) && (job->filetype != 0)) {
+                prev = pipeline_view_bind(&job->view);
+                event(cnt, (job->type == MOVIE_JOB_OPEN) ? EVENT_FILECREATE : EVENT_FILECLOSE
+                    , NULL, job->filename, (void *)job->filetype, &job->tv);
+                pipeline_view_bind(prev);
+            }
+
+            pthread_mutex_lock(&me->mutex);
+
+            job->state = MOVIE_JOB_FREE;
+            me->pending--;
+            me->closing--;
+        }
+    pthread_mutex_unlock(&me->mutex);
+}
+
+/**
+ * movie_encoder_flush
+ *
+ *   Wait until all queued jobs are done and the events of the closed movies
+ *   raised.  Gives up when the encoder makes no progress for 10 seconds.
+ */
+void movie_encoder_flush(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct timespec ts;
+    int wait_counter;
+
+    if ((me == NULL) || (!pipeline_output_owner(cnt))) {
+        return;
+    }
+
+    wait_counter = 0;
+    movie_encoder_drain(cnt);
+
+    pthread_mutex_lock(&me->mutex);
+        while ((me->pending > 0) && (wait_counter < 10)) {
+            if (me->done_count == 0) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec++;
+                if (pthread_cond_timedwait(&me->cond_done, &me->mutex, &ts) == ETIMEDOUT) {
+                    wait_counter++;
+                    continue;
+                }
+            }
+            wait_counter = 0;
+            pthread_mutex_unlock(&me->mutex);
+            movie_encoder_drain(cnt);
+            pthread_mutex_lock(&me->mutex);
+        }
+    pthread_mutex_unlock(&me->mutex);
+
+    if (wait_counter >= 10) {
+        MOTION_LOG(ERR, TYPE_ENCODER, NO_ERRNO
+            ,_("Movie encoder did not finish, %d jobs lost"), me->pending);
+    }
+}
+
+/* Number of jobs queued or being encoded */
+int movie_encoder_pending(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    int pending;
+
+    if (me == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&me->mutex);
+        pending = me->pending;
+    pthread_mutex_unlock(&me->mutex);
+
+    return pending;
+}
+
+/* Number of movies being opened or closed whose event is not yet raised */
+int movie_encoder_closing(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    int closing;
+
+    if (me == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&me->mutex);
+        closing = me->closing;
+    pthread_mutex_unlock(&me->mutex);
+
+    return closing;
+}
+
+/* Average milliseconds from queuing a frame to having it encoded */
+long movie_encoder_latency(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    long latency;
+
+    if (me == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&me->mutex);
+        if (me->encoded > 0) {
+            latency = (long)(me->latency_total / me->encoded);
+        } else {
+            latency = 0;
+        }
+    pthread_mutex_unlock(&me->mutex);
+
+    return latency;
+}
+
+/**
+ * movie_encoder_standby_init
+ *
+ *   Settings of the first standby movies from the configuration and the
+ *   frame rate measured.  movie_encoder_rate follows the rate afterwards.
+ */
+static void movie_encoder_standby_init(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct ffmpeg want;
+    int fps;
+
+    if ((cnt->conf.movie_codec == NULL) ||
+        mystreq(cnt->conf.movie_codec, "test") ||
+        mystreq(cnt->conf.movie_codec, "ogg")) {
+        return;
+    }
+
+    memset(&want, 0, sizeof(want));
+    fps = event_movie_fps(cnt);
+
+    if (cnt->conf.movie_output && !util_check_passthrough(cnt)) {
+        ffmpeg_movie_init(&want, cnt, FALSE, fps, cnt->conf.movie_codec, NULL, NULL);
+        movie_encoder_settings(&me->standby[MOVIE_STANDBY_OUTPUT], &want);
+    }
+
+    if (cnt->conf.movie_output_motion) {
+        ffmpeg_movie_init(&want, cnt, TRUE, fps, cnt->conf.movie_codec, NULL, NULL);
+        movie_encoder_settings(&me->standby[MOVIE_STANDBY_MOTION], &want);
+    }
+}
+
+/**
+ * movie_encoder_rate
+ *
+ *   Called by the motion loop each second.  The movies take the frame rate
+ *   measured when they start, so the standby movies prepared with another
+ *   rate are prepared again with the new one.
+ */
+void movie_encoder_rate(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    struct movie_standby *sb;
+    struct ffmpeg *discard[MOVIE_STANDBY_COUNT];
+    int indx, fps;
+
+    if (me == NULL) {
+        return;
+    }
+
+    fps = event_movie_fps(cnt);
+
+    pthread_mutex_lock(&me->mutex);
+        for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+            sb = &me->standby[indx];
+            discard[indx] = NULL;
+            if ((sb->width > 0) && (sb->fps != fps)) {
+                discard[indx] = sb->ffmpeg;
+                sb->ffmpeg = NULL;
+                sb->fps = fps;
+                sb->failed = FALSE;
+                sb->gen++;
+                pthread_cond_signal(&me->cond_work);
+            }
+        }
+    pthread_mutex_unlock(&me->mutex);
+
+    for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+        if (discard[indx] != NULL) {
+            ffmpeg_discard(discard[indx]);
+            free(discard[indx]);
+        }
+    }
+}
+
+/**
+ * movie_encoder_init
+ *
+ *   Start the encoder thread.  Called once the image sizes are known and
+ *   before the output stage is started.
+ */
+int movie_encoder_init(struct context *cnt)
+{
+    struct movie_encoder *me;
+
+    cnt->movie_encoder = NULL;
+
+    if (cnt->conf.movie_encoder_queue <= 0) {
+        return 0;
+    }
+
+    me = mymalloc(sizeof(struct movie_encoder));
+
+    me->depth = cnt->conf.movie_encoder_queue;
+
+    me->size_image = cnt->imgs.size_norm;
+    if (cnt->imgs.size_high > me->size_image) {
+        me->size_image = cnt->imgs.size_high;
+    }
+
+    me->jobs = mymalloc(me->depth * sizeof(struct movie_job));
+    me->frames = mymalloc(me->depth * sizeof(struct movie_frame));
+    me->queued = mymalloc(me->depth * sizeof(int));
+    me->done = mymalloc(me->depth * sizeof(int));
+    me->stage.finished = TRUE;
+
+    pthread_mutex_init(&me->mutex, NULL);
+    pthread_cond_init(&me->cond_work, NULL);
+    pthread_cond_init(&me->cond_done, NULL);
+
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->movie_encoder = me;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    movie_encoder_standby_init(cnt);
+
+    if (pipeline_stage_start(cnt, &me->stage, movie_encoder_loop) != 0) {
+        /* Encode the movies in the event handlers as before */
+        movie_encoder_deinit(cnt);
+        return -1;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Movie encoder queue %d"), me->depth);
+
+    return 0;
+}
+
+/**
+ * movie_encoder_deinit
+ *
+ *   Encode the queued frames, close the movies, stop the encoder thread
+ *   and free the queue.
+ */
+void movie_encoder_deinit(struct context *cnt)
+{
+    struct movie_encoder *me = cnt->movie_encoder;
+    int indx;
+
+    if (me == NULL) {
+        return;
+    }
+
+    movie_encoder_flush(cnt);
+
+    pthread_mutex_lock(&me->mutex);
+        me->finish = TRUE;
+        pthread_cond_broadcast(&me->cond_work);
+    pthread_mutex_unlock(&me->mutex);
+
+    pipeline_stage_stop(cnt, &me->stage, NULL);
+
+    /* The web status reads the counters until this is cleared */
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->movie_encoder = NULL;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    if (me->encoded > 0) {
+        MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
+            ,_("Movie encoder finished: %lu frames, %lu fillers, %lu shared, %lu dropped"
+               ", largest queue %d, latency average %ld ms maximum %ld ms")
+            ,me->encoded, me->fillers, me->shared, me->dropped, me->pending_max
+            ,(long)(me->latency_total / me->encoded), me->latency_max);
+    }
+    if ((me->standby_used + me->standby_missed) > 0) {
+        MOTION_LOG(INF, TYPE_ENCODER, NO_ERRNO
+            ,_("Movies started: %lu from standby, %lu opened by the events"
+               ", first frame average %ld ms maximum %ld ms"
+               ", %lu rollovers average %ld ms maximum %ld ms")
+            ,me->standby_used, me->standby_missed
+            ,(me->start_count > 0) ? (long)(me->start_total / me->start_count) : 0L
+            ,me->start_max, me->rollover_count
+            ,(me->rollover_count > 0) ? (long)(me->rollover_total / me->rollover_count) : 0L
+            ,me->rollover_max);
+    }
+
+    for (indx = 0; indx < MOVIE_STANDBY_COUNT; indx++) {
+        if (me->standby[indx].ffmpeg != NULL) {
+            ffmpeg_discard(me->standby[indx].ffmpeg);
+            free(me->standby[indx].ffmpeg);
+            me->standby[indx].ffmpeg = NULL;
+        }
+    }
+
+    for (indx = 0; indx < me->depth; indx++) {
+        free(me->frames[indx].image);
+    }
+    free(me->frames);
+    free(me->jobs);
+    free(me->queued);
+    free(me->done);
+
+    pthread_mutex_destroy(&me->mutex);
+    pthread_cond_destroy(&me->cond_work);
+    pthread_cond_destroy(&me->cond_done);
+
+    free(me);
+}
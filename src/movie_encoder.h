@@ -0,0 +1,160 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      movie_encoder.h
+ *
+ *      Headers associated with functions in the movie_encoder.c module.
+ *      The files event.h and pipeline.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_MOVIE_ENCODER_H
+#define _INCLUDE_MOVIE_ENCODER_H
+
+struct ffmpeg;
+
+#define MOVIE_ENCODER_QUEUED    0   /* The encoder thread will do the work */
+#define MOVIE_ENCODER_DROPPED   1   /* Queue was full, the frame is not in the movie */
+#define MOVIE_ENCODER_NONE      -1  /* No encoder thread for this movie, the caller must do the work */
+#define MOVIE_ENCODER_FAILED    -2  /* The movie could not be opened */
+
+#define MOVIE_STANDBY_OUTPUT    0   /* Standby of movie_output */
+#define MOVIE_STANDBY_MOTION    1   /* Standby of movie_output_motion */
+#define MOVIE_STANDBY_COUNT     2
+
+enum MOVIE_JOB_TYPE {
+    MOVIE_JOB_OPEN,                 /* Create the file of a movie prepared ahead */
+    MOVIE_JOB_PUT,                  /* Encode a frame */
+    MOVIE_JOB_RESET,                /* Reset the start time of the movie */
+    MOVIE_JOB_CLOSE                 /* Close and free the movie */
+};
+
+enum MOVIE_JOB_STATE {
+    MOVIE_JOB_FREE,
+    MOVIE_JOB_QUEUED,               /* Waiting for the encoder thread */
+    MOVIE_JOB_BUSY,                 /* Being encoded */
+    MOVIE_JOB_DONE                  /* Movie opened or closed, its event not yet raised */
+};
+
+/* Copy of a frame shared by all the jobs encoding it */
+struct movie_frame {
+    int                     refcnt;         /* Jobs using the frame.  Free when zero */
+    unsigned char          *image;          /* Copy of the plane the movie reads */
+    const unsigned char    *source;         /* Plane the copy was made from */
+    struct image_data       img;            /* Metadata of the frame with the plane pointing at image */
+};
+
+struct movie_job {
+    enum MOVIE_JOB_STATE    state;
+    enum MOVIE_JOB_TYPE     type;
+    struct ffmpeg          *ffmpeg;
+    int                     frame;          /* Index of the frame to encode or -1 */
+    int                     fillers;        /* Filler frames to add before the frame */
+    struct timeval          tv;
+    struct timeval          queued_tv;      /* When the job was queued, for the latency */
+    char                    filename[PATH_MAX]; /* File given with EVENT_FILECREATE or EVENT_FILECLOSE */
+    long                    filetype;       /* Type given with the event, 0 for no event */
+    int                     failed;         /* The file of the movie could not be created */
+    struct image_data       img;            /* Metadata for the conversion specifiers of the commands */
+    char                    text_event[PATH_MAX];
+    struct pipe_view        view;
+};
+
+/* Movie whose encoder is opened ahead of the event that needs it */
+struct movie_standby {
+    struct ffmpeg          *ffmpeg;         /* Prepared movie or NULL */
+    int                     busy;           /* Being prepared by the encoder thread */
+    int                     failed;         /* Could not be prepared with these settings */
+    unsigned int            gen;            /* Incremented when the settings change */
+    int                     width;          /* Settings of the movie, width 0 for none */
+    int                     height;
+    int                     fps;
+    int                     bps;
+    int                     quality;
+    int                     high_resolution;
+    char                    codec[128];
+    char                    codec_prep[128];    /* Codec of the movie prepared or being prepared */
+    char                    ext[PATH_MAX];      /* Extension of the container of the prepared movie */
+};
+
+/* Movie waiting for its first frame, for the start and rollover times */
+struct movie_start {
+    struct ffmpeg          *ffmpeg;         /* NULL when unused */
+    struct timeval          event_tv;       /* Time of the image that started the movie */
+    int                     rollover;       /* Movie follows one that reached movie_max_time */
+};
+
+struct movie_encoder {
+    struct pipe_stage       stage;
+    int                     depth;
+    int                     size_image;     /* Size of the frame copies */
+    struct movie_frame     *frames;
+    struct movie_job       *jobs;
+    int                    *queued;         /* Ring of jobs waiting for the encoder */
+    int                     queued_head;
+    int                     queued_count;
+    int                    *done;           /* Ring of closed movies */
+    int                     done_head;
+    int                     done_count;
+    int                     pending;        /* Jobs not yet back to free */
+    int                     closing;        /* Open and close jobs not yet back to free */
+    volatile int            finish;
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond_work;      /* The encoder waits for jobs */
+    pthread_cond_t          cond_done;      /* A job was finished */
+    unsigned long           encoded;
+    unsigned long           fillers;
+    unsigned long           shared;         /* Frames queued without a new copy */
+    unsigned long           dropped;
+    int                     pending_max;
+    long                    latency_last;   /* Milliseconds from queued to encoded */
+    long                    latency_max;
+    unsigned long long      latency_total;
+    struct movie_standby    standby[MOVIE_STANDBY_COUNT];
+    struct movie_start      starts[MOVIE_STANDBY_COUNT];
+    struct timeval          put_tv;         /* When the last frame was encoded */
+    unsigned long           standby_used;   /* Movies started from a standby */
+    unsigned long           standby_missed; /* Movies opened by the event handlers */
+    unsigned long           start_count;
+    long                    start_last;     /* Milliseconds from the event to the first frame encoded */
+    long                    start_max;
+    unsigned long long      start_total;
+    unsigned long           rollover_count;
+    long                    rollover_last;  /* Milliseconds without frames encoded at a rollover */
+    long                    rollover_max;
+    unsigned long long      rollover_total;
+};
+
+int movie_encoder_init(struct context *cnt);
+void movie_encoder_deinit(struct context *cnt);
+int movie_encoder_open(struct context *cnt, struct ffmpeg **ffmpeg, long filetype
+        , struct timeval *tv1, int rollover);
+int movie_encoder_active(struct context *cnt, struct ffmpeg *ffmpeg);
+void movie_encoder_gap(struct context *cnt, long msec);
+void movie_encoder_rate(struct context *cnt);
+int movie_encoder_put(struct context *cnt, struct ffmpeg *ffmpeg, struct image_data *img_data
+        , struct timeval *tv1, int fillers);
+int movie_encoder_reset(struct context *cnt, struct ffmpeg *ffmpeg, struct timeval *tv1);
+int movie_encoder_close(struct context *cnt, struct ffmpeg *ffmpeg, const char *filename
+        , long filetype, struct timeval *tv1);
+void movie_encoder_drain(struct context *cnt);
+void movie_encoder_flush(struct context *cnt);
+int movie_encoder_pending(struct context *cnt);
+int movie_encoder_closing(struct context *cnt);
+long movie_encoder_latency(struct context *cnt);
+
+#endif /* _INCLUDE_MOVIE_ENCODER_H */
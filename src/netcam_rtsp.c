@@ -47,6 +47,7 @@
 #include "rotate.h"
 #include "netcam.h"
 #include "netcam_rtsp.h"
+#include "live.h"
 #include "video_v4l2.h"  /* Needed to validate palette for v4l2 via netcam */
 
 #ifdef HAVE_FFMPEG
@@ -1235,6 +1236,11 @@ static int netcam_rtsp_read_image(struct rtsp_context *rtsp_data)
         }
     }
 
+    /* Stream the packet to the live clients before it is kept for the movies */
+    if (rtsp_data->passthrough) {
+        live_put(rtsp_data);
+    }
+
     pthread_mutex_lock(&rtsp_data->mutex);
         rtsp_data->idnbr++;
         if (rtsp_data->passthrough) {
@@ -1749,6 +1755,9 @@ static int netcam_rtsp_open_context(struct rtsp_context *rtsp_data)
                     ,rtsp_data->cameratype);
             }
             rtsp_data->passthrough = FALSE;
+        } else {
+            /* The codec of the camera may have changed */
+            live_reset(rtsp_data);
         }
     }
 
@@ -29,10 +29,20 @@
 #include "picture.h"
 #include "jpegutils.h"
 #include "event.h"
+#include "pipeline.h"
+#include "file_writer.h"
+#include "jpeg_cache.h"
 #include "netcam.h"
+#include "mask_span.h"
 
 #include <assert.h>
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 #ifdef HAVE_WEBP
     #include <webp/encode.h>
     #include <webp/mux.h>
@@ -496,6 +506,45 @@ static void put_webp_yuv420p_file(FILE *fp, unsigned char *image, int width, int
     #endif /* HAVE_WEBP */
 }
 
+/**
+ * put_jpeg_frame
+ *      Compress an image to a jpeg in memory.  When plane tells which pixels
+ *      of the frame img the image is, a jpeg of the same pixels made earlier
+ *      with the same size and quality is reused and the new jpeg is kept for
+ *      the other outputs of the frame.
+ *
+ * Returns the size of the jpeg.
+ */
+static int put_jpeg_frame(struct context *cnt, unsigned char *dest, int dest_size
+            , unsigned char *image, int width, int height, int quality, int grey
+            , struct image_data *img, enum JPEG_PLANE plane, struct timeval *tv1, struct coord *box)
+{
+    struct jpeg_key key;
+    int sz;
+
+    key.frame_id = (img != NULL) ? img->frame_id : 0;
+    key.plane = (key.frame_id != 0) ? plane : JPEG_PLANE_NONE;
+    key.width = width;
+    key.height = height;
+    key.quality = quality;
+    key.grey = grey;
+
+    sz = jpeg_cache_get(cnt, &key, dest, dest_size);
+    if (sz > 0) {
+        return sz;
+    }
+
+    if (grey) {
+        sz = jpgutl_put_grey(dest, dest_size, image, width, height, quality, cnt, tv1, box);
+    } else {
+        sz = jpgutl_put_yuv420p(dest, dest_size, image, width, height, quality, cnt, tv1, box);
+    }
+
+    jpeg_cache_put(cnt, &key, dest, sz);
+
+    return sz;
+}
+
 /**
  * put_jpeg_yuv420p_file
  *      Converts an YUV420P coded image to a jpeg image and writes
@@ -512,13 +561,14 @@ static void put_webp_yuv420p_file(FILE *fp, unsigned char *image, int width, int
  * Returns nothing
  */
 static void put_jpeg_yuv420p_file(FILE *fp, unsigned char *image, int width, int height
-            , int quality, struct context *cnt, struct timeval *tv1, struct coord *box)
+            , int quality, struct context *cnt, struct image_data *img, enum JPEG_PLANE plane)
 {
     int sz = 0;
     int image_size = cnt->imgs.size_norm;
     unsigned char *buf = mymalloc(image_size);
 
-    sz = jpgutl_put_yuv420p(buf, image_size, image, width, height, quality, cnt ,tv1, box);
+    sz = put_jpeg_frame(cnt, buf, image_size, image, width, height, quality, FALSE
+        , img, plane, &img->timestamp_tv, &img->location);
     fwrite(buf, sz, 1, fp);
 
     free(buf);
@@ -540,13 +590,14 @@ static void put_jpeg_yuv420p_file(FILE *fp, unsigned char *image, int width, int
  * Returns nothing
  */
 static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, int height,
-            int quality, struct context *cnt, struct timeval *tv1, struct coord *box)
+            int quality, struct context *cnt, struct image_data *img, enum JPEG_PLANE plane)
 {
     int sz = 0;
     int image_size = cnt->imgs.size_norm;
     unsigned char *buf = mymalloc(image_size);
 
-    sz = jpgutl_put_grey(buf, image_size, image, width, height, quality, cnt ,tv1, box);
+    sz = put_jpeg_frame(cnt, buf, image_size, image, width, height, quality, TRUE
+        , img, plane, &img->timestamp_tv, &img->location);
     fwrite(buf, sz, 1, picture);
 
     free(buf);
@@ -634,40 +685,16 @@ static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, i
  */
 void overlay_smartmask(struct context *cnt, unsigned char *out)
 {
-    int i, x, v, width, height, line;
     struct images *imgs = &cnt->imgs;
-    unsigned char *smartmask = imgs->smartmask_final;
-    unsigned char *out_y, *out_u, *out_v;
-
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
 
-    /* Set V to 255 to make smartmask appear red. */
-    out_v = out + v;
-    out_u = out + i;
-    for (i = 0; i < height; i += 2) {
-        line = i * width;
-        for (x = 0; x < width; x += 2) {
-            if (smartmask[line + x] == 0 || smartmask[line + x + 1] == 0 ||
-                smartmask[line + width + x] == 0 ||
-                smartmask[line + width + x + 1] == 0) {
-                *out_v = 255;
-                *out_u = 128;
-            }
-            out_v++;
-            out_u++;
-        }
-    }
-    out_y = out;
-    /* Set colour intensity for smartmask. */
-    for (i = 0; i < imgs->motionsize; i++) {
-        if (smartmask[i] == 0) {
-            *out_y = 0;
-        }
-        out_y++;
+    /* Only compiled again once alg_tune_smartmask changed the mask */
+    if (imgs->smartmask_spans == NULL) {
+        imgs->smartmask_spans = mask_span_overlay(imgs->smartmask_final
+            , imgs->width, imgs->height);
     }
+
+    /* Set V to 255 and the intensity to 0 to make smartmask appear red. */
+    mask_span_overlay_put(imgs->smartmask_spans, out, imgs->motionsize, 0, 128, 255);
 }
 
 /**
@@ -678,40 +705,111 @@ void overlay_smartmask(struct context *cnt, unsigned char *out)
  */
 void overlay_fixed_mask(struct context *cnt, unsigned char *out)
 {
-    int i, x, v, width, height, line;
     struct images *imgs = &cnt->imgs;
-    unsigned char *mask = imgs->mask;
-    unsigned char *out_y, *out_u, *out_v;
 
-    i = imgs->motionsize;
-    v = i + ((imgs->motionsize) / 4);
-    width = imgs->width;
-    height = imgs->height;
+    if (imgs->mask_overlay_spans == NULL) {
+        return;
+    }
 
-    /* Set U and V to 0 to make fixed mask appear green. */
-    out_v = out + v;
-    out_u = out + i;
-    for (i = 0; i < height; i += 2) {
-        line = i * width;
-        for (x = 0; x < width; x += 2) {
-            if (mask[line + x] == 0 || mask[line + x + 1] == 0 ||
-                mask[line + width + x] == 0 ||
-                mask[line + width + x + 1] == 0) {
-                *out_v = 0;
-                *out_u = 0;
+    /* Set U and V to 0 and the intensity to 0 to make fixed mask appear green. */
+    mask_span_overlay_put(imgs->mask_overlay_spans, out, imgs->motionsize, 0, 0, 0);
+}
+
+/**
+ * overlay_label_rows
+ *      Colours the pixels of the largest label in two rows of the image and
+ *      in their row of chroma, 16 pixels at a time with SSE2 or NEON.
+ *
+ * Returns the first column left for the plain loop.
+ */
+static int overlay_label_rows(const int *labels, int width
+            , unsigned char *out_y, unsigned char *out_u, unsigned char *out_v)
+{
+    int x;
+
+    x = 0;
+
+    #if defined(__SSE2__)
+        {
+            __m128i bit, zero, ones, half, m0, m1, c, px;
+            const int *lbl0, *lbl1;
+
+            bit = _mm_set1_epi32(32768);
+            zero = _mm_setzero_si128();
+            ones = _mm_set1_epi8((char)0xff);
+            half = _mm_set1_epi8((char)0x80);
+
+            #define LABEL_BITS(p) _mm_cmpeq_epi32(_mm_and_si128( \
+                _mm_loadu_si128((const __m128i *)(p)), bit), bit)
+            #define LABEL_MASK(p) _mm_packs_epi16( \
+                _mm_packs_epi32(LABEL_BITS(p), LABEL_BITS((p) + 4)), \
+                _mm_packs_epi32(LABEL_BITS((p) + 8), LABEL_BITS((p) + 12)))
+
+            for (; x + 16 <= width; x += 16) {
+                lbl0 = labels + x;
+                lbl1 = labels + width + x;
+                m0 = LABEL_MASK(lbl0);
+                m1 = LABEL_MASK(lbl1);
+
+                px = _mm_loadu_si128((const __m128i *)(out_y + x));
+                _mm_storeu_si128((__m128i *)(out_y + x), _mm_andnot_si128(m0, px));
+                px = _mm_loadu_si128((const __m128i *)(out_y + width + x));
+                _mm_storeu_si128((__m128i *)(out_y + width + x), _mm_andnot_si128(m1, px));
+
+                /* Chroma is kept where none of the 2x2 pixels is labelled */
+                c = _mm_cmpeq_epi16(_mm_or_si128(m0, m1), zero);
+                c = _mm_packs_epi16(c, c);
+
+                px = _mm_loadl_epi64((const __m128i *)(out_u + x / 2));
+                px = _mm_or_si128(_mm_and_si128(c, px), _mm_andnot_si128(c, ones));
+                _mm_storel_epi64((__m128i *)(out_u + x / 2), px);
+                px = _mm_loadl_epi64((const __m128i *)(out_v + x / 2));
+                px = _mm_or_si128(_mm_and_si128(c, px), _mm_andnot_si128(c, half));
+                _mm_storel_epi64((__m128i *)(out_v + x / 2), px);
             }
-            out_v++;
-            out_u++;
+
+            #undef LABEL_MASK
+            #undef LABEL_BITS
         }
-    }
-    out_y = out;
-    /* Set colour intensity for mask. */
-    for (i = 0; i < imgs->motionsize; i++) {
-        if (mask[i] == 0) {
-            *out_y = 0;
+    #elif defined(__ARM_NEON)
+        {
+            uint32x4_t bit;
+            uint8x16_t m0, m1;
+            uint8x8_t c, px;
+            const int *lbl0, *lbl1;
+
+            bit = vdupq_n_u32(32768);
+
+            #define LABEL_BITS(p) vmovn_u32(vtstq_u32(vld1q_u32((const uint32_t *)(p)), bit))
+            #define LABEL_MASK(p) vcombine_u8( \
+                vmovn_u16(vcombine_u16(LABEL_BITS(p), LABEL_BITS((p) + 4))), \
+                vmovn_u16(vcombine_u16(LABEL_BITS((p) + 8), LABEL_BITS((p) + 12))))
+
+            for (; x + 16 <= width; x += 16) {
+                lbl0 = labels + x;
+                lbl1 = labels + width + x;
+                m0 = LABEL_MASK(lbl0);
+                m1 = LABEL_MASK(lbl1);
+
+                vst1q_u8(out_y + x, vbicq_u8(vld1q_u8(out_y + x), m0));
+                vst1q_u8(out_y + width + x, vbicq_u8(vld1q_u8(out_y + width + x), m1));
+
+                /* Chroma is set where any of the 2x2 pixels is labelled */
+                c = vmovn_u16(vtstq_u16(vreinterpretq_u16_u8(vorrq_u8(m0, m1))
+                    , vdupq_n_u16(0xffff)));
+
+                px = vld1_u8(out_u + x / 2);
+                vst1_u8(out_u + x / 2, vbsl_u8(c, vdup_n_u8(255), px));
+                px = vld1_u8(out_v + x / 2);
+                vst1_u8(out_v + x / 2, vbsl_u8(c, vdup_n_u8(128), px));
+            }
+
+            #undef LABEL_MASK
+            #undef LABEL_BITS
         }
-        out_y++;
-    }
+    #endif
+
+    return x;
 }
 
 /**
@@ -732,29 +830,37 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
     width = imgs->width;
     height = imgs->height;
 
-    /* Set U to 255 to make label appear blue. */
-    out_u = out + i;
-    out_v = out + v;
+    /*
+     * Set U to 255 to make label appear blue and set intensity for
+     * coloured label to have better visibility.
+     */
     for (i = 0; i < height; i += 2) {
         line = i * width;
-        for (x = 0; x < width; x += 2) {
+        out_y = out + line;
+        out_u = out + imgs->motionsize + (i / 2) * (width / 2);
+        out_v = out + v + (i / 2) * (width / 2);
+
+        for (x = overlay_label_rows(labels + line, width, out_y, out_u, out_v);
+             x < width; x += 2) {
             if (labels[line + x] & 32768 || labels[line + x + 1] & 32768 ||
                 labels[line + width + x] & 32768 ||
                 labels[line + width + x + 1] & 32768) {
-                *out_u = 255;
-                *out_v = 128;
+                out_u[x / 2] = 255;
+                out_v[x / 2] = 128;
+            }
+            if (labels[line + x] & 32768) {
+                out_y[x] = 0;
+            }
+            if (labels[line + x + 1] & 32768) {
+                out_y[x + 1] = 0;
+            }
+            if (labels[line + width + x] & 32768) {
+                out_y[width + x] = 0;
+            }
+            if (labels[line + width + x + 1] & 32768) {
+                out_y[width + x + 1] = 0;
             }
-            out_u++;
-            out_v++;
-        }
-    }
-    out_y = out;
-    /* Set intensity for coloured label to have better visibility. */
-    for (i = 0; i < imgs->motionsize; i++) {
-        if (*labels++ & 32768) {
-            *out_y = 0;
         }
-        out_y++;
     }
 }
 
@@ -767,6 +873,9 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * - image_size is the size of the input image buffer
  * - *image points to the image buffer that contains the YUV420P or Grayscale image about to be put
  * - quality is the jpeg quality setting from the config file.
+ * - img is the frame the image belongs to and plane (a JPEG_PLANE) which pixels
+ *   of the frame the image is.  A jpeg of the frame made for a picture is reused.
+ *   The stream images are sent without the exif of the pictures.
  *
  * Output:
  * - **dest_image is a pointer to a pointer that points to the destination buffer in which the
@@ -775,31 +884,36 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * Returns the dest_image_size if successful. Otherwise 0.
  */
 int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size
-            , unsigned char *image, int quality, int width, int height)
+            , unsigned char *image, int quality, int width, int height
+            , struct image_data *img, int plane)
 {
     struct timeval tv1;
+    int sz;
 
-    /*
-     * Reset the time for the current image since it is not reliable
-     * for putting images to memory.
-     */
-    gettimeofday(&tv1, NULL);
-
-    if (!cnt->conf.stream_grey) {
-        return jpgutl_put_yuv420p(dest_image, image_size, image,
-                                       width, height, quality, cnt ,&tv1,NULL);
+    if ((img != NULL) && (img->frame_id != 0) && (plane != JPEG_PLANE_NONE)) {
+        /* Same exif as the pictures of the frame so that the jpeg can be shared */
+        sz = put_jpeg_frame(cnt, dest_image, image_size, image, width, height
+            , quality, cnt->conf.stream_grey, img, plane, &img->timestamp_tv, &img->location);
     } else {
-        return jpgutl_put_grey(dest_image, image_size, image,
-                                       width, height, quality, cnt,&tv1,NULL);
+        gettimeofday(&tv1, NULL);
+        sz = put_jpeg_frame(cnt, dest_image, image_size, image, width, height
+            , quality, cnt->conf.stream_grey, NULL, JPEG_PLANE_NONE, &tv1, NULL);
     }
 
-    return 0;
+    return jpgutl_strip_exif(dest_image, sz);
 }
 
 static void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image
             , int quality, int ftype)
 {
     int width, height, passthrough;
+    struct pipe_view view;
+    enum JPEG_PLANE plane;
+
+    pipeline_view(cnt, &view);
+
+    /* A picture of the frame itself may share its jpeg with the stream and the other pictures */
+    plane = jpeg_cache_plane(view.image, image);
 
     passthrough = util_check_passthrough(cnt);
     if ((ftype == FTYPE_IMAGE) && (cnt->imgs.size_high > 0) && (!passthrough)) {
@@ -815,15 +929,15 @@ static void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *im
 
     } else if (cnt->imgs.picture_type == IMAGE_TYPE_WEBP) {
         put_webp_yuv420p_file(picture, image, width, height, quality, cnt
-            , &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+            , &(view.image->timestamp_tv), &(view.image->location));
 
     } else if (cnt->imgs.picture_type == IMAGE_TYPE_GREY) {
         put_jpeg_grey_file(picture, image, width, height, quality, cnt
-            , &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+            , view.image, plane);
 
     } else {
         put_jpeg_yuv420p_file(picture, image, width, height, quality, cnt
-            , &(cnt->current_image->timestamp_tv), &(cnt->current_image->location));
+            , view.image, plane);
     }
 
 }
@@ -832,7 +946,7 @@ void put_picture(struct context *cnt, char *file, unsigned char *image, int ftyp
 {
     FILE *picture;
 
-    picture = myfopen(file, "w");
+    picture = file_writer_fopen(cnt->file_writer, file, "w");
     if (!picture) {
         /* Report to syslog - suggest solution if the problem is access rights to target dir. */
         if (errno ==  EACCES) {
@@ -998,23 +1112,3 @@ void put_fixed_mask(struct context *cnt, const char *file)
         "re-run motion to enable mask feature"), cnt->conf.mask_file);
 }
 
-void pic_scale_img(int width_src, int height_src, unsigned char *img_src, unsigned char *img_dst)
-{
-
-    int i = 0, x, y;
-    for (y = 0; y < height_src; y+=2) {
-        for (x = 0; x < width_src; x+=2) {
-            img_dst[i++] = img_src[y * width_src + x];
-        }
-    }
-
-    for (y = 0; y < height_src / 2; y+=2) {
-       for (x = 0; x < width_src; x += 4) {
-          img_dst[i++] = img_src[(width_src * height_src) + (y * width_src) + x];
-          img_dst[i++] = img_src[(width_src * height_src) + (y * width_src) + (x + 1)];
-       }
-    }
-
-    return;
-}
-
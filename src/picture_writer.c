@@ -0,0 +1,466 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      picture_writer.c
+ *
+ *      Pool of threads compressing and writing the pictures of a camera so
+ *      that the thread running the event handlers only copies the frame.
+ *
+ *      The pool has picture_writer_queue slots, each with its own frame
+ *      buffer that is reused from one picture to the next.  Detected and
+ *      motion pictures are dropped when all slots are in use; snapshots and
+ *      preview pictures wait for a slot.
+ *
+ *      EVENT_FILECREATE (on_picture_save, the database and the log entry) is
+ *      raised once the file is written.  It is raised by the thread running
+ *      the event handlers (see pipeline_output_owner) when it calls
+ *      picture_writer_drain so the handlers never run on the writer threads.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "picture.h"
+#include "event.h"
+#include "pipeline.h"
+#include "picture_writer.h"
+
+/* Size of the frame put_picture reads for a picture of type ftype */
+static int picture_writer_size(struct context *cnt, int ftype)
+{
+    if ((ftype == FTYPE_IMAGE) && (cnt->imgs.size_high > 0) && (!util_check_passthrough(cnt))) {
+        return cnt->imgs.size_high;
+    }
+    return cnt->imgs.size_norm;
+}
+
+/* Find a free job.  Called with the mutex held */
+static int picture_writer_free(struct picture_writer *pw)
+{
+    int indx;
+
+    for (indx = 0; indx < pw->depth; indx++) {
+        if (pw->jobs[indx].state == PICTURE_JOB_FREE) {
+            return indx;
+        }
+    }
+    return -1;
+}
+
+/* Compress and write the picture of a job.  Runs on a writer thread */
+static void picture_writer_write(struct context *cnt, struct picture_job *job)
+{
+    pipeline_view_bind(&job->view);
+
+    put_picture(cnt, job->filename, job->image, job->ftype);
+
+    /*
+     *  Update symbolic link *after* image has been written so that
+     *  the link always points to a valid file.
+     */
+    if (job->linkname[0] != '\0') {
+        remove(job->linkpath);
+        if (symlink(job->linkname, job->linkpath)) {
+            MOTION_LOG(ERR, TYPE_EVENTS, SHOW_ERRNO
+                ,_("Could not create symbolic link [%s]"), job->linkname);
+        }
+    }
+
+    pipeline_view_bind(NULL);
+}
+
+/**
+ * picture_writer_loop
+ *
+ *   Thread function of the writers.  Takes jobs in the order they were queued
+ *   and hands them back as done.
+ */
+static void *picture_writer_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct picture_writer *pw = cnt->picture_writer;
+    struct pipe_stage *stage;
+    struct picture_job *job;
+    int indx;
+
+    util_threadname_set("pw", cnt->threadnr, cnt->conf.camera_name);
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    pthread_mutex_lock(&pw->mutex);
+        /* picture_writer_init holds the mutex until all the thread ids are set */
+        stage = NULL;
+        for (indx = 0; indx < pw->threads; indx++) {
+            if (pthread_equal(pthread_self(), pw->stages[indx].thread_id)) {
+                stage = &pw->stages[indx];
+            }
+        }
+
+        while (TRUE) {
+            while ((pw->queued_count == 0) && (!pw->finish)) {
+                pthread_cond_wait(&pw->cond_work, &pw->mutex);
+            }
+            if (pw->queued_count == 0) {
+                break;
+            }
+
+            indx = pw->queued[pw->queued_head];
+            pw->queued_head = (pw->queued_head + 1) % pw->depth;
+            pw->queued_count--;
+
+            job = &pw->jobs[indx];
+            job->state = PICTURE_JOB_BUSY;
+
+            pthread_mutex_unlock(&pw->mutex);
+
+            picture_writer_write(cnt, job);
+
+            pthread_mutex_lock(&pw->mutex);
+
+            job->state = PICTURE_JOB_DONE;
+            pw->done[(pw->done_head + pw->done_count) % pw->depth] = indx;
+            pw->done_count++;
+            pw->written++;
+            pthread_cond_broadcast(&pw->cond_done);
+        }
+    pthread_mutex_unlock(&pw->mutex);
+
+    pthread_mutex_lock(&global_lock);
+        threads_running--;
+    pthread_mutex_unlock(&global_lock);
+
+    if (stage != NULL) {
+        stage->finished = TRUE;
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+ * picture_writer_put
+ *
+ *   Queue a picture for the writer threads.  The image is copied so the
+ *   caller may reuse it right away.  When linkname is not empty, a symbolic
+ *   link linkpath pointing at linkname is made once the file is written.
+ *
+ * Returns PICTURE_WRITER_QUEUED, PICTURE_WRITER_DROPPED or PICTURE_WRITER_NONE
+ * when the caller must write the picture itself.
+ */
+int picture_writer_put(struct context *cnt, char *file, unsigned char *image, int ftype
+        , long filetype, struct timeval *tv1, int may_drop, const char *linkname, const char *linkpath)
+{
+    struct picture_writer *pw = cnt->picture_writer;
+    struct picture_job *job;
+    struct timespec ts;
+    struct pipe_view view;
+    int indx;
+
+    if ((pw == NULL) || (pw->finish)) {
+        return PICTURE_WRITER_NONE;
+    }
+
+    pthread_mutex_lock(&pw->mutex);
+        indx = picture_writer_free(pw);
+        while (indx == -1) {
+            if (may_drop) {
+                pw->dropped++;
+                pthread_mutex_unlock(&pw->mutex);
+                if ((pw->dropped % 100) == 1) {
+                    MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO
+                        ,_("Picture writers are behind, %lu pictures dropped so far")
+                        ,pw->dropped);
+                }
+                return PICTURE_WRITER_DROPPED;
+            }
+
+            /* Written pictures only give back their slot once their event is raised */
+            pthread_mutex_unlock(&pw->mutex);
+            picture_writer_drain(cnt);
+            pthread_mutex_lock(&pw->mutex);
+
+            indx = picture_writer_free(pw);
+            if ((indx == -1) && (pw->done_count == 0)) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec++;
+                pthread_cond_timedwait(&pw->cond_done, &pw->mutex, &ts);
+            }
+        }
+        /* Claimed.  Writers only look at jobs in the queued ring */
+        pw->jobs[indx].state = PICTURE_JOB_QUEUED;
+        pw->pending++;
+        if (pw->pending > pw->pending_max) {
+            pw->pending_max = pw->pending;
+        }
+    pthread_mutex_unlock(&pw->mutex);
+
+    job = &pw->jobs[indx];
+
+    if (job->image == NULL) {
+        job->image = mymalloc(pw->size_image);
+    }
+    memcpy(job->image, image, picture_writer_size(cnt, ftype));
+
+    job->ftype = ftype;
+    job->filetype = filetype;
+    snprintf(job->filename, sizeof(job->filename), "%s", file);
+    snprintf(job->linkname, sizeof(job->linkname), "%s", (linkname != NULL ? linkname : ""));
+    snprintf(job->linkpath, sizeof(job->linkpath), "%s", (linkpath != NULL ? linkpath : ""));
+
+    if (tv1 != NULL) {
+        job->tv = *tv1;
+    } else {
+        gettimeofday(&job->tv, NULL);
+    }
+
+    /* Keep the values for exif and the conversion specifiers of the commands */
+    pipeline_view(cnt, &view);
+    memcpy(&job->img, view.image, sizeof(struct image_data));
+    /* Point the frame at the copy so its jpeg can still be shared (see jpeg_cache_plane) */
+    job->img.image_norm = (image == view.image->image_norm) ? job->image : NULL;
+    job->img.image_high = (image == view.image->image_high) ? job->image : NULL;
+    snprintf(job->text_event, sizeof(job->text_event), "%s", view.text_event);
+
+    job->view = view;
+    job->view.image = &job->img;
+    job->view.image_motion = NULL;
+    job->view.text_event = job->text_event;
+
+    pthread_mutex_lock(&pw->mutex);
+        pw->queued[(pw->queued_head + pw->queued_count) % pw->depth] = indx;
+        pw->queued_count++;
+        pthread_cond_signal(&pw->cond_work);
+    pthread_mutex_unlock(&pw->mutex);
+
+    return PICTURE_WRITER_QUEUED;
+}
+
+/**
+ * picture_writer_drain
+ *
+ *   Raise EVENT_FILECREATE for the pictures written since the last call and
+ *   give their slots back.  Does nothing unless called by the thread running
+ *   the event handlers.
+ */
+void picture_writer_drain(struct context *cnt)
+{
+    struct picture_writer *pw = cnt->picture_writer;
+    struct picture_job *job;
+    const struct pipe_view *prev;
+    int indx;
+
+    if ((pw == NULL) || (!pipeline_output_owner(cnt))) {
+        return;
+    }
+
+    pthread_mutex_lock(&pw->mutex);
+        while (pw->done_count > 0) {
+            indx = pw->done[pw->done_head];
+            pw->done_head = (pw->done_head + 1) % pw->depth;
+            pw->done_count--;
+
+            job = &pw->jobs[indx];
+
+            pthread_mutex_unlock(&pw->mutex);
+
+            prev = pipeline_view_bind(&job->view);
+            event(cnt, EVENT_FILECREATE, NULL, job->filename, (void *)job->filetype, &job->tv);
+            pipeline_view_bind(prev);
+
+            pthread_mutex_lock(&pw->mutex);
+
+            job->state = PICTURE_JOB_FREE;
+            pw->pending--;
+        }
+    pthread_mutex_unlock(&pw->mutex);
+}
+
+/**
+ * picture_writer_flush
+ *
+ *   Wait until all queued pictures are written and their events raised.
+ *   Gives up when the writers make no progress for 10 seconds.
+ */
+void picture_writer_flush(struct context *cnt)
+{
+    struct picture_writer *pw = cnt->picture_writer;
+    struct timespec ts;
+    int wait_counter;
+
+    if ((pw == NULL) || (!pipeline_output_owner(cnt))) {
+        return;
+    }
+
+    wait_counter = 0;
+    picture_writer_drain(cnt);
+
+    pthread_mutex_lock(&pw->mutex);
+        while ((pw->pending > 0) && (wait_counter < 10)) {
+            if (pw->done_count == 0) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec++;
+                if (pthread_cond_timedwait(&pw->cond_done, &pw->mutex, &ts) == ETIMEDOUT) {
+                    wait_counter++;
+                    continue;
+                }
+            }
+            wait_counter = 0;
+            pthread_mutex_unlock(&pw->mutex);
+            picture_writer_drain(cnt);
+            pthread_mutex_lock(&pw->mutex);
+        }
+    pthread_mutex_unlock(&pw->mutex);
+
+    if (wait_counter >= 10) {
+        MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO
+            ,_("Picture writers did not finish, %d pictures lost"), pw->pending);
+    }
+}
+
+/* Whether pictures are queued or written but their events not yet raised */
+int picture_writer_pending(struct context *cnt)
+{
+    struct picture_writer *pw = cnt->picture_writer;
+    int pending;
+
+    if (pw == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pw->mutex);
+        pending = pw->pending;
+    pthread_mutex_unlock(&pw->mutex);
+
+    return pending;
+}
+
+/**
+ * picture_writer_init
+ *
+ *   Start the writer threads.  Called once the image sizes are known and
+ *   before the output stage is started.
+ */
+int picture_writer_init(struct context *cnt)
+{
+    struct picture_writer *pw;
+    int indx;
+
+    cnt->picture_writer = NULL;
+
+    if (cnt->conf.picture_writer_threads <= 0) {
+        return 0;
+    }
+
+    pw = mymalloc(sizeof(struct picture_writer));
+
+    pw->threads = cnt->conf.picture_writer_threads;
+    pw->depth = cnt->conf.picture_writer_queue;
+    if (pw->depth < pw->threads) {
+        pw->depth = pw->threads;
+    }
+
+    pw->size_image = cnt->imgs.size_norm;
+    if (cnt->imgs.size_high > pw->size_image) {
+        pw->size_image = cnt->imgs.size_high;
+    }
+
+    pw->jobs = mymalloc(pw->depth * sizeof(struct picture_job));
+    pw->queued = mymalloc(pw->depth * sizeof(int));
+    pw->done = mymalloc(pw->depth * sizeof(int));
+    pw->stages = mymalloc(pw->threads * sizeof(struct pipe_stage));
+    for (indx = 0; indx < pw->threads; indx++) {
+        pw->stages[indx].finished = TRUE;
+    }
+
+    pthread_mutex_init(&pw->mutex, NULL);
+    pthread_cond_init(&pw->cond_work, NULL);
+    pthread_cond_init(&pw->cond_done, NULL);
+
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->picture_writer = pw;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    pthread_mutex_lock(&pw->mutex);
+        for (indx = 0; indx < pw->threads; indx++) {
+            if (pipeline_stage_start(cnt, &pw->stages[indx], picture_writer_loop) != 0) {
+                break;
+            }
+        }
+    pthread_mutex_unlock(&pw->mutex);
+
+    if (indx == 0) {
+        /* Write the pictures in the event handlers as before */
+        picture_writer_deinit(cnt);
+        return -1;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Picture writers %d, queue %d"), indx, pw->depth);
+
+    return 0;
+}
+
+/**
+ * picture_writer_deinit
+ *
+ *   Write out the queued pictures, stop the writer threads and free the pool.
+ */
+void picture_writer_deinit(struct context *cnt)
+{
+    struct picture_writer *pw = cnt->picture_writer;
+    int indx;
+
+    if (pw == NULL) {
+        return;
+    }
+
+    picture_writer_flush(cnt);
+
+    pthread_mutex_lock(&pw->mutex);
+        pw->finish = TRUE;
+        pthread_cond_broadcast(&pw->cond_work);
+    pthread_mutex_unlock(&pw->mutex);
+
+    for (indx = 0; indx < pw->threads; indx++) {
+        pipeline_stage_stop(cnt, &pw->stages[indx], NULL);
+    }
+
+    /* The web status no longer reads it past here */
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->picture_writer = NULL;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    if (pw->written > 0) {
+        MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO
+            ,_("Picture writers finished: %lu pictures, %lu dropped, largest queue %d")
+            ,pw->written, pw->dropped, pw->pending_max);
+    }
+
+    for (indx = 0; indx < pw->depth; indx++) {
+        free(pw->jobs[indx].image);
+    }
+    free(pw->jobs);
+    free(pw->queued);
+    free(pw->done);
+    free(pw->stages);
+
+    pthread_mutex_destroy(&pw->mutex);
+    pthread_cond_destroy(&pw->cond_work);
+    pthread_cond_destroy(&pw->cond_done);
+
+    free(pw);
+}
@@ -0,0 +1,85 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      picture_writer.h
+ *
+ *      Headers associated with functions in the picture_writer.c module.
+ *      The files event.h and pipeline.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_PICTURE_WRITER_H
+#define _INCLUDE_PICTURE_WRITER_H
+
+#define PICTURE_WRITER_QUEUED   0   /* Picture will be written and EVENT_FILECREATE raised later */
+#define PICTURE_WRITER_DROPPED  1   /* Queue was full, the picture is not saved */
+#define PICTURE_WRITER_NONE     -1  /* No writer threads, the caller must write the picture */
+
+enum PICTURE_JOB_STATE {
+    PICTURE_JOB_FREE,
+    PICTURE_JOB_QUEUED,             /* Waiting for a writer thread */
+    PICTURE_JOB_BUSY,               /* Being compressed and written */
+    PICTURE_JOB_DONE                /* Written, EVENT_FILECREATE not yet raised */
+};
+
+/* A picture to compress and write along with the state it was saved with */
+struct picture_job {
+    enum PICTURE_JOB_STATE  state;
+    unsigned char          *image;          /* Copy of the frame. Kept for the next job using the slot */
+    int                     ftype;          /* File type for put_picture */
+    long                    filetype;       /* File type given with EVENT_FILECREATE */
+    int                     written;        /* File was opened and written */
+    char                    filename[PATH_MAX];
+    char                    linkname[PATH_MAX]; /* Symbolic link to point at the file once written */
+    char                    linkpath[PATH_MAX];
+    struct timeval          tv;
+    struct image_data       img;            /* Metadata of the image for exif and conversion specifiers */
+    char                    text_event[PATH_MAX];
+    struct pipe_view        view;
+};
+
+struct picture_writer {
+    int                     threads;
+    struct pipe_stage      *stages;
+    int                     depth;
+    int                     size_image;     /* Size of the frame copy of each job */
+    struct picture_job     *jobs;
+    int                    *queued;         /* Ring of jobs waiting for a writer */
+    int                     queued_head;
+    int                     queued_count;
+    int                    *done;           /* Ring of written jobs in the order they finished */
+    int                     done_head;
+    int                     done_count;
+    int                     pending;        /* Jobs not yet back to free */
+    volatile int            finish;
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond_work;      /* Writers wait for jobs */
+    pthread_cond_t          cond_done;      /* A job was written */
+    unsigned long           written;
+    unsigned long           dropped;
+    int                     pending_max;
+};
+
+int picture_writer_init(struct context *cnt);
+void picture_writer_deinit(struct context *cnt);
+int picture_writer_put(struct context *cnt, char *file, unsigned char *image, int ftype
+        , long filetype, struct timeval *tv1, int may_drop, const char *linkname, const char *linkpath);
+void picture_writer_drain(struct context *cnt);
+void picture_writer_flush(struct context *cnt);
+int picture_writer_pending(struct context *cnt);
+
+#endif /* _INCLUDE_PICTURE_WRITER_H */
@@ -0,0 +1,929 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      pipeline.c
+ *
+ *      Module of routines that split the motion loop into stages.
+ *
+ *      capture - Thread reading frames from the camera into a pool of
+ *                buffers ahead of the detection stage (pipeline_capture_depth).
+ *                The motion loop stops it to close and reopen the camera.
+ *      detect  - The motion loop itself.  Takes the captured buffers by
+ *                swapping them with the image ring slot.
+ *      output  - Thread running the picture, movie, database and command
+ *                event handlers (pipeline_output_depth).  Events are queued
+ *                together with copies of the frames and detection values
+ *                they need so the motion loop never waits on the disk or
+ *                the encoder.
+ *
+ *      Stages are connected by bounded single producer / single consumer
+ *      queues of slot numbers.  When the output queue is full, pictures are
+ *      dropped or the motion loop waits depending on pipeline_output_policy.
+ *      Movie and timelapse frames and events without frames (start and end
+ *      of events, commands) always wait for room so they are never lost.
+ *
+ *      The state of the camera stays with the motion loop.  A queued event
+ *      carries what its handlers need from it (see pipe_view).
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "event.h"
+#include "pipeline.h"
+#include "picture_writer.h"
+#include "movie_encoder.h"
+#include "frame_arena.h"
+
+/* What a queued event needs copied from the motion loop */
+#define PIPE_COPY_NONE      0x00
+#define PIPE_COPY_IMAGE     0x01
+#define PIPE_COPY_MOTION    0x02
+#define PIPE_COPY_DROP      0x10    /* The event may be dropped when the queue is full */
+
+/* Detection values bound to a thread by pipeline_view_bind */
+static pthread_key_t pipeline_key_view;
+static pthread_once_t pipeline_once_view = PTHREAD_ONCE_INIT;
+
+static void pipeline_view_key(void)
+{
+    pthread_key_create(&pipeline_key_view, NULL);
+}
+
+/* Absolute time for the condition wait msec milliseconds from now */
+static void pipeline_timeout(struct timespec *ts, int msec)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += msec / 1000;
+    ts->tv_nsec += (msec % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void pipeline_queue_init(struct pipe_queue *queue, unsigned int size)
+{
+    unsigned int alloc;
+
+    alloc = 1;
+    while (alloc < size) {
+        alloc <<= 1;
+    }
+
+    queue->slots = mymalloc(alloc * sizeof(int));
+    queue->size = size;
+    queue->mask = alloc - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->waiting = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
+
+static void pipeline_queue_deinit(struct pipe_queue *queue)
+{
+    if (queue->slots == NULL) {
+        return;
+    }
+    free(queue->slots);
+    queue->slots = NULL;
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+}
+
+/* Number of entries in the queue.  May be called from any thread */
+unsigned int pipeline_queue_depth(struct pipe_queue *queue)
+{
+    if ((queue == NULL) || (queue->slots == NULL)) {
+        return 0;
+    }
+    return __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) -
+           __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+}
+
+/* Wake the consumer of the queue if it is parked */
+static void pipeline_queue_wake(struct pipe_queue *queue, int force)
+{
+    if ((queue == NULL) || (queue->slots == NULL)) {
+        return;
+    }
+    if (force || (__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST) > 0)) {
+        pthread_mutex_lock(&queue->mutex);
+            pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+}
+
+/* Producer side.  Returns -1 when the queue is full */
+static int pipeline_queue_push(struct pipe_queue *queue, int slot)
+{
+    unsigned int head;
+
+    head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    if ((head - __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST)) >= queue->size) {
+        return -1;
+    }
+    queue->slots[head & queue->mask] = slot;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+/* Consumer side.  Returns -1 when the queue is empty */
+static int pipeline_queue_pop(struct pipe_queue *queue)
+{
+    unsigned int tail;
+    int slot;
+
+    tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == tail) {
+        return -1;
+    }
+    slot = queue->slots[tail & queue->mask];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    return slot;
+}
+
+static int pipeline_queue_put(struct pipe_queue *queue, int slot)
+{
+    if (pipeline_queue_push(queue, slot) == -1) {
+        return -1;
+    }
+    pipeline_queue_wake(queue, FALSE);
+    return 0;
+}
+
+/*
+ * Get an entry, parking for at most msec milliseconds when the queue is empty.
+ * The waiting count is raised before the queue is checked again under the
+ * mutex so a producer either sees us waiting or we see its entry.
+ */
+static int pipeline_queue_get_wait(struct pipe_queue *queue, int msec)
+{
+    struct timespec ts;
+    int slot;
+
+    slot = pipeline_queue_pop(queue);
+    if (slot != -1) {
+        return slot;
+    }
+
+    pipeline_timeout(&ts, msec);
+
+    pthread_mutex_lock(&queue->mutex);
+        __atomic_add_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+        while ((slot = pipeline_queue_pop(queue)) == -1) {
+            if (pthread_cond_timedwait(&queue->cond, &queue->mutex, &ts) == ETIMEDOUT) {
+                slot = pipeline_queue_pop(queue);
+                break;
+            }
+        }
+        __atomic_sub_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return slot;
+}
+
+/**
+ * pipeline_stage_start
+ *
+ *   Start the thread for a stage.  Like the netcam handlers, the stage threads
+ *   are detached and counted in threads_running.  The global stages serving
+ *   all the cameras are not counted so that Motion ends once the cameras
+ *   did, and they decrement nothing when they end.
+ */
+int pipeline_stage_start(struct context *cnt, struct pipe_stage *stage, void *(*stage_func)(void *))
+{
+    pthread_attr_t handler_attribute;
+    int retcd;
+
+    stage->finish = FALSE;
+    stage->finished = FALSE;
+
+    pthread_attr_init(&handler_attribute);
+    pthread_attr_setdetachstate(&handler_attribute, PTHREAD_CREATE_DETACHED);
+
+    if (!stage->global) {
+        pthread_mutex_lock(&global_lock);
+            threads_running++;
+        pthread_mutex_unlock(&global_lock);
+    }
+
+    retcd = pthread_create(&stage->thread_id, &handler_attribute, stage_func, cnt);
+    pthread_attr_destroy(&handler_attribute);
+
+    if (retcd != 0) {
+        MOTION_LOG(ALR, TYPE_ALL, SHOW_ERRNO, _("Error starting pipeline thread"));
+        if (!stage->global) {
+            pthread_mutex_lock(&global_lock);
+                threads_running--;
+            pthread_mutex_unlock(&global_lock);
+        }
+        stage->finished = TRUE;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * pipeline_stage_stop
+ *
+ *   Ask a stage thread to end and wait for it.  The wait is restarted as long
+ *   as the thread keeps draining its queue so a backlog of movie frames is
+ *   written out rather than lost.  The queue is NULL for stages that are
+ *   woken by their owner instead.
+ */
+void pipeline_stage_stop(struct context *cnt, struct pipe_stage *stage, struct pipe_queue *queue)
+{
+    unsigned int depth, depth_prev;
+    int wait_counter;
+
+    (void)cnt;
+
+    if (stage->finished) {
+        return;
+    }
+
+    stage->finish = TRUE;
+    pipeline_queue_wake(queue, TRUE);
+
+    wait_counter = 0;
+    depth_prev = pipeline_queue_depth(queue);
+    while ((!stage->finished) && (wait_counter < 100)) {
+        SLEEP(0, 100000000L);
+        depth = pipeline_queue_depth(queue);
+        if (depth != depth_prev) {
+            depth_prev = depth;
+            wait_counter = 0;
+        } else {
+            wait_counter++;
+        }
+        pipeline_queue_wake(queue, TRUE);
+    }
+
+    if (!stage->finished) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, _("No response from pipeline thread."));
+        /* Last resort.  Same as the netcam handlers */
+        pthread_cancel(stage->thread_id);
+        pthread_kill(stage->thread_id, SIGVTALRM);
+        if (!stage->global) {
+            pthread_mutex_lock(&global_lock);
+                threads_running--;
+            pthread_mutex_unlock(&global_lock);
+        }
+        stage->finished = TRUE;
+    }
+}
+
+/**
+ * pipeline_output_loop
+ *
+ *   Thread function for the output stage.  Runs the event handlers for each
+ *   queued event in the order the motion loop raised them.
+ */
+static void *pipeline_output_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct pipeline *pl = cnt->pipeline;
+    struct pipe_job *job;
+    struct pipe_view view;
+    int indx;
+
+    util_threadname_set("op", cnt->threadnr, cnt->conf.camera_name);
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO, _("Output stage started"));
+
+    while ((!pl->output_stage.finish) || (pipeline_queue_depth(&pl->output_ready) > 0)) {
+        /* Look back soon for pictures and movies being written so their events are not held up */
+        indx = pipeline_queue_get_wait(&pl->output_ready
+            , ((picture_writer_pending(cnt) || movie_encoder_closing(cnt))
+                ? PIPELINE_POLL_MSEC : PIPELINE_WAIT_MSEC));
+        if (indx != -1) {
+            job = &pl->output[indx];
+
+            view.image = &job->img;
+            view.image_motion = (job->has_motion ? &job->img_motion : NULL);
+            view.event_nr = job->event_nr;
+            view.noise = job->noise;
+            view.threshold = job->threshold;
+            view.lastrate = job->lastrate;
+            view.movie_fps = job->movie_fps;
+            view.fillers = job->fillers;
+            view.text_event = job->text_event;
+
+            pipeline_view_bind(&view);
+            event_dispatch(cnt, job->eventtype
+                , (job->has_img ? &job->img : NULL), NULL, NULL
+                , (job->has_tv ? &job->tv : NULL));
+            pipeline_view_bind(NULL);
+
+            pipeline_queue_put(&pl->output_free, indx);
+        }
+
+        picture_writer_drain(cnt);
+        movie_encoder_drain(cnt);
+    }
+
+    /* Events of the pictures and movies still being written are raised by this thread */
+    picture_writer_flush(cnt);
+    movie_encoder_flush(cnt);
+
+    MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO
+        ,_("Output stage finished: %lu events, %lu frames dropped, largest queue %u")
+        ,pl->output_events, pl->output_dropped, pl->output_max);
+
+    pthread_mutex_lock(&global_lock);
+        threads_running--;
+    pthread_mutex_unlock(&global_lock);
+
+    pl->output_stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Which events are moved to the output stage and what they need copied.
+ * A detected image goes into the movies when they are on.  Dropping it would
+ * leave the movie short of frames for that second, so it is never dropped.
+ */
+static int pipeline_event_copy(struct context *cnt, motion_event eventtype)
+{
+    switch (eventtype) {
+    case EVENT_IMAGE_DETECTED:
+        if (cnt->conf.movie_output_motion) {
+            return PIPE_COPY_IMAGE | PIPE_COPY_MOTION;
+        }
+        if (cnt->conf.movie_output || cnt->conf.movie_extpipe_use) {
+            return PIPE_COPY_IMAGE;
+        }
+        return PIPE_COPY_IMAGE | PIPE_COPY_DROP;
+    case EVENT_IMAGEM_DETECTED:
+        return PIPE_COPY_MOTION | PIPE_COPY_DROP;
+    case EVENT_TIMELAPSE:
+    case EVENT_IMAGE_SNAPSHOT:
+    case EVENT_IMAGE_PREVIEW:
+        return PIPE_COPY_IMAGE;
+    case EVENT_MOTION:
+    case EVENT_FIRSTMOTION:
+    case EVENT_ENDMOTION:
+    case EVENT_TIMELAPSEEND:
+    case EVENT_AREA_DETECTED:
+    case EVENT_CAMERA_LOST:
+    case EVENT_CAMERA_FOUND:
+    case EVENT_MAX_MOVIE:
+    case EVENT_MOVIE_RESUME:
+        return PIPE_COPY_NONE;
+    default:
+        /* Stream, loopback and file events stay with the thread raising them */
+        return -1;
+    }
+}
+
+/* Copy the metadata and optionally the pixels of src into the job buffers of dst */
+static void pipeline_copy_image(struct context *cnt, struct image_data *dst
+        , struct image_data *src, int pixels)
+{
+    unsigned char *image_norm, *image_high;
+
+    image_norm = dst->image_norm;
+    image_high = dst->image_high;
+
+    if (src != NULL) {
+        memcpy(dst, src, sizeof(struct image_data));
+    } else {
+        memset(dst, 0, sizeof(struct image_data));
+    }
+
+    dst->image_norm = image_norm;
+    dst->image_high = image_high;
+
+    if ((!pixels) || (src == NULL)) {
+        return;
+    }
+
+    if (dst->image_norm == NULL) {
+        dst->image_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
+    }
+    memcpy(dst->image_norm, src->image_norm, cnt->imgs.size_norm);
+
+    if ((cnt->imgs.size_high > 0) && (src->image_high != NULL)) {
+        if (dst->image_high == NULL) {
+            dst->image_high = frame_arena_alloc(cnt, cnt->imgs.size_high);
+        }
+        memcpy(dst->image_high, src->image_high, cnt->imgs.size_high);
+    }
+}
+
+/**
+ * pipeline_event
+ *
+ *   Called by event() before running the handlers.  When an output stage is
+ *   running, events it owns are queued along with the detection state and
+ *   the frames they refer to.
+ *
+ * Returns TRUE when the event was queued (or dropped) and must not be run now.
+ */
+int pipeline_event(struct context *cnt, motion_event eventtype
+        , struct image_data *img_data, struct timeval *tv1)
+{
+    struct pipeline *pl = cnt->pipeline;
+    struct pipe_job *job;
+    unsigned int depth;
+    int indx, copy;
+
+    if ((pl == NULL) || (pl->output_depth == 0) || (pl->output_stage.finished)) {
+        return FALSE;
+    }
+
+    /* Events raised by the handlers themselves are run right away */
+    if (pthread_equal(pthread_self(), pl->output_stage.thread_id)) {
+        return FALSE;
+    }
+
+    copy = pipeline_event_copy(cnt, eventtype);
+    if (copy == -1) {
+        return FALSE;
+    }
+
+    indx = pipeline_queue_pop(&pl->output_free);
+    if (indx == -1) {
+        if ((copy & PIPE_COPY_DROP) && (!pl->output_block)) {
+            pl->output_dropped++;
+            if ((pl->output_dropped % 100) == 1) {
+                MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO
+                    ,_("Output queue full, %lu frames dropped so far")
+                    ,pl->output_dropped);
+            }
+            return TRUE;
+        }
+        while (indx == -1) {
+            if (pl->output_stage.finished) {
+                return FALSE;
+            }
+            indx = pipeline_queue_get_wait(&pl->output_free, PIPELINE_WAIT_MSEC);
+        }
+    }
+
+    job = &pl->output[indx];
+    job->eventtype = eventtype;
+
+    /* The handlers use the current image unless they are given one */
+    pipeline_copy_image(cnt, &job->img
+        , (img_data != NULL ? img_data : cnt->current_image)
+        , (copy & PIPE_COPY_IMAGE));
+    job->has_img = (img_data != NULL);
+
+    job->has_motion = ((copy & PIPE_COPY_MOTION) != 0);
+    if (job->has_motion) {
+        pipeline_copy_image(cnt, &job->img_motion, &cnt->imgs.img_motion, TRUE);
+    }
+
+    if (tv1 != NULL) {
+        job->tv = *tv1;
+        job->has_tv = TRUE;
+    } else {
+        job->has_tv = FALSE;
+    }
+
+    job->event_nr = cnt->event_nr;
+    job->noise = cnt->noise;
+    job->threshold = cnt->threshold;
+    job->lastrate = cnt->lastrate;
+    job->movie_fps = cnt->movie_fps;
+    job->fillers = cnt->movie_fillers;
+    snprintf(job->text_event, sizeof(job->text_event), "%s", cnt->text_event_string);
+
+    pipeline_queue_put(&pl->output_ready, indx);
+
+    pl->output_events++;
+    depth = pipeline_queue_depth(&pl->output_ready);
+    if (depth > pl->output_max) {
+        pl->output_max = depth;
+    }
+
+    return TRUE;
+}
+
+/**
+ * pipeline_view_bind
+ *
+ *   Make the handlers running on this thread use the detection values in view
+ *   until it is unbound with NULL.  The view must stay valid while bound.
+ *
+ * Returns the view that was bound before so nested users can restore it.
+ */
+const struct pipe_view *pipeline_view_bind(const struct pipe_view *view)
+{
+    const struct pipe_view *prev;
+
+    pthread_once(&pipeline_once_view, pipeline_view_key);
+
+    prev = pthread_getspecific(pipeline_key_view);
+    pthread_setspecific(pipeline_key_view, view);
+
+    return prev;
+}
+
+/**
+ * pipeline_view
+ *
+ *   Fill view with the detection values a handler must use.  On the output
+ *   thread and the picture writers these are the values saved with the event
+ *   being handled, anywhere else they are the live values of the context.
+ */
+void pipeline_view(const struct context *cnt, struct pipe_view *view)
+{
+    const struct pipe_view *bound;
+
+    pthread_once(&pipeline_once_view, pipeline_view_key);
+
+    bound = pthread_getspecific(pipeline_key_view);
+    if (bound != NULL) {
+        memcpy(view, bound, sizeof(struct pipe_view));
+    } else {
+        view->image = cnt->current_image;
+        view->image_motion = (struct image_data *)&cnt->imgs.img_motion;
+        view->event_nr = cnt->event_nr;
+        view->noise = cnt->noise;
+        view->threshold = cnt->threshold;
+        view->lastrate = cnt->lastrate;
+        view->movie_fps = cnt->movie_fps;
+        view->fillers = cnt->movie_fillers;
+        view->text_event = cnt->text_event_string;
+    }
+}
+
+/**
+ * pipeline_output_owner
+ *
+ *   Whether the calling thread is the one running the output event handlers:
+ *   the output stage thread when there is one, otherwise the motion loop.
+ */
+int pipeline_output_owner(const struct context *cnt)
+{
+    const struct pipeline *pl = cnt->pipeline;
+
+    if ((pl == NULL) || (pl->output_depth == 0) || (pl->output_stage.finished)) {
+        return TRUE;
+    }
+
+    return pthread_equal(pthread_self(), pl->output_stage.thread_id);
+}
+
+/**
+ * pipeline_output_thread
+ *
+ *   Whether the calling thread is the output stage thread.  Its handlers get
+ *   the copy of the images made by pipeline_event rather than the ring frame.
+ */
+int pipeline_output_thread(const struct context *cnt)
+{
+    const struct pipeline *pl = cnt->pipeline;
+
+    if ((pl == NULL) || (pl->output_depth == 0) || (pl->output_stage.finished)) {
+        return FALSE;
+    }
+
+    return pthread_equal(pthread_self(), pl->output_stage.thread_id);
+}
+
+/* Whether the frames come from the capture thread.  Only called by the motion loop */
+int pipeline_capture_active(struct context *cnt)
+{
+    return ((cnt->pipeline != NULL) && (cnt->pipeline->capture_running));
+}
+
+/**
+ * pipeline_capture_slot
+ *
+ *   Capture thread: get a free buffer to read the next frame into.  Waits
+ *   while all buffers are queued for the detection stage.
+ *
+ * Returns the slot number or -1 when the stage is finishing.
+ */
+int pipeline_capture_slot(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    int indx;
+
+    indx = pipeline_queue_pop(&pl->capture_free);
+    if (indx != -1) {
+        return indx;
+    }
+
+    pl->capture_stalls++;
+    while ((indx == -1) && (!pl->capture_stage.finish)) {
+        indx = pipeline_queue_get_wait(&pl->capture_free, PIPELINE_WAIT_MSEC);
+    }
+
+    return indx;
+}
+
+/* Capture thread: hand a filled buffer to the detection stage */
+void pipeline_capture_put(struct context *cnt, int indx, int retcd)
+{
+    struct pipeline *pl = cnt->pipeline;
+
+    pl->capture[indx].retcd = retcd;
+    pl->capture_frames++;
+
+    pipeline_queue_put(&pl->capture_ready, indx);
+}
+
+/**
+ * pipeline_capture_wait
+ *
+ *   Motion loop: release the previous frame and wait for the next one.
+ *
+ * Returns 0 when a frame is ready (or there is no capture stage) and
+ * -1 when nothing arrived within PIPELINE_WAIT_MSEC.
+ */
+int pipeline_capture_wait(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+
+    if (!pipeline_capture_active(cnt)) {
+        return 0;
+    }
+
+    if (pl->capture_pending != -1) {
+        pipeline_queue_put(&pl->capture_free, pl->capture_pending);
+        pl->capture_pending = -1;
+    }
+
+    pl->capture_pending = pipeline_queue_get_wait(&pl->capture_ready, PIPELINE_WAIT_MSEC);
+    if (pl->capture_pending == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * pipeline_capture_take
+ *
+ *   Motion loop: move the frame from pipeline_capture_wait into img.  The
+ *   buffers are swapped rather than copied; the old buffers of img go back to
+ *   the capture thread.
+ *
+ * Returns the vid_next return code of the frame.
+ */
+int pipeline_capture_take(struct context *cnt, struct image_data *img)
+{
+    struct pipeline *pl = cnt->pipeline;
+    struct pipe_capture *cap;
+    unsigned char *image_norm, *image_high;
+
+    if (pl->capture_pending == -1) {
+        return 1;
+    }
+
+    cap = &pl->capture[pl->capture_pending];
+    if (cap->retcd == 0) {
+        image_norm = img->image_norm;
+        image_high = img->image_high;
+
+        img->image_norm = cap->img.image_norm;
+        img->image_high = cap->img.image_high;
+        img->timestamp_tv = cap->img.timestamp_tv;
+        img->idnbr_norm = cap->img.idnbr_norm;
+        img->idnbr_high = cap->img.idnbr_high;
+
+        cap->img.image_norm = image_norm;
+        cap->img.image_high = image_high;
+    }
+
+    return cap->retcd;
+}
+
+static void pipeline_capture_init(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    int indx;
+
+    pl->capture = mymalloc(pl->capture_depth * sizeof(struct pipe_capture));
+    pipeline_queue_init(&pl->capture_free, pl->capture_depth);
+    pipeline_queue_init(&pl->capture_ready, pl->capture_depth);
+
+    for (indx = 0; indx < pl->capture_depth; indx++) {
+        pl->capture[indx].img.image_norm = frame_arena_alloc(cnt, cnt->imgs.size_norm);
+        memset(pl->capture[indx].img.image_norm, 0x80, cnt->imgs.size_norm);
+        if (cnt->imgs.size_high > 0) {
+            pl->capture[indx].img.image_high = frame_arena_alloc(cnt, cnt->imgs.size_high);
+            memset(pl->capture[indx].img.image_high, 0x80, cnt->imgs.size_high);
+        }
+        pipeline_queue_put(&pl->capture_free, indx);
+    }
+}
+
+/**
+ * pipeline_capture_stop
+ *
+ *   Motion loop: stop the capture thread before the camera is closed and
+ *   give the frames it left behind back to the pool.  The frames are read
+ *   in the motion loop until pipeline_capture_start is called again.
+ */
+void pipeline_capture_stop(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    int indx;
+
+    if (!pipeline_capture_active(cnt)) {
+        return;
+    }
+
+    pipeline_stage_stop(cnt, &pl->capture_stage, &pl->capture_free);
+    pl->capture_running = FALSE;
+
+    /* Both sides of the queues are ours now */
+    if (pl->capture_pending != -1) {
+        pipeline_queue_put(&pl->capture_free, pl->capture_pending);
+        pl->capture_pending = -1;
+    }
+    while ((indx = pipeline_queue_pop(&pl->capture_ready)) != -1) {
+        pipeline_queue_put(&pl->capture_free, indx);
+    }
+}
+
+static void pipeline_capture_deinit(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    int indx;
+
+    if (pl->capture == NULL) {
+        return;
+    }
+
+    pipeline_capture_stop(cnt);
+
+    for (indx = 0; indx < pl->capture_depth; indx++) {
+        frame_arena_free(cnt, pl->capture[indx].img.image_norm);
+        frame_arena_free(cnt, pl->capture[indx].img.image_high);
+    }
+    free(pl->capture);
+    pl->capture = NULL;
+    pl->capture_depth = 0;
+
+    pipeline_queue_deinit(&pl->capture_free);
+    pipeline_queue_deinit(&pl->capture_ready);
+}
+
+/**
+ * pipeline_capture_start
+ *
+ *   Start the capture stage thread when capture buffers were set up and the
+ *   camera is open.  The thread function is supplied by the motion loop.
+ */
+void pipeline_capture_start(struct context *cnt, void *(*capture_func)(void *))
+{
+    struct pipeline *pl = cnt->pipeline;
+
+    if ((pl == NULL) || (pl->capture == NULL) || (pl->capture_running) || (cnt->video_dev < 0)) {
+        return;
+    }
+
+    if (pipeline_stage_start(cnt, &pl->capture_stage, capture_func) != 0) {
+        /* Capture in the motion loop as before */
+        pipeline_capture_deinit(cnt);
+        return;
+    }
+    pl->capture_running = TRUE;
+}
+
+static void pipeline_output_init(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    int indx;
+
+    pl->output_block = mystreq(cnt->conf.pipeline_output_policy, "block");
+
+    pl->output = mymalloc(pl->output_depth * sizeof(struct pipe_job));
+    pipeline_queue_init(&pl->output_free, pl->output_depth);
+    pipeline_queue_init(&pl->output_ready, pl->output_depth);
+
+    /* Frame buffers of the jobs are allocated on first use */
+    for (indx = 0; indx < pl->output_depth; indx++) {
+        pipeline_queue_put(&pl->output_free, indx);
+    }
+
+    if (pipeline_stage_start(cnt, &pl->output_stage, pipeline_output_loop) != 0) {
+        /* Run the handlers on the motion thread as before */
+        free(pl->output);
+        pl->output = NULL;
+        pl->output_depth = 0;
+        pipeline_queue_deinit(&pl->output_free);
+        pipeline_queue_deinit(&pl->output_ready);
+    }
+}
+
+static void pipeline_output_deinit(struct context *cnt)
+{
+    struct pipeline *pl = cnt->pipeline;
+    int indx;
+
+    if (pl->output == NULL) {
+        return;
+    }
+
+    pipeline_stage_stop(cnt, &pl->output_stage, &pl->output_ready);
+
+    for (indx = 0; indx < pl->output_depth; indx++) {
+        frame_arena_free(cnt, pl->output[indx].img.image_norm);
+        frame_arena_free(cnt, pl->output[indx].img.image_high);
+        frame_arena_free(cnt, pl->output[indx].img_motion.image_norm);
+        frame_arena_free(cnt, pl->output[indx].img_motion.image_high);
+    }
+    free(pl->output);
+    pl->output = NULL;
+    pl->output_depth = 0;
+
+    pipeline_queue_deinit(&pl->output_free);
+    pipeline_queue_deinit(&pl->output_ready);
+}
+
+/**
+ * pipeline_init
+ *
+ *   Set up the stage buffers and start the output stage.  The capture stage
+ *   thread is started by the motion loop since it runs the loop's own retry
+ *   logic.  Called once the image sizes are known.
+ */
+int pipeline_init(struct context *cnt)
+{
+    struct pipeline *pl;
+
+    cnt->pipeline = NULL;
+
+    if ((cnt->conf.pipeline_capture_depth <= 0) && (cnt->conf.pipeline_output_depth <= 0)) {
+        return 0;
+    }
+
+    pl = mymalloc(sizeof(struct pipeline));
+
+    /* The web status reads the queues once the pipeline is set */
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->pipeline = pl;
+
+        pl->capture_pending = -1;
+        pl->capture_stage.finished = TRUE;
+        pl->output_stage.finished = TRUE;
+
+        if (cnt->conf.pipeline_capture_depth > 0) {
+            pl->capture_depth = cnt->conf.pipeline_capture_depth;
+            pipeline_capture_init(cnt);
+        }
+
+        if (cnt->conf.pipeline_output_depth > 0) {
+            pl->output_depth = cnt->conf.pipeline_output_depth;
+            pipeline_output_init(cnt);
+        }
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO
+        ,_("Pipeline capture queue %d, output queue %d (%s when full)")
+        ,pl->capture_depth, pl->output_depth
+        ,(pl->output_block ? "block" : "drop"));
+
+    return 0;
+}
+
+/**
+ * pipeline_deinit
+ *
+ *   Stop the stage threads and free the buffers.  Events still queued for the
+ *   output stage are handled before it ends.
+ */
+void pipeline_deinit(struct context *cnt)
+{
+    if (cnt->pipeline == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&cnt->mutex_stages);
+        pipeline_capture_deinit(cnt);
+        pipeline_output_deinit(cnt);
+
+        free(cnt->pipeline);
+        cnt->pipeline = NULL;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+}
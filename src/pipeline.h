@@ -0,0 +1,143 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      pipeline.h
+ *
+ *      Headers associated with functions in the pipeline.c module.
+ *      The file event.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_PIPELINE_H
+#define _INCLUDE_PIPELINE_H
+
+struct context;
+struct image_data;
+
+#define PIPELINE_WAIT_MSEC          1000    /* Longest wait on a queue before rechecking finish flags */
+#define PIPELINE_POLL_MSEC          50      /* Wait of the output stage while pictures are being written */
+
+/*
+ * Bounded queue of slot numbers between exactly one producer and one consumer.
+ * The head and tail are only moved with atomic operations so neither side ever
+ * takes a lock to put or get an entry.  The mutex and condition are only used to
+ * park the consumer when the queue is empty.  A producer that runs out of room
+ * waits on the queue of free slots going the other way.
+ */
+struct pipe_queue {
+    int                *slots;      /* Slot numbers waiting in the queue */
+    unsigned int        size;       /* Maximum number of entries */
+    unsigned int        mask;       /* Allocated entries (a power of two) minus one */
+    unsigned int        head;       /* Next entry to write. Only moved by the producer */
+    unsigned int        tail;       /* Next entry to read. Only moved by the consumer */
+    int                 waiting;    /* Consumer is parked on the queue */
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+};
+
+/* Thread running one stage of the pipeline */
+struct pipe_stage {
+    pthread_t           thread_id;
+    volatile int        finish;     /* Ask the stage thread to end */
+    volatile int        finished;   /* Set by the stage thread when it has ended */
+    int                 global;     /* Thread of all the cameras, not counted in threads_running */
+};
+
+/* A captured frame waiting for the detection stage */
+struct pipe_capture {
+    struct image_data   img;        /* Buffers swapped with the image ring slot */
+    int                 retcd;      /* Return code of vid_next for this frame */
+};
+
+/* An event deferred to the output stage along with the state it was raised with */
+struct pipe_job {
+    motion_event        eventtype;
+    struct image_data   img;        /* Image metadata plus copies of the pixels used by the handlers */
+    struct image_data   img_motion; /* Copy of the motion image */
+    int                 has_motion; /* img_motion was copied for this event */
+    int                 has_img;    /* Handlers receive img as their img_data */
+    struct timeval      tv;
+    int                 has_tv;
+    int                 event_nr;
+    int                 noise;
+    int                 threshold;
+    unsigned int        lastrate;
+    int                 movie_fps;
+    int                 fillers;
+    char                text_event[PATH_MAX];
+};
+
+/* Detection state that an event handler must use instead of the live values in the context */
+struct pipe_view {
+    struct image_data  *image;          /* Image for conversion specifiers and exif data */
+    struct image_data  *image_motion;   /* Motion image belonging to image or NULL when not kept */
+    int                 event_nr;
+    int                 noise;
+    int                 threshold;
+    unsigned int        lastrate;
+    int                 movie_fps;      /* Frame rate of the movies of the event */
+    int                 fillers;        /* Filler frames due before the detected image */
+    const char         *text_event;
+};
+
+struct pipeline {
+    /* Capture stage: frames read from the camera ahead of detection */
+    int                 capture_depth;
+    struct pipe_capture *capture;
+    struct pipe_queue   capture_free;       /* Slots the capture thread may fill */
+    struct pipe_queue   capture_ready;      /* Slots waiting for the detection stage */
+    int                 capture_pending;    /* Slot handed to the detection stage but not yet taken */
+    struct pipe_stage   capture_stage;
+    int                 capture_running;    /* Capture thread reads the camera.  Only changed by the motion loop */
+    unsigned long       capture_frames;
+    unsigned long       capture_stalls;     /* Times the capture thread waited for a free slot */
+
+    /* Output stage: events handled after detection has moved on */
+    int                 output_depth;
+    int                 output_block;       /* Block instead of dropping frames when the queue is full */
+    struct pipe_job    *output;
+    struct pipe_queue   output_free;
+    struct pipe_queue   output_ready;
+    struct pipe_stage   output_stage;
+    unsigned long       output_events;
+    unsigned long       output_dropped;
+    unsigned int        output_max;         /* Largest queue depth seen */
+};
+
+int pipeline_init(struct context *cnt);
+void pipeline_deinit(struct context *cnt);
+
+int pipeline_stage_start(struct context *cnt, struct pipe_stage *stage, void *(*stage_func)(void *));
+void pipeline_stage_stop(struct context *cnt, struct pipe_stage *stage, struct pipe_queue *queue);
+
+int pipeline_capture_active(struct context *cnt);
+void pipeline_capture_start(struct context *cnt, void *(*capture_func)(void *));
+void pipeline_capture_stop(struct context *cnt);
+int pipeline_capture_slot(struct context *cnt);
+void pipeline_capture_put(struct context *cnt, int indx, int retcd);
+int pipeline_capture_wait(struct context *cnt);
+int pipeline_capture_take(struct context *cnt, struct image_data *img);
+
+int pipeline_event(struct context *cnt, motion_event eventtype
+        , struct image_data *img_data, struct timeval *tv1);
+void pipeline_view(const struct context *cnt, struct pipe_view *view);
+const struct pipe_view *pipeline_view_bind(const struct pipe_view *view);
+int pipeline_output_owner(const struct context *cnt);
+int pipeline_output_thread(const struct context *cnt);
+unsigned int pipeline_queue_depth(struct pipe_queue *queue);
+
+#endif /* _INCLUDE_PIPELINE_H */
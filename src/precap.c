@@ -0,0 +1,306 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      precap.c
+ *
+ *      Compressed pre-capture images.
+ *
+ *      With pre_capture_quality set, the image ring only holds the frames
+ *      needed for minimum_motion_frames.  The older pre-captured frames are
+ *      compressed as jpegs when they leave the ring and kept in one buffer
+ *      of pre_capture_memory megabytes, oldest first.  The oldest frames are
+ *      dropped when a new one does not fit.  When an event starts, the frames
+ *      are decompressed one at a time and output ahead of the image ring.
+ *
+ *      The buffer is written from the start again when the jpegs of a frame
+ *      do not fit before its end so that every frame is in one piece.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "jpegutils.h"
+#include "precap.h"
+#include "frame_arena.h"
+
+/* Whether the pre-captured frames are compressed with the current options */
+int precap_active(struct context *cnt)
+{
+    return ((cnt->conf.pre_capture_quality > 0) &&
+            (cnt->conf.pre_capture > 1) &&
+            (!cnt->conf.movie_passthrough));
+}
+
+static void precap_deinit(struct context *cnt, struct precap *precap)
+{
+    free(precap->buf);
+    free(precap->frames);
+    free(precap->jpeg);
+    frame_arena_free(cnt, precap->img.image_norm);
+    frame_arena_free(cnt, precap->img.image_high);
+    free(precap);
+}
+
+/**
+ * precap_init
+ *
+ *   Set up the buffer for the current options.  By default the buffer is a
+ *   quarter of the size of the images it replaces in the image ring.
+ */
+static struct precap *precap_init(struct context *cnt)
+{
+    struct precap *precap;
+    long buf_size;
+    int quality;
+
+    quality = cnt->conf.pre_capture_quality;
+    if (quality > 100) {
+        quality = 100;
+    }
+
+    precap = mymalloc(sizeof(struct precap));
+    precap->quality = quality;
+    precap->frames_max = cnt->conf.pre_capture - 1;
+    precap->size_norm = cnt->imgs.size_norm;
+    precap->size_high = cnt->imgs.size_high;
+
+    if (cnt->conf.pre_capture_memory > 0) {
+        buf_size = (long)cnt->conf.pre_capture_memory * 1024 * 1024;
+    } else {
+        buf_size = ((long)precap->frames_max * (precap->size_norm + precap->size_high)) / 4;
+    }
+    precap->buf_size = buf_size;
+    precap->buf = mymalloc(buf_size);
+    precap->frames = mymalloc(precap->frames_max * sizeof(struct precap_frame));
+    precap->jpeg = mymalloc(precap->size_norm + precap->size_high);
+
+    precap->img.image_norm = frame_arena_alloc(cnt, precap->size_norm);
+    if (precap->size_high > 0) {
+        precap->img.image_high = frame_arena_alloc(cnt, precap->size_high);
+    }
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+        ,_("Compressing %d pre-captured images into %ld kilobytes")
+        ,precap->frames_max, buf_size / 1024);
+
+    return precap;
+}
+
+/* Whether the buffer was set up for the current options */
+static int precap_fits(struct context *cnt, struct precap *precap)
+{
+    long buf_size;
+
+    if (cnt->conf.pre_capture_memory > 0) {
+        buf_size = (long)cnt->conf.pre_capture_memory * 1024 * 1024;
+    } else {
+        buf_size = ((long)(cnt->conf.pre_capture - 1) * (cnt->imgs.size_norm + cnt->imgs.size_high)) / 4;
+    }
+
+    return ((precap->quality == cnt->conf.pre_capture_quality) &&
+            (precap->frames_max == cnt->conf.pre_capture - 1) &&
+            (precap->size_norm == cnt->imgs.size_norm) &&
+            (precap->size_high == cnt->imgs.size_high) &&
+            (precap->buf_size == buf_size));
+}
+
+/* Drop the oldest frame */
+static void precap_drop(struct precap *precap)
+{
+    if (++precap->first >= precap->frames_max) {
+        precap->first = 0;
+    }
+    precap->count--;
+}
+
+static struct precap_frame *precap_frame(struct precap *precap, int indx)
+{
+    return &precap->frames[(precap->first + indx) % precap->frames_max];
+}
+
+/**
+ * precap_put
+ *
+ *   Compress an image about to be overwritten in the image ring.  Images
+ *   that were or will be saved are left out.
+ */
+void precap_put(struct context *cnt, struct image_data *img)
+{
+    struct precap *precap;
+    struct precap_frame *frame;
+    int len_norm, len_high;
+    long len, pos;
+
+    if (!precap_active(cnt)) {
+        if (cnt->precap != NULL) {
+            precap_free(cnt);
+        }
+        return;
+    }
+
+    if ((img->flags & IMAGE_SAVE) || (img->timestamp_tv.tv_sec == 0)) {
+        return;
+    }
+
+    if ((cnt->precap != NULL) && !precap_fits(cnt, cnt->precap)) {
+        precap_free(cnt);
+    }
+    if (cnt->precap == NULL) {
+        cnt->precap = precap_init(cnt);
+    }
+    precap = cnt->precap;
+
+    len_norm = jpgutl_put_yuv420p(precap->jpeg, precap->size_norm, img->image_norm
+        , cnt->imgs.width, cnt->imgs.height, precap->quality, cnt, &img->timestamp_tv, NULL);
+    if (len_norm <= 0) {
+        return;
+    }
+    len_high = 0;
+    if (precap->size_high > 0) {
+        len_high = jpgutl_put_yuv420p(precap->jpeg + len_norm, precap->size_high, img->image_high
+            , cnt->imgs.width_high, cnt->imgs.height_high, precap->quality, cnt, &img->timestamp_tv, NULL);
+        if (len_high <= 0) {
+            return;
+        }
+    }
+
+    len = len_norm + len_high;
+    if (len > precap->buf_size) {
+        /* Keep the frames in order rather than leave a gap before this one */
+        precap->evicted += precap->count;
+        precap->count = 0;
+        return;
+    }
+
+    pos = precap->head;
+    if (pos + len > precap->buf_size) {
+        /* The frames after the head are older than the ones from the start */
+        while ((precap->count > 0) && (precap_frame(precap, 0)->pos >= precap->head)) {
+            precap->evicted++;
+            precap_drop(precap);
+        }
+        pos = 0;
+    }
+
+    /* Drop the oldest frames that are in the way */
+    while (precap->count > 0) {
+        frame = precap_frame(precap, 0);
+        if ((precap->count < precap->frames_max) &&
+            ((frame->pos >= pos + len) ||
+             (frame->pos + frame->len_norm + frame->len_high <= pos))) {
+            break;
+        }
+        if (precap->count < precap->frames_max) {
+            precap->evicted++;
+        }
+        precap_drop(precap);
+    }
+
+    frame = precap_frame(precap, precap->count);
+    frame->img = *img;
+    frame->img.image_norm = NULL;
+    frame->img.image_high = NULL;
+    frame->pos = pos;
+    frame->len_norm = len_norm;
+    frame->len_high = len_high;
+    memcpy(precap->buf + pos, precap->jpeg, len);
+
+    precap->head = pos + len;
+    precap->count++;
+    precap->compressed++;
+}
+
+/* Time of the oldest pre-captured frame, NULL when there are none */
+struct timeval *precap_first_tv(struct context *cnt)
+{
+    if ((cnt->precap == NULL) || (cnt->precap->count == 0)) {
+        return NULL;
+    }
+
+    return &precap_frame(cnt->precap, 0)->img.timestamp_tv;
+}
+
+/**
+ * precap_get
+ *
+ *   Take the oldest pre-captured frame out of the buffer.  The image stays
+ *   valid until the next call.
+ *
+ * Returns NULL once there are no frames left.
+ */
+struct image_data *precap_get(struct context *cnt)
+{
+    struct precap *precap = cnt->precap;
+    struct precap_frame *frame;
+    int retcd;
+
+    if (precap == NULL) {
+        return NULL;
+    }
+
+    while (precap->count > 0) {
+        frame = precap_frame(precap, 0);
+
+        retcd = jpgutl_decode_jpeg(precap->buf + frame->pos, frame->len_norm
+            , cnt->imgs.width, cnt->imgs.height, precap->img.image_norm);
+        if ((retcd == 0) && (frame->len_high > 0)) {
+            retcd = jpgutl_decode_jpeg(precap->buf + frame->pos + frame->len_norm, frame->len_high
+                , cnt->imgs.width_high, cnt->imgs.height_high, precap->img.image_high);
+        }
+
+        if (retcd == 0) {
+            precap->img.diffs = frame->img.diffs;
+            precap->img.idnbr_norm = frame->img.idnbr_norm;
+            precap->img.idnbr_high = frame->img.idnbr_high;
+            precap->img.timestamp_tv = frame->img.timestamp_tv;
+            precap->img.shot = frame->img.shot;
+            precap->img.frame_id = 0;
+            precap->img.cent_dist = frame->img.cent_dist;
+            precap->img.flags = frame->img.flags | IMAGE_SAVE;
+            precap->img.location = frame->img.location;
+            precap->img.total_labels = frame->img.total_labels;
+        }
+
+        precap_drop(precap);
+        if (precap->count == 0) {
+            precap->head = 0;
+        }
+
+        if (retcd == 0) {
+            return &precap->img;
+        }
+    }
+
+    return NULL;
+}
+
+void precap_free(struct context *cnt)
+{
+    if (cnt->precap == NULL) {
+        return;
+    }
+
+    if (cnt->precap->compressed > 0) {
+        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO
+            ,_("Pre-captured images compressed %lu, dropped for memory %lu")
+            ,cnt->precap->compressed, cnt->precap->evicted);
+    }
+
+    precap_deinit(cnt, cnt->precap);
+    cnt->precap = NULL;
+}
@@ -0,0 +1,61 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      precap.h
+ *
+ *      Headers associated with functions in the precap.c module.
+ *
+ */
+
+#ifndef _INCLUDE_PRECAP_H
+#define _INCLUDE_PRECAP_H
+
+struct context;
+struct image_data;
+
+/* Pre-captured image left out of the image ring */
+struct precap_frame {
+    struct image_data       img;            /* Values of the image.  The image pointers are not used */
+    long                    pos;            /* Start of the jpegs in the buffer */
+    int                     len_norm;
+    int                     len_high;
+};
+
+struct precap {
+    int                     quality;
+    int                     frames_max;     /* Pre-captured images not kept in the image ring */
+    long                    buf_size;
+    int                     size_norm;      /* Sizes of the images compressed */
+    int                     size_high;
+    unsigned char          *buf;            /* Jpegs of the frames one after the other */
+    long                    head;           /* Where the next jpegs are written */
+    struct precap_frame    *frames;
+    int                     first;          /* Oldest frame */
+    int                     count;
+    unsigned char          *jpeg;           /* Jpeg being compressed */
+    struct image_data       img;            /* Frame given back to the image ring processing */
+    unsigned long           compressed;
+    unsigned long           evicted;        /* Frames dropped to stay within buf_size */
+};
+
+int precap_active(struct context *cnt);
+void precap_put(struct context *cnt, struct image_data *img);
+struct timeval *precap_first_tv(struct context *cnt);
+struct image_data *precap_get(struct context *cnt);
+void precap_free(struct context *cnt);
+
+#endif /* _INCLUDE_PRECAP_H */
@@ -47,7 +47,13 @@
 #include "util.h"
 #include "logger.h"
 #include "rotate.h"
+#include "frame_arena.h"
 #include <stdint.h>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
 #if defined(__APPLE__)
     #include <libkern/OSByteOrder.h>
     #define bswap_32(x) OSSwapInt32(x)
@@ -126,68 +132,153 @@ static void flip_inplace_vertical(unsigned char *src, int width, int height)
 }
 
 /**
- * rot90cw
+ * rotate_tile
  *
- *  Performs a 90 degrees clockwise rotation of the memory block pointed to
- *  by src. The rotation is NOT performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  Transposes a tile of 8x8 pixels.  Row k of the destination, found at
+ *  dst + k * dstep, gets the pixel k of each of the 8 source rows.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate clockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   src    - the 8 source rows, at the first column of the tile
+ *   dst    - the first destination row
+ *   dstep  - distance from a destination row to the next one
  *
  * Returns: nothing
  */
-static void rot90cw(unsigned char *src, register unsigned char *dst
-            ,int size, int width, int height)
+static void rotate_tile(const unsigned char *src[8], unsigned char *dst, int dstep)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
-
-    endp = src + size;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width) {
-            *dst++ = *src;
+    #if defined(__SSE2__)
+        __m128i s0, s1, s2, s3, t0, t1, t2, t3, u0, u1, u2, u3;
+
+        s0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[0])
+            , _mm_loadl_epi64((const __m128i *)src[1]));
+        s1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[2])
+            , _mm_loadl_epi64((const __m128i *)src[3]));
+        s2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[4])
+            , _mm_loadl_epi64((const __m128i *)src[5]));
+        s3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src[6])
+            , _mm_loadl_epi64((const __m128i *)src[7]));
+
+        t0 = _mm_unpacklo_epi16(s0, s1);
+        t1 = _mm_unpackhi_epi16(s0, s1);
+        t2 = _mm_unpacklo_epi16(s2, s3);
+        t3 = _mm_unpackhi_epi16(s2, s3);
+
+        u0 = _mm_unpacklo_epi32(t0, t2);    /* Rows 0 and 1 of the destination */
+        u1 = _mm_unpackhi_epi32(t0, t2);
+        u2 = _mm_unpacklo_epi32(t1, t3);
+        u3 = _mm_unpackhi_epi32(t1, t3);
+
+        _mm_storel_epi64((__m128i *)(dst), u0);
+        _mm_storel_epi64((__m128i *)(dst + dstep), _mm_unpackhi_epi64(u0, u0));
+        _mm_storel_epi64((__m128i *)(dst + 2 * dstep), u1);
+        _mm_storel_epi64((__m128i *)(dst + 3 * dstep), _mm_unpackhi_epi64(u1, u1));
+        _mm_storel_epi64((__m128i *)(dst + 4 * dstep), u2);
+        _mm_storel_epi64((__m128i *)(dst + 5 * dstep), _mm_unpackhi_epi64(u2, u2));
+        _mm_storel_epi64((__m128i *)(dst + 6 * dstep), u3);
+        _mm_storel_epi64((__m128i *)(dst + 7 * dstep), _mm_unpackhi_epi64(u3, u3));
+    #elif defined(__ARM_NEON)
+        uint8x8x2_t b0, b1, b2, b3;
+        uint16x4x2_t c0, c1, c2, c3;
+        uint32x2x2_t d0, d1, d2, d3;
+
+        b0 = vtrn_u8(vld1_u8(src[0]), vld1_u8(src[1]));
+        b1 = vtrn_u8(vld1_u8(src[2]), vld1_u8(src[3]));
+        b2 = vtrn_u8(vld1_u8(src[4]), vld1_u8(src[5]));
+        b3 = vtrn_u8(vld1_u8(src[6]), vld1_u8(src[7]));
+
+        c0 = vtrn_u16(vreinterpret_u16_u8(b0.val[0]), vreinterpret_u16_u8(b1.val[0]));
+        c1 = vtrn_u16(vreinterpret_u16_u8(b0.val[1]), vreinterpret_u16_u8(b1.val[1]));
+        c2 = vtrn_u16(vreinterpret_u16_u8(b2.val[0]), vreinterpret_u16_u8(b3.val[0]));
+        c3 = vtrn_u16(vreinterpret_u16_u8(b2.val[1]), vreinterpret_u16_u8(b3.val[1]));
+
+        d0 = vtrn_u32(vreinterpret_u32_u16(c0.val[0]), vreinterpret_u32_u16(c2.val[0]));
+        d1 = vtrn_u32(vreinterpret_u32_u16(c1.val[0]), vreinterpret_u32_u16(c3.val[0]));
+        d2 = vtrn_u32(vreinterpret_u32_u16(c0.val[1]), vreinterpret_u32_u16(c2.val[1]));
+        d3 = vtrn_u32(vreinterpret_u32_u16(c1.val[1]), vreinterpret_u32_u16(c3.val[1]));
+
+        vst1_u8(dst, vreinterpret_u8_u32(d0.val[0]));
+        vst1_u8(dst + dstep, vreinterpret_u8_u32(d1.val[0]));
+        vst1_u8(dst + 2 * dstep, vreinterpret_u8_u32(d2.val[0]));
+        vst1_u8(dst + 3 * dstep, vreinterpret_u8_u32(d3.val[0]));
+        vst1_u8(dst + 4 * dstep, vreinterpret_u8_u32(d0.val[1]));
+        vst1_u8(dst + 5 * dstep, vreinterpret_u8_u32(d1.val[1]));
+        vst1_u8(dst + 6 * dstep, vreinterpret_u8_u32(d2.val[1]));
+        vst1_u8(dst + 7 * dstep, vreinterpret_u8_u32(d3.val[1]));
+    #else
+        int x, y;
+
+        for (x = 0; x < 8; x++) {
+            for (y = 0; y < 8; y++) {
+                dst[y] = src[y][x];
+            }
+            dst += dstep;
         }
-    }
+    #endif
 }
 
 /**
- * rot90ccw
+ * rot90
+ *
+ *  Performs a 90 degrees rotation of the plane pointed to by src into dst,
+ *  clockwise or counterclockwise.  The rotation is NOT performed in-place.
  *
- *  Performs a 90 degrees counterclockwise rotation of the memory block pointed
- *  to by src. The rotation is not performed in-place; dst must point to a
- *  receiving memory block the same size as src.
+ *  The plane is read in blocks of ROTATE_BLOCK x ROTATE_BLOCK pixels so that
+ *  the rows written for a block stay in the cache until they are filled.
+ *  Within a block, the pixels are moved in tiles of 8x8 by rotate_tile.  The
+ *  columns and rows past the last full tile are moved one pixel at a time.
  *
  * Parameters:
  *
- *   src    - pointer to the memory block (image) to rotate counterclockwise
- *   dst    - where to put the rotated memory block
- *   size   - the size (in bytes) of the memory blocks (both src and dst)
- *   width  - the width of the memory block when seen as an image
- *   height - the height of the memory block when seen as an image
+ *   src    - pointer to the plane to rotate
+ *   dst    - where to put the rotated plane
+ *   width  - the width of the source plane
+ *   height - the height of the source plane
+ *   cw     - TRUE to rotate clockwise
  *
  * Returns: nothing
  */
-static inline void rot90ccw(unsigned char *src, register unsigned char *dst
-            ,int size, int width, int height)
+static void rot90(const unsigned char *src, unsigned char *dst
+            , int width, int height, int cw)
 {
-    unsigned char *endp;
-    register unsigned char *base;
-    int j;
-
-    endp = src + size;
-    dst = dst + size - 1;
-    for (base = endp - width; base < endp; base++) {
-        src = base;
-        for (j = 0; j < height; j++, src -= width) {
-            *dst-- = *src;
+    const unsigned char *rows[8];
+    int bx, by, x, y, x_end, y_end, i, tiled_w, tiled_h;
+
+    tiled_w = width & ~7;
+    tiled_h = height & ~7;
+
+    for (by = 0; by < tiled_h; by += ROTATE_BLOCK) {
+        y_end = MIN(by + ROTATE_BLOCK, tiled_h);
+        for (bx = 0; bx < tiled_w; bx += ROTATE_BLOCK) {
+            x_end = MIN(bx + ROTATE_BLOCK, tiled_w);
+            for (y = by; y < y_end; y += 8) {
+                for (x = bx; x < x_end; x += 8) {
+                    if (cw) {
+                        /* Source row y goes to destination column height - 1 - y */
+                        for (i = 0; i < 8; i++) {
+                            rows[i] = src + (y + 7 - i) * width + x;
+                        }
+                        rotate_tile(rows, dst + x * height + (height - 8 - y), height);
+                    } else {
+                        /* Source column x goes to destination row width - 1 - x */
+                        for (i = 0; i < 8; i++) {
+                            rows[i] = src + (y + i) * width + x;
+                        }
+                        rotate_tile(rows, dst + (width - 1 - x) * height + y, -height);
+                    }
+                }
+            }
+        }
+    }
+
+    for (y = 0; y < height; y++) {
+        x = (y < tiled_h) ? tiled_w : 0;
+        for (; x < width; x++) {
+            if (cw) {
+                dst[x * height + (height - 1 - y)] = src[y * width + x];
+            } else {
+                dst[(width - 1 - x) * height + y] = src[y * width + x];
+            }
         }
     }
 }
@@ -278,9 +369,9 @@ void rotate_init(struct context *cnt)
      * cannot be performed in-place (they can, but it would be too slow).
      */
     if ((cnt->rotate_data.degrees == 90) || (cnt->rotate_data.degrees == 270)) {
-        cnt->rotate_data.buffer_norm = mymalloc(size_norm);
+        cnt->rotate_data.buffer_norm = frame_arena_alloc(cnt, size_norm);
         if (size_high > 0) {
-            cnt->rotate_data.buffer_high = mymalloc(size_high);
+            cnt->rotate_data.buffer_high = frame_arena_alloc(cnt, size_high);
         }
     }
 
@@ -301,11 +392,11 @@ void rotate_deinit(struct context *cnt)
 {
 
     if (cnt->rotate_data.buffer_norm) {
-        free(cnt->rotate_data.buffer_norm);
+        frame_arena_free(cnt, cnt->rotate_data.buffer_norm);
     }
 
     if (cnt->rotate_data.buffer_high) {
-        free(cnt->rotate_data.buffer_high);
+        frame_arena_free(cnt, cnt->rotate_data.buffer_high);
     }
 }
 
@@ -336,7 +427,7 @@ int rotate_map(struct context *cnt, struct image_data *img_data)
 
     int indx, indx_max;
     int wh, wh4 = 0, w2 = 0, h2 = 0;  /* width * height, width * height / 4 etc. */
-    int size, deg;
+    int deg;
     enum FLIP_TYPE axis;
     int width, height;
     unsigned char *img;
@@ -372,13 +463,11 @@ int rotate_map(struct context *cnt, struct image_data *img_data)
         /*
          * Pre-calculate some stuff:
          *  wh   - size of the Y plane
-         *  size - size of the entire memory block
          *  wh4  - size of the U plane, and the V plane
          *  w2   - width of the U plane, and the V plane
          *  h2   - as w2, but height instead
          */
         wh = width * height;
-        size = wh * 3 / 2;
         wh4 = wh / 4;
         w2 = width / 2;
         h2 = height / 2;
@@ -400,22 +489,27 @@ int rotate_map(struct context *cnt, struct image_data *img_data)
 
         switch (deg) {
         case 90:
-            rot90cw(img, temp_buff, wh, width, height);
-            rot90cw(img + wh, temp_buff + wh, wh4, w2, h2);
-            rot90cw(img + wh + wh4, temp_buff + wh + wh4, wh4, w2, h2);
-            memcpy(img, temp_buff, size);
+        case 270:
+            rot90(img, temp_buff, width, height, (deg == 90));
+            rot90(img + wh, temp_buff + wh, w2, h2, (deg == 90));
+            rot90(img + wh + wh4, temp_buff + wh + wh4, w2, h2, (deg == 90));
+            /*
+             * The rotated image takes the place of the captured one and
+             * the captured buffer is the one rotated into next time.
+             */
+            if (indx == 0) {
+                img_data->image_norm = temp_buff;
+                cnt->rotate_data.buffer_norm = img;
+            } else {
+                img_data->image_high = temp_buff;
+                cnt->rotate_data.buffer_high = img;
+            }
             break;
         case 180:
             reverse_inplace_quad(img, wh);
             reverse_inplace_quad(img + wh, wh4);
             reverse_inplace_quad(img + wh + wh4, wh4);
             break;
-        case 270:
-            rot90ccw(img, temp_buff, wh, width, height);
-            rot90ccw(img + wh, temp_buff + wh, wh4, w2, h2);
-            rot90ccw(img + wh + wh4, temp_buff + wh + wh4, wh4, w2, h2);
-            memcpy(img, temp_buff, size);
-            break;
         default:
             /* Invalid */
             return -1;
@@ -25,6 +25,8 @@
 #ifndef _INCLUDE_ROTATE_H
 #define _INCLUDE_ROTATE_H
 
+#define ROTATE_BLOCK    64      /* Side of the blocks a plane is rotated in, multiple of 8 */
+
 /**
  * rotate_init
  *
@@ -57,12 +59,13 @@ void rotate_deinit(struct context *cnt);
  *  available in cnt. Rotation is performed clockwise. Supports 90,
  *  180 and 270 degrees rotation. 180 degrees rotation is performed
  *  in-place by simply reversing the image data, which is a very
- *  fast operation. 90 and 270 degrees rotation are performed using
- *  a temporary buffer and a somewhat more complicated algorithm,
- *  which makes them slower.
+ *  fast operation. 90 and 270 degrees rotation are performed into
+ *  a temporary buffer which then takes the place of the image in
+ *  img_data, while the buffer of the image becomes the temporary
+ *  buffer for the next frame.
  *
- *  Note that to the caller, all rotations will seem as they are
- *  performed in-place.
+ *  Note that after a 90 or 270 degrees rotation, the image pointers
+ *  of img_data have changed.
  *
  * Parameters:
  *
@@ -0,0 +1,303 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      scale.c
+ *
+ *      Resize YUV420P images to any size.
+ *
+ *      Each destination pixel is the average of the source pixels it covers
+ *      weighted by how much of them it covers (area filter).  When the image
+ *      is made larger, it is interpolated between the two nearest source
+ *      pixels instead (bilinear filter).  The filter is applied down the
+ *      columns first and then along the rows, with the weights of every
+ *      destination row and column computed once in scale_init.
+ *
+ *      The weights of a destination pixel add up to SCALE_ONE so that the
+ *      weighted sum of 8 bit pixels fits in 16 bits.  The column pass, which
+ *      reads every source pixel, then works on 8 or 16 pixels at a time
+ *      with SSE2 or NEON.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "scale.h"
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+/**
+ * scale_axis_init
+ *
+ *   Compute the source pixels and weights of every destination pixel along
+ *   one direction.  Positions are counted in units of 1/dst_n source pixel
+ *   so that no floating point is needed.
+ */
+static void scale_axis_init(struct scale_axis *axis, int src_n, int dst_n)
+{
+    unsigned short *weight;
+    long x0, x1, ctr, lo, hi, frac;
+    int d, s, first, last, taps, pos, wgt;
+
+    if (src_n >= dst_n) {
+        taps = ((src_n + dst_n - 1) / dst_n) + 1;
+    } else {
+        taps = 2;
+    }
+    if (taps > src_n) {
+        taps = src_n;
+    }
+
+    axis->src_n = src_n;
+    axis->dst_n = dst_n;
+    axis->taps = taps;
+    axis->pos = mymalloc(dst_n * sizeof(int));
+    axis->weight = mymalloc(dst_n * taps * sizeof(unsigned short));
+    memset(axis->weight, 0, dst_n * taps * sizeof(unsigned short));
+
+    for (d = 0; d < dst_n; d++) {
+        weight = axis->weight + (d * taps);
+
+        if (src_n >= dst_n) {
+            /* Source pixel s covers [s * dst_n, (s + 1) * dst_n) */
+            x0 = (long)d * src_n;
+            x1 = (long)(d + 1) * src_n;
+            first = (int)(x0 / dst_n);
+            last = (int)((x1 - 1) / dst_n);
+            frac = 0;
+        } else {
+            /* Center of the destination pixel in units of 1/(2 * dst_n) */
+            ctr = ((long)(2 * d + 1) * src_n) - dst_n;
+            if (ctr < 0) {
+                ctr = 0;
+            }
+            first = (int)(ctr / (2 * dst_n));
+            frac = ctr % (2 * dst_n);
+            last = first + 1;
+            x0 = x1 = 0;
+        }
+        if (last > src_n - 1) {
+            last = src_n - 1;
+        }
+
+        pos = first;
+        if (pos + taps > src_n) {
+            pos = src_n - taps;
+        }
+        axis->pos[d] = pos;
+
+        for (s = first; s <= last; s++) {
+            if (src_n >= dst_n) {
+                /* Rounded from the start of the destination pixel so the
+                 * weights always add up to SCALE_ONE
+                 */
+                lo = (((long)s * dst_n > x0) ? (long)s * dst_n : x0) - x0;
+                hi = (((long)(s + 1) * dst_n < x1) ? (long)(s + 1) * dst_n : x1) - x0;
+                wgt = (int)(((hi * SCALE_ONE) + (src_n / 2)) / src_n)
+                    - (int)(((lo * SCALE_ONE) + (src_n / 2)) / src_n);
+            } else if (first == last) {
+                wgt = SCALE_ONE;
+            } else if (s == first) {
+                wgt = SCALE_ONE - (int)((frac * SCALE_ONE) / (2 * dst_n));
+            } else {
+                wgt = (int)((frac * SCALE_ONE) / (2 * dst_n));
+            }
+            weight[s - pos] = (unsigned short)wgt;
+        }
+    }
+}
+
+static void scale_axis_deinit(struct scale_axis *axis)
+{
+    free(axis->pos);
+    free(axis->weight);
+    axis->pos = NULL;
+    axis->weight = NULL;
+}
+
+/**
+ * scale_column
+ *
+ *   Weighted sum of the source rows making up destination row y, for all
+ *   the columns of the source.  The sums are SCALE_ONE times the pixels.
+ */
+static void scale_column(const struct scale_axis *axis, int y
+            , const unsigned char *plane, int width, unsigned short *row)
+{
+    const unsigned char *src;
+    const unsigned short *weight;
+    unsigned int sum;
+    int x, t;
+
+    src = plane + (axis->pos[y] * width);
+    weight = axis->weight + (y * axis->taps);
+
+    x = 0;
+
+    #if defined(__SSE2__)
+        {
+            __m128i zero, lo, hi, px, wgt;
+
+            zero = _mm_setzero_si128();
+            for (; x + 16 <= width; x += 16) {
+                lo = zero;
+                hi = zero;
+                for (t = 0; t < axis->taps; t++) {
+                    if (weight[t] == 0) {
+                        continue;
+                    }
+                    wgt = _mm_set1_epi16((short)weight[t]);
+                    px = _mm_loadu_si128((const __m128i *)(src + (t * width) + x));
+                    lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), wgt));
+                    hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), wgt));
+                }
+                _mm_storeu_si128((__m128i *)(row + x), lo);
+                _mm_storeu_si128((__m128i *)(row + x + 8), hi);
+            }
+        }
+    #elif defined(__ARM_NEON)
+        {
+            uint16x8_t lo, hi;
+            uint8x16_t px;
+
+            for (; x + 16 <= width; x += 16) {
+                lo = vdupq_n_u16(0);
+                hi = vdupq_n_u16(0);
+                for (t = 0; t < axis->taps; t++) {
+                    if (weight[t] == 0) {
+                        continue;
+                    }
+                    px = vld1q_u8(src + (t * width) + x);
+                    lo = vmlaq_n_u16(lo, vmovl_u8(vget_low_u8(px)), weight[t]);
+                    hi = vmlaq_n_u16(hi, vmovl_u8(vget_high_u8(px)), weight[t]);
+                }
+                vst1q_u16(row + x, lo);
+                vst1q_u16(row + x + 8, hi);
+            }
+        }
+    #endif
+
+    for (; x < width; x++) {
+        sum = 0;
+        for (t = 0; t < axis->taps; t++) {
+            sum += (unsigned int)src[(t * width) + x] * weight[t];
+        }
+        row[x] = (unsigned short)sum;
+    }
+}
+
+/* Weighted sum along the row filtered by scale_column for every destination pixel */
+static void scale_row(const struct scale_axis *axis, const unsigned short *row, unsigned char *dst)
+{
+    const unsigned short *src, *weight;
+    unsigned int sum;
+    int x, t;
+
+    weight = axis->weight;
+    for (x = 0; x < axis->dst_n; x++) {
+        src = row + axis->pos[x];
+        sum = 0;
+        for (t = 0; t < axis->taps; t++) {
+            sum += (unsigned int)src[t] * weight[t];
+        }
+        dst[x] = (unsigned char)((sum + ((SCALE_ONE * SCALE_ONE) / 2)) / (SCALE_ONE * SCALE_ONE));
+        weight += axis->taps;
+    }
+}
+
+static void scale_plane(struct scale_ctx *ctx, const struct scale_axis *axis_x
+            , const struct scale_axis *axis_y, const unsigned char *src, unsigned char *dst)
+{
+    int y;
+
+    for (y = 0; y < axis_y->dst_n; y++) {
+        scale_column(axis_y, y, src, axis_x->src_n, ctx->row);
+        scale_row(axis_x, ctx->row, dst + (y * axis_x->dst_n));
+    }
+}
+
+/**
+ * scale_init
+ *
+ *   Prepare the resizing of images of one size to another.  The sizes must
+ *   be even.
+ */
+struct scale_ctx *scale_init(int width_src, int height_src, int width_dst, int height_dst)
+{
+    struct scale_ctx *ctx;
+
+    ctx = mymalloc(sizeof(struct scale_ctx));
+    ctx->width_src = width_src;
+    ctx->height_src = height_src;
+    ctx->width_dst = width_dst;
+    ctx->height_dst = height_dst;
+
+    scale_axis_init(&ctx->luma_x, width_src, width_dst);
+    scale_axis_init(&ctx->luma_y, height_src, height_dst);
+    scale_axis_init(&ctx->chroma_x, width_src / 2, width_dst / 2);
+    scale_axis_init(&ctx->chroma_y, height_src / 2, height_dst / 2);
+
+    ctx->row = mymalloc(width_src * sizeof(unsigned short));
+
+    return ctx;
+}
+
+void scale_deinit(struct scale_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    scale_axis_deinit(&ctx->luma_x);
+    scale_axis_deinit(&ctx->luma_y);
+    scale_axis_deinit(&ctx->chroma_x);
+    scale_axis_deinit(&ctx->chroma_y);
+    free(ctx->row);
+    free(ctx);
+}
+
+/* Whether the scaler was prepared for these sizes */
+int scale_fits(const struct scale_ctx *ctx, int width_src, int height_src, int width_dst, int height_dst)
+{
+    return ((ctx != NULL) &&
+            (ctx->width_src == width_src) && (ctx->height_src == height_src) &&
+            (ctx->width_dst == width_dst) && (ctx->height_dst == height_dst));
+}
+
+/**
+ * scale_yuv420p
+ *
+ *   Resize the YUV420P image img_src into img_dst.
+ */
+void scale_yuv420p(struct scale_ctx *ctx, const unsigned char *img_src, unsigned char *img_dst)
+{
+    const unsigned char *src_u, *src_v;
+    unsigned char *dst_u, *dst_v;
+
+    src_u = img_src + (ctx->width_src * ctx->height_src);
+    src_v = src_u + ((ctx->width_src / 2) * (ctx->height_src / 2));
+    dst_u = img_dst + (ctx->width_dst * ctx->height_dst);
+    dst_v = dst_u + ((ctx->width_dst / 2) * (ctx->height_dst / 2));
+
+    scale_plane(ctx, &ctx->luma_x, &ctx->luma_y, img_src, img_dst);
+    scale_plane(ctx, &ctx->chroma_x, &ctx->chroma_y, src_u, dst_u);
+    scale_plane(ctx, &ctx->chroma_x, &ctx->chroma_y, src_v, dst_v);
+}
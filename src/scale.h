@@ -0,0 +1,55 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      scale.h
+ *
+ *      Headers associated with functions in the scale.c module.
+ *
+ */
+
+#ifndef _INCLUDE_SCALE_H
+#define _INCLUDE_SCALE_H
+
+#define SCALE_ONE       256     /* Sum of the weights of a destination pixel */
+
+/* Source pixels making up each destination pixel along one direction */
+struct scale_axis {
+    int                 src_n;
+    int                 dst_n;
+    int                 taps;           /* Source pixels weighted for every destination pixel */
+    int                *pos;            /* First source pixel of each destination pixel */
+    unsigned short     *weight;         /* Weights of the taps of each destination pixel */
+};
+
+struct scale_ctx {
+    int                 width_src;
+    int                 height_src;
+    int                 width_dst;
+    int                 height_dst;
+    struct scale_axis   luma_x;
+    struct scale_axis   luma_y;
+    struct scale_axis   chroma_x;
+    struct scale_axis   chroma_y;
+    unsigned short     *row;            /* Source row filtered vertically */
+};
+
+struct scale_ctx *scale_init(int width_src, int height_src, int width_dst, int height_dst);
+void scale_deinit(struct scale_ctx *ctx);
+int scale_fits(const struct scale_ctx *ctx, int width_src, int height_src, int width_dst, int height_dst);
+void scale_yuv420p(struct scale_ctx *ctx, const unsigned char *img_src, unsigned char *img_dst);
+
+#endif /* _INCLUDE_SCALE_H */
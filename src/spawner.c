@@ -0,0 +1,385 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      spawner.c
+ *
+ *      Start the on_* commands of all the cameras from one thread.
+ *
+ *      A fork of the Motion process has to copy the page tables of all the
+ *      image buffers, which takes milliseconds while the camera thread
+ *      waits.  The commands are instead queued and started by the spawner
+ *      thread with posix_spawn, which does not copy the process.  With
+ *      on_command_max, commands wait in the queue while that many of them
+ *      are still running.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "event.h"
+#include "pipeline.h"
+#include "spawner.h"
+#include <spawn.h>
+#include <dirent.h>
+
+/* Leave only the console descriptors open in the command, so we see its errors */
+static void spawner_closefds(posix_spawn_file_actions_t *actions)
+{
+    #ifdef HAVE_POSIX_SPAWN_CLOSEFROM
+        posix_spawn_file_actions_addclosefrom_np(actions, 3);
+    #else
+        DIR *dir;
+        struct dirent *ent;
+        int fd;
+
+        dir = opendir("/proc/self/fd");
+        if (dir == NULL) {
+            return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            fd = atoi(ent->d_name);
+            if ((fd > 2) && (fd != dirfd(dir))) {
+                posix_spawn_file_actions_addclose(actions, fd);
+            }
+        }
+        closedir(dir);
+    #endif
+}
+
+/**
+ * spawner_run
+ *
+ *   Start the command with /bin/sh in a session of its own and with the
+ *   default handling of the signals Motion ignores.  Returns the pid or -1.
+ */
+static pid_t spawner_run(const char *command)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    char *argv[5];
+    pid_t pid;
+    short flags;
+    int retcd;
+
+    posix_spawn_file_actions_init(&actions);
+    spawner_closefds(&actions);
+
+    posix_spawnattr_init(&attr);
+    flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    #ifdef POSIX_SPAWN_SETSID
+        flags |= POSIX_SPAWN_SETSID;
+    #else
+        flags |= POSIX_SPAWN_SETPGROUP;
+    #endif
+    posix_spawnattr_setflags(&attr, flags);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+
+    argv[0] = (char *)"sh";
+    argv[1] = (char *)"-c";
+    argv[2] = (char *)command;
+    argv[3] = (char *)" &";
+    argv[4] = NULL;
+
+    retcd = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (retcd != 0) {
+        errno = retcd;
+        MOTION_LOG(ALR, TYPE_EVENTS, SHOW_ERRNO
+            ,_("Unable to start external command '%s'"), command);
+        return -1;
+    }
+
+    return pid;
+}
+
+/**
+ * spawner_ended
+ *
+ *   Whether the command has ended.  The ended commands are reaped by the
+ *   system or the SIGCHLD handler, after which waitpid no longer knows
+ *   them.  Unlike kill, waitpid only looks at the children of Motion so a
+ *   pid taken again by another process is not mistaken for the command.
+ */
+static int spawner_ended(pid_t pid)
+{
+    pid_t retcd;
+
+    retcd = waitpid(pid, NULL, WNOHANG);
+    if (retcd == 0) {
+        return FALSE;
+    }
+    if ((retcd == -1) && (errno == EINTR)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Forget the commands that have ended */
+static void spawner_reap(struct spawner *spw)
+{
+    int indx;
+
+    indx = 0;
+    while (indx < spw->running_count) {
+        if (spawner_ended(spw->running[indx])) {
+            spw->running_count--;
+            spw->running[indx] = spw->running[spw->running_count];
+        } else {
+            indx++;
+        }
+    }
+}
+
+/* The command that had the pid of a new one has ended, even if it was not seen */
+static void spawner_forget(struct spawner *spw, pid_t pid)
+{
+    int indx;
+
+    for (indx = 0; indx < spw->running_count; indx++) {
+        if (spw->running[indx] == pid) {
+            spw->running_count--;
+            spw->running[indx] = spw->running[spw->running_count];
+            return;
+        }
+    }
+}
+
+/**
+ * spawner_loop
+ *
+ *   Thread function of the spawner.  Starts the commands in the order they
+ *   were queued.  While on_command_max of them run, looks for ended ones
+ *   every 100ms.  Once asked to end, starts the commands left at once.
+ */
+static void *spawner_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct spawner *spw = cnt->spawner;
+    struct spawn_job job;
+    struct timeval tv_now;
+    struct timespec ts;
+    long latency;
+    pid_t pid;
+
+    util_threadname_set("sp", 0, NULL);
+
+    pthread_mutex_lock(&spw->mutex);
+        while (TRUE) {
+            while ((spw->count == 0) && (!spw->stage.finish)) {
+                pthread_cond_wait(&spw->cond_work, &spw->mutex);
+            }
+            if (spw->count == 0) {
+                break;
+            }
+
+            if ((spw->running_max > 0) && (!spw->stage.finish)) {
+                spawner_reap(spw);
+                if (spw->running_count >= spw->running_max) {
+                    clock_gettime(CLOCK_REALTIME, &ts);
+                    ts.tv_nsec += 100000000L;
+                    if (ts.tv_nsec >= 1000000000L) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000L;
+                    }
+                    pthread_cond_timedwait(&spw->cond_work, &spw->mutex, &ts);
+                    continue;
+                }
+            }
+
+            job = spw->jobs[spw->head];
+            spw->head = (spw->head + 1) % SPAWNER_QUEUE_MAX;
+            spw->count--;
+
+            pthread_mutex_unlock(&spw->mutex);
+
+            pid = spawner_run(job.command);
+
+            gettimeofday(&tv_now, NULL);
+            latency = ((tv_now.tv_sec - job.tv_queued.tv_sec) * 1000000L) +
+                (tv_now.tv_usec - job.tv_queued.tv_usec);
+            if (pid > 0) {
+                MOTION_LOG(DBG, TYPE_EVENTS, NO_ERRNO
+                    ,_("Executing external command '%s' of camera %d after %ld us")
+                    ,job.command, job.threadnr, latency);
+            }
+            free(job.command);
+
+            pthread_mutex_lock(&spw->mutex);
+
+            if (pid > 0) {
+                spw->started++;
+                spw->latency_last = latency;
+                if (latency > spw->latency_max) {
+                    spw->latency_max = latency;
+                }
+                if (spw->running_max > 0) {
+                    spawner_forget(spw, pid);
+                    spw->running[spw->running_count++] = pid;
+                }
+            } else {
+                spw->failed++;
+            }
+        }
+    pthread_mutex_unlock(&spw->mutex);
+
+    spw->stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/**
+ * spawner_put
+ *
+ *   Queue a command for the spawner.  Without the spawner thread, the
+ *   command is started right away.
+ */
+void spawner_put(struct context *cnt, const char *command)
+{
+    struct spawner *spw = cnt->spawner;
+    struct spawn_job *job;
+    char *cmd;
+
+    if (spw == NULL) {
+        if (spawner_run(command) > 0) {
+            MOTION_LOG(DBG, TYPE_EVENTS, NO_ERRNO
+                ,_("Executing external command '%s'"), command);
+        }
+        return;
+    }
+
+    cmd = mystrdup(command);
+
+    pthread_mutex_lock(&spw->mutex);
+        if (spw->count == SPAWNER_QUEUE_MAX) {
+            spw->dropped++;
+        } else {
+            job = &spw->jobs[(spw->head + spw->count) % SPAWNER_QUEUE_MAX];
+            job->command = cmd;
+            job->threadnr = cnt->threadnr;
+            gettimeofday(&job->tv_queued, NULL);
+            cmd = NULL;
+            spw->count++;
+            pthread_cond_signal(&spw->cond_work);
+        }
+    pthread_mutex_unlock(&spw->mutex);
+
+    if (cmd != NULL) {
+        MOTION_LOG(WRN, TYPE_EVENTS, NO_ERRNO
+            ,_("Command queue full, external command '%s' not executed"), cmd);
+        free(cmd);
+    }
+}
+
+/**
+ * spawner_init
+ *
+ *   Start the spawner thread.  The commands of all the contexts go through
+ *   the one of the first context.
+ */
+void spawner_init(struct context **cntlist)
+{
+    struct spawner *spw;
+    int indx;
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->spawner = NULL;
+    }
+
+    spw = mymalloc(sizeof(struct spawner));
+    spw->stage.finished = TRUE;
+    spw->stage.global = TRUE;
+    spw->running_max = cntlist[0]->conf.on_command_max;
+    if (spw->running_max > 0) {
+        spw->running = mymalloc(spw->running_max * sizeof(pid_t));
+    } else {
+        spw->running = NULL;
+    }
+    pthread_mutex_init(&spw->mutex, NULL);
+    pthread_cond_init(&spw->cond_work, NULL);
+
+    cntlist[0]->spawner = spw;
+
+    if (pipeline_stage_start(cntlist[0], &spw->stage, spawner_loop) != 0) {
+        /* Start the commands in the event handlers */
+        spawner_deinit(cntlist);
+        return;
+    }
+
+    for (indx = 1; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->spawner = spw;
+    }
+
+    if (spw->running_max > 0) {
+        MOTION_LOG(NTC, TYPE_EVENTS, NO_ERRNO
+            ,_("Command spawner started, at most %d commands running"), spw->running_max);
+    }
+}
+
+/**
+ * spawner_deinit
+ *
+ *   Start the commands left in the queue and stop the spawner thread.
+ *   Called once the cameras have stopped.
+ */
+void spawner_deinit(struct context **cntlist)
+{
+    struct spawner *spw = cntlist[0]->spawner;
+    int indx;
+
+    if (spw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&spw->mutex);
+        spw->stage.finish = TRUE;
+        pthread_cond_broadcast(&spw->cond_work);
+    pthread_mutex_unlock(&spw->mutex);
+
+    pipeline_stage_stop(cntlist[0], &spw->stage, NULL);
+
+    while (spw->count > 0) {
+        free(spw->jobs[spw->head].command);
+        spw->head = (spw->head + 1) % SPAWNER_QUEUE_MAX;
+        spw->count--;
+    }
+
+    if (spw->started > 0) {
+        MOTION_LOG(INF, TYPE_EVENTS, NO_ERRNO
+            ,_("Command spawner finished: %lu commands, %lu failed, %lu dropped, longest wait %ld us")
+            ,spw->started, spw->failed, spw->dropped, spw->latency_max);
+    }
+
+    pthread_mutex_destroy(&spw->mutex);
+    pthread_cond_destroy(&spw->cond_work);
+
+    free(spw->running);
+    free(spw);
+
+    for (indx = 0; cntlist[indx] != NULL; indx++) {
+        cntlist[indx]->spawner = NULL;
+    }
+}
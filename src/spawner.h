@@ -0,0 +1,59 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      spawner.h
+ *
+ *      Headers associated with functions in the spawner.c module.
+ *      The file pipeline.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_SPAWNER_H
+#define _INCLUDE_SPAWNER_H
+
+#define SPAWNER_QUEUE_MAX   64      /* Commands waiting to be started */
+
+/* A command waiting to be started */
+struct spawn_job {
+    char               *command;
+    int                 threadnr;       /* Camera that asked for it, for the log */
+    struct timeval      tv_queued;
+};
+
+/* Thread starting the on_* commands of all the cameras.  Only on the first context */
+struct spawner {
+    struct pipe_stage   stage;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond_work;      /* Spawner waits for commands */
+    struct spawn_job    jobs[SPAWNER_QUEUE_MAX];
+    int                 head;
+    int                 count;
+    int                 running_max;    /* on_command_max, 0 for no limit */
+    pid_t              *running;        /* Commands started that have not ended yet */
+    int                 running_count;
+    unsigned long       started;
+    unsigned long       failed;
+    unsigned long       dropped;
+    long                latency_last;   /* Microseconds from queued to started */
+    long                latency_max;
+};
+
+void spawner_init(struct context **cntlist);
+void spawner_deinit(struct context **cntlist);
+void spawner_put(struct context *cnt, const char *command);
+
+#endif /* _INCLUDE_SPAWNER_H */
@@ -0,0 +1,264 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      stream_jpeg.c
+ *
+ *      Compressed images of the web streams shared with the clients without
+ *      copying them and without a lock.
+ *
+ *      Every stream has a list of buffers that only grows while the camera
+ *      runs.  The thread compressing the stream images claims a buffer that
+ *      no client references, fills it and swaps it with the published one
+ *      with an atomic exchange.  A client takes a reference on the published
+ *      buffer and sends the image straight from it, so a published image is
+ *      never changed and the compressing thread never waits for the clients.
+ *
+ *      Buffers are only freed with the stream, so a client may look at the
+ *      count of a buffer that was replaced meanwhile.  It then sees that the
+ *      buffer is no longer published, drops the reference and tries again.
+ *
+ *      Only one thread may compress the images of a stream at a time.
+ *
+ *      The substream, quarter and thumbnail streams are the camera image
+ *      scaled to a smaller size.  The scaler and the scaled image belong to
+ *      the stream so they are only made while the stream has clients.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "picture.h"
+#include "jpeg_cache.h"
+#include "scale.h"
+#include "stream_jpeg.h"
+
+/**
+ * stream_jpeg_claim
+ *
+ *   Get a buffer no client references for the next image of the stream.
+ *   The buffer is held until it is given to stream_jpeg_publish.
+ */
+struct stream_jpeg *stream_jpeg_claim(struct context *cnt, struct stream_data *stream)
+{
+    struct stream_jpeg *jpeg;
+    int refcnt, size;
+
+    for (jpeg = stream->buffers; jpeg != NULL; jpeg = jpeg->next) {
+        refcnt = 0;
+        if (__atomic_compare_exchange_n(&jpeg->refcnt, &refcnt, 1, FALSE
+                , __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return jpeg;
+        }
+    }
+
+    /* All the buffers are being sent.  The mosaic is larger than a camera image */
+    size = (stream->width * stream->height * 3) / 2;
+    if (size < cnt->imgs.size_norm) {
+        size = cnt->imgs.size_norm;
+    }
+    jpeg = mymalloc(sizeof(struct stream_jpeg));
+    jpeg->jpeg_data = mymalloc(size);
+    jpeg->refcnt = 1;
+    jpeg->next = stream->buffers;
+    stream->buffers = jpeg;
+
+    return jpeg;
+}
+
+/**
+ * stream_jpeg_publish
+ *
+ *   Give the clients the image in the claimed buffer and drop the previous
+ *   image.  A size of 0 hands the buffer back unpublished.
+ */
+void stream_jpeg_publish(struct stream_data *stream, struct stream_jpeg *jpeg, long jpeg_size)
+{
+    struct stream_jpeg *jpeg_prev;
+
+    if (jpeg_size <= 0) {
+        stream_jpeg_release(jpeg);
+        return;
+    }
+
+    jpeg->jpeg_size = jpeg_size;
+    jpeg->seq = __atomic_add_fetch(&stream->seq, 1, __ATOMIC_SEQ_CST);
+
+    jpeg_prev = __atomic_exchange_n(&stream->jpeg, jpeg, __ATOMIC_SEQ_CST);
+    if (jpeg_prev != NULL) {
+        stream_jpeg_release(jpeg_prev);
+    }
+}
+
+/**
+ * stream_jpeg_get
+ *
+ *   Take a reference on the published image of the stream.
+ *
+ * Returns the image to give to stream_jpeg_release or NULL when there is
+ * no image yet.
+ */
+struct stream_jpeg *stream_jpeg_get(struct stream_data *stream)
+{
+    struct stream_jpeg *jpeg;
+
+    while (TRUE) {
+        jpeg = __atomic_load_n(&stream->jpeg, __ATOMIC_SEQ_CST);
+        if (jpeg == NULL) {
+            return NULL;
+        }
+        __atomic_add_fetch(&jpeg->refcnt, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&stream->jpeg, __ATOMIC_SEQ_CST) == jpeg) {
+            return jpeg;
+        }
+        /* Replaced before the reference was taken */
+        stream_jpeg_release(jpeg);
+    }
+}
+
+void stream_jpeg_release(struct stream_jpeg *jpeg)
+{
+    if (jpeg != NULL) {
+        __atomic_sub_fetch(&jpeg->refcnt, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* Whether the stream has published an image */
+int stream_jpeg_ready(struct stream_data *stream)
+{
+    return (__atomic_load_n(&stream->jpeg, __ATOMIC_SEQ_CST) != NULL);
+}
+
+/**
+ * stream_jpeg_free
+ *
+ *   Free the buffers of the stream.  Called once the compressing thread
+ *   has stopped.  A buffer a client still sends is left to that client
+ *   rather than freed under it.
+ */
+void stream_jpeg_free(struct stream_data *stream)
+{
+    struct stream_jpeg *jpeg;
+
+    jpeg = __atomic_exchange_n(&stream->jpeg, NULL, __ATOMIC_SEQ_CST);
+    stream_jpeg_release(jpeg);
+
+    while (stream->buffers != NULL) {
+        jpeg = stream->buffers;
+        stream->buffers = jpeg->next;
+        if (__atomic_load_n(&jpeg->refcnt, __ATOMIC_SEQ_CST) > 0) {
+            MOTION_LOG(WRN, TYPE_STREAM, NO_ERRNO
+                ,_("Stream image still being sent, not freed"));
+            continue;
+        }
+        free(jpeg->jpeg_data);
+        free(jpeg);
+    }
+
+    scale_deinit(stream->scale);
+    stream->scale = NULL;
+    free(stream->image);
+    stream->image = NULL;
+}
+
+/* Quality of the images of the normal stream sent to the clients falling behind */
+int stream_jpeg_low_quality(struct context *cnt)
+{
+    int quality;
+
+    quality = (cnt->conf.stream_quality * STREAM_JPEG_LOW_QUALITY) / 100;
+    if (quality < 1) {
+        quality = 1;
+    }
+
+    return quality;
+}
+
+/**
+ * stream_jpeg_size
+ *
+ *   Set the size of the images of the stream for a width of the camera
+ *   image or less.  The sizes are kept multiples of 8 like the camera
+ *   image for the jpeg encoder.
+ */
+void stream_jpeg_size(struct context *cnt, struct stream_data *stream, int width)
+{
+    int height;
+
+    if ((width <= 0) || (width >= cnt->imgs.width)) {
+        stream->width = cnt->imgs.width;
+        stream->height = cnt->imgs.height;
+        return;
+    }
+
+    height = (int)(((long)cnt->imgs.height * width) / cnt->imgs.width);
+
+    width = width - (width % 8);
+    height = height - (height % 8);
+    if (width < 16) {
+        width = 16;
+    }
+    if (height < 16) {
+        height = 16;
+    }
+
+    stream->width = width;
+    stream->height = height;
+}
+
+/**
+ * stream_jpeg_put_scaled
+ *
+ *   Scale the camera image to the size of the stream and compress it into
+ *   the claimed buffer.
+ *
+ * Returns the size of the jpeg.
+ */
+long stream_jpeg_put_scaled(struct context *cnt, struct stream_data *stream, struct stream_jpeg *jpeg
+            , unsigned char *image, struct image_data *img)
+{
+    if ((stream->width == cnt->imgs.width) && (stream->height == cnt->imgs.height)) {
+        return put_picture_memory(cnt
+            ,jpeg->jpeg_data
+            ,cnt->imgs.size_norm
+            ,image
+            ,cnt->conf.stream_quality
+            ,cnt->imgs.width
+            ,cnt->imgs.height
+            ,img, JPEG_PLANE_NORM);
+    }
+
+    if (!scale_fits(stream->scale, cnt->imgs.width, cnt->imgs.height
+            , stream->width, stream->height)) {
+        scale_deinit(stream->scale);
+        free(stream->image);
+        stream->scale = scale_init(cnt->imgs.width, cnt->imgs.height
+            , stream->width, stream->height);
+        stream->image = mymalloc((stream->width * stream->height * 3) / 2);
+    }
+
+    scale_yuv420p(stream->scale, image, stream->image);
+
+    return put_picture_memory(cnt
+        ,jpeg->jpeg_data
+        ,cnt->imgs.size_norm
+        ,stream->image
+        ,cnt->conf.stream_quality
+        ,stream->width
+        ,stream->height
+        ,img, JPEG_PLANE_SUB);
+}
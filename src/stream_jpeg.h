@@ -0,0 +1,53 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      stream_jpeg.h
+ *
+ *      Headers associated with functions in the stream_jpeg.c module.
+ *
+ */
+
+#ifndef _INCLUDE_STREAM_JPEG_H
+#define _INCLUDE_STREAM_JPEG_H
+
+#define STREAM_JPEG_LOW_QUALITY     50  /* Percent of stream_quality for the slow clients */
+
+struct context;
+struct stream_data;
+struct image_data;
+
+/* Compressed image of a stream.  Not changed while it is published or referenced */
+struct stream_jpeg {
+    struct stream_jpeg     *next;           /* Next buffer of the stream */
+    int                     refcnt;         /* Clients sending it plus one while published or written */
+    unsigned long           seq;            /* Sequence number within the stream */
+    long                    jpeg_size;
+    unsigned char          *jpeg_data;
+};
+
+struct stream_jpeg *stream_jpeg_claim(struct context *cnt, struct stream_data *stream);
+void stream_jpeg_publish(struct stream_data *stream, struct stream_jpeg *jpeg, long jpeg_size);
+struct stream_jpeg *stream_jpeg_get(struct stream_data *stream);
+void stream_jpeg_release(struct stream_jpeg *jpeg);
+int stream_jpeg_ready(struct stream_data *stream);
+void stream_jpeg_free(struct stream_data *stream);
+int stream_jpeg_low_quality(struct context *cnt);
+void stream_jpeg_size(struct context *cnt, struct stream_data *stream, int width);
+long stream_jpeg_put_scaled(struct context *cnt, struct stream_data *stream, struct stream_jpeg *jpeg
+            , unsigned char *image, struct image_data *img);
+
+#endif /* _INCLUDE_STREAM_JPEG_H */
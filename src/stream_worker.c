@@ -0,0 +1,437 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      stream_worker.c
+ *
+ *      Thread compressing the images of the web streams of a camera so that
+ *      the thread running the event handlers only publishes the raw frame.
+ *
+ *      The motion thread copies the images the connected streams need into
+ *      a spare frame and swaps it with the published one.  A frame that the
+ *      worker has not taken yet is replaced by the newer one, so the motion
+ *      thread never waits for the worker.
+ *
+ *      A stream image is only compressed when a client of the stream will
+ *      fetch it before the next frame arrives.  Each client registers the
+ *      time of its next fetch after it copied an image (stream_worker_want)
+ *      and the stream keeps the earliest of them, so the images are
+ *      compressed at the rate of the fastest client rather than at the
+ *      rate of the camera.
+ */
+
+#include "translate.h"
+#include "motion.h"
+#include "util.h"
+#include "logger.h"
+#include "picture.h"
+#include "jpeg_cache.h"
+#include "event.h"
+#include "pipeline.h"
+#include "stream_worker.h"
+#include "stream_jpeg.h"
+#include "webu.h"
+#include "webu_stream.h"
+
+/**
+ * stream_worker_want
+ *
+ *   Register that a client of the stream will fetch an image at tv_due.
+ */
+void stream_worker_want(struct context *cnt, struct stream_data *stream, const struct timeval *tv_due)
+{
+    long long due, due_prev;
+
+    (void)cnt;
+
+    due = ((long long)tv_due->tv_sec * 1000000LL) + tv_due->tv_usec;
+
+    due_prev = __atomic_load_n(&stream->due, __ATOMIC_SEQ_CST);
+    while ((due_prev == 0) || (due < due_prev)) {
+        if (__atomic_compare_exchange_n(&stream->due, &due_prev, due, FALSE
+                , __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+    }
+}
+
+/**
+ * stream_worker_due
+ *
+ *   Whether a client of the stream fetches an image before the frame after
+ *   this one arrives.  Called with mutex_stream held, or without it by the
+ *   motion thread as a hint of which images to copy.
+ */
+static int stream_worker_due(struct context *cnt, struct stream_data *stream, long long now)
+{
+    long long due;
+
+    if (stream->cnct_count == 0) {
+        return FALSE;
+    }
+    if (!stream_jpeg_ready(stream)) {
+        return TRUE;
+    }
+
+    due = __atomic_load_n(&stream->due, __ATOMIC_SEQ_CST);
+    if (due == 0) {
+        return FALSE;
+    }
+
+    return ((due - now) <= cnt->required_frame_time);
+}
+
+/* Give the compressed image to the clients of the stream */
+static void stream_worker_publish(struct context *cnt, struct stream_data *stream
+        , struct stream_jpeg *jpeg, long jpeg_size)
+{
+    (void)cnt;
+
+    /* The clients that asked so far get this image */
+    __atomic_store_n(&stream->due, 0, __ATOMIC_SEQ_CST);
+
+    stream_jpeg_publish(stream, jpeg, jpeg_size);
+}
+
+/* Compress the image of the frame scaled for a stream */
+static void stream_worker_scaled(struct context *cnt, struct stream_worker *sw
+        , struct stream_data *stream, struct stream_frame *frame)
+{
+    struct stream_jpeg *jpeg;
+    long jpeg_size;
+
+    jpeg = stream_jpeg_claim(cnt, stream);
+    jpeg_size = stream_jpeg_put_scaled(cnt, stream, jpeg, frame->image_norm, &frame->img);
+    stream_worker_publish(cnt, stream, jpeg, jpeg_size);
+    sw->encoded++;
+}
+
+/**
+ * stream_worker_work
+ *
+ *   Compress the images of the frame that the clients of each stream are
+ *   due.  mutex_stream is only held to check the connections, the images
+ *   are published without it.
+ */
+static void stream_worker_work(struct context *cnt, struct stream_worker *sw, struct stream_frame *frame)
+{
+    struct timeval tv_now;
+    struct stream_jpeg *jpeg;
+    long long now;
+    int due_norm, due_low, due_sub, due_quarter, due_thumb, due_motion, due_source;
+    long jpeg_size;
+
+    gettimeofday(&tv_now, NULL);
+    now = ((long long)tv_now.tv_sec * 1000000LL) + tv_now.tv_usec;
+
+    pthread_mutex_lock(&cnt->mutex_stream);
+        due_norm = stream_worker_due(cnt, &cnt->stream_norm, now);
+        due_low = stream_worker_due(cnt, &cnt->stream_low, now);
+        due_sub = stream_worker_due(cnt, &cnt->stream_sub, now);
+        due_quarter = stream_worker_due(cnt, &cnt->stream_quarter, now);
+        due_thumb = stream_worker_due(cnt, &cnt->stream_thumb, now);
+        due_motion = stream_worker_due(cnt, &cnt->stream_motion, now);
+        due_source = stream_worker_due(cnt, &cnt->stream_source, now);
+    pthread_mutex_unlock(&cnt->mutex_stream);
+
+    if (due_norm && frame->has_norm) {
+        jpeg = stream_jpeg_claim(cnt, &cnt->stream_norm);
+        jpeg_size = put_picture_memory(cnt
+            ,jpeg->jpeg_data
+            ,cnt->imgs.size_norm
+            ,frame->image_norm
+            ,cnt->conf.stream_quality
+            ,cnt->imgs.width
+            ,cnt->imgs.height
+            ,&frame->img, JPEG_PLANE_NORM);
+        stream_worker_publish(cnt, &cnt->stream_norm, jpeg, jpeg_size);
+        sw->encoded++;
+    }
+
+    if (due_low && frame->has_norm) {
+        jpeg = stream_jpeg_claim(cnt, &cnt->stream_low);
+        jpeg_size = put_picture_memory(cnt
+            ,jpeg->jpeg_data
+            ,cnt->imgs.size_norm
+            ,frame->image_norm
+            ,stream_jpeg_low_quality(cnt)
+            ,cnt->imgs.width
+            ,cnt->imgs.height
+            ,&frame->img, JPEG_PLANE_NORM);
+        stream_worker_publish(cnt, &cnt->stream_low, jpeg, jpeg_size);
+        sw->encoded++;
+    }
+
+    if (due_sub && frame->has_norm) {
+        stream_worker_scaled(cnt, sw, &cnt->stream_sub, frame);
+    }
+
+    if (due_quarter && frame->has_norm) {
+        stream_worker_scaled(cnt, sw, &cnt->stream_quarter, frame);
+    }
+
+    if (due_thumb && frame->has_norm) {
+        stream_worker_scaled(cnt, sw, &cnt->stream_thumb, frame);
+    }
+
+    if (due_motion && frame->has_motion) {
+        jpeg = stream_jpeg_claim(cnt, &cnt->stream_motion);
+        jpeg_size = put_picture_memory(cnt
+            ,jpeg->jpeg_data
+            ,cnt->imgs.size_norm
+            ,frame->image_motion
+            ,cnt->conf.stream_quality
+            ,cnt->imgs.width
+            ,cnt->imgs.height
+            ,NULL, JPEG_PLANE_NONE);
+        stream_worker_publish(cnt, &cnt->stream_motion, jpeg, jpeg_size);
+        sw->encoded++;
+    }
+
+    if (due_source && frame->has_source) {
+        jpeg = stream_jpeg_claim(cnt, &cnt->stream_source);
+        jpeg_size = put_picture_memory(cnt
+            ,jpeg->jpeg_data
+            ,cnt->imgs.size_norm
+            ,frame->image_source
+            ,cnt->conf.stream_quality
+            ,cnt->imgs.width
+            ,cnt->imgs.height
+            ,NULL, JPEG_PLANE_NONE);
+        stream_worker_publish(cnt, &cnt->stream_source, jpeg, jpeg_size);
+        sw->encoded++;
+    }
+
+    if (due_norm || due_low || due_sub || due_quarter || due_thumb ||
+        due_motion || due_source) {
+        webu_stream_wake(cnt, FALSE);
+    }
+}
+
+/**
+ * stream_worker_loop
+ *
+ *   Thread function of the stream worker.  Takes the latest published
+ *   frame and compresses the images the clients are due.
+ */
+static void *stream_worker_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct stream_worker *sw = cnt->stream_worker;
+    int indx;
+
+    util_threadname_set("sw", cnt->threadnr, cnt->conf.camera_name);
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    pthread_mutex_lock(&sw->mutex);
+        while (TRUE) {
+            while ((!sw->published) && (!sw->finish)) {
+                pthread_cond_wait(&sw->cond_work, &sw->mutex);
+            }
+            if (sw->finish) {
+                break;
+            }
+
+            indx = sw->work;
+            sw->work = sw->ready;
+            sw->ready = indx;
+            sw->published = FALSE;
+
+            pthread_mutex_unlock(&sw->mutex);
+
+            stream_worker_work(cnt, sw, &sw->frames[sw->work]);
+
+            pthread_mutex_lock(&sw->mutex);
+        }
+    pthread_mutex_unlock(&sw->mutex);
+
+    pthread_mutex_lock(&global_lock);
+        threads_running--;
+    pthread_mutex_unlock(&global_lock);
+
+    sw->stage.finished = TRUE;
+
+    pthread_exit(NULL);
+}
+
+/**
+ * stream_worker_put
+ *
+ *   Publish the images of the frame that the clients of the streams are
+ *   due.  The images are copied so the caller may reuse them right away.
+ *
+ * Returns STREAM_WORKER_QUEUED or STREAM_WORKER_NONE when the caller must
+ * compress the images itself.
+ */
+int stream_worker_put(struct context *cnt, struct image_data *img_data)
+{
+    struct stream_worker *sw = cnt->stream_worker;
+    struct stream_frame *frame;
+    struct timeval tv_now;
+    long long now;
+    int indx;
+
+    if ((sw == NULL) || (sw->finish)) {
+        return STREAM_WORKER_NONE;
+    }
+
+    gettimeofday(&tv_now, NULL);
+    now = ((long long)tv_now.tv_sec * 1000000LL) + tv_now.tv_usec;
+
+    /* Only the images that a client is due are copied.  The connections and
+     * the due times are read as a hint, the worker checks them again under
+     * mutex_stream.  The frame being filled is only used by this thread so
+     * no lock is needed.
+     */
+    frame = &sw->frames[sw->fill];
+
+    frame->has_norm = FALSE;
+    if ((stream_worker_due(cnt, &cnt->stream_norm, now) ||
+         stream_worker_due(cnt, &cnt->stream_low, now) ||
+         stream_worker_due(cnt, &cnt->stream_sub, now) ||
+         stream_worker_due(cnt, &cnt->stream_quarter, now) ||
+         stream_worker_due(cnt, &cnt->stream_thumb, now)) && (img_data->image_norm != NULL)) {
+        memcpy(frame->image_norm, img_data->image_norm, cnt->imgs.size_norm);
+        frame->has_norm = TRUE;
+    }
+
+    frame->has_motion = FALSE;
+    if (stream_worker_due(cnt, &cnt->stream_motion, now) &&
+        (cnt->imgs.img_motion.image_norm != NULL)) {
+        memcpy(frame->image_motion, cnt->imgs.img_motion.image_norm, cnt->imgs.size_norm);
+        frame->has_motion = TRUE;
+    }
+
+    frame->has_source = FALSE;
+    if (stream_worker_due(cnt, &cnt->stream_source, now) &&
+        (cnt->imgs.image_virgin.image_norm != NULL)) {
+        memcpy(frame->image_source, cnt->imgs.image_virgin.image_norm, cnt->imgs.size_norm);
+        frame->has_source = TRUE;
+    }
+
+    if ((!frame->has_norm) && (!frame->has_motion) && (!frame->has_source)) {
+        return STREAM_WORKER_QUEUED;
+    }
+
+    memcpy(&frame->img, img_data, sizeof(struct image_data));
+    frame->img.image_norm = frame->image_norm;
+    frame->img.image_high = NULL;
+
+    pthread_mutex_lock(&sw->mutex);
+        if (sw->published) {
+            sw->frames_skipped++;
+        }
+        indx = sw->ready;
+        sw->ready = sw->fill;
+        sw->fill = indx;
+        sw->published = TRUE;
+        sw->frames_put++;
+        pthread_cond_signal(&sw->cond_work);
+    pthread_mutex_unlock(&sw->mutex);
+
+    return STREAM_WORKER_QUEUED;
+}
+
+/**
+ * stream_worker_init
+ *
+ *   Start the stream worker.  Called once the image sizes are known.
+ */
+int stream_worker_init(struct context *cnt)
+{
+    struct stream_worker *sw;
+    int indx;
+
+    cnt->stream_worker = NULL;
+
+    if (!cnt->conf.stream_worker) {
+        return 0;
+    }
+
+    sw = mymalloc(sizeof(struct stream_worker));
+
+    for (indx = 0; indx < STREAM_FRAMES; indx++) {
+        sw->frames[indx].image_norm = mymalloc(cnt->imgs.size_norm);
+        sw->frames[indx].image_motion = mymalloc(cnt->imgs.size_norm);
+        sw->frames[indx].image_source = mymalloc(cnt->imgs.size_norm);
+    }
+    sw->fill = 0;
+    sw->ready = 1;
+    sw->work = 2;
+    sw->stage.finished = TRUE;
+
+    pthread_mutex_init(&sw->mutex, NULL);
+    pthread_cond_init(&sw->cond_work, NULL);
+
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->stream_worker = sw;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    if (pipeline_stage_start(cnt, &sw->stage, stream_worker_loop) != 0) {
+        /* Compress the stream images in the event handlers as before */
+        stream_worker_deinit(cnt);
+        return -1;
+    }
+
+    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, _("Stream worker started"));
+
+    return 0;
+}
+
+/**
+ * stream_worker_deinit
+ *
+ *   Stop the stream worker and free its frames.  Must be called before the
+ *   stream buffers are freed.
+ */
+void stream_worker_deinit(struct context *cnt)
+{
+    struct stream_worker *sw = cnt->stream_worker;
+    int indx;
+
+    if (sw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&sw->mutex);
+        sw->finish = TRUE;
+        pthread_cond_broadcast(&sw->cond_work);
+    pthread_mutex_unlock(&sw->mutex);
+
+    pipeline_stage_stop(cnt, &sw->stage, NULL);
+
+    pthread_mutex_lock(&cnt->mutex_stages);
+        cnt->stream_worker = NULL;
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    if (sw->frames_put > 0) {
+        MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO
+            ,_("Stream worker finished: %lu frames, %lu skipped, %lu images compressed")
+            ,sw->frames_put, sw->frames_skipped, sw->encoded);
+    }
+
+    for (indx = 0; indx < STREAM_FRAMES; indx++) {
+        free(sw->frames[indx].image_norm);
+        free(sw->frames[indx].image_motion);
+        free(sw->frames[indx].image_source);
+    }
+
+    pthread_mutex_destroy(&sw->mutex);
+    pthread_cond_destroy(&sw->cond_work);
+
+    free(sw);
+}
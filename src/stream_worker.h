@@ -0,0 +1,64 @@
+/*   This file is part of Motion.
+ *
+ *   Motion is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Motion is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Motion.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ *      stream_worker.h
+ *
+ *      Headers associated with functions in the stream_worker.c module.
+ *      The files event.h and pipeline.h must be included before this one.
+ *
+ */
+
+#ifndef _INCLUDE_STREAM_WORKER_H
+#define _INCLUDE_STREAM_WORKER_H
+
+#define STREAM_WORKER_QUEUED    0   /* The stream worker will compress the frame */
+#define STREAM_WORKER_NONE      -1  /* No stream worker, the caller must compress the frame */
+
+#define STREAM_FRAMES           3   /* Frames being filled, published and compressed */
+
+/* Raw images of a frame published for the stream worker */
+struct stream_frame {
+    unsigned char          *image_norm;     /* Copy of the image for the normal and sub streams */
+    unsigned char          *image_motion;   /* Copy of the motion image */
+    unsigned char          *image_source;   /* Copy of the image before the masks and text */
+    int                     has_norm;
+    int                     has_motion;
+    int                     has_source;
+    struct image_data       img;            /* Metadata of the frame with image_norm pointing at the copy */
+};
+
+struct stream_worker {
+    struct pipe_stage       stage;
+    struct stream_frame     frames[STREAM_FRAMES];
+    int                     fill;           /* Frame written by the motion thread */
+    int                     ready;          /* Frame published and not yet taken */
+    int                     work;           /* Frame compressed by the worker */
+    int                     published;      /* The ready frame is newer than the work frame */
+    volatile int            finish;
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond_work;      /* The worker waits for frames */
+    unsigned long           frames_put;     /* Frames published by the motion thread */
+    unsigned long           frames_skipped; /* Frames replaced before the worker took them */
+    unsigned long           encoded;        /* Images compressed for the streams */
+};
+
+int stream_worker_init(struct context *cnt);
+void stream_worker_deinit(struct context *cnt);
+int stream_worker_put(struct context *cnt, struct image_data *img_data);
+void stream_worker_want(struct context *cnt, struct stream_data *stream, const struct timeval *tv_due);
+
+#endif /* _INCLUDE_STREAM_WORKER_H */
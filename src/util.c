@@ -21,10 +21,15 @@
  *
  */
 
+#include <stdarg.h>
+
 #include "translate.h"
 #include "motion.h"
 #include "logger.h"
 #include "util.h"
+#include "event.h"
+#include "pipeline.h"
+#include "dbse.h"
 
 #ifdef HAVE_FFMPEG
 
@@ -228,6 +233,78 @@ void *myrealloc(void *ptr, size_t size, const char *desc)
     return dummy;
 }
 
+/* Directories known to exist, so their parents are not created again */
+static struct {
+    pthread_mutex_t mutex;
+    char           *dirs[DIR_CACHE_MAX];
+    unsigned long   used[DIR_CACHE_MAX];
+    unsigned long   clock;
+} dir_cache = {PTHREAD_MUTEX_INITIALIZER, {NULL}, {0}, 0};
+
+/* Length of the longest directory of the cache that holds dir, 0 for none */
+static size_t dir_cache_find(const char *dir)
+{
+    size_t len, found;
+    int indx;
+
+    found = 0;
+    pthread_mutex_lock(&dir_cache.mutex);
+        for (indx = 0; indx < DIR_CACHE_MAX; indx++) {
+            if (dir_cache.dirs[indx] == NULL) {
+                continue;
+            }
+            len = strlen(dir_cache.dirs[indx]);
+            if (strncmp(dir_cache.dirs[indx], dir, len) != 0) {
+                continue;
+            }
+            if (dir[len] == '\0') {
+                /* We were asked for it so it was removed */
+                free(dir_cache.dirs[indx]);
+                dir_cache.dirs[indx] = NULL;
+            } else if ((dir[len] == '/') && (len > found)) {
+                dir_cache.used[indx] = ++dir_cache.clock;
+                found = len;
+            }
+        }
+    pthread_mutex_unlock(&dir_cache.mutex);
+
+    return found;
+}
+
+/* Remember the directory in place of the least recently used one */
+static void dir_cache_add(const char *dir)
+{
+    int indx, oldest;
+
+    pthread_mutex_lock(&dir_cache.mutex);
+        oldest = 0;
+        for (indx = 0; indx < DIR_CACHE_MAX; indx++) {
+            if (dir_cache.dirs[indx] == NULL) {
+                oldest = indx;
+                break;
+            }
+            if (dir_cache.used[indx] < dir_cache.used[oldest]) {
+                oldest = indx;
+            }
+        }
+        free(dir_cache.dirs[oldest]);
+        dir_cache.dirs[oldest] = mystrdup(dir);
+        dir_cache.used[oldest] = ++dir_cache.clock;
+    pthread_mutex_unlock(&dir_cache.mutex);
+}
+
+static void dir_cache_clear(void)
+{
+    int indx;
+
+    pthread_mutex_lock(&dir_cache.mutex);
+        for (indx = 0; indx < DIR_CACHE_MAX; indx++) {
+            free(dir_cache.dirs[indx]);
+            dir_cache.dirs[indx] = NULL;
+        }
+    pthread_mutex_unlock(&dir_cache.mutex);
+}
+
 /**
  * mycreate_path
  *
@@ -236,43 +313,65 @@ void *myrealloc(void *ptr, size_t size, const char *desc)
  *      /this/is/an/example/
  *   Warning: a path *must* end with a slash!
  *
+ *   The directories created are remembered and only the components below
+ *   the deepest one of them are created for the next paths.  When that
+ *   directory has been removed in the meantime, the whole path is created.
+ *
  * Parameters:
  *
- *   cnt  - current thread's context structure (for logging)
  *   path - the path to create
  *
  * Returns: 0 on success, -1 on failure
  */
 int mycreate_path(const char *path)
 {
-    char *start;
+    char *buffer, *start, *last;
+    size_t known;
     mode_t mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
 
-    if (path[0] == '/') {
-        start = strchr(path + 1, '/');
-    } else {
-        start = strchr(path, '/');
+    buffer = mystrdup(path);
+    last = strrchr(buffer, '/');
+    if ((last == NULL) || (last == buffer)) {
+        free(buffer);
+        return 0;
     }
+    *last = 0x00;
 
-    while (start) {
-        char *buffer = mystrdup(path);
-        buffer[start-path] = 0x00;
+    known = dir_cache_find(buffer);
 
+    start = strchr(buffer + known + 1, '/');
+    while (TRUE) {
+        if (start) {
+            *start = 0x00;
+        }
         if (mkdir(buffer, mode) == -1 && errno != EEXIST) {
+            if ((errno == ENOENT) && (known > 0)) {
+                /* A directory of the cache is gone, start again from the top */
+                if (start) {
+                    *start = '/';
+                }
+                dir_cache_clear();
+                known = 0;
+                start = strchr(buffer + 1, '/');
+                continue;
+            }
             MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO
                 ,_("Problem creating directory %s"), buffer);
             free(buffer);
             return -1;
         }
-
+        if (start == NULL) {
+            break;
+        }
+        *start = '/';
         start = strchr(start + 1, '/');
+    }
 
-        if (!start) {
-            MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("creating directory %s"), buffer);
-        }
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, _("creating directory %s"), buffer);
 
-        free(buffer);
-    }
+    dir_cache_add(buffer);
+
+    free(buffer);
 
     return 0;
 }
@@ -346,19 +445,136 @@ int myfclose(FILE *fh)
     return rval;
 }
 
+/*
+ * The formats given to mystrftime are compiled into a list of tokens the
+ * first time they are used and kept in a cache of templates keyed by the
+ * content of the format.  A format changed from the web control is a new
+ * key, so it is compiled on its next use and the old one ages out.
+ *
+ * As ever, %C, %f, %n and %$ with nothing to put in copy the character that
+ * follows them for strftime.  Their values are only known when the format
+ * is expanded, so the template is also keyed by which of them are empty.
+ */
+#define STRF_EMPTY_TEXT_EVENT   1
+#define STRF_EMPTY_FILENAME     2
+#define STRF_EMPTY_SQLTYPE      4
+#define STRF_EMPTY_CAMERA_NAME  8
+
+enum strf_type {
+    STRF_TEXT,          /* Copied as is */
+    STRF_TIME,          /* Given to strftime */
+    STRF_EVENT,         /* %v */
+    STRF_SHOTS,         /* %q */
+    STRF_DIFFS,         /* %D */
+    STRF_NOISE,         /* %N */
+    STRF_MOTION_WIDTH,  /* %i */
+    STRF_MOTION_HEIGHT, /* %J */
+    STRF_MOTION_X,      /* %K */
+    STRF_MOTION_Y,      /* %L */
+    STRF_THRESHOLD,     /* %o */
+    STRF_LABELS,        /* %Q */
+    STRF_CAMERA_ID,     /* %t */
+    STRF_TEXT_EVENT,    /* %C */
+    STRF_WIDTH,         /* %w */
+    STRF_HEIGHT,        /* %h */
+    STRF_FPS,           /* %fps and %{fps} */
+    STRF_FILENAME,      /* %f */
+    STRF_SQLTYPE,       /* %n */
+    STRF_CAMERA_NAME,   /* %$ */
+    STRF_HOST,          /* %{host} */
+    STRF_DBEVENTID,     /* %{dbeventid} */
+    STRF_VER,           /* %{ver} */
+    STRF_INVALID        /* Unknown %{word} */
+};
+
+struct strf_token {
+    enum strf_type  type;
+    int             width;
+    char           *text;       /* STRF_TEXT and STRF_TIME only */
+};
+
+struct strf_template {
+    char               *format;
+    unsigned int        hash;
+    int                 empty;      /* STRF_EMPTY_* of the specifiers with nothing to put in */
+    struct strf_token  *tokens;
+    int                 token_count;
+    int                 refs;       /* Threads expanding it */
+    int                 cached;
+    unsigned long       used;       /* Clock of the cache at the last use */
+};
+
+static struct {
+    pthread_mutex_t         mutex;
+    struct strf_template   *tmpl[STRF_CACHE_MAX];
+    int                     count;
+    unsigned long           clock;
+} strf_cache = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0, 0};
+
+static unsigned int strf_hash(const char *str)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619U;
+    }
+    return hash;
+}
+
+static void strf_free(struct strf_template *tmpl)
+{
+    int indx;
+
+    for (indx = 0; indx < tmpl->token_count; indx++) {
+        free(tmpl->tokens[indx].text);
+    }
+    free(tmpl->tokens);
+    free(tmpl->format);
+    free(tmpl);
+}
+
+/* Add a token.  The runs of plain text and strftime codes end up in one token */
+static void strf_add(struct strf_template *tmpl, enum strf_type type, int width
+            , char *run, int *run_len, int *run_time)
+{
+    struct strf_token *tok;
+
+    if (*run_len > 0) {
+        tok = &tmpl->tokens[tmpl->token_count++];
+        run[*run_len] = '\0';
+        tok->type = *run_time ? STRF_TIME : STRF_TEXT;
+        tok->width = 0;
+        tok->text = mystrdup(run);
+        *run_len = 0;
+        *run_time = FALSE;
+    }
+
+    if ((type != STRF_TEXT) && (type != STRF_TIME)) {
+        tok = &tmpl->tokens[tmpl->token_count++];
+        tok->type = type;
+        tok->width = width;
+        tok->text = NULL;
+    }
+}
+
+/* Copy the character after a specifier with nothing to put in.  Returns where to go on from */
+static const char *strf_empty(const char *pos_userformat, char *run, int *run_len, int *run_time)
+{
+    ++pos_userformat;
+    if (*pos_userformat == '\0') {
+        return pos_userformat - 1;
+    }
+    run[(*run_len)++] = *pos_userformat;
+    *run_time = *run_time || (*pos_userformat == '%');
+
+    return pos_userformat;
+}
+
 /**
- * mystrftime_long
+ * strf_long
  *
  *   Motion-specific long form of format specifiers.
  *
- * Parameters:
- *
- *   cnt        - current thread's context structure.
- *   width      - width associated with the format specifier.
- *   word       - beginning of the format specifier's word.
- *   l          - length of the format specifier's word.
- *   out        - output buffer where to store the result. Size: PATH_MAX.
- *
  * This is called if a format specifier with the format below was found:
  *
  *   % { word }
@@ -372,243 +588,418 @@ int myfclose(FILE *fh)
  *
  * The following specifier keywords are currently supported:
  *
- * host    Replaced with the name of the local machine (see gethostname(2)).
- * fps     Equivalent to %fps.
+ * host         Replaced with the name of the local machine (see gethostname(2)).
+ * fps          Equivalent to %fps.
+ * dbeventid    Event ID returned by sql_query_start.
+ * ver          Version of Motion.
  */
-static void mystrftime_long (const struct context *cnt, int width, const char *word, int l, char *out)
+static enum strf_type strf_long(const char *word, int l)
 {
-    #define SPECIFIERWORD(k) ((strlen(k)==l) && (!strncmp (k, word, l)))
+    #define SPECIFIERWORD(k) ((strlen(k)==(size_t)l) && (!strncmp (k, word, l)))
 
     if (SPECIFIERWORD("host")) {
-        snprintf (out, PATH_MAX, "%*s", width, cnt->hostname);
-        return;
+        return STRF_HOST;
     }
     if (SPECIFIERWORD("fps")) {
-        sprintf(out, "%*d", width, cnt->movie_fps);
-        return;
+        return STRF_FPS;
     }
     if (SPECIFIERWORD("dbeventid")) {
-        #ifdef HAVE_PGSQL
-            if (cnt->eid_db_format == dbeid_no_return) {
-                MOTION_LOG(ERR, TYPE_DB, NO_ERRNO,
-                    _("Used %{dbeventid} but sql_query_start returned no valid event ID"));
-                ((struct context *)cnt)->eid_db_format = dbeid_use_error;
-            }
-        #endif
-        sprintf(out, "%*llu", width, cnt->database_event_id);
-        return;
+        return STRF_DBEVENTID;
     }
     if (SPECIFIERWORD("ver")) {
-        sprintf(out, "%*s", width, VERSION);
-        return;
+        return STRF_VER;
     }
 
-    // Not a valid modifier keyword. Log the error and ignore.
+    /* Not a valid modifier keyword. Log the error and put a ~ in its place */
     MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO,
         _("invalid format specifier keyword %*.*s"), l, l, word);
 
-    // Do not let the output buffer empty, or else where to restart the
-    // interpretation of the user string will become dependent to far too
-    // many conditions. Maybe change loop to "if (*pos_userformat == '%') {
-    // ...} __else__ ..."?
-    out[0] = '~'; out[1] = 0;
+    return STRF_INVALID;
+
+    #undef SPECIFIERWORD
 }
 
 /**
- * mystrftime
+ * strf_compile
  *
- *   Motion-specific variant of strftime(3) that supports additional format
- *   specifiers in the format string.
- *
- * Parameters:
- *
- *   cnt        - current thread's context structure
- *   s          - destination string
- *   max        - max number of bytes to write
- *   userformat - format string
- *   tm         - time information
- *   filename   - string containing full path of filename
- *                set this to NULL if not relevant
- *   sqltype    - Filetype as used in SQL feature, set to 0 if not relevant
- *
- * Returns: number of bytes written to the string s
+ *   Split the user format into tokens.  Whatever is not a Motion specifier
+ *   is left for strftime.  empty has the STRF_EMPTY_* of the specifiers
+ *   that have nothing to put in.
  */
-size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *userformat
-            , const struct timeval *tv1, const char *filename, int sqltype)
+static struct strf_template *strf_compile(const char *userformat, unsigned int hash, int empty)
 {
-    char formatstring[PATH_MAX] = "";
-    char tempstring[PATH_MAX] = "";
-    char *format, *tempstr;
-    const char *pos_userformat;
-    int width;
-    struct tm timestamp_tm;
+    struct strf_template *tmpl;
+    const char *pos_userformat, *word;
+    char *run;
+    int run_len, run_time, width;
+    size_t len;
+
+    len = strlen(userformat);
+
+    tmpl = mymalloc(sizeof(struct strf_template));
+    tmpl->format = mystrdup(userformat);
+    tmpl->hash = hash;
+    tmpl->empty = empty;
+    /* Each specifier takes two characters and may add a text token */
+    tmpl->tokens = mymalloc((len + 1) * sizeof(struct strf_token));
+    run = mymalloc(len + 1);
+    run_len = 0;
+    run_time = FALSE;
 
-    localtime_r(&tv1->tv_sec, &timestamp_tm);
+    for (pos_userformat = userformat; *pos_userformat; ++pos_userformat) {
 
-    format = formatstring;
+        if (*pos_userformat != '%') {
+            run[run_len++] = *pos_userformat;
+            continue;
+        }
 
-    /* if mystrftime is called with userformat = NULL we return a zero length string */
-    if (userformat == NULL) {
-        *s = '\0';
-        return 0;
-    }
+        width = 0;
+        while ('0' <= pos_userformat[1] && pos_userformat[1] <= '9') {
+            width *= 10;
+            width += pos_userformat[1] - '0';
+            ++pos_userformat;
+        }
 
-    for (pos_userformat = userformat; *pos_userformat; ++pos_userformat) {
+        switch (*++pos_userformat) {
+        case '\0': // end of string, keep the last character for strftime
+            --pos_userformat;
+            run[run_len++] = *pos_userformat;
+            run_time = run_time || (*pos_userformat == '%');
+            break;
+        case 'v': strf_add(tmpl, STRF_EVENT, width, run, &run_len, &run_time); break;
+        case 'q': strf_add(tmpl, STRF_SHOTS, width, run, &run_len, &run_time); break;
+        case 'D': strf_add(tmpl, STRF_DIFFS, width, run, &run_len, &run_time); break;
+        case 'N': strf_add(tmpl, STRF_NOISE, width, run, &run_len, &run_time); break;
+        case 'i': strf_add(tmpl, STRF_MOTION_WIDTH, width, run, &run_len, &run_time); break;
+        case 'J': strf_add(tmpl, STRF_MOTION_HEIGHT, width, run, &run_len, &run_time); break;
+        case 'K': strf_add(tmpl, STRF_MOTION_X, width, run, &run_len, &run_time); break;
+        case 'L': strf_add(tmpl, STRF_MOTION_Y, width, run, &run_len, &run_time); break;
+        case 'o': strf_add(tmpl, STRF_THRESHOLD, width, run, &run_len, &run_time); break;
+        case 'Q': strf_add(tmpl, STRF_LABELS, width, run, &run_len, &run_time); break;
+        case 't': strf_add(tmpl, STRF_CAMERA_ID, width, run, &run_len, &run_time); break;
+        case 'C':
+            if (empty & STRF_EMPTY_TEXT_EVENT) {
+                pos_userformat = strf_empty(pos_userformat, run, &run_len, &run_time);
+            } else {
+                strf_add(tmpl, STRF_TEXT_EVENT, width, run, &run_len, &run_time);
+            }
+            break;
+        case 'w': strf_add(tmpl, STRF_WIDTH, width, run, &run_len, &run_time); break;
+        case 'h': strf_add(tmpl, STRF_HEIGHT, width, run, &run_len, &run_time); break;
+        case 'n':
+            if (empty & STRF_EMPTY_SQLTYPE) {
+                pos_userformat = strf_empty(pos_userformat, run, &run_len, &run_time);
+            } else {
+                strf_add(tmpl, STRF_SQLTYPE, width, run, &run_len, &run_time);
+            }
+            break;
+        case '$':
+            if (empty & STRF_EMPTY_CAMERA_NAME) {
+                pos_userformat = strf_empty(pos_userformat, run, &run_len, &run_time);
+            } else {
+                strf_add(tmpl, STRF_CAMERA_NAME, width, run, &run_len, &run_time);
+            }
+            break;
+
+        case 'f': // filename -- or %fps
+            if ((pos_userformat[1] == 'p') && (pos_userformat[2] == 's')) {
+                strf_add(tmpl, STRF_FPS, width, run, &run_len, &run_time);
+                pos_userformat += 2;
+            } else if (empty & STRF_EMPTY_FILENAME) {
+                pos_userformat = strf_empty(pos_userformat, run, &run_len, &run_time);
+            } else {
+                strf_add(tmpl, STRF_FILENAME, width, run, &run_len, &run_time);
+            }
+            break;
 
-        if (*pos_userformat == '%') {
-            /*
-             * Reset 'tempstr' to point to the beginning of 'tempstring',
-             * otherwise we will eat up tempstring if there are many
-             * format specifiers.
-             */
-            tempstr = tempstring;
-            tempstr[0] = '\0';
-            width = 0;
-            while ('0' <= pos_userformat[1] && pos_userformat[1] <= '9') {
-                width *= 10;
-                width += pos_userformat[1] - '0';
+        case '{': // long format specifier word.
+            word = ++pos_userformat;
+            while ((*pos_userformat != '}') && (*pos_userformat != 0)) {
                 ++pos_userformat;
             }
-
-            switch (*++pos_userformat) {
-            case '\0': // end of string
+            strf_add(tmpl, strf_long(word, (int)(pos_userformat - word))
+                , width, run, &run_len, &run_time);
+            if (*pos_userformat == '\0') {
                 --pos_userformat;
-                break;
+            }
+            break;
 
-            case 'v': // event
-                sprintf(tempstr, "%0*d", width ? width : 2, cnt->event_nr);
-                break;
+        default: // Any other code is left for strftime with the %-sign
+            run[run_len++] = '%';
+            run[run_len++] = *pos_userformat;
+            run_time = TRUE;
+        }
+    }
+    strf_add(tmpl, STRF_TEXT, 0, run, &run_len, &run_time);
 
-            case 'q': // shots
-                sprintf(tempstr, "%0*d", width ? width : 2,
-                    cnt->current_image->shot);
-                break;
+    free(run);
 
-            case 'D': // diffs
-                sprintf(tempstr, "%*d", width, cnt->current_image->diffs);
-                break;
+    return tmpl;
+}
 
-            case 'N': // noise
-                sprintf(tempstr, "%*d", width, cnt->noise);
+/* Get the compiled template of the format, compiling it on its first use */
+static struct strf_template *strf_get(const char *userformat, int empty)
+{
+    struct strf_template *tmpl, *found;
+    unsigned int hash;
+    int indx, oldest;
+
+    hash = strf_hash(userformat);
+    found = NULL;
+
+    pthread_mutex_lock(&strf_cache.mutex);
+        for (indx = 0; indx < strf_cache.count; indx++) {
+            tmpl = strf_cache.tmpl[indx];
+            if ((tmpl->hash == hash) && (tmpl->empty == empty) &&
+                (mystreq(tmpl->format, userformat))) {
+                tmpl->refs++;
+                tmpl->used = ++strf_cache.clock;
+                found = tmpl;
                 break;
+            }
+        }
+    pthread_mutex_unlock(&strf_cache.mutex);
 
-            case 'i': // motion width
-                sprintf(tempstr, "%*d", width,
-                    cnt->current_image->location.width);
-                break;
+    if (found != NULL) {
+        return found;
+    }
 
-            case 'J': // motion height
-                sprintf(tempstr, "%*d", width,
-                    cnt->current_image->location.height);
-                break;
+    tmpl = strf_compile(userformat, hash, empty);
+    tmpl->refs = 1;
 
-            case 'K': // motion center x
-                sprintf(tempstr, "%*d", width, cnt->current_image->location.x);
-                break;
+    pthread_mutex_lock(&strf_cache.mutex);
+        tmpl->used = ++strf_cache.clock;
+        if (strf_cache.count < STRF_CACHE_MAX) {
+            strf_cache.tmpl[strf_cache.count++] = tmpl;
+            tmpl->cached = TRUE;
+        } else {
+            /* Replace the least recently used template not being expanded */
+            oldest = -1;
+            for (indx = 0; indx < strf_cache.count; indx++) {
+                if ((strf_cache.tmpl[indx]->refs == 0) &&
+                    ((oldest == -1) ||
+                     (strf_cache.tmpl[indx]->used < strf_cache.tmpl[oldest]->used))) {
+                    oldest = indx;
+                }
+            }
+            if (oldest != -1) {
+                strf_free(strf_cache.tmpl[oldest]);
+                strf_cache.tmpl[oldest] = tmpl;
+                tmpl->cached = TRUE;
+            }
+        }
+    pthread_mutex_unlock(&strf_cache.mutex);
 
-            case 'L': // motion center y
-                sprintf(tempstr, "%*d", width, cnt->current_image->location.y);
-                break;
+    return tmpl;
+}
 
-            case 'o': // threshold
-                sprintf(tempstr, "%*d", width, cnt->threshold);
-                break;
+static void strf_put(struct strf_template *tmpl)
+{
+    int cached;
 
-            case 'Q': // number of labels
-                sprintf(tempstr, "%*d", width,
-                    cnt->current_image->total_labels);
-                break;
+    pthread_mutex_lock(&strf_cache.mutex);
+        tmpl->refs--;
+        cached = tmpl->cached;
+    pthread_mutex_unlock(&strf_cache.mutex);
 
-            case 't': // camera id
-                sprintf(tempstr, "%*d", width, cnt->camera_id);
-                break;
+    if (!cached) {
+        strf_free(tmpl);
+    }
+}
 
-            case 'C': // text_event
-                if (cnt->text_event_string[0]) {
-                    snprintf(tempstr, PATH_MAX, "%*s", width,
-                        cnt->text_event_string);
-                } else {
-                    ++pos_userformat;
-                }
-                break;
+/* Append to the destination.  Returns -1 once it does not fit */
+static int strf_append(char *s, size_t max, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+    int retcd;
 
-            case 'w': // picture width
-                sprintf(tempstr, "%*d", width, cnt->imgs.width);
-                break;
+    va_start(ap, fmt);
+    retcd = vsnprintf(s + *len, max - *len, fmt, ap);
+    va_end(ap);
 
-            case 'h': // picture height
-                sprintf(tempstr, "%*d", width, cnt->imgs.height);
-                break;
+    if ((retcd < 0) || ((size_t)retcd >= max - *len)) {
+        return -1;
+    }
+    *len += retcd;
 
-            case 'f': // filename -- or %fps
-                if ((*(pos_userformat+1) == 'p') && (*(pos_userformat+2) == 's')) {
-                    sprintf(tempstr, "%*d", width, cnt->movie_fps);
-                    pos_userformat += 2;
-                    break;
-                }
+    return 0;
+}
 
-                if (filename) {
-                    snprintf(tempstr, PATH_MAX, "%*s", width, filename);
-                } else {
-                    ++pos_userformat;
-                }
-                break;
+/**
+ * mystrftime
+ *
+ *   Motion-specific variant of strftime(3) that supports additional format
+ *   specifiers in the format string.
+ *
+ * Parameters:
+ *
+ *   cnt        - current thread's context structure
+ *   s          - destination string
+ *   max        - max number of bytes to write
+ *   userformat - format string
+ *   tm         - time information
+ *   filename   - string containing full path of filename
+ *                set this to NULL if not relevant
+ *   sqltype    - Filetype as used in SQL feature, set to 0 if not relevant
+ *
+ * Returns: number of bytes written to the string s, 0 when it did not fit
+ */
+size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *userformat
+            , const struct timeval *tv1, const char *filename, int sqltype)
+{
+    char timestring[PATH_MAX];
+    struct strf_template *tmpl;
+    struct strf_token *tok;
+    struct tm timestamp_tm;
+    struct pipe_view view;
+    size_t len;
+    int indx, retcd, empty;
 
-            case 'n': // sqltype
-                if (sqltype) {
-                    sprintf(tempstr, "%*d", width, sqltype);
-                } else {
-                    ++pos_userformat;
-                }
-                break;
+    if (max == 0) {
+        return 0;
+    }
+    *s = '\0';
 
-            case '{': // long format specifier word.
-                {
-                    const char *word = ++pos_userformat;
-                    while ((*pos_userformat != '}') && (*pos_userformat != 0)) {
-                        ++pos_userformat;
-                    }
-                    mystrftime_long ((struct context *)cnt, width, word, (int)(pos_userformat-word), tempstr);
-                    if (*pos_userformat == '\0') {
-                        --pos_userformat;
-                    }
-                }
-                break;
+    /* if mystrftime is called with userformat = NULL we return a zero length string */
+    if (userformat == NULL) {
+        return 0;
+    }
 
-            case '$': // thread name
-                if (cnt->conf.camera_name && cnt->conf.camera_name[0]) {
-                    snprintf(tempstr, PATH_MAX, "%s", cnt->conf.camera_name);
-                } else {
-                    ++pos_userformat;
-                }
-                break;
+    localtime_r(&tv1->tv_sec, &timestamp_tm);
 
-            default: // Any other code is copied with the %-sign
-                *format++ = '%';
-                *format++ = *pos_userformat;
-                continue;
-            }
+    /* Detection values of the event being handled rather than of the latest frame */
+    pipeline_view(cnt, &view);
 
-            /*
-             * If a format specifier was found and used, copy the result from
-             * 'tempstr' to 'format'.
-             */
-            if (tempstr[0]) {
-                while ((*format = *tempstr++) != '\0') {
-                    ++format;
-                }
-                continue;
+    empty = 0;
+    if (view.text_event[0] == '\0') {
+        empty |= STRF_EMPTY_TEXT_EVENT;
+    }
+    if (filename == NULL) {
+        empty |= STRF_EMPTY_FILENAME;
+    }
+    if (sqltype == 0) {
+        empty |= STRF_EMPTY_SQLTYPE;
+    }
+    if ((cnt->conf.camera_name == NULL) || (cnt->conf.camera_name[0] == '\0')) {
+        empty |= STRF_EMPTY_CAMERA_NAME;
+    }
+
+    tmpl = strf_get(userformat, empty);
+
+    len = 0;
+    retcd = 0;
+    for (indx = 0; (indx < tmpl->token_count) && (retcd == 0); indx++) {
+        tok = &tmpl->tokens[indx];
+        switch (tok->type) {
+        case STRF_TEXT:
+            retcd = strf_append(s, max, &len, "%s", tok->text);
+            break;
+        case STRF_TIME:
+            if (strftime(timestring, sizeof(timestring), tok->text, &timestamp_tm) == 0) {
+                timestring[0] = '\0';
             }
+            retcd = strf_append(s, max, &len, "%s", timestring);
+            break;
+        case STRF_EVENT:
+            retcd = strf_append(s, max, &len, "%0*d", tok->width ? tok->width : 2, view.event_nr);
+            break;
+        case STRF_SHOTS:
+            retcd = strf_append(s, max, &len, "%0*d", tok->width ? tok->width : 2, view.image->shot);
+            break;
+        case STRF_DIFFS:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.image->diffs);
+            break;
+        case STRF_NOISE:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.noise);
+            break;
+        case STRF_MOTION_WIDTH:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.image->location.width);
+            break;
+        case STRF_MOTION_HEIGHT:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.image->location.height);
+            break;
+        case STRF_MOTION_X:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.image->location.x);
+            break;
+        case STRF_MOTION_Y:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.image->location.y);
+            break;
+        case STRF_THRESHOLD:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.threshold);
+            break;
+        case STRF_LABELS:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.image->total_labels);
+            break;
+        case STRF_CAMERA_ID:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, cnt->camera_id);
+            break;
+        case STRF_TEXT_EVENT:
+            retcd = strf_append(s, max, &len, "%*s", tok->width, view.text_event);
+            break;
+        case STRF_WIDTH:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, cnt->imgs.width);
+            break;
+        case STRF_HEIGHT:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, cnt->imgs.height);
+            break;
+        case STRF_FPS:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, view.movie_fps);
+            break;
+        case STRF_FILENAME:
+            retcd = strf_append(s, max, &len, "%*s", tok->width, filename);
+            break;
+        case STRF_SQLTYPE:
+            retcd = strf_append(s, max, &len, "%*d", tok->width, sqltype);
+            break;
+        case STRF_CAMERA_NAME:
+            retcd = strf_append(s, max, &len, "%s", cnt->conf.camera_name);
+            break;
+        case STRF_HOST:
+            retcd = strf_append(s, max, &len, "%*s", tok->width, cnt->hostname);
+            break;
+        case STRF_DBEVENTID:
+            retcd = strf_append(s, max, &len, "%*llu", tok->width
+                , dbse_event_id((struct context *)cnt));
+            break;
+        case STRF_VER:
+            retcd = strf_append(s, max, &len, "%*s", tok->width, VERSION);
+            break;
+        case STRF_INVALID:
+            retcd = strf_append(s, max, &len, "~");
+            break;
         }
+    }
 
-        /* For any other character than % we just simply copy the character */
-        *format++ = *pos_userformat;
+    strf_put(tmpl);
+
+    /* Like strftime, nothing is put out when the result does not fit */
+    if (retcd != 0) {
+        *s = '\0';
+        return 0;
     }
 
-    *format = '\0';
-    format = formatstring;
+    return len;
+}
+
+/**
+ * util_cache_free
+ *
+ *   Free the compiled formats and the directories known to exist.
+ *   Called once the threads using them have ended.
+ */
+void util_cache_free(void)
+{
+    int indx;
+
+    pthread_mutex_lock(&strf_cache.mutex);
+        for (indx = 0; indx < strf_cache.count; indx++) {
+            strf_free(strf_cache.tmpl[indx]);
+            strf_cache.tmpl[indx] = NULL;
+        }
+        strf_cache.count = 0;
+    pthread_mutex_unlock(&strf_cache.mutex);
 
-    return strftime(s, max, format, &timestamp_tm);
+    dir_cache_clear();
 }
 
 /* This is a temporary location for these util functions.  All the generic utility
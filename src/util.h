@@ -24,6 +24,9 @@
 #ifndef _INCLUDE_UTIL_H
 #define _INCLUDE_UTIL_H
 
+#define STRF_CACHE_MAX  128     /* Formats kept compiled for mystrftime */
+#define DIR_CACHE_MAX   32      /* Directories mycreate_path knows to exist */
+
 #ifdef HAVE_FFMPEG
 
     #if ( MYFFVER >= 56000)
@@ -105,6 +108,7 @@ int myfclose(FILE *fh);
 size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *userformat
             , const struct timeval *tv1, const char *filename, int sqltype);
 int mycreate_path(const char *path);
+void util_cache_free(void);
 
 char *mystrcpy(char *to, const char *from);
 char *mystrdup(const char *from);
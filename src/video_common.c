@@ -33,9 +33,14 @@
 #include "video_bktr.h"
 #include "jpegutils.h"
 
-typedef unsigned char uint8_t;
-typedef unsigned short int uint16_t;
-typedef unsigned int uint32_t;
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+    #include <immintrin.h>
+#endif
 
 #define CLAMP(x)  ((x) < 0 ? 0 : ((x) > 255) ? 255 : (x))
 
@@ -202,180 +207,345 @@ int vid_sonix_decompress(unsigned char *outp, unsigned char *inp, int width, int
  */
 void vid_bayer2rgb24(unsigned char *dst, unsigned char *src, long int width, long int height)
 {
-    long int i;
+    long int x, y, odd;
     unsigned char *rawpt, *scanpt;
-    long int size;
 
-    rawpt = src;
+    /* The pixels are walked row by row, odd tells the parity of (y * width + x) */
     scanpt = dst;
-    size = width * height;
-
-    for (i = 0; i < size; i++) {
-        if (((i / width) & 1) == 0) {    // %2 changed to & 1
-            if ((i & 1) == 0) {
-                /* B */
-                if ((i > width) && ((i % width) > 0)) {
-                    *scanpt++ = *rawpt;     /* B */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
-                                *(rawpt + width) + *(rawpt - width)) / 4;    /* G */
-                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
-                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* R */
+
+    for (y = 0; y < height; y++) {
+        rawpt = src + (y * width);
+        odd = (y * width) & 1;
+        for (x = 0; x < width; x++, rawpt++, odd ^= 1) {
+            if ((y & 1) == 0) {
+                if (odd == 0) {
+                    /* B */
+                    if ((y > 1) && (x > 0)) {
+                        *scanpt++ = *rawpt;     /* B */
+                        *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
+                                    *(rawpt + width) + *(rawpt - width)) / 4;    /* G */
+                        *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
+                                    *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* R */
+                    } else {
+                        /* First line or left column. */
+                        *scanpt++ = *rawpt;     /* B */
+                        *scanpt++ = (*(rawpt + 1) + *(rawpt + width)) / 2;    /* G */
+                        *scanpt++ = *(rawpt + width + 1);       /* R */
+                    }
                 } else {
-                    /* First line or left column. */
-                    *scanpt++ = *rawpt;     /* B */
-                    *scanpt++ = (*(rawpt + 1) + *(rawpt + width)) / 2;    /* G */
-                    *scanpt++ = *(rawpt + width + 1);       /* R */
+                    /* (B)G */
+                    if ((y > 1) && (x < (width - 1))) {
+                        *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* B */
+                        *scanpt++ = *rawpt;    /* G */
+                        *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* R */
+                    } else {
+                        /* First line or right column. */
+                        *scanpt++ = *(rawpt - 1);       /* B */
+                        *scanpt++ = *rawpt;    /* G */
+                        *scanpt++ = *(rawpt + width);   /* R */
+                    }
                 }
             } else {
-                /* (B)G */
-                if ((i > width) && ((i % width) < (width - 1))) {
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* R */
+                if (odd == 0) {
+                    /* G(R) */
+                    if ((y < (height - 1)) && (x > 0)) {
+                        *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* B */
+                        *scanpt++ = *rawpt;    /* G */
+                        *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* R */
+                    } else {
+                        /* Bottom line or left column. */
+                        *scanpt++ = *(rawpt - width);   /* B */
+                        *scanpt++ = *rawpt;    /* G */
+                        *scanpt++ = *(rawpt + 1);       /* R */
+                    }
                 } else {
-                    /* First line or right column. */
-                    *scanpt++ = *(rawpt - 1);       /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = *(rawpt + width);   /* R */
+                    /* R */
+                    if ((y < (height - 1)) && (x < (width - 1))) {
+                        *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
+                                    *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* B */
+                        *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
+                                    *(rawpt - width) + *(rawpt + width)) / 4;    /* G */
+                        *scanpt++ = *rawpt;     /* R */
+                    } else {
+                        /* Bottom line or right column. */
+                        *scanpt++ = *(rawpt - width - 1);       /* B */
+                        *scanpt++ = (*(rawpt - 1) + *(rawpt - width)) / 2;    /* G */
+                        *scanpt++ = *rawpt;     /* R */
+                    }
                 }
             }
+        }
+    }
+
+}
+
+/*
+ * The packed and planar 4:2:2 converters run on every frame of most USB
+ * cameras.  Their inner loops work on 16 pixels at a time with SSE2 or NEON
+ * and, when the CPU has it, on 32 pixels at a time with AVX2.  The result is
+ * the same as that of the plain loops, which convert what is left of a row.
+ */
+#ifdef HAVE_AVX2_DISPATCH
+    static pthread_once_t vid_simd_once = PTHREAD_ONCE_INIT;
+    static int vid_simd_avx2 = FALSE;
+
+    static void vid_simd_init(void)
+    {
+        vid_simd_avx2 = __builtin_cpu_supports("avx2");
+    }
+#endif
+
+/**
+ * vid_packed422_avx2
+ *
+ *   Convert two rows of packed 4:2:2, 32 pixels at a time.  With yoff 0 the
+ *   bytes are Y U Y V (YUYV) and with yoff 1 they are U Y V Y (UYVY).
+ *
+ * Returns the number of pixels converted in each row.
+ */
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static int vid_packed422_avx2(const unsigned char *src, const unsigned char *src2, int width
+            , unsigned char *dst_y, unsigned char *dst_y2, unsigned char *dst_u, unsigned char *dst_v
+            , int yoff)
+{
+    __m256i mask8, mask16, order, a0, b0, a1, b1, ya, yb, ca, cb, u, v;
+    int x;
+
+    mask8 = _mm256_set1_epi16(0x00ff);
+    mask16 = _mm256_set1_epi32(0x0000ffff);
+    order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    for (x = 0; x + 32 <= width; x += 32) {
+        a0 = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+        b0 = _mm256_loadu_si256((const __m256i *)(src + x * 2 + 32));
+        a1 = _mm256_loadu_si256((const __m256i *)(src2 + x * 2));
+        b1 = _mm256_loadu_si256((const __m256i *)(src2 + x * 2 + 32));
+
+        if (yoff) {
+            ya = _mm256_packus_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(b0, 8));
+            yb = _mm256_packus_epi16(_mm256_srli_epi16(a1, 8), _mm256_srli_epi16(b1, 8));
+            ca = _mm256_add_epi16(_mm256_and_si256(a0, mask8), _mm256_and_si256(a1, mask8));
+            cb = _mm256_add_epi16(_mm256_and_si256(b0, mask8), _mm256_and_si256(b1, mask8));
         } else {
-            if ((i & 1) == 0) {
-                /* G(R) */
-                if ((i < (width * (height - 1))) && ((i % width) > 0)) {
-                    *scanpt++ = (*(rawpt + width) + *(rawpt - width)) / 2;  /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1)) / 2;  /* R */
-                } else {
-                    /* Bottom line or left column. */
-                    *scanpt++ = *(rawpt - width);   /* B */
-                    *scanpt++ = *rawpt;    /* G */
-                    *scanpt++ = *(rawpt + 1);       /* R */
-                }
-            } else {
-                /* R */
-                if (i < (width * (height - 1)) && ((i % width) < (width - 1))) {
-                    *scanpt++ = (*(rawpt - width - 1) + *(rawpt - width + 1) +
-                                *(rawpt + width - 1) + *(rawpt + width + 1)) / 4;    /* B */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt + 1) +
-                                *(rawpt - width) + *(rawpt + width)) / 4;    /* G */
-                    *scanpt++ = *rawpt;     /* R */
+            ya = _mm256_packus_epi16(_mm256_and_si256(a0, mask8), _mm256_and_si256(b0, mask8));
+            yb = _mm256_packus_epi16(_mm256_and_si256(a1, mask8), _mm256_and_si256(b1, mask8));
+            ca = _mm256_add_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8));
+            cb = _mm256_add_epi16(_mm256_srli_epi16(b0, 8), _mm256_srli_epi16(b1, 8));
+        }
+        /* The packs work within each half of the registers */
+        _mm256_storeu_si256((__m256i *)(dst_y + x), _mm256_permute4x64_epi64(ya, 0xd8));
+        _mm256_storeu_si256((__m256i *)(dst_y2 + x), _mm256_permute4x64_epi64(yb, 0xd8));
+
+        ca = _mm256_srli_epi16(ca, 1);
+        cb = _mm256_srli_epi16(cb, 1);
+        u = _mm256_packs_epi32(_mm256_and_si256(ca, mask16), _mm256_and_si256(cb, mask16));
+        v = _mm256_packs_epi32(_mm256_srli_epi32(ca, 16), _mm256_srli_epi32(cb, 16));
+        u = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(u, u), order);
+        v = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(v, v), order);
+        _mm_storeu_si128((__m128i *)(dst_u + x / 2), _mm256_castsi256_si128(u));
+        _mm_storeu_si128((__m128i *)(dst_v + x / 2), _mm256_castsi256_si128(v));
+    }
+
+    return x;
+}
+#endif
+
+/**
+ * vid_packed422_simd
+ *
+ *   Same as vid_packed422_avx2 with SSE2 or NEON, 16 pixels at a time.
+ */
+static int vid_packed422_simd(const unsigned char *src, const unsigned char *src2, int width
+            , unsigned char *dst_y, unsigned char *dst_y2, unsigned char *dst_u, unsigned char *dst_v
+            , int yoff)
+{
+    int x;
+
+    x = 0;
+
+    #ifdef HAVE_AVX2_DISPATCH
+        if (vid_simd_avx2) {
+            x = vid_packed422_avx2(src, src2, width, dst_y, dst_y2, dst_u, dst_v, yoff);
+        }
+    #endif
+
+    #if defined(__SSE2__)
+        {
+            __m128i mask8, mask16, a0, b0, a1, b1, ca, cb, u, v;
+
+            mask8 = _mm_set1_epi16(0x00ff);
+            mask16 = _mm_set1_epi32(0x0000ffff);
+
+            for (; x + 16 <= width; x += 16) {
+                a0 = _mm_loadu_si128((const __m128i *)(src + x * 2));
+                b0 = _mm_loadu_si128((const __m128i *)(src + x * 2 + 16));
+                a1 = _mm_loadu_si128((const __m128i *)(src2 + x * 2));
+                b1 = _mm_loadu_si128((const __m128i *)(src2 + x * 2 + 16));
+
+                if (yoff) {
+                    _mm_storeu_si128((__m128i *)(dst_y + x)
+                        , _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8)));
+                    _mm_storeu_si128((__m128i *)(dst_y2 + x)
+                        , _mm_packus_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8)));
+                    ca = _mm_add_epi16(_mm_and_si128(a0, mask8), _mm_and_si128(a1, mask8));
+                    cb = _mm_add_epi16(_mm_and_si128(b0, mask8), _mm_and_si128(b1, mask8));
                 } else {
-                    /* Bottom line or right column. */
-                    *scanpt++ = *(rawpt - width - 1);       /* B */
-                    *scanpt++ = (*(rawpt - 1) + *(rawpt - width)) / 2;    /* G */
-                    *scanpt++ = *rawpt;     /* R */
+                    _mm_storeu_si128((__m128i *)(dst_y + x)
+                        , _mm_packus_epi16(_mm_and_si128(a0, mask8), _mm_and_si128(b0, mask8)));
+                    _mm_storeu_si128((__m128i *)(dst_y2 + x)
+                        , _mm_packus_epi16(_mm_and_si128(a1, mask8), _mm_and_si128(b1, mask8)));
+                    ca = _mm_add_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));
+                    cb = _mm_add_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8));
                 }
+
+                /* Chroma of the two rows, U in the low and V in the high 16 bits */
+                ca = _mm_srli_epi16(ca, 1);
+                cb = _mm_srli_epi16(cb, 1);
+                u = _mm_packs_epi32(_mm_and_si128(ca, mask16), _mm_and_si128(cb, mask16));
+                v = _mm_packs_epi32(_mm_srli_epi32(ca, 16), _mm_srli_epi32(cb, 16));
+                _mm_storel_epi64((__m128i *)(dst_u + x / 2), _mm_packus_epi16(u, u));
+                _mm_storel_epi64((__m128i *)(dst_v + x / 2), _mm_packus_epi16(v, v));
             }
         }
-        rawpt++;
-    }
+    #elif defined(__ARM_NEON)
+        {
+            uint8x16x2_t p0, p1;
+            uint8x16_t c;
+            uint8x8x2_t uv;
+
+            for (; x + 16 <= width; x += 16) {
+                p0 = vld2q_u8(src + x * 2);
+                p1 = vld2q_u8(src2 + x * 2);
+                vst1q_u8(dst_y + x, p0.val[yoff]);
+                vst1q_u8(dst_y2 + x, p1.val[yoff]);
+                c = vhaddq_u8(p0.val[1 - yoff], p1.val[1 - yoff]);
+                uv = vuzp_u8(vget_low_u8(c), vget_high_u8(c));
+                vst1_u8(dst_u + x / 2, uv.val[0]);
+                vst1_u8(dst_v + x / 2, uv.val[1]);
+            }
+        }
+    #endif
 
+    return x;
 }
 
-void vid_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
+/**
+ * vid_avg_rows
+ *
+ *   Average two rows of len pixels into dst, rounding down.
+ */
+static void vid_avg_rows(unsigned char *dst, const unsigned char *src, const unsigned char *src2, int len)
 {
-    unsigned char *src, *dest, *src2, *dest2;
-    int i, j;
+    int x;
 
-    /* Create the Y plane. */
-    src = cap_map;
-    dest = map;
-    for (i = width * height; i > 0; i--) {
-        *dest++ = *src;
-        src += 2;
+    x = 0;
+
+    #if defined(__SSE2__)
+        {
+            __m128i a, b, one;
+
+            /* pavgb rounds up, take off the half it added */
+            one = _mm_set1_epi8(1);
+            for (; x + 16 <= len; x += 16) {
+                a = _mm_loadu_si128((const __m128i *)(src + x));
+                b = _mm_loadu_si128((const __m128i *)(src2 + x));
+                _mm_storeu_si128((__m128i *)(dst + x), _mm_sub_epi8(_mm_avg_epu8(a, b)
+                    , _mm_and_si128(_mm_xor_si128(a, b), one)));
+            }
+        }
+    #elif defined(__ARM_NEON)
+        for (; x + 16 <= len; x += 16) {
+            vst1q_u8(dst + x, vhaddq_u8(vld1q_u8(src + x), vld1q_u8(src2 + x)));
+        }
+    #endif
+
+    for (; x < len; x++) {
+        dst[x] = ((int)src[x] + (int)src2[x]) / 2;
     }
-    /* Create U and V planes. */
-    src = cap_map + 1;
-    src2 = cap_map + width * 2 + 1;
-    dest = map + width * height;
-    dest2 = dest + (width * height) / 4;
-    for (i = height / 2; i > 0; i--) {
-        for (j = width / 2; j > 0; j--) {
-            *dest = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest++;
-            *dest2 = ((int) *src + (int) *src2) / 2;
-            src += 2;
-            src2 += 2;
-            dest2++;
+}
+
+/**
+ * vid_packed422to420p
+ *
+ *   Convert packed 4:2:2 to YUV420P in one pass over each pair of rows.
+ *   The chroma is the average of the two rows.
+ */
+static void vid_packed422to420p(unsigned char *map, unsigned char *cap_map
+            , int width, int height, int yoff)
+{
+    unsigned char *dst_y, *dst_u, *dst_v;
+    const unsigned char *src, *src2;
+    int row, x;
+
+    #ifdef HAVE_AVX2_DISPATCH
+        pthread_once(&vid_simd_once, vid_simd_init);
+    #endif
+
+    dst_y = map;
+    dst_u = map + width * height;
+    dst_v = dst_u + (width * height) / 4;
+
+    for (row = 0; row + 1 < height; row += 2) {
+        src = cap_map + (row * width * 2);
+        src2 = src + (width * 2);
+
+        x = vid_packed422_simd(src, src2, width, dst_y, dst_y + width, dst_u, dst_v, yoff);
+        for (; x + 1 < width; x += 2) {
+            dst_y[x] = src[x * 2 + yoff];
+            dst_y[x + 1] = src[x * 2 + 2 + yoff];
+            dst_y[width + x] = src2[x * 2 + yoff];
+            dst_y[width + x + 1] = src2[x * 2 + 2 + yoff];
+            dst_u[x / 2] = ((int)src[x * 2 + 1 - yoff] + (int)src2[x * 2 + 1 - yoff]) / 2;
+            dst_v[x / 2] = ((int)src[x * 2 + 3 - yoff] + (int)src2[x * 2 + 3 - yoff]) / 2;
         }
-        src += width * 2;
-        src2 += width * 2;
+
+        dst_y += width * 2;
+        dst_u += width / 2;
+        dst_v += width / 2;
     }
+
+    /* Luma of the last row of an odd height */
+    if (row < height) {
+        src = cap_map + (row * width * 2);
+        for (x = 0; x < width; x++) {
+            dst_y[x] = src[x * 2 + yoff];
+        }
+    }
+}
+
+void vid_yuv422to420p(unsigned char *map, unsigned char *cap_map, int width, int height)
+{
+    vid_packed422to420p(map, cap_map, width, height, 0);
 }
 
 void vid_yuv422pto420p(unsigned char *map, unsigned char *cap_map, int width, int height)
 {
-    unsigned char *src, *dest, *dest2;
-    unsigned char *src_u, *src_u2, *src_v, *src_v2;
+    unsigned char *dest, *dest2;
+    unsigned char *src_u, *src_v;
+    int i;
 
-    int i, j;
     /*Planar version of 422 */
     /* Create the Y plane. */
-    src = cap_map;
-    dest = map;
-    for (i = width * height; i > 0; i--) {
-        *dest++ = *src++;
-    }
+    memcpy(map, cap_map, width * height);
 
     /* Create U and V planes. */
     dest = map + width * height;
     dest2 = dest + (width * height) / 4;
     for (i = 0; i< (height / 2); i++) {
         src_u = cap_map + (width * height) + ((i*2) * (width/2));
-        src_u2 = src_u  + (width/2);
         src_v = src_u + (width/2 * height);
-        src_v2 = src_v  + (width/2);
-
-        for (j = 0; j < (width / 2); j++) {
-            *dest = ((int) *src_u + (int) *src_u2) / 2;
-            src_u ++;
-            src_u2++;
-            dest++;
-
-            *dest2 = ((int) *src_v + (int) *src_v2) / 2;
-            src_v ++;
-            src_v2++;
-            dest2++;
-        }
+
+        vid_avg_rows(dest, src_u, src_u + (width/2), width / 2);
+        vid_avg_rows(dest2, src_v, src_v + (width/2), width / 2);
+        dest += width / 2;
+        dest2 += width / 2;
     }
 }
 
 void vid_uyvyto420p(unsigned char *map, unsigned char *cap_map, int width, int height)
 {
-    uint8_t *pY = map;
-    uint8_t *pU = pY + (width * height);
-    uint8_t *pV = pU + (width * height) / 4;
-    uint32_t uv_offset = width * 2 * sizeof(uint8_t);
-    int ix, jx;
-
-    for (ix = 0; ix < height; ix++) {
-        for (jx = 0; jx < width; jx += 2) {
-            uint16_t calc;
-
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pU++ = (uint8_t) calc;
-            }
-
-            cap_map++;
-            *pY++ = *cap_map++;
-
-            if ((ix&1) == 0) {
-                calc = *cap_map;
-                calc += *(cap_map + uv_offset);
-                calc /= 2;
-                *pV++ = (uint8_t) calc;
-            }
-
-            cap_map++;
-            *pY++ = *cap_map++;
-        }
-    }
+    vid_packed422to420p(map, cap_map, width, height, 1);
 }
 
 void vid_rgb24toyuv420p(unsigned char *map, unsigned char *cap_map, int width, int height)
@@ -474,22 +644,19 @@ void vid_y10torgb24(unsigned char *map, unsigned char *cap_map, int width, int h
     /* url: https://linuxtv.org/downloads/v4l-dvb-apis/V4L2-PIX-FMT-Y12.html */
     /* url: https://linuxtv.org/downloads/v4l-dvb-apis/V4L2-PIX-FMT-Y10.html */
 
-    int src_size[2] = {width,height};
-    int bpp = 16;
-    unsigned int src_stride = (src_size[0] * bpp) / 8;
-    unsigned int rgb_stride = src_size[0] * 3;
-    int a = 0;
-    int src_x = 0, src_y = 0;
-    int dst_x = 0, dst_y = 0;
-
-    for (src_y = 0, dst_y = 0; dst_y < src_size[1]; src_y++, dst_y++) {
-        for (src_x = 0, dst_x = 0; dst_x < src_size[0]; src_x++, dst_x++) {
-            a = (cap_map[src_y*src_stride + src_x*2+0] |
-                (cap_map[src_y*src_stride + src_x*2+1] << 8)) >> shift;
-            map[dst_y*rgb_stride+3*dst_x+0] = a;
-            map[dst_y*rgb_stride+3*dst_x+1] = a;
-            map[dst_y*rgb_stride+3*dst_x+2] = a;
-        }
+    unsigned char *src, *dst, *end;
+    int a;
+
+    src = cap_map;
+    dst = map;
+    end = map + (width * height * 3);
+    while (dst < end) {
+        a = (src[0] | (src[1] << 8)) >> shift;
+        dst[0] = a;
+        dst[1] = a;
+        dst[2] = a;
+        src += 2;
+        dst += 3;
     }
 }
 
@@ -78,6 +78,9 @@ typedef struct {
 
     s32 pframe;
 
+    unsigned char *convert;             /* Rgb image of the bayer and Y10 conversions */
+    size_t convert_size;
+
     u32 ctrl_flags;
     volatile unsigned int *finish;      /* End the thread */
 
@@ -1000,6 +1003,25 @@ static int v4l2_imgs_set(struct context *cnt, struct video_dev *curdev)
 
 }
 
+/**
+ * v4l2_convert_buffer
+ *
+ *   Buffer of the device for the formats converted through rgb.  The capture
+ *   may run in its own thread, so the buffers of the motion loop are not used.
+ */
+static unsigned char *v4l2_convert_buffer(src_v4l2_t *vid_source, int width, int height)
+{
+    size_t size = (size_t)3 * width * height;
+
+    if (vid_source->convert_size < size) {
+        free(vid_source->convert);
+        vid_source->convert = mymalloc(size);
+        vid_source->convert_size = size;
+    }
+
+    return vid_source->convert;
+}
+
 static int v4l2_capture(struct context *cnt, struct video_dev *curdev, unsigned char *map)
 {
 
@@ -1008,6 +1030,7 @@ static int v4l2_capture(struct context *cnt, struct video_dev *curdev, unsigned
 
     sigset_t set, old;
     src_v4l2_t *vid_source = (src_v4l2_t *) curdev->v4l2_private;
+    unsigned char *convert;
     int shift, width, height, retcd;
 
     width = cnt->conf.width;
@@ -1127,24 +1150,27 @@ static int v4l2_capture(struct context *cnt, struct video_dev *curdev, unsigned
         case V4L2_PIX_FMT_SGRBG8:
             /*FALLTHROUGH*/
         case V4L2_PIX_FMT_SBGGR8:    /* bayer */
-            vid_bayer2rgb24(cnt->imgs.common_buffer, the_buffer->ptr, width, height);
-            vid_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
+            convert = v4l2_convert_buffer(vid_source, width, height);
+            vid_bayer2rgb24(convert, the_buffer->ptr, width, height);
+            vid_rgb24toyuv420p(map, convert, width, height);
             return 0;
 
         case V4L2_PIX_FMT_SPCA561:
             /*FALLTHROUGH*/
         case V4L2_PIX_FMT_SN9C10X:
+            convert = v4l2_convert_buffer(vid_source, width, height);
             vid_sonix_decompress(map, the_buffer->ptr, width, height);
-            vid_bayer2rgb24(cnt->imgs.common_buffer, map, width, height);
-            vid_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
+            vid_bayer2rgb24(convert, map, width, height);
+            vid_rgb24toyuv420p(map, convert, width, height);
             return 0;
         case V4L2_PIX_FMT_Y12:
             shift += 2;
             /*FALLTHROUGH*/
         case V4L2_PIX_FMT_Y10:
             shift += 2;
-            vid_y10torgb24(cnt->imgs.common_buffer, the_buffer->ptr, width, height, shift);
-            vid_rgb24toyuv420p(map, cnt->imgs.common_buffer, width, height);
+            convert = v4l2_convert_buffer(vid_source, width, height);
+            vid_y10torgb24(convert, the_buffer->ptr, width, height, shift);
+            vid_rgb24toyuv420p(map, convert, width, height);
             return 0;
         case V4L2_PIX_FMT_GREY:
             vid_greytoyuv420p(map, the_buffer->ptr, width, height);
@@ -1189,6 +1215,8 @@ static int v4l2_device_init(struct context *cnt, struct video_dev *curdev)
     vid_source->pframe = -1;
     vid_source->finish = &cnt->finish;
     vid_source->buffers = NULL;
+    vid_source->convert = NULL;
+    vid_source->convert_size = 0;
 
     return 0;
 }
@@ -1328,6 +1356,7 @@ static void v4l2_device_cleanup(struct video_dev *curdev)
     }
 
     if (vid_source != NULL) {
+        free(vid_source->convert);
         free(vid_source);
         curdev->v4l2_private = NULL;
     }
@@ -53,6 +53,10 @@
 #include "webu_text.h"
 #include "webu_stream.h"
 #include "webu_status.h"
+#include "stream_jpeg.h"
+#include "event.h"
+#include "pipeline.h"
+#include "mosaic.h"
 #include "translate.h"
 
 /* Context to pass the parms to functions to start mhd */
@@ -97,7 +101,29 @@ static void webu_context_init(struct context **cntlst, struct context *cnt, stru
     webui->resp_size     = WEBUI_LEN_RESP * 10; /* The size of the resp_page buffer.  May get adjusted */
     webui->resp_used     = 0;                   /* How many bytes used so far in resp_page*/
     webui->stream_pos    = 0;                   /* Stream position of image being sent */
+    webui->stream_jpeg   = NULL;                /* Reference on the image being sent */
+    webui->stream_seq    = 0;                   /* No image sent yet */
+    webui->stream_due    = 0;                   /* First image is due right away */
+    webui->cnct_counted  = FALSE;               /* Not yet in the stream connection counts */
+    webui->mhd_poll      = FALSE;               /* Set with the daemon when the stream is answered */
+    webui->wait_next     = NULL;                /* Not waiting for an image */
+    webui->client_next   = NULL;                /* Not in the stream connections yet */
+    webui->stream_strm   = WEBUI_STRM_FULL;     /* Best images until the client falls behind */
+    webui->stream_start  = 0;
+    webui->stream_since  = 0;
+    webui->stream_recover = WEBU_STREAM_RECOVER;
+    webui->stream_rate   = 0;
+    webui->stream_late   = 0;
+    webui->stream_images = 0;
+    webui->stream_skipped = 0;
+    webui->stream_lates  = 0;
+    webui->stream_lowered = 0;
+    memset(webui->strm_size, 0, sizeof(webui->strm_size));
     webui->stream_fps    = 1;                   /* Stream rate */
+    webui->live_generation = 0;
+    webui->live_init_sent = FALSE;
+    webui->live_seq      = 0;
+    webui->live_pos      = 0;
     webui->resp_page     = mymalloc(webui->resp_size);      /* The response being constructed */
     webui->cntlst        = cntlst;  /* The list of context's for all cameras */
     webui->cnt           = cnt;     /* The context pointer for a single camera */
@@ -1234,6 +1260,22 @@ static void webu_answer_strm_type(struct webui_ctx *webui)
                mystreq(webui->uri_camid,"substream")) {
         webui->cnct_type = WEBUI_CNCT_SUB;
 
+    } else if (mystreq(webui->uri_cmd1,"quarter") ||
+               mystreq(webui->uri_camid,"quarter")) {
+        webui->cnct_type = WEBUI_CNCT_QUARTER;
+
+    } else if (mystreq(webui->uri_cmd1,"thumbnail") ||
+               mystreq(webui->uri_camid,"thumbnail")) {
+        webui->cnct_type = WEBUI_CNCT_THUMB;
+
+    } else if (mystreq(webui->uri_cmd1,"mosaic") ||
+               mystreq(webui->uri_camid,"mosaic")) {
+        webui->cnct_type = WEBUI_CNCT_MOSAIC;
+
+    } else if (mystreq(webui->uri_cmd1,"live") ||
+               mystreq(webui->uri_camid,"live")) {
+        webui->cnct_type = WEBUI_CNCT_LIVE;
+
     } else if (mystreq(webui->uri_cmd1,"motion") ||
                mystreq(webui->uri_camid,"motion")) {
         webui->cnct_type = WEBUI_CNCT_MOTION;
@@ -1382,10 +1424,19 @@ static mymhd_retcd webu_answer_strm(void *cls, struct MHD_Connection *connection
         return retcd;
     }
 
+    /* Wait for images by suspending the connection when served by polling threads */
+    if (webui->cntlst != NULL) {
+        webui->mhd_poll = webui->cntlst[0]->webstream_poll;
+    } else {
+        webui->mhd_poll = webui->cnt->webstream_poll;
+    }
+
+    webu_answer_strm_type(webui);
+
     /* Do not answer a request until the motion loop has completed at least once.
-     * Required for the Motioneye application
+     * Required for the Motioneye application.  The mosaic has no motion loop.
     */
-    if (webui->cnt->passflag == 0) {
+    if ((webui->cnt->passflag == 0) && (webui->cnct_type != WEBUI_CNCT_MOSAIC)) {
         MOTION_LOG(DBG, TYPE_STREAM, NO_ERRNO, _("Stream picture is not ready yet"));
         return MHD_NO;
     }
@@ -1408,8 +1459,6 @@ static mymhd_retcd webu_answer_strm(void *cls, struct MHD_Connection *connection
         }
     }
 
-    webu_answer_strm_type(webui);
-
     retcd = 0;
     if ((webui->cnct_type == WEBUI_CNCT_STATUS_LIST) ||
         (webui->cnct_type == WEBUI_CNCT_STATUS_ONE)) {
@@ -1421,6 +1470,12 @@ static mymhd_retcd webu_answer_strm(void *cls, struct MHD_Connection *connection
             webu_badreq(webui);
             retcd = webu_mhd_send(webui, FALSE);
         }
+    } else if (webui->cnct_type == WEBUI_CNCT_LIVE) {
+        retcd = webu_stream_live(webui);
+        if (retcd == MHD_NO) {
+            webu_badreq(webui);
+            retcd = webu_mhd_send(webui, FALSE);
+        }
     } else if (webui->cnct_type != WEBUI_CNCT_UNKNOWN) {
         retcd = webu_stream_mjpeg(webui);
         if (retcd == MHD_NO) {
@@ -1527,32 +1582,10 @@ static void webu_mhd_deinit(void *cls, struct MHD_Connection *connection
     (void)cls;
     (void)toe;
 
-    if (webui->cnct_type == WEBUI_CNCT_FULL ) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_norm.cnct_count--;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
-
-    } else if (webui->cnct_type == WEBUI_CNCT_SUB ) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_sub.cnct_count--;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
+    stream_jpeg_release(webui->stream_jpeg);
+    webui->stream_jpeg = NULL;
 
-    } else if (webui->cnct_type == WEBUI_CNCT_MOTION ) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_motion.cnct_count--;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
-
-    } else if (webui->cnct_type == WEBUI_CNCT_SOURCE ) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_source.cnct_count--;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
-
-    } else if (webui->cnct_type == WEBUI_CNCT_STATIC ) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_norm.cnct_count--;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
-
-    }
+    webu_stream_cnct_uncount(webui);
 
     webu_context_free(webui);
 
@@ -1901,6 +1934,35 @@ static void webu_mhd_opts_tls(struct mhdstart_ctx *mhdst)
 
 }
 
+static int webu_mhd_threads(struct mhdstart_ctx *mhdst)
+{
+    /* The number of threads polling the connections of the daemon.  Zero
+     * for a thread per connection
+     */
+    #ifdef WEBUI_MHD_POLL
+        if (mhdst->ctrl) {
+            return mhdst->cnt[mhdst->indxthrd]->conf.webcontrol_threads;
+        } else {
+            return mhdst->cnt[mhdst->indxthrd]->conf.stream_threads;
+        }
+    #else
+        (void)mhdst;
+        return 0;
+    #endif
+}
+
+static void webu_mhd_opts_threads(struct mhdstart_ctx *mhdst)
+{
+    /* Set the MHD option for the size of the pool of polling threads */
+    if (webu_mhd_threads(mhdst) > 1) {
+        mhdst->mhd_ops[mhdst->mhd_opt_nbr].option = MHD_OPTION_THREAD_POOL_SIZE;
+        mhdst->mhd_ops[mhdst->mhd_opt_nbr].value = (unsigned int)webu_mhd_threads(mhdst);
+        mhdst->mhd_ops[mhdst->mhd_opt_nbr].ptr_value = NULL;
+        mhdst->mhd_opt_nbr++;
+    }
+
+}
+
 static void webu_mhd_opts(struct mhdstart_ctx *mhdst)
 {
     /* Set all the options we need based upon the motion configuration parameters*/
@@ -1919,6 +1981,8 @@ static void webu_mhd_opts(struct mhdstart_ctx *mhdst)
 
     webu_mhd_opts_tls(mhdst);
 
+    webu_mhd_opts_threads(mhdst);
+
     mhdst->mhd_ops[mhdst->mhd_opt_nbr].option = MHD_OPTION_END;
     mhdst->mhd_ops[mhdst->mhd_opt_nbr].value = 0;
     mhdst->mhd_ops[mhdst->mhd_opt_nbr].ptr_value = NULL;
@@ -1932,6 +1996,15 @@ static void webu_mhd_flags(struct mhdstart_ctx *mhdst)
     /* This sets the MHD startup flags based upon what user put into configuration */
     mhdst->mhd_flags = MHD_USE_THREAD_PER_CONNECTION;
 
+    #ifdef WEBUI_MHD_POLL
+        if (webu_mhd_threads(mhdst) > 0) {
+            /* A pool of threads polling with the best method of the system (epoll
+             * on Linux).  Streams waiting for an image are suspended.
+             */
+            mhdst->mhd_flags = MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_AUTO | MHD_ALLOW_SUSPEND_RESUME;
+        }
+    #endif
+
     if (mhdst->ipv6) {
         mhdst->mhd_flags = mhdst->mhd_flags | MHD_USE_DUAL_STACK;
     }
@@ -2091,6 +2164,8 @@ static void webu_start_strm(struct context **cnt)
                     ,MHD_OPTION_END);
             }
             free(mhdst.mhd_ops);
+            cnt[mhdst.indxthrd]->webstream_poll =
+                ((mhdst.mhd_flags & MHD_USE_THREAD_PER_CONNECTION) == 0);
             if (cnt[mhdst.indxthrd]->webstream_daemon == NULL) {
                 MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO
                     ,_("Unable to start stream for camera %d")
@@ -2171,6 +2246,14 @@ void webu_stop(struct context **cnt)
     }
 
 
+    /* Suspended streams must be resumed before their daemon is stopped */
+    indxthrd = 0;
+    while (cnt[indxthrd] != NULL) {
+        cnt[indxthrd]->webcontrol_finish = TRUE;
+        webu_stream_wake(cnt[indxthrd], TRUE);
+        indxthrd++;
+    }
+
     indxthrd = 0;
     while (cnt[indxthrd] != NULL) {
         if (cnt[indxthrd]->webstream_daemon != NULL) {
@@ -2181,6 +2264,9 @@ void webu_stop(struct context **cnt)
         cnt[indxthrd]->webcontrol_daemon = NULL;
         indxthrd++;
     }
+
+    /* No more clients of the mosaic */
+    mosaic_deinit(cnt);
 }
 
 void webu_start(struct context **cnt)
@@ -2210,6 +2296,9 @@ void webu_start(struct context **cnt)
 
     webu_start_ports(cnt);
 
+    /* The mosaic stream must be ready before its daemon answers */
+    mosaic_init(cnt);
+
     webu_start_strm(cnt);
 
     webu_start_ctrl(cnt);
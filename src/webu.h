@@ -28,9 +28,16 @@
 #define WEBUI_LEN_PARM 512          /* Parameters specified */
 #define WEBUI_LEN_URLI 512          /* Maximum URL permitted */
 #define WEBUI_LEN_RESP 1024         /* Initial response size */
-#define WEBUI_MHD_OPTS 10           /* Maximum number of options permitted for MHD */
+#define WEBUI_MHD_OPTS 12           /* Maximum number of options permitted for MHD */
 #define WEBUI_LEN_LNK  15           /* Maximum length for chars in strminfo */
 
+/* Versions of MHD that can serve the connections from a pool of polling
+ * threads and suspend the streams waiting for an image
+ */
+#if MHD_VERSION >= 0x00095300
+    #define WEBUI_MHD_POLL
+#endif
+
 enum WEBUI_CNCT{
   WEBUI_CNCT_CONTROL     = 0,
   WEBUI_CNCT_FULL        = 1,
@@ -40,9 +47,22 @@ enum WEBUI_CNCT{
   WEBUI_CNCT_STATIC      = 5,
   WEBUI_CNCT_STATUS_LIST = 6,
   WEBUI_CNCT_STATUS_ONE  = 7,
+  WEBUI_CNCT_QUARTER     = 8,
+  WEBUI_CNCT_THUMB       = 9,
+  WEBUI_CNCT_MOSAIC      = 10,
+  WEBUI_CNCT_LIVE        = 11,
   WEBUI_CNCT_UNKNOWN     = 99
 };
 
+/* Images sent to a client of the normal stream as it falls behind */
+enum WEBUI_STRM{
+  WEBUI_STRM_FULL        = 0,   /* The normal stream */
+  WEBUI_STRM_LOW         = 1,   /* The normal stream at a lower quality */
+  WEBUI_STRM_SUB         = 2,   /* The substream */
+  WEBUI_STRM_QUARTER     = 3,   /* The quarter size stream */
+  WEBUI_STRM_COUNT       = 4
+};
+
 struct webui_ctx {
     char *url;                   /* The URL sent from the client */
     char *uri_camid;            /* Parsed thread number from the url*/
@@ -75,7 +95,29 @@ struct webui_ctx {
     size_t          resp_size;         /* The allocated size of the response */
     size_t          resp_used;         /* The amount of the response page used */
     uint64_t        stream_pos;        /* Stream position of sent image */
+    struct stream_jpeg *stream_jpeg;   /* Image being sent, the header is in resp_page */
+    unsigned long   stream_seq;        /* Sequence number of the image sent last */
+    long long       stream_due;        /* Time in microseconds the next image is due */
+    int             cnct_counted;      /* Connection is in the count of its stream */
+    int             mhd_poll;          /* Served by polling threads, wait for images by suspending */
+    struct webui_ctx *wait_next;       /* Next connection waiting for an image of the camera */
+    struct webui_ctx *client_next;     /* Next stream connection of the camera */
+    enum WEBUI_STRM stream_strm;       /* Images sent to a client of the normal stream */
+    long long       stream_start;      /* Time in microseconds the image being sent was taken */
+    long long       stream_since;      /* Time the client first had room for the next better images */
+    long long       stream_recover;    /* Microseconds with room before sending better images */
+    long            stream_rate;       /* Averaged bytes per second read by the client */
+    long            strm_size[WEBUI_STRM_COUNT];   /* Bytes of the image last sent of each kind */
+    int             stream_late;       /* Consecutive images that took longer than the rate allows */
+    unsigned long   stream_images;     /* Images sent */
+    unsigned long   stream_skipped;    /* Images published but never sent to the client */
+    unsigned long   stream_lates;      /* Images that took longer than the rate allows */
+    unsigned long   stream_lowered;    /* Times the client was sent worse images */
     int             stream_fps;        /* Stream rate per second */
+    int             live_generation;   /* Muxer of the live stream being sent, 0 before the first */
+    int             live_init_sent;    /* Header of the live stream was sent */
+    unsigned long   live_seq;          /* Fragment of the live stream being sent, 0 to wait for a key frame */
+    size_t          live_pos;          /* Bytes sent of the header or fragment */
     struct timeval  time_last;         /* Keep track of processing time for stream thread*/
     int             mhd_first;         /* Boolean for whether it is the first connection*/
 
@@ -882,6 +882,17 @@ static void webu_html_script_camera_all(struct webui_ctx *webui)
     snprintf(response, sizeof (response), "      if (camid == \"cam_all00\") {\n");
     webu_write(webui, response);
 
+    /* A single connection for the mosaic of all the cameras.  See mosaic.c */
+    if (webui->cntlst[0]->mosaic != NULL) {
+        strm_info.motion_images = FALSE;
+        webu_html_strminfo(&strm_info, 0);
+        snprintf(response, sizeof (response),
+            "        preview = \"<img src=%s://%s:%d/mosaic border=0 width=100%%>\"; \n"
+            ,strm_info.proto, webui->hostname, strm_info.port);
+        webu_write(webui, response);
+        indx_st = webui->cam_threads;
+    }
+
     for (indx = indx_st; indx<webui->cam_threads; indx++) {
         if (indx == indx_st) {
             snprintf(response, sizeof (response),"%s","        preview = \"\";\n");
@@ -23,10 +23,20 @@
 
 #include <ctype.h>
 #include <inttypes.h>
+#include <sys/sysmacros.h>
 
 #include "motion.h"
 #include "webu.h"
 #include "webu_status.h"
+#include "event.h"
+#include "pipeline.h"
+#include "picture_writer.h"
+#include "movie_encoder.h"
+#include "frame_arena.h"
+#include "stream_worker.h"
+#include "spawner.h"
+#include "file_writer.h"
+#include "stream_jpeg.h"
 
 /* Conservatively encode characters in an array as a JSON string */
 static void webu_json_write_string(struct webui_ctx *webui, const char *str)
@@ -155,10 +165,98 @@ static void webu_status_list(struct webui_ctx *webui)
     webu_status_write_list(webui, "cameras", webu_json_cam_list_single);
 }
 
+/* Describe the clients of the streams of a camera */
+static void webu_json_stream_clients(struct webui_ctx *webui, struct context *cnt)
+{
+    char buf[WEBUI_LEN_RESP];
+    struct webui_ctx *client;
+    const char *stream_name, *strm_name;
+    int quality, first;
+
+    webu_write(webui, ", \"stream_clients\": [");
+
+    /* The clients are only listed while the camera runs */
+    if (!cnt->stream_closed) {
+        first = TRUE;
+        pthread_mutex_lock(&cnt->mutex_stream);
+            for (client = cnt->stream_clients; client != NULL; client = client->client_next) {
+                if (client->cnct_type == WEBUI_CNCT_SUB) {
+                    stream_name = "substream";
+                } else if (client->cnct_type == WEBUI_CNCT_QUARTER) {
+                    stream_name = "quarter";
+                } else if (client->cnct_type == WEBUI_CNCT_THUMB) {
+                    stream_name = "thumbnail";
+                } else if (client->cnct_type == WEBUI_CNCT_MOTION) {
+                    stream_name = "motion";
+                } else if (client->cnct_type == WEBUI_CNCT_SOURCE) {
+                    stream_name = "source";
+                } else if (client->cnct_type == WEBUI_CNCT_STATIC) {
+                    stream_name = "current";
+                } else if (client->cnct_type == WEBUI_CNCT_MOSAIC) {
+                    stream_name = "mosaic";
+                } else if (client->cnct_type == WEBUI_CNCT_LIVE) {
+                    stream_name = "live";
+                } else {
+                    stream_name = "stream";
+                }
+
+                quality = cnt->conf.stream_quality;
+                if (client->stream_strm == WEBUI_STRM_LOW) {
+                    strm_name = "low";
+                    quality = stream_jpeg_low_quality(cnt);
+                } else if (client->stream_strm == WEBUI_STRM_SUB) {
+                    strm_name = "substream";
+                } else if (client->stream_strm == WEBUI_STRM_QUARTER) {
+                    strm_name = "quarter";
+                } else {
+                    strm_name = "full";
+                }
+
+                webu_write(webui, first ? "{\"client\": " : ", {\"client\": ");
+                webu_json_write_string(webui, client->clientip);
+                first = FALSE;
+
+                snprintf(buf, sizeof(buf),
+                         ", \"stream\": \"%s\""
+                         ", \"images\": \"%s\""
+                         ", \"quality\": %d"
+                         ", \"fps\": %d"
+                         ", \"rate\": %ld"
+                         ", \"sent\": %lu"
+                         ", \"skipped\": %lu"
+                         ", \"late\": %lu"
+                         ", \"lowered\": %lu}"
+                         , stream_name
+                         , strm_name
+                         , quality
+                         , client->stream_fps
+                         , client->stream_rate
+                         , client->stream_images
+                         , client->stream_skipped
+                         , client->stream_lates
+                         , client->stream_lowered);
+                webu_write(webui, buf);
+            }
+        pthread_mutex_unlock(&cnt->mutex_stream);
+    }
+
+    webu_write(webui, "]");
+}
+
 /* Describe a single camera status */
 static void webu_json_cam_status_single(struct webui_ctx *webui, struct context *cnt)
 {
     char buf[WEBUI_LEN_RESP];
+    struct pipeline *pl;
+    struct picture_writer *pw;
+    struct movie_encoder *me;
+    struct stream_worker *sw;
+    struct spawner *spw;
+    struct file_writer *fw;
+    struct file_dev *dev;
+    long long rate;
+    int indx;
+    size_t arena_mapped, arena_in_use, arena_pooled;
     const struct {
         const char *name;
         time_t value;
@@ -195,6 +293,198 @@ static void webu_json_cam_status_single(struct webui_ctx *webui, struct context
 
     webu_write(webui, buf);
 
+    /* The stages of the camera are freed and set up again when it restarts */
+    pthread_mutex_lock(&cnt->mutex_stages);
+        /* Queues between the capture, detection and output stages */
+        pl = cnt->pipeline;
+        if (pl != NULL) {
+            snprintf(buf, sizeof(buf),
+                     ", \"capture_queue\": %u"
+                     ", \"capture_stalls\": %lu"
+                     ", \"output_queue\": %u"
+                     ", \"output_queue_max\": %u"
+                     ", \"output_events\": %lu"
+                     ", \"output_dropped\": %lu"
+                     , pipeline_queue_depth(&pl->capture_ready)
+                     , pl->capture_stalls
+                     , pipeline_queue_depth(&pl->output_ready)
+                     , pl->output_max
+                     , pl->output_events
+                     , pl->output_dropped);
+        } else {
+            snprintf(buf, sizeof(buf),
+                     ", \"capture_queue\": 0"
+                     ", \"capture_stalls\": 0"
+                     ", \"output_queue\": 0"
+                     ", \"output_queue_max\": 0"
+                     ", \"output_events\": 0"
+                     ", \"output_dropped\": 0");
+        }
+
+        webu_write(webui, buf);
+
+        pw = cnt->picture_writer;
+        if (pw != NULL) {
+            snprintf(buf, sizeof(buf),
+                     ", \"picture_queue\": %d"
+                     ", \"picture_queue_max\": %d"
+                     ", \"pictures_written\": %lu"
+                     ", \"pictures_dropped\": %lu"
+                     , picture_writer_pending(cnt)
+                     , pw->pending_max
+                     , pw->written
+                     , pw->dropped);
+        } else {
+            snprintf(buf, sizeof(buf),
+                     ", \"picture_queue\": 0"
+                     ", \"picture_queue_max\": 0"
+                     ", \"pictures_written\": 0"
+                     ", \"pictures_dropped\": 0");
+        }
+
+        webu_write(webui, buf);
+
+        me = cnt->movie_encoder;
+        if (me != NULL) {
+            snprintf(buf, sizeof(buf),
+                     ", \"movie_queue\": %d"
+                     ", \"movie_queue_max\": %d"
+                     ", \"movie_frames\": %lu"
+                     ", \"movie_fillers\": %lu"
+                     ", \"movie_dropped\": %lu"
+                     ", \"movie_latency\": %ld"
+                     ", \"movie_latency_max\": %ld"
+                     ", \"movie_start\": %ld"
+                     ", \"movie_start_max\": %ld"
+                     ", \"movie_rollover_gap\": %ld"
+                     ", \"movie_rollover_gap_max\": %ld"
+                     ", \"movie_standby_used\": %lu"
+                     ", \"movie_standby_missed\": %lu"
+                     , movie_encoder_pending(cnt)
+                     , me->pending_max
+                     , me->encoded
+                     , me->fillers
+                     , me->dropped
+                     , movie_encoder_latency(cnt)
+                     , me->latency_max
+                     , me->start_last
+                     , me->start_max
+                     , me->rollover_last
+                     , me->rollover_max
+                     , me->standby_used
+                     , me->standby_missed);
+        } else {
+            snprintf(buf, sizeof(buf),
+                     ", \"movie_queue\": 0"
+                     ", \"movie_queue_max\": 0"
+                     ", \"movie_frames\": 0"
+                     ", \"movie_fillers\": 0"
+                     ", \"movie_dropped\": 0"
+                     ", \"movie_latency\": 0"
+                     ", \"movie_latency_max\": 0"
+                     ", \"movie_start\": 0"
+                     ", \"movie_start_max\": 0"
+                     ", \"movie_rollover_gap\": 0"
+                     ", \"movie_rollover_gap_max\": 0"
+                     ", \"movie_standby_used\": 0"
+                     ", \"movie_standby_missed\": 0");
+        }
+
+        webu_write(webui, buf);
+
+        sw = cnt->stream_worker;
+        if (sw != NULL) {
+            snprintf(buf, sizeof(buf),
+                     ", \"stream_frames\": %lu"
+                     ", \"stream_frames_skipped\": %lu"
+                     ", \"stream_images\": %lu"
+                     , sw->frames_put
+                     , sw->frames_skipped
+                     , sw->encoded);
+        } else {
+            snprintf(buf, sizeof(buf),
+                     ", \"stream_frames\": 0"
+                     ", \"stream_frames_skipped\": 0"
+                     ", \"stream_images\": 0");
+        }
+
+        webu_write(webui, buf);
+
+        frame_arena_usage(cnt, &arena_mapped, &arena_in_use, &arena_pooled);
+        snprintf(buf, sizeof(buf),
+                 ", \"image_memory\": %lu"
+                 ", \"image_memory_in_use\": %lu"
+                 ", \"image_memory_pooled\": %lu"
+                 , (unsigned long)arena_mapped
+                 , (unsigned long)arena_in_use
+                 , (unsigned long)arena_pooled);
+
+        webu_write(webui, buf);
+    pthread_mutex_unlock(&cnt->mutex_stages);
+
+    /* The on_* commands of all the cameras */
+    spw = cnt->spawner;
+    if (spw != NULL) {
+        snprintf(buf, sizeof(buf),
+                 ", \"command_queue\": %d"
+                 ", \"commands_running\": %d"
+                 ", \"commands_started\": %lu"
+                 ", \"commands_failed\": %lu"
+                 ", \"commands_dropped\": %lu"
+                 ", \"command_latency\": %ld"
+                 ", \"command_latency_max\": %ld"
+                 , spw->count
+                 , spw->running_count
+                 , spw->started
+                 , spw->failed
+                 , spw->dropped
+                 , spw->latency_last
+                 , spw->latency_max);
+    } else {
+        snprintf(buf, sizeof(buf),
+                 ", \"command_queue\": 0"
+                 ", \"commands_running\": 0"
+                 ", \"commands_started\": 0"
+                 ", \"commands_failed\": 0"
+                 ", \"commands_dropped\": 0"
+                 ", \"command_latency\": 0"
+                 ", \"command_latency_max\": 0");
+    }
+
+    webu_write(webui, buf);
+
+    /* The devices written to by the file writer, shared by all the cameras */
+    webu_write(webui, ", \"file_devices\": [");
+    fw = cnt->file_writer;
+    if (fw != NULL) {
+        for (indx = 0; indx < fw->dev_count; indx++) {
+            dev = &fw->devs[indx];
+            rate = (dev->busy > 0) ? (long long)((dev->bytes * 1000000ULL) / (unsigned long long)dev->busy) : 0;
+            snprintf(buf, sizeof(buf),
+                     "%s{\"device\": \"%u:%u\""
+                     ", \"writes\": %lu"
+                     ", \"bytes\": %llu"
+                     ", \"syncs\": %lu"
+                     ", \"errors\": %lu"
+                     ", \"write_rate\": %lld"
+                     ", \"write_latency\": %ld"
+                     ", \"write_latency_max\": %ld}"
+                     , (indx > 0 ? ", " : "")
+                     , major(dev->dev), minor(dev->dev)
+                     , dev->writes
+                     , dev->bytes
+                     , dev->syncs
+                     , dev->errors
+                     , rate
+                     , dev->latency_last
+                     , dev->latency_max);
+            webu_write(webui, buf);
+        }
+    }
+    webu_write(webui, "]");
+
+    webu_json_stream_clients(webui, cnt);
+
     webu_write(webui, ", \"currenttime\": ");
     webu_json_write_timestamp(webui, cnt->currenttime);
     webu_write(webui, ", \"currenttime_iso8601\": ");
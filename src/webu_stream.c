@@ -23,6 +23,7 @@
  *    webu_stream*      - All functions in this module
  *    webu_stream_mjpeg*    - Create the motion-jpeg stream for the user
  *    webu_stream_static*   - Create the static jpg image for the user.
+ *    webu_stream_live*     - Send the fragmented MP4 of a pass-through camera
  *    webu_stream_checks    - Edit/validate request from user
  */
 
@@ -31,6 +32,11 @@
 #include "logger.h"
 #include "webu.h"
 #include "webu_stream.h"
+#include "event.h"
+#include "pipeline.h"
+#include "stream_worker.h"
+#include "stream_jpeg.h"
+#include "live.h"
 #include "translate.h"
 
 static void webu_stream_mjpeg_checkbuffers(struct webui_ctx *webui)
@@ -48,6 +54,133 @@ static void webu_stream_mjpeg_checkbuffers(struct webui_ctx *webui)
 
 }
 
+static struct stream_data *webu_stream_data(struct webui_ctx *webui)
+{
+    /* The stream of the camera that the connection sends.  A client of the
+     * normal stream that falls behind is sent one of the worse streams.
+     */
+    if (webui->cnct_type == WEBUI_CNCT_FULL) {
+        if (webui->stream_strm == WEBUI_STRM_LOW) {
+            return &webui->cnt->stream_low;
+        } else if (webui->stream_strm == WEBUI_STRM_SUB) {
+            return &webui->cnt->stream_sub;
+        } else if (webui->stream_strm == WEBUI_STRM_QUARTER) {
+            return &webui->cnt->stream_quarter;
+        }
+        return &webui->cnt->stream_norm;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_STATIC) {
+        return &webui->cnt->stream_norm;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_SUB) {
+        return &webui->cnt->stream_sub;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_QUARTER) {
+        return &webui->cnt->stream_quarter;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_THUMB) {
+        return &webui->cnt->stream_thumb;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_MOTION) {
+        return &webui->cnt->stream_motion;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_SOURCE) {
+        return &webui->cnt->stream_source;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_MOSAIC) {
+        return &webui->cnt->stream_mosaic;
+
+    } else if (webui->cnct_type == WEBUI_CNCT_LIVE) {
+        return &webui->cnt->stream_live;
+
+    } else {
+        return NULL;
+    }
+
+}
+
+static int webu_stream_ready(struct webui_ctx *webui, struct stream_data *stream, long long now)
+{
+    /* Whether the stream has an image the connection did not send yet and
+     * the connection is due it before the next frame of the camera
+     */
+    if (__atomic_load_n(&stream->seq, __ATOMIC_SEQ_CST) == webui->stream_seq) {
+        return FALSE;
+    }
+
+    return ((webui->stream_due - now) <= webui->cnt->required_frame_time);
+}
+
+static long long webu_stream_now(void)
+{
+    struct timeval tv_now;
+
+    gettimeofday(&tv_now, NULL);
+
+    return ((long long)tv_now.tv_sec * 1000000LL) + tv_now.tv_usec;
+}
+
+static int webu_stream_wait(struct webui_ctx *webui)
+{
+    /* When the connection is not due a new image, suspend it until an image
+     * is published for it (see webu_stream_wake) rather than holding one of
+     * the polling threads.  The check and the suspend are done under
+     * mutex_stream so an image published in between is not missed.  While
+     * the camera is not running the connection is suspended until it starts.
+     * Returns 0 when an image is ready, 1 when the connection was suspended
+     * and -1 when the connection is to be ended.
+     */
+    struct context *cnt = webui->cnt;
+    struct stream_data *stream;
+    int retcd;
+
+    stream = webu_stream_data(webui);
+    if (stream == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cnt->mutex_stream);
+        if (cnt->webcontrol_finish) {
+            retcd = -1;
+        } else if ((!cnt->stream_closed) && (webu_stream_ready(webui, stream, webu_stream_now()))) {
+            retcd = 0;
+        } else {
+            webui->wait_next = cnt->stream_waiters;
+            cnt->stream_waiters = webui;
+            MHD_suspend_connection(webui->connection);
+            retcd = 1;
+        }
+    pthread_mutex_unlock(&cnt->mutex_stream);
+
+    return retcd;
+}
+
+void webu_stream_wake(struct context *cnt, int wake_all)
+{
+    /* Resume the connections that are due the image just published by the
+     * camera or all of them when the camera or the web server stops.
+     */
+    struct webui_ctx **prev, *webui;
+    long long now;
+
+    now = webu_stream_now();
+
+    pthread_mutex_lock(&cnt->mutex_stream);
+        prev = &cnt->stream_waiters;
+        while (*prev != NULL) {
+            webui = *prev;
+            if (wake_all || webu_stream_ready(webui, webu_stream_data(webui), now)) {
+                *prev = webui->wait_next;
+                webui->wait_next = NULL;
+                MHD_resume_connection(webui->connection);
+            } else {
+                prev = &webui->wait_next;
+            }
+        }
+    pthread_mutex_unlock(&cnt->mutex_stream);
+
+}
+
 static void webu_stream_mjpeg_delay(struct webui_ctx *webui)
 {
     /* Sleep required time to get to the user requested frame
@@ -86,56 +219,227 @@ static void webu_stream_mjpeg_delay(struct webui_ctx *webui)
 
 static void webu_stream_mjpeg_getimg(struct webui_ctx *webui)
 {
-    long jpeg_size;
-    char resp_head[80];
-    int  header_len;
+    /* Take a reference on the latest image of the stream and put the header
+     * for it into resp_page.  The image itself is sent straight from the
+     * shared buffer.  See stream_jpeg.c
+     */
     struct stream_data *local_stream;
+    struct timeval tv_due;
+    int  header_len;
 
-    memset(webui->resp_page, '\0', webui->resp_size);
+    /* Drop the image sent last */
+    stream_jpeg_release(webui->stream_jpeg);
+    webui->stream_jpeg = NULL;
+    webui->resp_used = 0;
 
     /* Assign to a local pointer the stream we want */
-    if (webui->cnct_type == WEBUI_CNCT_FULL) {
-        local_stream = &webui->cnt->stream_norm;
+    local_stream = webu_stream_data(webui);
+    if (local_stream == NULL) {
+        return;
+    }
 
-    } else if (webui->cnct_type == WEBUI_CNCT_SUB) {
-        local_stream = &webui->cnt->stream_sub;
+    if (webui->cnct_type == WEBUI_CNCT_MOSAIC) {
+        webui->stream_fps = webui->cnt->conf.stream_mosaic_rate;
+    } else if ((!webui->cnt->detecting_motion) && (webui->cnt->conf.stream_motion)) {
+        webui->stream_fps = 1;
+    } else {
+        webui->stream_fps = webui->cnt->conf.stream_maxrate;
+    }
 
-    } else if (webui->cnct_type == WEBUI_CNCT_MOTION) {
-        local_stream = &webui->cnt->stream_motion;
+    webui->stream_jpeg = stream_jpeg_get(local_stream);
+    if (webui->stream_jpeg == NULL) {
+        /* The images seen before the camera stopped are not waited for again */
+        webui->stream_seq = __atomic_load_n(&local_stream->seq, __ATOMIC_SEQ_CST);
+        return;
+    }
 
-    } else if (webui->cnct_type == WEBUI_CNCT_SOURCE) {
-        local_stream = &webui->cnt->stream_source;
+    header_len = snprintf(webui->resp_page, webui->resp_size
+        ,"--BoundaryString\r\n"
+        "Content-type: image/jpeg\r\n"
+        "Content-Length: %9ld\r\n\r\n"
+        ,webui->stream_jpeg->jpeg_size);
+    webui->resp_used = header_len;
+
+    /* Images published since the last one sent were skipped by the client */
+    if ((webui->stream_seq != 0) && (webui->stream_jpeg->seq > (webui->stream_seq + 1))) {
+        webui->stream_skipped += webui->stream_jpeg->seq - webui->stream_seq - 1;
+    }
+    webui->stream_seq = webui->stream_jpeg->seq;
+    webui->stream_start = webu_stream_now();
+
+    /* Ask the stream worker for a new image by the time of our next one */
+    tv_due.tv_sec = webui->time_last.tv_sec;
+    tv_due.tv_usec = webui->time_last.tv_usec;
+    if (webui->stream_fps >= 1) {
+        tv_due.tv_usec += (1000000L / webui->stream_fps);
+    }
+    tv_due.tv_sec += tv_due.tv_usec / 1000000L;
+    tv_due.tv_usec = tv_due.tv_usec % 1000000L;
+    webui->stream_due = ((long long)tv_due.tv_sec * 1000000LL) + tv_due.tv_usec;
+    stream_worker_want(webui->cnt, local_stream, &tv_due);
+
+}
+
+static size_t webu_stream_mjpeg_copy(struct webui_ctx *webui, char *buf, size_t max)
+{
+    /* Copy the part of the header, the image and the terminator after it
+     * that starts at the stream position.
+     */
+    size_t sent_bytes, part_bytes;
+    uint64_t pos;
+
+    sent_bytes = 0;
+    pos = webui->stream_pos;
+
+    if ((pos < webui->resp_used) && (sent_bytes < max)) {
+        part_bytes = webui->resp_used - pos;
+        if (part_bytes > (max - sent_bytes)) {
+            part_bytes = max - sent_bytes;
+        }
+        memcpy(buf + sent_bytes, webui->resp_page + pos, part_bytes);
+        sent_bytes += part_bytes;
+        pos += part_bytes;
+    }
+
+    if ((pos < (webui->resp_used + webui->stream_jpeg->jpeg_size)) && (sent_bytes < max)) {
+        part_bytes = webui->resp_used + webui->stream_jpeg->jpeg_size - pos;
+        if (part_bytes > (max - sent_bytes)) {
+            part_bytes = max - sent_bytes;
+        }
+        memcpy(buf + sent_bytes
+            ,webui->stream_jpeg->jpeg_data + (pos - webui->resp_used)
+            ,part_bytes);
+        sent_bytes += part_bytes;
+        pos += part_bytes;
+    }
+
+    if ((pos < (webui->resp_used + webui->stream_jpeg->jpeg_size + 2)) && (sent_bytes < max)) {
+        part_bytes = webui->resp_used + webui->stream_jpeg->jpeg_size + 2 - pos;
+        if (part_bytes > (max - sent_bytes)) {
+            part_bytes = max - sent_bytes;
+        }
+        memcpy(buf + sent_bytes
+            ,"\r\n" + (pos - webui->resp_used - webui->stream_jpeg->jpeg_size)
+            ,part_bytes);
+        sent_bytes += part_bytes;
+    }
+
+    return sent_bytes;
+}
+
+static void webu_stream_strm_set(struct webui_ctx *webui, enum WEBUI_STRM strm)
+{
+    /* Move the client of the normal stream to other images.  The counts of
+     * the streams decide which images are compressed.
+     */
+    struct context *cnt = webui->cnt;
+    struct stream_data *stream;
+    struct timeval tv_now;
+
+    gettimeofday(&tv_now, NULL);
+
+    pthread_mutex_lock(&cnt->mutex_stream);
+        stream = webu_stream_data(webui);
+        stream->cnct_count--;
+        webui->stream_strm = strm;
+        stream = webu_stream_data(webui);
+        stream->cnct_count++;
+        stream_worker_want(cnt, stream, &tv_now);
+    pthread_mutex_unlock(&cnt->mutex_stream);
+
+    /* Send the next image of the new stream whatever its sequence */
+    webui->stream_seq = 0;
+    webui->stream_late = 0;
+    webui->stream_since = 0;
 
+}
+
+static void webu_stream_mjpeg_sent(struct webui_ctx *webui)
+{
+    /* Track how fast the client reads the images.  The time to send an
+     * image is the time the client took to take it out of the socket, so a
+     * client that keeps taking longer than the rate allows is sent worse
+     * images.  It gets the better ones back once it has read fast enough
+     * for them for a while.  Since the next image is due as soon as a late
+     * one is sent, a late client always gets the latest image.
+     */
+    long long now, duration, interval, rate, rate_need;
+    long sent_size;
+
+    now = webu_stream_now();
+    sent_size = (long)(webui->resp_used + webui->stream_jpeg->jpeg_size + 2);
+
+    duration = now - webui->stream_start;
+    if (duration < 1) {
+        duration = 1;
+    }
+    if (webui->stream_fps >= 1) {
+        interval = 1000000LL / webui->stream_fps;
     } else {
-        return;
+        interval = 1000000LL;
+    }
+
+    rate = ((long long)sent_size * 1000000LL) / duration;
+    if (rate > 1000000000LL) {
+        rate = 1000000000LL;
     }
 
-    /* Copy jpg from the motion loop thread */
+    /* The statistics are read by the status page */
     pthread_mutex_lock(&webui->cnt->mutex_stream);
-        if ((!webui->cnt->detecting_motion) && (webui->cnt->conf.stream_motion)) {
-            webui->stream_fps = 1;
+        if (webui->stream_rate == 0) {
+            webui->stream_rate = (long)rate;
         } else {
-            webui->stream_fps = webui->cnt->conf.stream_maxrate;
+            webui->stream_rate = (long)(((webui->stream_rate * 7LL) + rate) / 8);
         }
-        if (local_stream->jpeg_data == NULL) {
-            pthread_mutex_unlock(&webui->cnt->mutex_stream);
-            return;
+        webui->strm_size[webui->stream_strm] = sent_size;
+        webui->stream_images++;
+        if (duration > interval) {
+            webui->stream_late++;
+            webui->stream_lates++;
+        } else {
+            webui->stream_late = 0;
         }
-        jpeg_size = local_stream->jpeg_size;
-        header_len = snprintf(resp_head, 80
-            ,"--BoundaryString\r\n"
-            "Content-type: image/jpeg\r\n"
-            "Content-Length: %9ld\r\n\r\n"
-            ,jpeg_size);
-        memcpy(webui->resp_page, resp_head, header_len);
-        memcpy(webui->resp_page + header_len
-            ,local_stream->jpeg_data
-            ,jpeg_size);
-        /* Copy in the terminator after the jpg data at the end*/
-        memcpy(webui->resp_page + header_len + jpeg_size,"\r\n",2);
-        webui->resp_used = header_len + jpeg_size + 2;
     pthread_mutex_unlock(&webui->cnt->mutex_stream);
 
+    if ((webui->cnct_type != WEBUI_CNCT_FULL) || (!webui->cnt->conf.stream_adaptive)) {
+        return;
+    }
+
+    if (webui->stream_late >= WEBU_STREAM_LATE) {
+        if (webui->stream_strm < WEBUI_STRM_QUARTER) {
+            /* A client lowered again waits longer before it gets better images */
+            if (webui->stream_lowered > 0) {
+                webui->stream_recover = webui->stream_recover * 2;
+                if (webui->stream_recover > WEBU_STREAM_RECOVER_MAX) {
+                    webui->stream_recover = WEBU_STREAM_RECOVER_MAX;
+                }
+            }
+            webui->stream_lowered++;
+            MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO
+                ,_("Stream client %s falling behind, sending worse images")
+                ,webui->clientip);
+            webu_stream_strm_set(webui, webui->stream_strm + 1);
+        }
+        return;
+    }
+
+    if (webui->stream_strm == WEBUI_STRM_FULL) {
+        return;
+    }
+
+    /* Room for the better images with a margin */
+    rate_need = ((long long)webui->strm_size[webui->stream_strm - 1] * 1000000LL * 3) / (interval * 2);
+    if ((webui->stream_late > 0) || (webui->stream_rate < rate_need)) {
+        webui->stream_since = 0;
+    } else if (webui->stream_since == 0) {
+        webui->stream_since = now;
+    } else if ((now - webui->stream_since) >= webui->stream_recover) {
+        MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO
+            ,_("Stream client %s caught up, sending better images")
+            ,webui->clientip);
+        webu_stream_strm_set(webui, webui->stream_strm - 1);
+    }
+
 }
 
 static ssize_t webu_stream_mjpeg_response (void *cls, uint64_t pos, char *buf, size_t max)
@@ -149,6 +453,7 @@ static ssize_t webu_stream_mjpeg_response (void *cls, uint64_t pos, char *buf, s
      */
     struct webui_ctx *webui = cls;
     size_t sent_bytes;
+    int retcd;
 
     (void)pos;  /*Remove compiler warning */
 
@@ -156,30 +461,40 @@ static ssize_t webu_stream_mjpeg_response (void *cls, uint64_t pos, char *buf, s
         return -1;
     }
 
-    if ((webui->stream_pos == 0) || (webui->resp_used == 0)) {
-
-        webu_stream_mjpeg_delay(webui);
-
-        webui->stream_pos = 0;
-        webui->resp_used = 0;
-
-        webu_stream_mjpeg_getimg(webui);
-
-        if (webui->resp_used == 0) {
-            return 0;
+    if ((webui->stream_pos == 0) || (webui->stream_jpeg == NULL)) {
+        while (TRUE) {
+            if (webui->mhd_poll) {
+                retcd = webu_stream_wait(webui);
+                if (retcd == 1) {
+                    return 0;
+                } else if (retcd == -1) {
+                    return -1;
+                }
+                gettimeofday(&webui->time_last, NULL);
+            } else {
+                webu_stream_mjpeg_delay(webui);
+            }
+
+            webui->stream_pos = 0;
+
+            webu_stream_mjpeg_getimg(webui);
+
+            if (webui->stream_jpeg != NULL) {
+                break;
+            }
+
+            /* Polling threads wait again for the next image */
+            if (!webui->mhd_poll) {
+                return 0;
+            }
         }
     }
 
-    if ((webui->resp_used - webui->stream_pos) > max) {
-        sent_bytes = max;
-    } else {
-        sent_bytes = webui->resp_used - webui->stream_pos;
-    }
-
-    memcpy(buf, webui->resp_page + webui->stream_pos, sent_bytes);
+    sent_bytes = webu_stream_mjpeg_copy(webui, buf, max);
 
     webui->stream_pos = webui->stream_pos + sent_bytes;
-    if (webui->stream_pos >= webui->resp_used) {
+    if (webui->stream_pos >= (webui->resp_used + webui->stream_jpeg->jpeg_size + 2)) {
+        webu_stream_mjpeg_sent(webui);
         webui->stream_pos = 0;
     }
 
@@ -187,25 +502,57 @@ static ssize_t webu_stream_mjpeg_response (void *cls, uint64_t pos, char *buf, s
 
 }
 
+static ssize_t webu_stream_live_response (void *cls, uint64_t pos, char *buf, size_t max)
+{
+    /* Callback response function for the live stream.  The fragments are
+     * sent as they are published by the network camera thread so there is
+     * no delay between them.
+     */
+    struct webui_ctx *webui = cls;
+    int sent_bytes, retcd;
+
+    (void)pos;  /*Remove compiler warning */
+
+    while (!webui->cnt->webcontrol_finish) {
+        sent_bytes = live_read(webui, buf, max);
+        if (sent_bytes != 0) {
+            return sent_bytes;
+        }
+
+        if (webui->mhd_poll) {
+            retcd = webu_stream_wait(webui);
+            if (retcd == 1) {
+                return 0;
+            } else if (retcd == -1) {
+                return -1;
+            }
+        } else {
+            live_wait(webui);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 static void webu_stream_static_getimg(struct webui_ctx *webui)
 {
     /* Obtain the current image, compress it to a JPG and put into webui->resp_page
      * for MHD to send back to user
      */
+    struct stream_jpeg *jpeg;
+
     webui->resp_used = 0;
 
     memset(webui->resp_page, '\0', webui->resp_size);
 
-    pthread_mutex_lock(&webui->cnt->mutex_stream);
-        if (webui->cnt->stream_norm.jpeg_data == NULL) {
-            pthread_mutex_unlock(&webui->cnt->mutex_stream);
-            return;
-        }
-        memcpy(webui->resp_page
-            ,webui->cnt->stream_norm.jpeg_data
-            ,webui->cnt->stream_norm.jpeg_size);
-        webui->resp_used = webui->cnt->stream_norm.jpeg_size;
-    pthread_mutex_unlock(&webui->cnt->mutex_stream);
+    jpeg = stream_jpeg_get(&webui->cnt->stream_norm);
+    if (jpeg == NULL) {
+        return;
+    }
+    memcpy(webui->resp_page, jpeg->jpeg_data, jpeg->jpeg_size);
+    webui->resp_used = jpeg->jpeg_size;
+    stream_jpeg_release(jpeg);
 
 }
 
@@ -214,6 +561,17 @@ static int webu_stream_checks(struct webui_ctx *webui)
     /* Perform edits to determine whether the user specified a valid URL
      * for the particular port
      */
+    if (webui->cnct_type == WEBUI_CNCT_MOSAIC) {
+        /* The mosaic belongs to the port of motion.conf rather than a camera */
+        if ((webui->cntlst == NULL) || (webui->cntlst[0]->mosaic == NULL) ||
+            (webui->thread_nbr != 0)) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO
+                , _("Mosaic stream not available: %s"),webui->url);
+            return -1;
+        }
+        return 0;
+    }
+
     if ((webui->cntlst != NULL) && (webui->thread_nbr >= webui->cam_threads)) {
         MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO
             , _("Invalid thread specified: %s"),webui->url);
@@ -253,45 +611,74 @@ static int webu_stream_checks(struct webui_ctx *webui)
 
 static void webu_stream_cnct_count(struct webui_ctx *webui)
 {
-    /* Increment the counters for the connections to the streams */
+    /* Increment the counters for the connections to the streams and
+     * ask the stream worker for an image right away
+     */
+    struct stream_data *stream;
     int cnct_count;
+    struct timeval tv_now;
 
-    cnct_count = 0;
-    if (webui->cnct_type == WEBUI_CNCT_SUB) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_sub.cnct_count++;
-            cnct_count = webui->cnt->stream_sub.cnct_count;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
-
-    } else if (webui->cnct_type == WEBUI_CNCT_MOTION) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_motion.cnct_count++;
-            cnct_count = webui->cnt->stream_motion.cnct_count;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
-
-    } else if (webui->cnct_type == WEBUI_CNCT_SOURCE) {
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_source.cnct_count++;
-            cnct_count = webui->cnt->stream_source.cnct_count;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
+    /* A static request that waited for the first image is answered again */
+    if (webui->cnct_counted) {
+        return;
+    }
 
-    } else {
-        /* Stream, Static */
-        pthread_mutex_lock(&webui->cnt->mutex_stream);
-            webui->cnt->stream_norm.cnct_count++;
-            cnct_count = webui->cnt->stream_norm.cnct_count;
-        pthread_mutex_unlock(&webui->cnt->mutex_stream);
+    stream = webu_stream_data(webui);
+    if (stream == NULL) {
+        return;
     }
+    webui->cnct_counted = TRUE;
 
-    if (cnct_count == 1) {
+    gettimeofday(&tv_now, NULL);
+    pthread_mutex_lock(&webui->cnt->mutex_stream);
+        stream->cnct_count++;
+        cnct_count = stream->cnct_count;
+        stream_worker_want(webui->cnt, stream, &tv_now);
+        webui->client_next = webui->cnt->stream_clients;
+        webui->cnt->stream_clients = webui;
+    pthread_mutex_unlock(&webui->cnt->mutex_stream);
+
+    if ((cnct_count == 1) && (!webui->mhd_poll)) {
         /* This is the first connection so we need to wait half a sec
-         * so that the motion loop on the other thread can update image
+         * so that the motion loop on the other thread can update image.
+         * Connections of polling threads wait in webu_stream_wait instead.
          */
         SLEEP(0,500000000L);
     }
 
 }
 
+void webu_stream_cnct_uncount(struct webui_ctx *webui)
+{
+    /* Decrement the counter of the stream the connection was counted in
+     * as it closes
+     */
+    struct webui_ctx **prev;
+    struct stream_data *stream;
+
+    /* Only the streams that were started are in the connection counts */
+    if (!webui->cnct_counted) {
+        return;
+    }
+    webui->cnct_counted = FALSE;
+
+    stream = webu_stream_data(webui);
+
+    pthread_mutex_lock(&webui->cnt->mutex_stream);
+        stream->cnct_count--;
+        prev = &webui->cnt->stream_clients;
+        while (*prev != NULL) {
+            if (*prev == webui) {
+                *prev = webui->client_next;
+                break;
+            }
+            prev = &(*prev)->client_next;
+        }
+        webui->client_next = NULL;
+    pthread_mutex_unlock(&webui->cnt->mutex_stream);
+
+}
+
 mymhd_retcd webu_stream_mjpeg(struct webui_ctx *webui)
 {
     /* Create the stream for the motion jpeg */
@@ -329,6 +716,44 @@ mymhd_retcd webu_stream_mjpeg(struct webui_ctx *webui)
     return retcd;
 }
 
+mymhd_retcd webu_stream_live(struct webui_ctx *webui)
+{
+    /* Create the live stream of a pass-through camera */
+    mymhd_retcd retcd;
+    struct MHD_Response *response;
+
+    if (webu_stream_checks(webui) == -1) {
+        return MHD_NO;
+    }
+
+    if (__atomic_load_n(&webui->cnt->live, __ATOMIC_SEQ_CST) == NULL) {
+        MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO
+            , _("Live stream requires movie_passthrough: %s"),webui->url);
+        return MHD_NO;
+    }
+
+    webu_stream_cnct_count(webui);
+
+    response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN, 16384
+        ,&webu_stream_live_response, webui, NULL);
+    if (!response) {
+        MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, _("Invalid response"));
+        return MHD_NO;
+    }
+
+    if (webui->cnt->conf.stream_cors_header != NULL) {
+        MHD_add_response_header (response, MHD_HTTP_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN
+            , webui->cnt->conf.stream_cors_header);
+    }
+
+    MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE, "video/mp4");
+
+    retcd = MHD_queue_response (webui->connection, MHD_HTTP_OK, response);
+    MHD_destroy_response (response);
+
+    return retcd;
+}
+
 mymhd_retcd webu_stream_static(struct webui_ctx *webui)
 {
     /* Create the response for the static image request*/
@@ -346,6 +771,14 @@ mymhd_retcd webu_stream_static(struct webui_ctx *webui)
 
     webu_stream_static_getimg(webui);
 
+    /* Wait for the first image and answer the request again when resumed */
+    if ((webui->resp_used == 0) && (webui->mhd_poll)) {
+        if (webu_stream_wait(webui) == 1) {
+            return MHD_YES;
+        }
+        webu_stream_static_getimg(webui);
+    }
+
     if (webui->resp_used == 0) {
         MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, _("Could not get image to stream."));
         return MHD_NO;
@@ -17,8 +17,14 @@
 #ifndef _INCLUDE_WEBU_STREAM_H_
 #define _INCLUDE_WEBU_STREAM_H_
 
+#define WEBU_STREAM_LATE        3               /* Consecutive late images before sending worse ones */
+#define WEBU_STREAM_RECOVER     10000000LL      /* Microseconds with room before sending better images */
+#define WEBU_STREAM_RECOVER_MAX 300000000LL     /* Longest wait for a client lowered again and again */
 
 mymhd_retcd webu_stream_mjpeg(struct webui_ctx *webui);
 mymhd_retcd webu_stream_static(struct webui_ctx *webui);
+mymhd_retcd webu_stream_live(struct webui_ctx *webui);
+void webu_stream_wake(struct context *cnt, int wake_all);
+void webu_stream_cnct_uncount(struct webui_ctx *webui);
 
 #endif